@@ -0,0 +1,129 @@
+/*++
+
+Module Name:
+
+    bitstreampack.c
+
+Abstract:
+
+    Host tool that wraps a raw UC120 configuration bitstream in the
+    header the driver checks before loading it, or checks an image that
+    was already packed. Builds with any C compiler together with the
+    driver's bitstream.c:
+
+        cl BitstreamPack.c ..\LumiaUSBCKm\Bitstream.c
+        cc -o bitstreampack BitstreamPack.c ../LumiaUSBCKm/Bitstream.c
+
+    Copy the result to the device and point BitstreamPath under
+    HKLM\System\usbc at it, as an NT path such as
+    \SystemRoot\System32\drivers\uc120.bin.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../LumiaUSBCKm/Bitstream.h"
+
+static const char *BitstreamStatusNames[] = {
+	"ok", "truncated", "bad magic", "unsupported version", "bad length", "checksum mismatch", "transfer failed"
+};
+
+static unsigned char *ReadWholeFile(const char *name, unsigned int *size)
+{
+	unsigned char *data;
+	FILE *file;
+	long length;
+
+	file = fopen(name, "rb");
+	if (!file)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) || (length = ftell(file)) < 0 ||
+		length > BITSTREAM_HEADER_SIZE + BITSTREAM_PAYLOAD_MAX || fseek(file, 0, SEEK_SET)) {
+		fclose(file);
+		return NULL;
+	}
+
+	data = malloc(length ? (size_t)length : 1);
+	if (data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(file);
+	*size = (unsigned int)length;
+	return data;
+}
+
+static int Check(const char *name)
+{
+	const unsigned char *payload;
+	unsigned char *image;
+	unsigned int size, length;
+	BITSTREAM_STATUS status;
+
+	image = ReadWholeFile(name, &size);
+	if (!image) {
+		fprintf(stderr, "%s: cannot read\n", name);
+		return 1;
+	}
+
+	status = BitstreamParse(image, size, &payload, &length);
+	if (status == BitstreamOk)
+		printf("%s: %u bytes, CRC-32 %08x\n", name, length, BitstreamCrc32(0, payload, length));
+	else
+		fprintf(stderr, "%s: %s\n", name, BitstreamStatusNames[status]);
+
+	free(image);
+	return status != BitstreamOk;
+}
+
+static int Pack(const char *input, const char *output)
+{
+	unsigned char header[BITSTREAM_HEADER_SIZE];
+	unsigned char *payload;
+	unsigned int length;
+	FILE *file;
+	int ok;
+
+	payload = ReadWholeFile(input, &length);
+	if (!payload || !length || length > BITSTREAM_PAYLOAD_MAX) {
+		fprintf(stderr, "%s: cannot read, or not between 1 and %u bytes\n", input, BITSTREAM_PAYLOAD_MAX);
+		free(payload);
+		return 1;
+	}
+
+	BitstreamPack(header, payload, length);
+
+	file = fopen(output, "wb");
+	ok = file &&
+		fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+		fwrite(payload, 1, length, file) == length;
+	if (file && fclose(file))
+		ok = 0;
+
+	free(payload);
+
+	if (!ok) {
+		fprintf(stderr, "%s: cannot write\n", output);
+		return 1;
+	}
+
+	return Check(output);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'c' && !argv[1][2])
+		return Check(argv[2]);
+	if (argc == 3)
+		return Pack(argv[1], argv[2]);
+
+	fprintf(stderr, "usage: %s <raw bitstream> <packed image>\n"
+		"       %s -c <packed image>\n", argv[0], argv[0]);
+	return 2;
+}
@@ -0,0 +1,199 @@
+/*++
+
+Module Name:
+
+    bitbang.c
+
+Abstract:
+
+    SPI transactions bit-banged over GPIO lines.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "BitBang.h"
+
+#define BIT_BANG_CALIBRATION_CYCLES 16
+
+static void BitBangStall(PBIT_BANG bitBang)
+{
+	if (bitBang->StallUs)
+		bitBang->Ops->Stall(bitBang->Context, bitBang->StallUs);
+}
+
+static int BitBangClockOut(PBIT_BANG bitBang, unsigned char byte)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		BitBangStall(bitBang);
+
+		if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinMosi, (byte >> i) & 1) ||
+			!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 0))
+			return 0;
+
+		BitBangStall(bitBang);
+
+		if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int BitBangClockIn(PBIT_BANG bitBang, unsigned char *byte)
+{
+	int i, level;
+
+	*byte = 0;
+
+	for (i = 7; i >= 0; i--) {
+		BitBangStall(bitBang);
+
+		if (!bitBang->Ops->GetPin(bitBang->Context, BitBangPinMiso, &level))
+			return 0;
+
+		*byte |= (unsigned char)((level & 1) << i);
+
+		if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 0))
+			return 0;
+
+		BitBangStall(bitBang);
+
+		if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+void
+BitBangInitialize(
+	PBIT_BANG bitBang,
+	const BIT_BANG_OPS *ops,
+	void *context,
+	unsigned int halfPeriodUs
+)
+{
+	bitBang->Ops = ops;
+	bitBang->Context = context;
+	bitBang->HalfPeriodUs = halfPeriodUs;
+	bitBang->StallUs = halfPeriodUs;
+	bitBang->EdgeCostNs = 0;
+	bitBang->Calibrated = 0;
+
+	bitBang->Transactions = 0;
+	bitBang->Failures = 0;
+	bitBang->Bytes = 0;
+	bitBang->BusyUs = 0;
+	bitBang->BitTimeNs = 0;
+	bitBang->LastJitterNs = 0;
+	bitBang->MaxJitterNs = 0;
+}
+
+int
+BitBangCalibrate(
+	PBIT_BANG bitBang
+)
+{
+	unsigned long long start, elapsed;
+	unsigned long halfPeriodNs = bitBang->HalfPeriodUs * 1000UL;
+	int i;
+
+	// Clocks are ignored while the chip is deselected
+	if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinCs, 1))
+		return 0;
+
+	start = bitBang->Ops->Now(bitBang->Context);
+
+	for (i = 0; i < BIT_BANG_CALIBRATION_CYCLES; i++) {
+		if (!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 0) ||
+			!bitBang->Ops->SetPin(bitBang->Context, BitBangPinClk, 1))
+			return 0;
+	}
+
+	elapsed = bitBang->Ops->Now(bitBang->Context) - start;
+
+	bitBang->EdgeCostNs = (unsigned long)(elapsed * 1000 / (2 * BIT_BANG_CALIBRATION_CYCLES));
+	bitBang->StallUs = bitBang->EdgeCostNs < halfPeriodNs ? (unsigned int)((halfPeriodNs - bitBang->EdgeCostNs + 500) / 1000) : 0;
+	bitBang->Calibrated = 1;
+
+	return 1;
+}
+
+int
+BitBangTransfer(
+	PBIT_BANG bitBang,
+	unsigned char command,
+	unsigned char *data,
+	unsigned int length,
+	int write
+)
+{
+	unsigned long long start, elapsed;
+	unsigned long bitNs, jitter;
+	unsigned int j;
+	int ok;
+
+	start = bitBang->Ops->Now(bitBang->Context);
+
+	ok = bitBang->Ops->SetPin(bitBang->Context, BitBangPinCs, 0) && BitBangClockOut(bitBang, command);
+
+	for (j = 0; ok && j < length; j++)
+		ok = write ? BitBangClockOut(bitBang, data[j]) : BitBangClockIn(bitBang, &data[j]);
+
+	// Deselect even after a failure, the next transaction starts from a clean frame
+	ok = bitBang->Ops->SetPin(bitBang->Context, BitBangPinCs, 1) && ok;
+
+	if (!ok) {
+		bitBang->Failures++;
+		return 0;
+	}
+
+	elapsed = bitBang->Ops->Now(bitBang->Context) - start;
+	bitNs = (unsigned long)(elapsed * 1000 / (8 * (length + 1)));
+
+	// Jitter is measured against a running average of the bit time
+	if (bitBang->Transactions == 0)
+		bitBang->BitTimeNs = bitNs;
+
+	jitter = bitNs > bitBang->BitTimeNs ? bitNs - bitBang->BitTimeNs : bitBang->BitTimeNs - bitNs;
+	bitBang->LastJitterNs = jitter;
+	if (jitter > bitBang->MaxJitterNs)
+		bitBang->MaxJitterNs = jitter;
+
+	bitBang->BitTimeNs = (unsigned long)(((unsigned long long)bitBang->BitTimeNs * 7 + bitNs) / 8);
+	bitBang->Transactions++;
+	bitBang->Bytes += length + 1;
+	bitBang->BusyUs += elapsed;
+
+	return 1;
+}
+
+int
+BitBangWrite(
+	PBIT_BANG bitBang,
+	const unsigned char *data,
+	unsigned int length
+)
+{
+	unsigned long long start;
+	unsigned int j;
+
+	start = bitBang->Ops->Now(bitBang->Context);
+
+	for (j = 0; j < length; j++) {
+		if (!BitBangClockOut(bitBang, data[j])) {
+			bitBang->Failures++;
+			return 0;
+		}
+	}
+
+	bitBang->Bytes += length;
+	bitBang->BusyUs += bitBang->Ops->Now(bitBang->Context) - start;
+
+	return 1;
+}
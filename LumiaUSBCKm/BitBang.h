@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    bitbang.h
+
+Abstract:
+
+    SPI transactions bit-banged over GPIO lines, clock idle high with
+    data sampled on the rising edge. Pins, delays and the clock are
+    reached through callbacks, so the timing logic also runs against a
+    mock GPIO backend outside the kernel.
+
+    The structures are not synchronized, callers serialize access.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+typedef enum _BIT_BANG_PIN
+{
+	BitBangPinCs,
+	BitBangPinClk,
+	BitBangPinMosi,
+	BitBangPinMiso
+} BIT_BANG_PIN;
+
+typedef struct _BIT_BANG_OPS
+{
+	// Drives an output line, returns nonzero on success
+	int (*SetPin)(void *context, BIT_BANG_PIN pin, int level);
+	// Samples an input line, returns nonzero on success
+	int (*GetPin)(void *context, BIT_BANG_PIN pin, int *level);
+	// Busy-waits, used for delays shorter than a timer tick
+	void (*Stall)(void *context, unsigned int us);
+	// Monotonic time in microseconds
+	unsigned long long (*Now)(void *context);
+} BIT_BANG_OPS;
+
+typedef struct _BIT_BANG
+{
+	const BIT_BANG_OPS *Ops;
+	void *Context;
+
+	// Nominal half clock period, and what is left of it once the pin write is paid for
+	unsigned int HalfPeriodUs;
+	unsigned int StallUs;
+	unsigned long EdgeCostNs;
+	int Calibrated;
+
+	// Accounting
+	unsigned long Transactions;
+	unsigned long Failures;
+	unsigned long long Bytes;
+	unsigned long long BusyUs;
+	unsigned long BitTimeNs;
+	unsigned long LastJitterNs;
+	unsigned long MaxJitterNs;
+} BIT_BANG, *PBIT_BANG;
+
+void
+BitBangInitialize(
+	PBIT_BANG bitBang,
+	const BIT_BANG_OPS *ops,
+	void *context,
+	unsigned int halfPeriodUs
+);
+
+//
+// Times clock edges with the chip deselected and sizes the stalls so a
+// half period lasts HalfPeriodUs. Returns nonzero on success.
+//
+int
+BitBangCalibrate(
+	PBIT_BANG bitBang
+);
+
+//
+// Runs one chip select framed transaction: the command byte, then length
+// bytes written from or read into data. Returns nonzero on success.
+//
+int
+BitBangTransfer(
+	PBIT_BANG bitBang,
+	unsigned char command,
+	unsigned char *data,
+	unsigned int length,
+	int write
+);
+
+//
+// Clocks length bytes out without touching chip select, for streams the
+// caller frames itself. Counted in the byte and busy time totals but not
+// as a transaction. Returns nonzero on success.
+//
+int
+BitBangWrite(
+	PBIT_BANG bitBang,
+	const unsigned char *data,
+	unsigned int length
+);
+
+//
+// Bytes per second over everything clocked so far
+//
+static __inline unsigned long BitBangThroughput(const BIT_BANG *bitBang)
+{
+	return bitBang->BusyUs ? (unsigned long)(bitBang->Bytes * 1000000 / bitBang->BusyUs) : 0;
+}
@@ -0,0 +1,187 @@
+/*++
+
+Module Name:
+
+    bitstream.c
+
+Abstract:
+
+    UC120 configuration image checks and loading sequence.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Bitstream.h"
+
+// Header fields, little endian words
+#define BITSTREAM_FIELD_MAGIC       0
+#define BITSTREAM_FIELD_VERSION     4
+#define BITSTREAM_FIELD_HEADER_SIZE 8
+#define BITSTREAM_FIELD_LENGTH      12
+#define BITSTREAM_FIELD_CRC32       16
+
+// Reflected polynomial 0xEDB88320 a nibble at a time
+static const unsigned int BitstreamCrcTable[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static unsigned int BitstreamGetWord(const unsigned char *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void BitstreamPutWord(unsigned char *p, unsigned int value)
+{
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+unsigned int
+BitstreamCrc32(
+	unsigned int crc,
+	const unsigned char *data,
+	unsigned int length
+)
+{
+	unsigned int i;
+
+	crc = ~crc;
+	for (i = 0; i < length; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ BitstreamCrcTable[crc & 0x0F];
+		crc = (crc >> 4) ^ BitstreamCrcTable[crc & 0x0F];
+	}
+
+	return ~crc;
+}
+
+void
+BitstreamPack(
+	unsigned char *header,
+	const unsigned char *payload,
+	unsigned int length
+)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITSTREAM_HEADER_SIZE; i++)
+		header[i] = 0;
+
+	BitstreamPutWord(header + BITSTREAM_FIELD_MAGIC, BITSTREAM_MAGIC);
+	BitstreamPutWord(header + BITSTREAM_FIELD_VERSION, BITSTREAM_VERSION);
+	BitstreamPutWord(header + BITSTREAM_FIELD_HEADER_SIZE, BITSTREAM_HEADER_SIZE);
+	BitstreamPutWord(header + BITSTREAM_FIELD_LENGTH, length);
+	BitstreamPutWord(header + BITSTREAM_FIELD_CRC32, BitstreamCrc32(0, payload, length));
+}
+
+BITSTREAM_STATUS
+BitstreamParse(
+	const unsigned char *image,
+	unsigned int size,
+	const unsigned char **payload,
+	unsigned int *length
+)
+{
+	unsigned int headerSize, payloadLength;
+
+	if (size < BITSTREAM_HEADER_SIZE)
+		return BitstreamTruncated;
+	if (BitstreamGetWord(image + BITSTREAM_FIELD_MAGIC) != BITSTREAM_MAGIC)
+		return BitstreamBadMagic;
+	if (BitstreamGetWord(image + BITSTREAM_FIELD_VERSION) != BITSTREAM_VERSION)
+		return BitstreamBadVersion;
+
+	// Later versions may grow the header, the payload always starts where it ends
+	headerSize = BitstreamGetWord(image + BITSTREAM_FIELD_HEADER_SIZE);
+	payloadLength = BitstreamGetWord(image + BITSTREAM_FIELD_LENGTH);
+	if (headerSize < BITSTREAM_HEADER_SIZE || !payloadLength || payloadLength > BITSTREAM_PAYLOAD_MAX)
+		return BitstreamBadLength;
+	if (headerSize > size || size - headerSize < payloadLength)
+		return BitstreamTruncated;
+
+	if (BitstreamCrc32(0, image + headerSize, payloadLength) != BitstreamGetWord(image + BITSTREAM_FIELD_CRC32))
+		return BitstreamBadChecksum;
+
+	*payload = image + headerSize;
+	*length = payloadLength;
+	return BitstreamOk;
+}
+
+BITSTREAM_STATUS
+BitstreamLoad(
+	const BITSTREAM_OPS *ops,
+	void *context,
+	const unsigned char *image,
+	unsigned int size,
+	unsigned int chunk,
+	PBITSTREAM_RESULT result
+)
+{
+	static const unsigned char zeros[BITSTREAM_TRAIL_BYTES] = { 0 };
+	const unsigned char *payload;
+	unsigned long long start;
+	unsigned int length, offset, count;
+	BITSTREAM_STATUS status;
+	int ok;
+
+	result->Chunks = 0;
+	result->Bytes = 0;
+	result->Crc32 = 0;
+	result->ElapsedUs = 0;
+
+	status = BitstreamParse(image, size, &payload, &length);
+	if (status != BitstreamOk)
+		return status;
+
+	if (!chunk)
+		chunk = BITSTREAM_CHUNK_DEFAULT;
+
+	start = ops->Now(context);
+
+	// Chip select held low through reset puts the chip in SPI slave configuration
+	ok = ops->Select(context, 1) && ops->Reset(context, 1);
+	if (ok) {
+		ops->Delay(context, BITSTREAM_RESET_US);
+		ok = ops->Reset(context, 0);
+	}
+	if (ok) {
+		ops->Delay(context, BITSTREAM_CLEAR_US);
+		ok = ops->Select(context, 0) &&
+			ops->Write(context, zeros, BITSTREAM_LEAD_BYTES) &&
+			ops->Select(context, 1);
+	}
+
+	for (offset = 0; ok && offset < length; offset += count) {
+		count = length - offset < chunk ? length - offset : chunk;
+
+		ok = ops->Write(context, payload + offset, count);
+		if (ok) {
+			result->Crc32 = BitstreamCrc32(result->Crc32, payload + offset, count);
+			result->Bytes += count;
+			result->Chunks++;
+		}
+	}
+
+	// The start-up clocks run with the chip still selected
+	ok = ok && ops->Write(context, zeros, BITSTREAM_TRAIL_BYTES);
+
+	// Deselect even after a failure, the next attempt starts from a clean frame
+	ok = ops->Select(context, 0) && ok;
+
+	result->ElapsedUs = (unsigned long)(ops->Now(context) - start);
+
+	if (!ok)
+		return BitstreamTransferFailed;
+	if (result->Crc32 != BitstreamGetWord(image + BITSTREAM_FIELD_CRC32))
+		return BitstreamBadChecksum;
+
+	return BitstreamOk;
+}
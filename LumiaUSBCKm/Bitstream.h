@@ -0,0 +1,125 @@
+/*++
+
+Module Name:
+
+    bitstream.h
+
+Abstract:
+
+    Configuration image for the UC120 and the sequence that loads it in
+    SPI slave mode: reset with chip select held, a few clocks with the
+    chip deselected, the image in as few transfers as the transport
+    allows, then the clocks it needs to start up. The image carries a
+    small header with its length and CRC-32, written by the host side
+    packager with BitstreamPack. Reset, chip select and the bus are
+    reached through callbacks, there are no kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+// "UCBS" read as a little endian word
+#define BITSTREAM_MAGIC 0x53424355
+#define BITSTREAM_VERSION 1
+#define BITSTREAM_HEADER_SIZE 32
+
+// Far larger than any image the chip takes, guards against reading a wrong file
+#define BITSTREAM_PAYLOAD_MAX (1024 * 1024)
+
+// Bytes per write unless configured otherwise
+#define BITSTREAM_CHUNK_DEFAULT 4096
+
+// Reset pulse, then the time the chip needs to clear its configuration memory
+#define BITSTREAM_RESET_US 200
+#define BITSTREAM_CLEAR_US 1200
+
+// 8 clocks deselected before the image, and at least 49 after it, rounded up to 150 as before
+#define BITSTREAM_LEAD_BYTES 1
+#define BITSTREAM_TRAIL_BYTES 19
+
+typedef enum _BITSTREAM_STATUS
+{
+	BitstreamOk,
+	BitstreamTruncated,
+	BitstreamBadMagic,
+	BitstreamBadVersion,
+	BitstreamBadLength,
+	BitstreamBadChecksum,
+	BitstreamTransferFailed
+} BITSTREAM_STATUS;
+
+typedef struct _BITSTREAM_OPS
+{
+	// Holds the chip in reset or releases it, returns nonzero on success
+	int (*Reset)(void *context, int asserted);
+	// Selects or deselects the chip, it stays that way across writes; returns nonzero on success
+	int (*Select)(void *context, int selected);
+	// Clocks bytes out MSB first without touching chip select, returns nonzero on success
+	int (*Write)(void *context, const unsigned char *data, unsigned int length);
+	void (*Delay)(void *context, unsigned int us);
+	// Monotonic time in microseconds
+	unsigned long long (*Now)(void *context);
+} BITSTREAM_OPS;
+
+typedef struct _BITSTREAM_RESULT
+{
+	// Writes the image went out in, lead and trailing clocks not included
+	unsigned int Chunks;
+	unsigned int Bytes;
+	// Over the bytes as they were handed to Write
+	unsigned int Crc32;
+	unsigned long ElapsedUs;
+} BITSTREAM_RESULT, *PBITSTREAM_RESULT;
+
+//
+// CRC-32 as used by zlib and Ethernet. Start with zero and feed the
+// previous result back in to run it over several buffers.
+//
+unsigned int
+BitstreamCrc32(
+	unsigned int crc,
+	const unsigned char *data,
+	unsigned int length
+);
+
+//
+// Fills in the header that goes in front of payload
+//
+void
+BitstreamPack(
+	unsigned char *header,
+	const unsigned char *payload,
+	unsigned int length
+);
+
+//
+// Checks a header and the payload behind it. On success *payload and
+// *length describe the bytes to load.
+//
+BITSTREAM_STATUS
+BitstreamParse(
+	const unsigned char *image,
+	unsigned int size,
+	const unsigned char **payload,
+	unsigned int *length
+);
+
+//
+// Runs the whole configuration sequence for an image BitstreamParse
+// accepted, writing at most chunk bytes at a time. Returns
+// BitstreamBadChecksum if what went out does not match the header.
+// Chip select is left deasserted, reset released.
+//
+BITSTREAM_STATUS
+BitstreamLoad(
+	const BITSTREAM_OPS *ops,
+	void *context,
+	const unsigned char *image,
+	unsigned int size,
+	unsigned int chunk,
+	PBITSTREAM_RESULT result
+);
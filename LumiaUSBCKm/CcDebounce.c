@@ -0,0 +1,92 @@
+/*++
+
+Module Name:
+
+    ccdebounce.c
+
+Abstract:
+
+    CC state debouncing.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "CcDebounce.h"
+
+#define CC_TIME_REACHED(now, deadline) ((long)((now) - (deadline)) >= 0)
+
+void
+CcDebounceInitialize(
+	PCC_DEBOUNCE debounce,
+	unsigned int ccDebounceMs,
+	unsigned int pdDebounceMs
+)
+{
+	debounce->CcDebounceMs = ccDebounceMs;
+	debounce->PdDebounceMs = pdDebounceMs;
+	debounce->Stable = 0;
+	debounce->Pending = 0;
+	debounce->Candidate = 0;
+	debounce->Deadline = 0;
+	debounce->Accepted = 0;
+	debounce->Suppressed = 0;
+}
+
+unsigned int
+CcDebouncePoll(
+	PCC_DEBOUNCE debounce,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	if (!debounce->Pending) {
+		*next = 0;
+		return 0;
+	}
+
+	if (!CC_TIME_REACHED(now, debounce->Deadline)) {
+		*next = debounce->Deadline - now;
+		return 0;
+	}
+
+	debounce->Stable = debounce->Candidate;
+	debounce->Pending = 0;
+	debounce->Accepted++;
+	*next = 0;
+	return CC_DEBOUNCE_EVENT_CHANGED;
+}
+
+unsigned int
+CcDebounceSample(
+	PCC_DEBOUNCE debounce,
+	unsigned char state,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	if (state == debounce->Stable) {
+		// Bounced back before the change held
+		if (debounce->Pending) {
+			debounce->Pending = 0;
+			debounce->Suppressed++;
+		}
+
+		*next = 0;
+		return 0;
+	}
+
+	if (!debounce->Pending || state != debounce->Candidate) {
+		if (debounce->Pending)
+			debounce->Suppressed++;
+
+		// A partner has to settle for the longer tCCDebounce, leaving or changing Rp takes tPDDebounce
+		debounce->Pending = 1;
+		debounce->Candidate = state;
+		debounce->Deadline = now + (debounce->Stable == 0 ? debounce->CcDebounceMs : debounce->PdDebounceMs);
+	}
+
+	return CcDebouncePoll(debounce, now, next);
+}
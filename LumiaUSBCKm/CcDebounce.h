@@ -0,0 +1,74 @@
+/*++
+
+Module Name:
+
+    ccdebounce.h
+
+Abstract:
+
+    Debounces the CC pin state between the raw chip status and the
+    connection state acted on. A change only counts once it held for
+    tCCDebounce when a partner appears, or tPDDebounce when it leaves or
+    its termination changes. Times are milliseconds from any monotonic
+    clock, there are no kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+// Timing values from the Type-C specification, the minimum of each range
+#define TYPEC_T_CC_DEBOUNCE_MS  100
+#define TYPEC_T_PD_DEBOUNCE_MS  10
+
+#define CC_DEBOUNCE_EVENT_CHANGED 0x01
+
+typedef struct _CC_DEBOUNCE
+{
+	unsigned int CcDebounceMs;
+	unsigned int PdDebounceMs;
+
+	// State last reported as stable, zero meaning nothing attached
+	unsigned char Stable;
+
+	// State seen on the pins that has not held long enough yet
+	int Pending;
+	unsigned char Candidate;
+	unsigned long Deadline;
+
+	unsigned long Accepted;
+	unsigned long Suppressed;
+} CC_DEBOUNCE, *PCC_DEBOUNCE;
+
+void
+CcDebounceInitialize(
+	PCC_DEBOUNCE debounce,
+	unsigned int ccDebounceMs,
+	unsigned int pdDebounceMs
+);
+
+//
+// Feeds a state read from the pins. Returns CC_DEBOUNCE_EVENT_* flags.
+// *next receives the milliseconds until the pending state is due, or zero
+// if nothing is pending.
+//
+unsigned int
+CcDebounceSample(
+	PCC_DEBOUNCE debounce,
+	unsigned char state,
+	unsigned long now,
+	unsigned long *next
+);
+
+//
+// Runs the debounce timer, same results as CcDebounceSample
+//
+unsigned int
+CcDebouncePoll(
+	PCC_DEBOUNCE debounce,
+	unsigned long now,
+	unsigned long *next
+);
@@ -0,0 +1,158 @@
+/*++
+
+Module Name:
+
+    connectorreport.c
+
+Abstract:
+
+    Deduplication of UCM connector notifications.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "ConnectorReport.h"
+
+static int ConnectorCapsEqual(const unsigned long *a, unsigned int aCount, const unsigned long *b, unsigned int bCount)
+{
+	unsigned int i;
+
+	if (aCount != bCount)
+		return 0;
+
+	for (i = 0; i < aCount; i++) {
+		if (a[i] != b[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static unsigned int ConnectorDiffValue(PCONNECTOR_REPORT report, int *reported, int next, unsigned int notification)
+{
+	if (next == CONNECTOR_VALUE_UNKNOWN)
+		return 0;
+
+	if (*reported == next) {
+		report->Suppressed++;
+		return 0;
+	}
+
+	*reported = next;
+	return notification;
+}
+
+static unsigned int ConnectorDiffCaps(PCONNECTOR_REPORT report, unsigned long *reported, unsigned int *reportedCount,
+	const unsigned long *next, unsigned int nextCount, unsigned int notification)
+{
+	unsigned int i;
+
+	if (nextCount == 0)
+		return 0;
+
+	if (ConnectorCapsEqual(reported, *reportedCount, next, nextCount)) {
+		report->Suppressed++;
+		return 0;
+	}
+
+	for (i = 0; i < nextCount && i < PD_MAX_DATA_OBJECTS; i++)
+		reported[i] = next[i];
+	*reportedCount = i;
+
+	return notification;
+}
+
+void
+ConnectorStateInitialize(
+	PCONNECTOR_STATE state
+)
+{
+	state->PowerRole = CONNECTOR_VALUE_UNKNOWN;
+	state->TypeCCurrent = CONNECTOR_VALUE_UNKNOWN;
+	state->ChargingState = CONNECTOR_VALUE_UNKNOWN;
+	state->PdConnState = CONNECTOR_VALUE_UNKNOWN;
+	state->Rdo = 0;
+	state->SourceCapCount = 0;
+	state->PartnerSourceCapCount = 0;
+}
+
+void
+ConnectorReportInitialize(
+	PCONNECTOR_REPORT report
+)
+{
+	ConnectorStateInitialize(&report->Reported);
+	report->Notifications = 0;
+	report->Suppressed = 0;
+}
+
+void
+ConnectorReportInvalidate(
+	PCONNECTOR_REPORT report,
+	unsigned int notifications
+)
+{
+	if (notifications & CONNECTOR_REPORT_SOURCE_CAPS)
+		report->Reported.SourceCapCount = 0;
+	if (notifications & CONNECTOR_REPORT_PARTNER_SOURCE_CAPS)
+		report->Reported.PartnerSourceCapCount = 0;
+	if (notifications & CONNECTOR_REPORT_POWER_DIRECTION)
+		report->Reported.PowerRole = CONNECTOR_VALUE_UNKNOWN;
+	if (notifications & CONNECTOR_REPORT_TYPEC_CURRENT)
+		report->Reported.TypeCCurrent = CONNECTOR_VALUE_UNKNOWN;
+	if (notifications & CONNECTOR_REPORT_PD_CONN_STATE) {
+		report->Reported.PdConnState = CONNECTOR_VALUE_UNKNOWN;
+		report->Reported.Rdo = 0;
+	}
+	if (notifications & CONNECTOR_REPORT_CHARGING_STATE)
+		report->Reported.ChargingState = CONNECTOR_VALUE_UNKNOWN;
+}
+
+void
+ConnectorReportAttach(
+	PCONNECTOR_REPORT report,
+	int typeCCurrent,
+	int chargingState
+)
+{
+	ConnectorReportInvalidate(report, CONNECTOR_REPORT_ALL);
+	report->Reported.TypeCCurrent = typeCCurrent;
+	report->Reported.ChargingState = chargingState;
+	report->Notifications++;
+}
+
+unsigned int
+ConnectorReportDiff(
+	PCONNECTOR_REPORT report,
+	const CONNECTOR_STATE *next
+)
+{
+	CONNECTOR_STATE *reported = &report->Reported;
+	unsigned int changes = 0, i;
+
+	changes |= ConnectorDiffCaps(report, reported->SourceCaps, &reported->SourceCapCount,
+		next->SourceCaps, next->SourceCapCount, CONNECTOR_REPORT_SOURCE_CAPS);
+	changes |= ConnectorDiffCaps(report, reported->PartnerSourceCaps, &reported->PartnerSourceCapCount,
+		next->PartnerSourceCaps, next->PartnerSourceCapCount, CONNECTOR_REPORT_PARTNER_SOURCE_CAPS);
+	changes |= ConnectorDiffValue(report, &reported->PowerRole, next->PowerRole, CONNECTOR_REPORT_POWER_DIRECTION);
+	changes |= ConnectorDiffValue(report, &reported->TypeCCurrent, next->TypeCCurrent, CONNECTOR_REPORT_TYPEC_CURRENT);
+
+	// A renegotiated contract is news even if the connection state stays the same
+	if (next->PdConnState != CONNECTOR_VALUE_UNKNOWN && next->PdConnState == reported->PdConnState && next->Rdo != reported->Rdo)
+		reported->PdConnState = CONNECTOR_VALUE_UNKNOWN;
+	changes |= ConnectorDiffValue(report, &reported->PdConnState, next->PdConnState, CONNECTOR_REPORT_PD_CONN_STATE);
+	if (changes & CONNECTOR_REPORT_PD_CONN_STATE)
+		reported->Rdo = next->Rdo;
+
+	changes |= ConnectorDiffValue(report, &reported->ChargingState, next->ChargingState, CONNECTOR_REPORT_CHARGING_STATE);
+	if ((changes & CONNECTOR_REPORT_PD_CONN_STATE) && (changes & CONNECTOR_REPORT_CHARGING_STATE))
+		changes &= ~CONNECTOR_REPORT_CHARGING_STATE;
+
+	for (i = changes; i; i &= i - 1)
+		report->Notifications++;
+
+	return changes;
+}
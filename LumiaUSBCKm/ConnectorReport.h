@@ -0,0 +1,105 @@
+/*++
+
+Module Name:
+
+    connectorreport.h
+
+Abstract:
+
+    Keeps the connector state last reported to UCM and works out which
+    notifications a new state actually needs. No kernel dependencies;
+    UCM enumeration values are carried as plain ints.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Pd.h"
+
+//
+// Notifications, in the order they have to be sent: capabilities before
+// the negotiation outcome they belong to, the charging state last
+//
+#define CONNECTOR_REPORT_SOURCE_CAPS            0x01
+#define CONNECTOR_REPORT_PARTNER_SOURCE_CAPS    0x02
+#define CONNECTOR_REPORT_POWER_DIRECTION        0x04
+#define CONNECTOR_REPORT_TYPEC_CURRENT          0x08
+#define CONNECTOR_REPORT_PD_CONN_STATE          0x10
+#define CONNECTOR_REPORT_CHARGING_STATE         0x20
+
+#define CONNECTOR_REPORT_ALL                    0x3F
+
+// A field left at this value has nothing to report
+#define CONNECTOR_VALUE_UNKNOWN (-1)
+
+typedef struct _CONNECTOR_STATE
+{
+	int PowerRole;
+	int TypeCCurrent;
+	int ChargingState;
+	int PdConnState;
+	unsigned long Rdo;
+
+	// A count of zero leaves the capabilities alone
+	unsigned long SourceCaps[PD_MAX_DATA_OBJECTS];
+	unsigned int SourceCapCount;
+	unsigned long PartnerSourceCaps[PD_MAX_DATA_OBJECTS];
+	unsigned int PartnerSourceCapCount;
+} CONNECTOR_STATE, *PCONNECTOR_STATE;
+
+typedef struct _CONNECTOR_REPORT
+{
+	CONNECTOR_STATE Reported;
+
+	unsigned long Notifications;
+	unsigned long Suppressed;
+} CONNECTOR_REPORT, *PCONNECTOR_REPORT;
+
+//
+// Sets every field of a state to unknown, callers then fill in what they know
+//
+void
+ConnectorStateInitialize(
+	PCONNECTOR_STATE state
+);
+
+void
+ConnectorReportInitialize(
+	PCONNECTOR_REPORT report
+);
+
+//
+// Forgets what was reported for the given CONNECTOR_REPORT_* notifications,
+// so the next state sends them again. Attach and detach forget everything.
+//
+void
+ConnectorReportInvalidate(
+	PCONNECTOR_REPORT report,
+	unsigned int notifications
+);
+
+//
+// Records the Type-C current and charging state carried by the attach
+// notification itself
+//
+void
+ConnectorReportAttach(
+	PCONNECTOR_REPORT report,
+	int typeCCurrent,
+	int chargingState
+);
+
+//
+// Merges the known fields of next into the reported state and returns the
+// CONNECTOR_REPORT_* notifications to send, in bit order. A charging state
+// change riding on a PD connection state notification is not sent twice.
+//
+unsigned int
+ConnectorReportDiff(
+	PCONNECTOR_REPORT report,
+	const CONNECTOR_STATE *next
+);
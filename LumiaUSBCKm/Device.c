@@ -19,17 +19,48 @@ Environment:
 #define RESHUB_USE_HELPER_ROUTINES
 #include <reshub.h>
 #include <gpio.h>
+#include <spb.h>
 #include <wdf.h>
 
 
 EVT_WDF_DEVICE_PREPARE_HARDWARE LumiaUSBCDevicePrepareHardware;
 EVT_UCM_CONNECTOR_SET_DATA_ROLE     LumiaUSBCSetDataRole;
+EVT_UCM_CONNECTOR_SET_POWER_ROLE    LumiaUSBCSetPowerRole;
 //EVT_WDF_DEVICE_D0_ENTRY LumiaUSBCDeviceD0Entry;
 
 NTSTATUS ReadRegister(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length);
 NTSTATUS WriteRegister(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length);
 NTSTATUS GetGPIO(PDEVICE_CONTEXT ctx, WDFIOTARGET gpio, unsigned char *value);
 NTSTATUS SetGPIO(PDEVICE_CONTEXT ctx, WDFIOTARGET gpio, unsigned char *value);
+NTSTATUS LumiaUSBCRunScript(PDEVICE_CONTEXT ctx, const UC120_SCRIPT_OP *script, UC120_SCRIPT_RESULT *result);
+void LumiaUSBCGpioResync(PDEVICE_CONTEXT ctx);
+NTSTATUS ReadRegisterAt(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, int reg, unsigned char *value, ULONG length);
+NTSTATUS WriteRegisterAt(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, int reg, unsigned char *value, ULONG length);
+void LumiaUSBCReadRegisters(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, const UCHAR *regs, unsigned char *values, NTSTATUS *statuses, ULONG count);
+NTSTATUS LumiaUSBCBusStart(PDEVICE_CONTEXT ctx);
+void LumiaUSBCBusShutdown(PDEVICE_CONTEXT ctx);
+void LumiaUSBCBusPause(PDEVICE_CONTEXT ctx);
+void LumiaUSBCBusResume(PDEVICE_CONTEXT ctx);
+NTSTATUS LumiaUSBCBusSubmit(PDEVICE_CONTEXT ctx, SPI_BUS_REQUEST *requests, ULONG count);
+void LumiaUSBCUpdateAttachState(PDEVICE_CONTEXT ctx, unsigned char ccStatus);
+void LumiaUSBCSetAttachState(PDEVICE_CONTEXT ctx, BOOLEAN attached, UC120_ORIENTATION orientation, UC120_RP_LEVEL rpLevel);
+void LumiaUSBCCcSample(PDEVICE_CONTEXT ctx, unsigned char ccStatus);
+NTSTATUS LumiaUSBCSetUc120Clock(PDEVICE_CONTEXT ctx, BOOLEAN on);
+NTSTATUS LumiaUSBCAssignIdleSettings(WDFDEVICE Device, ULONG timeoutMs, BOOLEAN enabled);
+void LumiaUSBCPublishStatistics(PDEVICE_CONTEXT ctx);
+void LumiaUSBCPublishInterruptProfile(PDEVICE_CONTEXT ctx);
+NTSTATUS LumiaUSBCStatsCreate(PDEVICE_CONTEXT ctx);
+NTSTATUS LumiaUSBCBitstreamRead(PDEVICE_CONTEXT ctx);
+EVT_WDF_OBJECT_CONTEXT_CLEANUP LumiaUSBCDeviceCleanup;
+void LumiaUSBCClockAcquire(PDEVICE_CONTEXT ctx, PEP_CLOCK_REASON reason);
+void LumiaUSBCClockRelease(PDEVICE_CONTEXT ctx, PEP_CLOCK_REASON reason);
+void LumiaUSBCPdService(PDEVICE_CONTEXT ctx, unsigned char interruptStatus);
+void LumiaUSBCApplyMux(PDEVICE_CONTEXT ctx);
+void LumiaUSBCApplyPowerRole(PDEVICE_CONTEXT ctx, BOOLEAN source);
+void LumiaUSBCPdPoll(PDEVICE_CONTEXT ctx);
+void LumiaUSBCPdSwapEvents(PDEVICE_CONTEXT ctx, unsigned int events);
+void LumiaUSBCSetVbus(void *context, int on);
+ULONG LumiaUSBCPdNow(void);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, LumiaUSBCKmCreateDevice)
@@ -37,6 +68,54 @@ NTSTATUS SetGPIO(PDEVICE_CONTEXT ctx, WDFIOTARGET gpio, unsigned char *value);
 #pragma alloc_text (PAGE, LumiaUSBCSetDataRole)
 #endif
 
+C_ASSERT(UC120_SNAPSHOT_COUNT == LUMIAUSBC_SNAPSHOT_REGISTERS);
+C_ASSERT(SNAPSHOT_STREAM_CAPTURE_SIZE == LUMIAUSBC_SNAPSHOT_CAPTURE_SIZE);
+
+//
+// Copies an interrupt's register dump into the statistics block, and
+// appends it to the capture
+//
+void LumiaUSBCStatsSnapshot(PDEVICE_CONTEXT ctx, const unsigned char *registers)
+{
+	ULONGLONG time = KeQueryInterruptTime();
+	ULONG i;
+
+	STATS_BEGIN(ctx);
+	ctx->Stats->SnapshotTime = time;
+	for (i = 0; i < LUMIAUSBC_SNAPSHOT_REGISTERS; i++)
+		ctx->Stats->Snapshot[i] = registers[i];
+	STATS_END(ctx);
+
+	WdfWaitLockAcquire(ctx->SnapshotLock, NULL);
+	SnapshotStreamAppend(&ctx->Snapshots, time, registers);
+	WdfWaitLockRelease(ctx->SnapshotLock);
+}
+
+int LumiaUSBCInterruptReadStatus(void *context, unsigned char *status)
+{
+	return NT_SUCCESS(ReadRegisterAt((PDEVICE_CONTEXT)context, SpiBusPriorityInterrupt, UC120_REG_INTERRUPT_STATUS, status, 1));
+}
+
+int LumiaUSBCInterruptAcknowledge(void *context, unsigned char bits)
+{
+	if (NT_SUCCESS(WriteRegisterAt((PDEVICE_CONTEXT)context, SpiBusPriorityInterrupt, UC120_REG_INTERRUPT_STATUS, &bits, 1)))
+		return 1;
+
+	LumiaUSBCPostEvent((PDEVICE_CONTEXT)context, LUMIAUSBC_EVENT_ERROR, LUMIAUSBC_EVENT_ERROR_ACKNOWLEDGE, bits);
+	return 0;
+}
+
+void LumiaUSBCInterruptHandle(void *context, unsigned char bits)
+{
+	LumiaUSBCPdService((PDEVICE_CONTEXT)context, bits);
+}
+
+static const UC120_INTERRUPT_OPS LumiaUSBCInterruptOps = {
+	LumiaUSBCInterruptReadStatus,
+	LumiaUSBCInterruptAcknowledge,
+	LumiaUSBCInterruptHandle
+};
+
 NTSTATUS
 LumiaUSBCSetDataRole(
 	UCMCONNECTOR  Connector,
@@ -52,18 +131,136 @@ LumiaUSBCSetDataRole(
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS
+LumiaUSBCSetPowerRole(
+	UCMCONNECTOR  Connector,
+	UCM_POWER_ROLE  PowerRole
+)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(ConnectorGetContext(Connector)->Device);
+	BOOLEAN source = PowerRole == UcmPowerRoleSource ? TRUE : FALSE;
+	ULONGLONG start = KeQueryInterruptTime();
+	ULONG latencyMs;
+
+	WdfWaitLockAcquire(ctx->PdLock, NULL);
+
+	if (source == ctx->SourceMode) {
+		// A request is always answered, whether or not the direction changed
+		if (ctx->Attached)
+			UcmConnectorPowerDirectionChanged(Connector, TRUE, PowerRole);
+	}
+	else if (ctx->Attached && (ctx->Sink.ContractValid || ctx->Source.ContractValid)) {
+		// An explicit contract only changes hands through PR_Swap, UCM hears back when it completes
+		ctx->PowerRoleRequested = TRUE;
+		LumiaUSBCPdSwapEvents(ctx, PdPrSwapRequest(&ctx->Swap, &ctx->Pd, LumiaUSBCPdNow()));
+		LumiaUSBCPdPoll(ctx);
+	}
+	else {
+		// Without a contract the role only decides who drives VBUS
+		LumiaUSBCApplyPowerRole(ctx, source);
+
+		latencyMs = (ULONG)((KeQueryInterruptTime() - start) / 10000);
+		STATS_ADD(ctx, PowerRoleSwaps, 1);
+		STATS_SET(ctx, LastSwapLatencyMs, latencyMs);
+		STATS_MAX(ctx, MaxSwapLatencyMs, latencyMs);
+	}
+
+	WdfWaitLockRelease(ctx->PdLock);
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Interrupt resources as numbered in the statistics block and the profile
+//
+ULONG LumiaUSBCInterruptSource(PDEVICE_CONTEXT ctx, WDFINTERRUPT Interrupt)
+{
+	if (Interrupt == ctx->PlugDetectInterrupt)
+		return LUMIAUSBC_INTERRUPT_PLUG_DETECT;
+	if (Interrupt == ctx->Uc120Interrupt)
+		return LUMIAUSBC_INTERRUPT_UC120;
+	return Interrupt == ctx->MysteryInterrupt1 ? LUMIAUSBC_INTERRUPT_MYSTERY1 : LUMIAUSBC_INTERRUPT_MYSTERY2;
+}
+
+//
+// Bursts and correlation windows are a millisecond or so, far below the
+// interrupt time's resolution, so profile records use the performance counter
+//
+ULONG LumiaUSBCProfileNowUs(void)
+{
+	LARGE_INTEGER counter, frequency;
+
+	counter = KeQueryPerformanceCounter(&frequency);
+	return (ULONG)(counter.QuadPart / frequency.QuadPart * 1000000 +
+		counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+//
+// Counts an interrupt, and records it while profiling. Returns the length
+// of the burst it belongs to, zero when not profiling. The count waits in
+// the device context for STATS_FLUSH, only profiling takes a lock.
+//
+ULONG LumiaUSBCCountInterrupt(PDEVICE_CONTEXT ctx, WDFINTERRUPT Interrupt)
+{
+	ULONG source = LumiaUSBCInterruptSource(ctx, Interrupt);
+	ULONG burst;
+
+	InterlockedIncrement(&ctx->Interrupts[source]);
+
+	if (!ctx->ProfileInterrupts)
+		return 0;
+
+	WdfWaitLockAcquire(ctx->ProfileLock, NULL);
+	burst = IrqProfileInterrupt(&ctx->Profile, source, LumiaUSBCProfileNowUs());
+	WdfWaitLockRelease(ctx->ProfileLock);
+
+	return burst;
+}
+
 BOOLEAN EvtInterruptIsr(
 	WDFINTERRUPT Interrupt,
 	ULONG MessageID
 )
 {
-	UNREFERENCED_PARAMETER((Interrupt, MessageID));
+	UNREFERENCED_PARAMETER(MessageID);
+
+	LumiaUSBCCountInterrupt(DeviceGetContext(WdfInterruptGetDevice(Interrupt)), Interrupt);
 
 	WdfInterruptQueueWorkItemForIsr(Interrupt);
 
 	return TRUE;
 }
 
+//
+// ISR for the interrupts nothing is known to be wired to, only connected while profiling
+//
+BOOLEAN LumiaUSBCProfileIsr(
+	WDFINTERRUPT Interrupt,
+	ULONG MessageID
+)
+{
+	UNREFERENCED_PARAMETER(MessageID);
+
+	// Nothing here acknowledges the source, so a level-triggered line would storm. Mask it at the
+	// controller right here: the ISR thread would keep a work item from ever getting to run.
+	if (LumiaUSBCCountInterrupt(DeviceGetContext(WdfInterruptGetDevice(Interrupt)), Interrupt) == IRQ_PROFILE_STORM_BURST) {
+		WdfInterruptReportInactive(Interrupt);
+		WdfInterruptQueueWorkItemForIsr(Interrupt);
+	}
+
+	return TRUE;
+}
+
+void LumiaUSBCProfileWorkItem(
+	WDFINTERRUPT Interrupt,
+	WDFOBJECT AssociatedObject
+)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedObject);
+
+	TraceEvents(TRACE_LEVEL_WARNING, TRACE_INTERRUPT, "Interrupt %u kept firing, masked it and stopped profiling it", LumiaUSBCInterruptSource(ctx, Interrupt));
+}
+
 void Uc120InterruptWorkItem(
 	WDFINTERRUPT Interrupt,
 	WDFOBJECT AssociatedObject
@@ -71,49 +268,43 @@ void Uc120InterruptWorkItem(
 {
 	UNREFERENCED_PARAMETER(Interrupt);
 	PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedObject);
-	unsigned char registers[8];
-	NTSTATUS statuses[8];
-	unsigned char dismiss = 0xFF;
-	wchar_t buf[260];
-	//ULONG data = 0;
+	unsigned char registers[UC120_SNAPSHOT_COUNT];
+	NTSTATUS statuses[UC120_SNAPSHOT_COUNT];
+	unsigned char handled;
+
+	LumiaUSBCTraceUc120Interrupt();
 
-	DbgPrint("Got an interrupt from the UC120!\n");
+	LumiaUSBCClockAcquire(ctx, PepClockReasonInterrupt);
 
 	memset(registers, 0, sizeof(registers));
 	memset(statuses, 0, sizeof(statuses));
 
-	statuses[0] = ReadRegister(ctx, 0, registers + 0, 1);
-	statuses[1] = ReadRegister(ctx, 1, registers + 1, 1);
-	statuses[2] = ReadRegister(ctx, 2, registers + 2, 1);
-	statuses[3] = ReadRegister(ctx, 5, registers + 3, 1);
-	statuses[4] = ReadRegister(ctx, 7, registers + 4, 1);
-	statuses[5] = ReadRegister(ctx, 9, registers + 5, 1);
-	statuses[6] = ReadRegister(ctx, 10, registers + 6, 1);
-	statuses[7] = ReadRegister(ctx, 11, registers + 7, 1);
+	LumiaUSBCReadRegisters(ctx, SpiBusPriorityInterrupt, Uc120SnapshotRegisters, registers, statuses, ARRAYSIZE(registers));
+	LumiaUSBCStatsSnapshot(ctx, registers);
 
-	WriteRegister(ctx, 2, &dismiss, 1);
+	// Held across the whole service so a transmit in flight keeps its TX done bits to itself
+	WdfWaitLockAcquire(ctx->PdLock, NULL);
+	handled = NT_SUCCESS(statuses[UC120_SNAPSHOT_INTERRUPT_STATUS]) ?
+		Uc120ServiceInterrupts(&LumiaUSBCInterruptOps, ctx, registers[UC120_SNAPSHOT_INTERRUPT_STATUS], &ctx->InterruptStats) : 0;
+	WdfWaitLockRelease(ctx->PdLock);
 
-	swprintf(buf, L"UC120_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x", registers[0], registers[1], registers[2], registers[3], registers[4], registers[5], registers[6], registers[7]);
-
-	DbgPrint("%ls\n", buf);
+	// What the other interrupt lines are held against
+	if (ctx->ProfileInterrupts) {
+		WdfWaitLockAcquire(ctx->ProfileLock, NULL);
+		IrqProfileStatus(&ctx->Profile, handled, LumiaUSBCProfileNowUs());
+		WdfWaitLockRelease(ctx->ProfileLock);
+	}
 
-	/*RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));*/
+	// The CC status read with the dump predates a change caught on a later round
+	if (handled & ~registers[UC120_SNAPSHOT_INTERRUPT_STATUS] & UC120_INT_CC_CHANGE)
+		statuses[UC120_SNAPSHOT_CC_STATUS] = ReadRegisterAt(ctx, SpiBusPriorityInterrupt, UC120_REG_CC_STATUS, &registers[UC120_SNAPSHOT_CC_STATUS], 1);
 
-	swprintf(buf, L"S_UC120_%08x-%08x-%08x-%08x-%08x-%08x-%08x-%08x", statuses[0], statuses[1], statuses[2], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
+	LumiaUSBCClockRelease(ctx, PepClockReasonInterrupt);
 
-	DbgPrint("%ls\n", buf);
+	if (NT_SUCCESS(statuses[UC120_SNAPSHOT_CC_STATUS]))
+		LumiaUSBCCcSample(ctx, registers[UC120_SNAPSHOT_CC_STATUS]);
 
-	/*RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));*/
+	LumiaUSBCTraceUc120Dump(registers, statuses);
 }
 
 void PlugDetInterruptWorkItem(
@@ -123,43 +314,26 @@ void PlugDetInterruptWorkItem(
 {
 	UNREFERENCED_PARAMETER(Interrupt);
 	PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedObject);
-	unsigned char registers[8];
-	NTSTATUS statuses[8];
+	unsigned char registers[UC120_SNAPSHOT_COUNT];
+	NTSTATUS statuses[UC120_SNAPSHOT_COUNT];
 	//	unsigned char dismiss = 0x1;
-	wchar_t buf[260];
-	ULONG data = 0;
+
+	LumiaUSBCClockAcquire(ctx, PepClockReasonInterrupt);
 
 	memset(registers, 0, sizeof(registers));
 	memset(statuses, 0, sizeof(statuses));
 
-	statuses[0] = ReadRegister(ctx, 0, registers + 0, 1);
-	statuses[1] = ReadRegister(ctx, 1, registers + 1, 1);
-	statuses[2] = ReadRegister(ctx, 2, registers + 2, 1);
-	statuses[3] = ReadRegister(ctx, 5, registers + 3, 1);
-	statuses[4] = ReadRegister(ctx, 7, registers + 4, 1);
-	statuses[5] = ReadRegister(ctx, 9, registers + 5, 1);
-	statuses[6] = ReadRegister(ctx, 10, registers + 6, 1);
-	statuses[7] = ReadRegister(ctx, 11, registers + 7, 1);
+	LumiaUSBCReadRegisters(ctx, SpiBusPriorityInterrupt, Uc120SnapshotRegisters, registers, statuses, ARRAYSIZE(registers));
+	LumiaUSBCStatsSnapshot(ctx, registers);
 
 	//WriteRegister(ctx, 2, &dismiss, 1);
 
-	swprintf(buf, L"PLUGDET_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x", registers[0], registers[1], registers[2], registers[3], registers[4], registers[5], registers[6], registers[7]);
-
-	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));
+	LumiaUSBCClockRelease(ctx, PepClockReasonInterrupt);
 
-	swprintf(buf, L"S_PLUGDET_%08x-%08x-%08x-%08x-%08x-%08x-%08x-%08x", statuses[0], statuses[1], statuses[2], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
+	if (NT_SUCCESS(statuses[UC120_SNAPSHOT_CC_STATUS]))
+		LumiaUSBCCcSample(ctx, registers[UC120_SNAPSHOT_CC_STATUS]);
 
-	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));
+	LumiaUSBCTracePlugDetDump(registers, statuses);
 }
 
 NTSTATUS Uc120InterruptEnable(
@@ -169,20 +343,12 @@ NTSTATUS Uc120InterruptEnable(
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedDevice);
-	unsigned char value;
+	UC120_SCRIPT_RESULT result;
 	UNREFERENCED_PARAMETER(Interrupt);
 
-	value = 0xFF;
-	WriteRegister(ctx, 2, &value, 1);
-	WriteRegister(ctx, 3, &value, 1);
-
-	ReadRegister(ctx, 4, &value, 1);
-	value |= 1;
-	WriteRegister(ctx, 4, &value, 1);
-
-	ReadRegister(ctx, 5, &value, 1);
-	value &= ~0x80;
-	WriteRegister(ctx, 5, &value, 1);
+	LumiaUSBCRunScript(ctx, Uc120InterruptEnableScript, &result);
+	STATS_SET(ctx, InterruptScriptTransactions, result.Transactions);
+	STATS_SET(ctx, InterruptScriptAccesses, result.Accesses);
 
 	return status;
 }
@@ -194,25 +360,28 @@ NTSTATUS Uc120InterruptDisable(
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	PDEVICE_CONTEXT ctx = DeviceGetContext(AssociatedDevice);
-	unsigned char value;
+	UC120_SCRIPT_RESULT result;
 	UNREFERENCED_PARAMETER(Interrupt);
 
-	ReadRegister(ctx, 4, &value, 1);
-	value &= ~1;
-	WriteRegister(ctx, 4, &value, 1);
+	// Keep the chip able to raise its interrupt if it has to wake us from idle
+	if (ctx->ArmedForWake)
+		return status;
+
+	LumiaUSBCRunScript(ctx, Uc120InterruptDisableScript, &result);
 
 	return status;
 }
 
-NTSTATUS OpenIOTarget(PDEVICE_CONTEXT ctx, LARGE_INTEGER res, ACCESS_MASK use, WDFIOTARGET *target)
+NTSTATUS OpenIOTarget(PDEVICE_CONTEXT ctx, LARGE_INTEGER res, ACCESS_MASK use, WDFIOTARGET target)
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	WDF_OBJECT_ATTRIBUTES ObjectAttributes;
 	WDF_IO_TARGET_OPEN_PARAMS OpenParams;
 	UNICODE_STRING ReadString;
 	WCHAR ReadStringBuffer[260];
 
-	DbgPrint("%!FUNC! Entry");
+	UNREFERENCED_PARAMETER(ctx);
+
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_GPIO, "%!FUNC! Entry");
 
 	RtlInitEmptyUnicodeString(&ReadString,
 		ReadStringBuffer,
@@ -222,26 +391,51 @@ NTSTATUS OpenIOTarget(PDEVICE_CONTEXT ctx, LARGE_INTEGER res, ACCESS_MASK use, W
 		res.LowPart,
 		res.HighPart);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("RESOURCE_HUB_CREATE_PATH_FROM_ID failed %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "RESOURCE_HUB_CREATE_PATH_FROM_ID failed %!STATUS!", status);
 		return status;
 	}
 
-	WDF_OBJECT_ATTRIBUTES_INIT(&ObjectAttributes);
-	ObjectAttributes.ParentObject = ctx->Device;
-
-	status = WdfIoTargetCreate(ctx->Device, &ObjectAttributes, target);
+	WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(&OpenParams, &ReadString, use);
+	status = WdfIoTargetOpen(target, &OpenParams);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("WdfIoTargetCreate failed %!STATUS!\n", status);
-		return status;
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "WdfIoTargetOpen failed %!STATUS!", status);
 	}
 
-	WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(&OpenParams, &ReadString, use);
-	status = WdfIoTargetOpen(*target, &OpenParams);
-	if (!NT_SUCCESS(status)) {
-		DbgPrint("WdfIoTargetOpen failed %!STATUS!\n", status);
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_GPIO, "%!FUNC! Exit");
+	return status;
+}
+
+//
+// The I/O targets live as long as the device. They are created the first time the hardware
+// is prepared, D0Entry and D0Exit only open and close them.
+//
+NTSTATUS
+LumiaUSBCCreateResources(
+	PDEVICE_CONTEXT ctx
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	WDF_OBJECT_ATTRIBUTES ObjectAttributes;
+	WDFIOTARGET *targets[] = {
+		&ctx->Spi, &ctx->VbusGpio, &ctx->PolGpio, &ctx->AmselGpio, &ctx->EnGpio, &ctx->ResetGpio, &ctx->MuxGpio,
+		&ctx->FakeSpiMosi, &ctx->FakeSpiMiso, &ctx->FakeSpiCs, &ctx->FakeSpiClk
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(targets); i++) {
+		if (*targets[i])
+			continue;
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&ObjectAttributes, GPIO_SHADOW);
+		ObjectAttributes.ParentObject = ctx->Device;
+
+		status = WdfIoTargetCreate(ctx->Device, &ObjectAttributes, targets[i]);
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "WdfIoTargetCreate failed %!STATUS!", status);
+			return status;
+		}
 	}
 
-	DbgPrint("%!FUNC! Exit\n");
 	return status;
 }
 
@@ -258,8 +452,9 @@ LumiaUSBCProbeResources(
 	int k = 0, l = 0;
 	int spi_found = 0;
 	ctx->HaveResetGpio = FALSE;
+	ctx->HaveMuxGpio = FALSE;
 	ctx->UseFakeSpi = FALSE;
-	DbgPrint("%!FUNC! Entry\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Entry");
 
 	for (unsigned int i = 0; i < WdfCmResourceListGetCount(res); i++) {
 		desc = WdfCmResourceListGetDescriptor(res, i);
@@ -308,6 +503,11 @@ LumiaUSBCProbeResources(
 					ctx->FakeSpiClkId.LowPart = desc->u.Connection.IdLowPart;
 					ctx->FakeSpiClkId.HighPart = desc->u.Connection.IdHighPart;
 					break;
+				case 9:
+					ctx->MuxGpioId.LowPart = desc->u.Connection.IdLowPart;
+					ctx->MuxGpioId.HighPart = desc->u.Connection.IdHighPart;
+					ctx->HaveMuxGpio = TRUE;
+					break;
 				default:
 					break;
 				}
@@ -326,20 +526,30 @@ LumiaUSBCProbeResources(
 			switch (l)
 			{
 			case 0:
+				// Nothing we know of clears the plug-detect line, so only an edge-triggered one can be
+				// connected: a level-triggered one would fire for as long as it stays asserted. The
+				// UC120 interrupt reports CC changes either way, so going without it is not fatal.
+				if (!(desc->Flags & CM_RESOURCE_INTERRUPT_LATCHED)) {
+					TraceEvents(TRACE_LEVEL_WARNING, TRACE_INTERRUPT, "Plug detection interrupt is level-triggered, not connecting it");
+					break;
+				}
 				WDF_INTERRUPT_CONFIG_INIT(&Config, EvtInterruptIsr, NULL);
-				//Config.PassiveHandling = TRUE;
+				Config.PassiveHandling = TRUE;
+				Config.CanWakeDevice = TRUE;
 				Config.EvtInterruptWorkItem = PlugDetInterruptWorkItem;
 				Config.InterruptRaw = WdfCmResourceListGetDescriptor(rawres, i);
 				Config.InterruptTranslated = desc;
-				//status = WdfInterruptCreate(ctx->Device, &Config, WDF_NO_OBJECT_ATTRIBUTES, &ctx->PlugDetectInterrupt);
+				status = WdfInterruptCreate(ctx->Device, &Config, WDF_NO_OBJECT_ATTRIBUTES, &ctx->PlugDetectInterrupt);
 				if (!NT_SUCCESS(status)) {
-					DbgPrint("WdfInterruptCreate failed for plug detection %!STATUS!\n", status);
-					return status;
+					TraceEvents(TRACE_LEVEL_WARNING, TRACE_INTERRUPT, "WdfInterruptCreate failed for plug detection, going without it %!STATUS!", status);
+					ctx->PlugDetectInterrupt = NULL;
+					status = STATUS_SUCCESS;
 				}
 				break;
 			case 1:
 				WDF_INTERRUPT_CONFIG_INIT(&Config, EvtInterruptIsr, NULL);
 				Config.PassiveHandling = TRUE;
+				Config.CanWakeDevice = TRUE;
 				Config.EvtInterruptWorkItem = Uc120InterruptWorkItem;
 				Config.InterruptRaw = WdfCmResourceListGetDescriptor(rawres, i);
 				Config.InterruptTranslated = desc;
@@ -347,10 +557,27 @@ LumiaUSBCProbeResources(
 				Config.EvtInterruptDisable = Uc120InterruptDisable;
 				status = WdfInterruptCreate(ctx->Device, &Config, WDF_NO_OBJECT_ATTRIBUTES, &ctx->Uc120Interrupt);
 				if (!NT_SUCCESS(status)) {
-					DbgPrint("WdfInterruptCreate failed for UC120 interrupt %!STATUS!\n", status);
+					TraceEvents(TRACE_LEVEL_ERROR, TRACE_INTERRUPT, "WdfInterruptCreate failed for UC120 interrupt %!STATUS!", status);
 					return status;
 				}
 				break;
+			case 2:
+			case 3:
+				// Only connected to find out what they signal, a failure here is not fatal
+				if (!ctx->ProfileInterrupts)
+					break;
+				WDF_INTERRUPT_CONFIG_INIT(&Config, LumiaUSBCProfileIsr, NULL);
+				Config.PassiveHandling = TRUE;
+				Config.EvtInterruptWorkItem = LumiaUSBCProfileWorkItem;
+				Config.InterruptRaw = WdfCmResourceListGetDescriptor(rawres, i);
+				Config.InterruptTranslated = desc;
+				status = WdfInterruptCreate(ctx->Device, &Config, WDF_NO_OBJECT_ATTRIBUTES,
+					l == 2 ? &ctx->MysteryInterrupt1 : &ctx->MysteryInterrupt2);
+				if (!NT_SUCCESS(status)) {
+					TraceEvents(TRACE_LEVEL_WARNING, TRACE_INTERRUPT, "WdfInterruptCreate failed for interrupt %d, not profiling it %!STATUS!", l, status);
+					status = STATUS_SUCCESS;
+				}
+				break;
 			default:
 				break;
 			}
@@ -370,11 +597,11 @@ LumiaUSBCProbeResources(
 	}
 
 	if (!spi_found || k < 4) {
-		DbgPrint("Not all resources were found, SPI = %d, GPIO = %d\n", spi_found, k);
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "Not all resources were found, SPI = %d, GPIO = %d", spi_found, k);
 		status = 0xC0000000 + 8 * spi_found + k;
 	}
 
-	DbgPrint("%!FUNC! Exit\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Exit");
 	return status;
 }
 
@@ -384,74 +611,87 @@ LumiaUSBCOpenResources(
 )
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	DbgPrint("%!FUNC! Entry\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Entry");
 
 	if (!(ctx->UseFakeSpi)) {
-		status = OpenIOTarget(ctx, ctx->SpiId, GENERIC_READ | GENERIC_WRITE, &ctx->Spi);
+		status = OpenIOTarget(ctx, ctx->SpiId, GENERIC_READ | GENERIC_WRITE, ctx->Spi);
 		if (!NT_SUCCESS(status)) {
-			DbgPrint("OpenIOTarget failed for SPI %!STATUS! Falling back to fake SPI.\n", status);
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_SPI, "OpenIOTarget failed for SPI %!STATUS! Falling back to fake SPI.", status);
 			ctx->UseFakeSpi = TRUE;
 			status = STATUS_SUCCESS; // return status;
 		}
 	}
 
-	status = OpenIOTarget(ctx, ctx->VbusGpioId, GENERIC_READ | GENERIC_WRITE, &ctx->VbusGpio);
+	status = OpenIOTarget(ctx, ctx->VbusGpioId, GENERIC_READ | GENERIC_WRITE, ctx->VbusGpio);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("OpenIOTarget failed for VBUS GPIO %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "OpenIOTarget failed for VBUS GPIO %!STATUS!", status);
 		return status;
 	}
 
-	status = OpenIOTarget(ctx, ctx->PolGpioId, GENERIC_READ | GENERIC_WRITE, &ctx->PolGpio);
+	status = OpenIOTarget(ctx, ctx->PolGpioId, GENERIC_READ | GENERIC_WRITE, ctx->PolGpio);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("OpenIOTarget failed for polarity GPIO %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "OpenIOTarget failed for polarity GPIO %!STATUS!", status);
 		return status;
 	}
 
-	status = OpenIOTarget(ctx, ctx->AmselGpioId, GENERIC_READ | GENERIC_WRITE, &ctx->AmselGpio);
+	status = OpenIOTarget(ctx, ctx->AmselGpioId, GENERIC_READ | GENERIC_WRITE, ctx->AmselGpio);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("OpenIOTarget failed for alternate mode selection GPIO %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "OpenIOTarget failed for alternate mode selection GPIO %!STATUS!", status);
 		return status;
 	}
 
-	status = OpenIOTarget(ctx, ctx->EnGpioId, GENERIC_READ | GENERIC_WRITE, &ctx->EnGpio);
+	status = OpenIOTarget(ctx, ctx->EnGpioId, GENERIC_READ | GENERIC_WRITE, ctx->EnGpio);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("OpenIOTarget failed for mux enable GPIO %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "OpenIOTarget failed for mux enable GPIO %!STATUS!", status);
 		return status;
 	}
 
 	if (ctx->HaveResetGpio) {
-		status = OpenIOTarget(ctx, ctx->ResetGpioId, GENERIC_READ | GENERIC_WRITE, &ctx->ResetGpio);
+		status = OpenIOTarget(ctx, ctx->ResetGpioId, GENERIC_READ | GENERIC_WRITE, ctx->ResetGpio);
 		if (!(NT_SUCCESS(status))) {
-			DbgPrint("OpenIOTarget failed for chip reset GPIO %!STATUS!\n", status);
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_GPIO, "OpenIOTarget failed for chip reset GPIO %!STATUS!", status);
 			ctx->HaveResetGpio = FALSE;
 		}
 		status = STATUS_SUCCESS; // this GPIO is optional - make sure we never fail on it missing
 	}
 
+	if (ctx->HaveMuxGpio) {
+		status = OpenIOTarget(ctx, ctx->MuxGpioId, GENERIC_READ | GENERIC_WRITE, ctx->MuxGpio);
+		if (!(NT_SUCCESS(status))) {
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_GPIO, "OpenIOTarget failed for combined mux GPIO %!STATUS! Falling back to single pins.", status);
+			ctx->HaveMuxGpio = FALSE;
+		}
+		status = STATUS_SUCCESS;
+	}
+
+	LumiaUSBCGpioResync(ctx);
+
 	if (ctx->UseFakeSpi) {
-		status = OpenIOTarget(ctx, ctx->FakeSpiMosiId, GENERIC_READ | GENERIC_WRITE, &ctx->FakeSpiMosi);
+		status = OpenIOTarget(ctx, ctx->FakeSpiMosiId, GENERIC_READ | GENERIC_WRITE, ctx->FakeSpiMosi);
 		if (!NT_SUCCESS(status)) {
-			DbgPrint("OpenIOTarget failed for fake SPI MOSI line %!STATUS!\n", status);
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "OpenIOTarget failed for fake SPI MOSI line %!STATUS!", status);
 			return status;
 		}
-		status = OpenIOTarget(ctx, ctx->FakeSpiMisoId, GENERIC_READ | GENERIC_WRITE, &ctx->FakeSpiMiso);
+		status = OpenIOTarget(ctx, ctx->FakeSpiMisoId, GENERIC_READ | GENERIC_WRITE, ctx->FakeSpiMiso);
 		if (!NT_SUCCESS(status)) {
-			DbgPrint("OpenIOTarget failed for fake SPI MISO line %!STATUS!\n", status);
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "OpenIOTarget failed for fake SPI MISO line %!STATUS!", status);
 			return status;
 		}
-		status = OpenIOTarget(ctx, ctx->FakeSpiCsId, GENERIC_READ | GENERIC_WRITE, &ctx->FakeSpiCs);
+		status = OpenIOTarget(ctx, ctx->FakeSpiCsId, GENERIC_READ | GENERIC_WRITE, ctx->FakeSpiCs);
 		if (!NT_SUCCESS(status)) {
-			DbgPrint("OpenIOTarget failed for fake SPI CS# line %!STATUS!\n", status);
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "OpenIOTarget failed for fake SPI CS# line %!STATUS!", status);
 			return status;
 		}
-		status = OpenIOTarget(ctx, ctx->FakeSpiClkId, GENERIC_READ | GENERIC_WRITE, &ctx->FakeSpiClk);
+		status = OpenIOTarget(ctx, ctx->FakeSpiClkId, GENERIC_READ | GENERIC_WRITE, ctx->FakeSpiClk);
 		if (!NT_SUCCESS(status)) {
-			DbgPrint("OpenIOTarget failed for fake SPI clock line %!STATUS!\n", status);
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "OpenIOTarget failed for fake SPI clock line %!STATUS!", status);
 			return status;
 		}
 	}
 
-	DbgPrint("%!FUNC! Exit\n");
+	status = LumiaUSBCBusStart(ctx);
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Exit");
 	return status;
 }
 
@@ -460,7 +700,7 @@ LumiaUSBCCloseResources(
 	PDEVICE_CONTEXT ctx
 )
 {
-	DbgPrint("%!FUNC! Entry\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Entry");
 
 	if (ctx->Spi) {
 		WdfIoTargetClose(ctx->Spi);
@@ -486,6 +726,10 @@ LumiaUSBCCloseResources(
 		WdfIoTargetClose(ctx->ResetGpio);
 	}
 
+	if (ctx->MuxGpio) {
+		WdfIoTargetClose(ctx->MuxGpio);
+	}
+
 	if (ctx->FakeSpiClk) {
 		WdfIoTargetClose(ctx->FakeSpiClk);
 	}
@@ -502,7 +746,74 @@ LumiaUSBCCloseResources(
 		WdfIoTargetClose(ctx->FakeSpiMosi);
 	}
 
-	DbgPrint("%!FUNC! Exit\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Exit");
+}
+
+NTSTATUS LumiaUSBCSetUc120Clock(PDEVICE_CONTEXT ctx, BOOLEAN on)
+{
+	NTSTATUS status;
+	ULONG input[8], output[6];
+
+	// Tell PEP to turn the clock on or off
+	memset(input, 0, sizeof(input));
+	input[0] = 2;
+	input[7] = on ? 2 : 0;
+	status = PoFxPowerControl(ctx->PoHandle, &PowerControlGuid, &input, sizeof(input), &output, sizeof(output), NULL);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_POWER, "PoFxPowerControl failed %!STATUS!", status);
+	}
+
+	return status;
+}
+
+void LumiaUSBCClockSet(void *context, int on)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+
+	// Nothing to switch until PoFx registration in LumiaUSBCSelfManagedIoInit
+	if (ctx->PoHandle)
+		LumiaUSBCSetUc120Clock(ctx, on ? TRUE : FALSE);
+
+	if (!on) {
+		STATS_SET(ctx, ClockSwitches, ctx->Clock.Switches);
+		STATS_SET(ctx, ClockOnMs, ctx->Clock.OnTime / 10000);
+		STATS_SET(ctx, ClockOnMsSpi, ctx->Clock.ReasonOnTime[PepClockReasonSpi] / 10000);
+		STATS_SET(ctx, ClockOnMsInterrupt, ctx->Clock.ReasonOnTime[PepClockReasonInterrupt] / 10000);
+		STATS_SET(ctx, ClockOnMsInit, ctx->Clock.ReasonOnTime[PepClockReasonInit] / 10000);
+	}
+}
+
+void LumiaUSBCClockAcquire(PDEVICE_CONTEXT ctx, PEP_CLOCK_REASON reason)
+{
+	WdfWaitLockAcquire(ctx->ClockLock, NULL);
+	PepClockAcquire(&ctx->Clock, reason, KeQueryInterruptTime());
+	WdfWaitLockRelease(ctx->ClockLock);
+}
+
+void LumiaUSBCClockRelease(PDEVICE_CONTEXT ctx, PEP_CLOCK_REASON reason)
+{
+	int pending;
+
+	WdfWaitLockAcquire(ctx->ClockLock, NULL);
+	pending = PepClockRelease(&ctx->Clock, reason, KeQueryInterruptTime());
+	WdfWaitLockRelease(ctx->ClockLock);
+
+	// Restarting a running timer pushes the release out, so only the last burst in a row pays for it
+	if (pending)
+		WdfTimerStart(ctx->ClockTimer, WDF_REL_TIMEOUT_IN_MS(ctx->ClockHysteresisMs));
+}
+
+void LumiaUSBCClockTimer(WDFTIMER Timer)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	ULONGLONG remaining;
+
+	WdfWaitLockAcquire(ctx->ClockLock, NULL);
+	remaining = PepClockExpire(&ctx->Clock, KeQueryInterruptTime());
+	WdfWaitLockRelease(ctx->ClockLock);
+
+	if (remaining)
+		WdfTimerStart(ctx->ClockTimer, -(LONGLONG)remaining);
 }
 
 NTSTATUS LumiaUSBCDeviceD0Exit(
@@ -511,7 +822,36 @@ NTSTATUS LumiaUSBCDeviceD0Exit(
 )
 {
 	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
-	UNREFERENCED_PARAMETER(TargetState);
+
+	if (TargetState != WdfPowerDeviceD3Final && devCtx->PoHandle) {
+		// Drop the UC120 clock until we are back in D0
+		WdfTimerStop(devCtx->ClockTimer, TRUE);
+		WdfWaitLockAcquire(devCtx->ClockLock, NULL);
+		PepClockFlush(&devCtx->Clock, KeQueryInterruptTime());
+		WdfWaitLockRelease(devCtx->ClockLock);
+		PoFxIdleComponent(devCtx->PoHandle, 0, 0);
+		devCtx->ComponentIdle = TRUE;
+
+		if (WdfDeviceGetSystemPowerAction(Device) == PowerActionNone) {
+			// Runtime idle: the chip stays powered until the plug-detect or UC120 interrupt wakes us
+			devCtx->Idle = TRUE;
+			devCtx->WakePending = FALSE;
+			devCtx->IdleEnterTime = KeQueryInterruptTime();
+			STATS_ADD(devCtx, IdleTransitions, 1);
+		}
+		else {
+			// The system is going to sleep and may take the chip's power with it
+			devCtx->Reinitialize = TRUE;
+		}
+	}
+
+	// The mapped block is the live view, the registry copy only has to outlast the device
+	if (TargetState == WdfPowerDeviceD3Final)
+		LumiaUSBCPublishStatistics(devCtx);
+
+	// A debounce or PD timer running out must not touch the pins once they are closed
+	WdfTimerStop(devCtx->CcTimer, TRUE);
+	WdfTimerStop(devCtx->PdTimer, TRUE);
 
 	LumiaUSBCCloseResources(devCtx);
 
@@ -523,7 +863,9 @@ NTSTATUS LumiaUSBCDeviceReleaseHardware(
 	WDFCMRESLIST ResourcesTranslated
 )
 {
-	UNREFERENCED_PARAMETER((Device, ResourcesTranslated));
+	UNREFERENCED_PARAMETER(ResourcesTranslated);
+
+	LumiaUSBCBusShutdown(DeviceGetContext(Device));
 
 	return STATUS_SUCCESS;
 }
@@ -534,19 +876,51 @@ NTSTATUS LumiaUSBCDeviceReleaseHardware(
 #define IOCTL_QUP_SPI_ASSERT_CS   CTL_CODE(FILE_DEVICE_CONTROLLER, IOCTL_QUP_SPI_CS_MANIPULATION | 0x1, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_QUP_SPI_DEASSERT_CS CTL_CODE(FILE_DEVICE_CONTROLLER, IOCTL_QUP_SPI_CS_MANIPULATION | 0x0, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
-NTSTATUS ReadRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
+// Longest read done in one go is a PD frame
+#define SPI_FULL_DUPLEX_MAX 64
+
+NTSTATUS ReadRegisterFullDuplex(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
+{
+	NTSTATUS status;
+	WDF_MEMORY_DESCRIPTOR inputDescriptor;
+	SPB_TRANSFER_LIST_AND_ENTRIES(2) sequence;
+	unsigned char tx[SPI_FULL_DUPLEX_MAX + 1], rx[SPI_FULL_DUPLEX_MAX + 1];
+
+	if (length > SPI_FULL_DUPLEX_MAX)
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	// The answer is clocked in while the bytes after the command go out
+	RtlZeroMemory(tx, length + 1);
+	tx[0] = (unsigned char)(reg << 3);
+
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), 2);
+	sequence.List.Transfers[0] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(SpbTransferDirectionToDevice, 0, tx, length + 1);
+	sequence.List.Transfers[1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(SpbTransferDirectionFromDevice, 0, rx, length + 1);
+
+	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&inputDescriptor, &sequence, sizeof(sequence));
+
+	status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_SPB_FULL_DUPLEX, &inputDescriptor, NULL, NULL, NULL);
+
+	if (NT_SUCCESS(status))
+		RtlCopyMemory(value, rx + 1, length);
+
+	return status;
+}
+
+NTSTATUS ReadRegisterStrategy(PDEVICE_CONTEXT ctx, UC120_READ_STRATEGY strategy, int reg, unsigned char *value, ULONG length)
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	WDF_MEMORY_DESCRIPTOR regDescriptor, outputDescriptor;
 	unsigned char command = (unsigned char)(reg << 3);
+	unsigned int reads = UC120_READ_DUMMIES(strategy) + 1;
 
-	WdfObjectAcquireLock(ctx->Device);
+	if (strategy == Uc120ReadFullDuplex)
+		return ReadRegisterFullDuplex(ctx, reg, value, length);
 
 	status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_ASSERT_CS, NULL, NULL, NULL, NULL);
 	if (!NT_SUCCESS(status))
 	{
 		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-		WdfObjectReleaseLock(ctx->Device);
 		return status;
 	}
 
@@ -555,46 +929,88 @@ NTSTATUS ReadRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, UL
 	if (!NT_SUCCESS(status))
 	{
 		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-		WdfObjectReleaseLock(ctx->Device);
 		return status;
 	}
 
 	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&outputDescriptor, value, length);
 
-	// need to read 3 times to get the correct value, for some reason
-	// NOTE: original driver does a full-duplex transfer here, where the 1st byte starts reading *before*
-	// the register ID is written, so possibly we will need 2 here instead!
-	for (int i = 0; i < 3; i++) {
+	// The chip's answer trails the command, the first reads may return stale data
+	for (unsigned int i = 0; i < reads; i++) {
 		status = WdfIoTargetSendReadSynchronously(ctx->Spi, NULL, &outputDescriptor, NULL, NULL, NULL);
 
 		if (!NT_SUCCESS(status))
 		{
 			WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-			WdfObjectReleaseLock(ctx->Device);
 			return status;
 		}
 	}
 
 	status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
 
-	WdfObjectReleaseLock(ctx->Device);
 
 	return status;
 }
 
+NTSTATUS ReadRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
+{
+	return ReadRegisterStrategy(ctx, ctx->ReadStrategy, reg, value, length);
+}
+
+int LumiaUSBCProbeRead(void *context, UC120_READ_STRATEGY strategy, int reg, unsigned char *value, unsigned int length)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	SPI_BUS_REQUEST request;
+	NTSTATUS status;
+
+	request.Priority = SpiBusPriorityDiagnostic;
+	request.Flags = 0;
+	request.Mode = strategy;
+	request.Register = reg;
+	request.Data = value;
+	request.Length = length;
+	request.Write = FALSE;
+
+	LumiaUSBCClockAcquire(ctx, PepClockReasonSpi);
+	status = LumiaUSBCBusSubmit(ctx, &request, 1);
+	LumiaUSBCClockRelease(ctx, PepClockReasonSpi);
+
+	return NT_SUCCESS(status);
+}
+
+//
+// Finds the cheapest way of reading registers that gives the right answer. Only meaningful
+// once the configuration registers have been programmed.
+//
+void LumiaUSBCProbeReadStrategy(PDEVICE_CONTEXT ctx)
+{
+	unsigned int mask;
+
+	// Bit-banged reads sample every bit themselves, there is nothing to choose
+	if (ctx->UseFakeSpi)
+		return;
+
+	mask = Uc120ProbeReadStrategies(LumiaUSBCProbeRead, ctx, 3);
+	ctx->ReadStrategy = Uc120CheapestReadStrategy(mask, UC120_READ_STRATEGY_DEFAULT);
+
+	STATS_SET(ctx, SpiReadStrategiesCorrect, mask);
+	STATS_SET(ctx, SpiReadStrategy, ctx->ReadStrategy);
+
+	if (!mask)
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_SPI, "No SPI read strategy returned the configuration, keeping the default");
+	else
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_SPI, "SPI reads use strategy %d, working strategies 0x%x", ctx->ReadStrategy, mask);
+}
+
 NTSTATUS WriteRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	WDF_MEMORY_DESCRIPTOR regDescriptor, inputDescriptor;
 	unsigned char command = (unsigned char)((reg << 3) | 1);
 
-	WdfObjectAcquireLock(ctx->Device);
-
 	status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_ASSERT_CS, NULL, NULL, NULL, NULL);
 	if (!NT_SUCCESS(status))
 	{
 		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-		WdfObjectReleaseLock(ctx->Device);
 		return status;
 	}
 
@@ -603,7 +1019,6 @@ NTSTATUS WriteRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, U
 	if (!NT_SUCCESS(status))
 	{
 		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-		WdfObjectReleaseLock(ctx->Device);
 		return status;
 	}
 
@@ -612,13 +1027,11 @@ NTSTATUS WriteRegisterReal(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, U
 	if (!NT_SUCCESS(status))
 	{
 		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
-		WdfObjectReleaseLock(ctx->Device);
 		return status;
 	}
 
 	status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
 
-	WdfObjectReleaseLock(ctx->Device);
 
 	return status;
 }
@@ -642,178 +1055,396 @@ NTSTATUS SetGPIO(PDEVICE_CONTEXT ctx, WDFIOTARGET gpio, unsigned char *value)
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	WDF_MEMORY_DESCRIPTOR inputDescriptor, outputDescriptor;
+	PGPIO_SHADOW shadow = GpioGetShadow(gpio);
+	unsigned char requested = *value;
 
-	UNREFERENCED_PARAMETER(ctx);
+	// Bit-banged lines often keep their level from one bit to the next
+	if (shadow->Valid && shadow->Value == requested) {
+		InterlockedIncrement(&ctx->GpioWritesSuppressed);
+		return STATUS_SUCCESS;
+	}
 
 	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&inputDescriptor, value, 1);
 	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&outputDescriptor, value, 1);
 
 	status = WdfIoTargetSendIoctlSynchronously(gpio, NULL, IOCTL_GPIO_WRITE_PINS, &inputDescriptor, &outputDescriptor, NULL, NULL);
+	InterlockedIncrement(&ctx->GpioWritesIssued);
+
+	// After a failed write the pin level is unknown, so the next write must go out
+	shadow->Valid = NT_SUCCESS(status);
+	shadow->Value = requested;
 
 	return status;
 }
 
-NTSTATUS ReadRegisterFake(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
+//
+// Forgets what the pins were last set to. The connections are closed in D0Exit and the GPIO
+// controller may put the pins back to their defaults meanwhile, so every write after a power
+// transition has to reach the hardware.
+//
+void LumiaUSBCGpioResync(PDEVICE_CONTEXT ctx)
 {
-	NTSTATUS status;
-	unsigned char data;
-	unsigned char command = (unsigned char)(reg << 3);
-	LARGE_INTEGER delay;
-	int i;
-	unsigned int j;
+	WDFIOTARGET gpios[] = {
+		ctx->VbusGpio, ctx->PolGpio, ctx->AmselGpio, ctx->EnGpio, ctx->ResetGpio, ctx->MuxGpio,
+		ctx->FakeSpiMosi, ctx->FakeSpiMiso, ctx->FakeSpiCs, ctx->FakeSpiClk
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(gpios); i++) {
+		if (gpios[i])
+			GpioGetShadow(gpios[i])->Valid = FALSE;
+	}
 
-	delay.QuadPart = -10; // 1ms
+	ctx->MuxStateValid = FALSE;
+}
+
+static WDFIOTARGET LumiaUSBCBitBangTarget(PDEVICE_CONTEXT ctx, BIT_BANG_PIN pin)
+{
+	switch (pin) {
+	case BitBangPinCs:
+		return ctx->FakeSpiCs;
+	case BitBangPinClk:
+		return ctx->FakeSpiClk;
+	case BitBangPinMosi:
+		return ctx->FakeSpiMosi;
+	default:
+		return ctx->FakeSpiMiso;
+	}
+}
+
+int LumiaUSBCBitBangSetPin(void *context, BIT_BANG_PIN pin, int level)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	unsigned char data = (unsigned char)level;
+	NTSTATUS status;
 
-	// Select the chip
-	data = 0;
-	status = SetGPIO(ctx, ctx->FakeSpiCs, &data);
+	status = SetGPIO(ctx, LumiaUSBCBitBangTarget(ctx, pin), &data);
 	if (!NT_SUCCESS(status))
-		return status;
+		ctx->BitBangStatus = status;
 
-	// Send the read command bit by bit, MSB first
-	for (i = 7; i >= 0; i--) {
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	return NT_SUCCESS(status);
+}
 
-		data = (command >> i) & 1;
-		status = SetGPIO(ctx, ctx->FakeSpiMosi, &data);
-		if (!NT_SUCCESS(status))
-			return status;
+int LumiaUSBCBitBangGetPin(void *context, BIT_BANG_PIN pin, int *level)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	unsigned char data = 0;
+	NTSTATUS status;
 
-		data = 0;
-		status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-		if (!NT_SUCCESS(status))
-			return status;
+	status = GetGPIO(ctx, LumiaUSBCBitBangTarget(ctx, pin), &data);
+	if (!NT_SUCCESS(status))
+		ctx->BitBangStatus = status;
 
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	*level = data;
+	return NT_SUCCESS(status);
+}
 
-		data = 1;
-		status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-		if (!NT_SUCCESS(status))
-			return status;
-	}
+void LumiaUSBCBitBangStall(void *context, unsigned int us)
+{
+	UNREFERENCED_PARAMETER(context);
 
-	// Receive the result, MSB first
-	for (j = 0; j < length; j++) {
-		value[j] = 0;
-		for (i = 7; i >= 0; i--) {
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	// A timed wait would be rounded up to the next clock tick, milliseconds for a microsecond edge
+	KeStallExecutionProcessor(us);
+}
+
+unsigned long long LumiaUSBCBitBangNow(void *context)
+{
+	LARGE_INTEGER counter, frequency;
 
-			data = 0;
-			status = GetGPIO(ctx, ctx->FakeSpiMiso, &data);
-			if (!NT_SUCCESS(status))
-				return status;
+	UNREFERENCED_PARAMETER(context);
 
-			value[j] |= (data & 1) << i;
+	counter = KeQueryPerformanceCounter(&frequency);
+	return (unsigned long long)(counter.QuadPart / frequency.QuadPart * 1000000 +
+		counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
 
-			data = 0;
-			status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-			if (!NT_SUCCESS(status))
-				return status;
+const BIT_BANG_OPS LumiaUSBCBitBangOps = {
+	LumiaUSBCBitBangSetPin,
+	LumiaUSBCBitBangGetPin,
+	LumiaUSBCBitBangStall,
+	LumiaUSBCBitBangNow
+};
+
+//
+// One caller's requests to the bus owner, complete once all of them are
+//
+typedef struct _BUS_SUBMISSION
+{
+	KEVENT Done;
+	LONG Remaining;
+	NTSTATUS Status;
+} BUS_SUBMISSION, *PBUS_SUBMISSION;
 
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
+int LumiaUSBCBusTransfer(void *context, int mode, int reg, unsigned char *data, unsigned int length, int write)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
 
-			data = 1;
-			status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-			if (!NT_SUCCESS(status))
-				return status;
-		}
+	if (ctx->BusStop) {
+		ctx->BusStatus = STATUS_DEVICE_NOT_READY;
+	}
+	else if (ctx->UseFakeSpi) {
+		ctx->BitBangStatus = STATUS_SUCCESS;
+		if ((!ctx->BitBang.Calibrated && !BitBangCalibrate(&ctx->BitBang)) ||
+			!BitBangTransfer(&ctx->BitBang, (unsigned char)((reg << 3) | (write ? 1 : 0)), data, length, write))
+			ctx->BusStatus = NT_SUCCESS(ctx->BitBangStatus) ? STATUS_UNSUCCESSFUL : ctx->BitBangStatus;
+		else
+			ctx->BusStatus = STATUS_SUCCESS;
+	}
+	else if (write) {
+		ctx->BusStatus = WriteRegisterReal(ctx, reg, data, length);
+	}
+	else {
+		ctx->BusStatus = ReadRegisterStrategy(ctx, (UC120_READ_STRATEGY)mode, reg, data, length);
 	}
 
-	// Deselect the chip
-	data = 1;
-	status = SetGPIO(ctx, ctx->FakeSpiCs, &data);
-	if (!NT_SUCCESS(status))
-		return status;
+	STATS_BEGIN(ctx);
+	ctx->Stats->SpiTransactions++;
+	ctx->Stats->SpiBytes += length;
+	if (!NT_SUCCESS(ctx->BusStatus))
+		ctx->Stats->SpiErrors++;
+	STATS_FLUSH(ctx);
+	STATS_END(ctx);
 
-	return status;
+	return NT_SUCCESS(ctx->BusStatus);
 }
 
-NTSTATUS WriteRegisterFake(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
+void LumiaUSBCBusComplete(void *context, SPI_BUS_REQUEST *request)
 {
-	NTSTATUS status;
-	unsigned char data;
-	unsigned char command = (unsigned char)((reg << 3) | 1);
-	LARGE_INTEGER delay;
-	int i;
-	unsigned int j;
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	PBUS_SUBMISSION submission = (PBUS_SUBMISSION)request->Owner;
 
-	delay.QuadPart = -10; // 1ms
+	// Runs right after the transfer on the owner thread, so BusStatus is still this one's
+	if (!request->Succeeded && NT_SUCCESS(submission->Status))
+		submission->Status = ctx->BusStatus;
 
-	// Select the chip
-	data = 0;
-	status = SetGPIO(ctx, ctx->FakeSpiCs, &data);
-	if (!NT_SUCCESS(status))
-		return status;
+	if (InterlockedDecrement(&submission->Remaining) == 0)
+		KeSetEvent(&submission->Done, IO_NO_INCREMENT, FALSE);
+}
 
-	// Send the write command bit by bit, MSB first
-	for (i = 7; i >= 0; i--) {
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
+const SPI_BUS_OPS LumiaUSBCBusOps = {
+	LumiaUSBCBusTransfer,
+	LumiaUSBCBusComplete,
+	LumiaUSBCBitBangNow
+};
 
-		data = (command >> i) & 1;
-		status = SetGPIO(ctx, ctx->FakeSpiMosi, &data);
-		if (!NT_SUCCESS(status))
-			return status;
+VOID LumiaUSBCBusThread(PVOID context)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
 
-		data = 0;
-		status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-		if (!NT_SUCCESS(status))
-			return status;
+	// Nothing below real-time priority gets to stretch a clock phase in the middle of a bit-banged transaction
+	KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	for (;;) {
+		KeWaitForSingleObject(&ctx->BusWake, Executive, KernelMode, FALSE, NULL);
 
-		data = 1;
-		status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-		if (!NT_SUCCESS(status))
-			return status;
+		// Let the rest of the system run between transactions
+		while (!ctx->BusPaused && SpiBusRun(&ctx->Bus, &LumiaUSBCBusOps, ctx))
+			ZwYieldExecution();
+
+		if (ctx->BusStop)
+			break;
+
+		// Off the bus until LumiaUSBCBusResume, whatever gets queued meanwhile stays queued
+		if (ctx->BusPaused)
+			KeSetEvent(&ctx->BusIdle, IO_NO_INCREMENT, FALSE);
 	}
 
-	// Send the data, MSB 
-	for (j = 0; j < length; j++) {
-		for (i = 7; i >= 0; i--) {
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
 
-			data = (value[j] >> i) & 1;
-			status = SetGPIO(ctx, ctx->FakeSpiMosi, &data);
-			if (!NT_SUCCESS(status))
-				return status;
+NTSTATUS LumiaUSBCBusStart(PDEVICE_CONTEXT ctx)
+{
+	NTSTATUS status;
+	HANDLE thread;
 
-			data = 0;
-			status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-			if (!NT_SUCCESS(status))
-				return status;
+	if (ctx->BusThread)
+		return STATUS_SUCCESS;
 
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	ctx->BusStop = FALSE;
 
-			data = 1;
-			status = SetGPIO(ctx, ctx->FakeSpiClk, &data);
-			if (!NT_SUCCESS(status))
-				return status;
-		}
+	status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL, LumiaUSBCBusThread, ctx);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "PsCreateSystemThread failed for the SPI bus %!STATUS!", status);
+		return status;
 	}
 
-	// Deselect the chip
-	data = 1;
-	status = SetGPIO(ctx, ctx->FakeSpiCs, &data);
-	if (!NT_SUCCESS(status))
-		return status;
+	status = ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID *)&ctx->BusThread, NULL);
+	ZwClose(thread);
+
+	return status;
+}
+
+void LumiaUSBCBusShutdown(PDEVICE_CONTEXT ctx)
+{
+	if (!ctx->BusThread)
+		return;
+
+	ctx->BusStop = TRUE;
+	KeSetEvent(&ctx->BusWake, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(ctx->BusThread, Executive, KernelMode, FALSE, NULL);
+
+	ObDereferenceObject(ctx->BusThread);
+	ctx->BusThread = NULL;
+}
+
+//
+// Waits for the bus thread to finish the transaction it is on and keeps it
+// off the bus. Requests are still accepted and queue up until the resume.
+//
+void LumiaUSBCBusPause(PDEVICE_CONTEXT ctx)
+{
+	ctx->BusPaused = TRUE;
+	if (!ctx->BusThread)
+		return;
+
+	KeClearEvent(&ctx->BusIdle);
+	KeSetEvent(&ctx->BusWake, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(&ctx->BusIdle, Executive, KernelMode, FALSE, NULL);
+}
+
+void LumiaUSBCBusResume(PDEVICE_CONTEXT ctx)
+{
+	ctx->BusPaused = FALSE;
+	if (ctx->BusThread)
+		KeSetEvent(&ctx->BusWake, IO_NO_INCREMENT, FALSE);
+}
+
+//
+// Hands requests of one priority to the bus owner and waits for all of them
+//
+NTSTATUS LumiaUSBCBusSubmit(PDEVICE_CONTEXT ctx, SPI_BUS_REQUEST *requests, ULONG count)
+{
+	BUS_SUBMISSION submission;
+	ULONG i;
+
+	if (!ctx->BusThread)
+		return STATUS_DEVICE_NOT_READY;
+
+	KeInitializeEvent(&submission.Done, NotificationEvent, FALSE);
+	submission.Remaining = (LONG)count;
+	submission.Status = STATUS_SUCCESS;
+
+	for (i = 0; i < count; i++)
+		requests[i].Owner = &submission;
+
+	// The owner only sleeps once it found every queue empty, so only a push onto an empty one has to wake it
+	if (SpiBusSubmit(&ctx->Bus, requests, count, LumiaUSBCBitBangNow(ctx)))
+		KeSetEvent(&ctx->BusWake, IO_NO_INCREMENT, FALSE);
+
+	// A kernel mode wait keeps this stack, and the requests on it, resident
+	KeWaitForSingleObject(&submission.Done, Executive, KernelMode, FALSE, NULL);
+
+	return submission.Status;
+}
+
+static void LumiaUSBCBusRequestInit(PDEVICE_CONTEXT ctx, SPI_BUS_REQUEST *request, SPI_BUS_PRIORITY priority, int reg, unsigned char *value, ULONG length, BOOLEAN write)
+{
+	request->Priority = priority;
+	request->Register = reg;
+	request->Data = value;
+	request->Length = length;
+	request->Write = write;
+	request->Mode = ctx->ReadStrategy;
+	request->Succeeded = 0;
+
+	// Reading a FIFO pops it, a second reader must not be handed the same frame
+	request->Flags = (Uc120RegisterSpan(reg, length) & UC120_FIFO_REGISTERS) ? SPI_BUS_REQUEST_NO_MERGE : 0;
+}
+
+NTSTATUS ReadRegisterAt(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, int reg, unsigned char *value, ULONG length)
+{
+	SPI_BUS_REQUEST request;
+	NTSTATUS status;
+
+	LumiaUSBCBusRequestInit(ctx, &request, priority, reg, value, length, FALSE);
+
+	LumiaUSBCClockAcquire(ctx, PepClockReasonSpi);
+	status = LumiaUSBCBusSubmit(ctx, &request, 1);
+	LumiaUSBCClockRelease(ctx, PepClockReasonSpi);
+
+	return status;
+}
+
+NTSTATUS WriteRegisterAt(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, int reg, unsigned char *value, ULONG length)
+{
+	SPI_BUS_REQUEST request;
+	NTSTATUS status;
+
+	LumiaUSBCBusRequestInit(ctx, &request, priority, reg, value, length, TRUE);
+
+	LumiaUSBCClockAcquire(ctx, PepClockReasonSpi);
+	status = LumiaUSBCBusSubmit(ctx, &request, 1);
+	LumiaUSBCClockRelease(ctx, PepClockReasonSpi);
 
 	return status;
 }
 
 NTSTATUS ReadRegister(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
 {
-	if (ctx->UseFakeSpi)
-		return ReadRegisterFake(ctx, reg, value, length);
-	else
-		return ReadRegisterReal(ctx, reg, value, length);
+	return ReadRegisterAt(ctx, SpiBusPriorityControl, reg, value, length);
 }
 
 NTSTATUS WriteRegister(PDEVICE_CONTEXT ctx, int reg, unsigned char *value, ULONG length)
 {
-	if (ctx->UseFakeSpi)
-		return WriteRegisterFake(ctx, reg, value, length);
-	else
-		return WriteRegisterReal(ctx, reg, value, length);
+	return WriteRegisterAt(ctx, SpiBusPriorityControl, reg, value, length);
+}
+
+#define BUS_BATCH_MAX 8
+
+//
+// Reads single registers in one submission, so the owner can merge neighbours
+//
+void LumiaUSBCReadRegisters(PDEVICE_CONTEXT ctx, SPI_BUS_PRIORITY priority, const UCHAR *regs, unsigned char *values, NTSTATUS *statuses, ULONG count)
+{
+	SPI_BUS_REQUEST requests[BUS_BATCH_MAX];
+	NTSTATUS status;
+	ULONG i;
+
+	NT_ASSERT(count <= BUS_BATCH_MAX);
+
+	for (i = 0; i < count; i++)
+		LumiaUSBCBusRequestInit(ctx, &requests[i], priority, regs[i], values + i, 1, FALSE);
+
+	LumiaUSBCClockAcquire(ctx, PepClockReasonSpi);
+	status = LumiaUSBCBusSubmit(ctx, requests, count);
+	LumiaUSBCClockRelease(ctx, PepClockReasonSpi);
+
+	for (i = 0; i < count; i++)
+		statuses[i] = requests[i].Succeeded ? STATUS_SUCCESS : (NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status);
+}
+
+int LumiaUSBCScriptRead(void *context, int reg, unsigned char *value, unsigned int length)
+{
+	return NT_SUCCESS(ReadRegister((PDEVICE_CONTEXT)context, reg, value, length));
+}
+
+int LumiaUSBCScriptWrite(void *context, int reg, unsigned char *value, unsigned int length)
+{
+	return NT_SUCCESS(WriteRegister((PDEVICE_CONTEXT)context, reg, value, length));
+}
+
+void LumiaUSBCScriptDelay(void *context, unsigned int ms)
+{
+	LARGE_INTEGER delay;
+	UNREFERENCED_PARAMETER(context);
+
+	delay.QuadPart = -10000LL * ms;
+	KeDelayExecutionThread(KernelMode, FALSE, &delay);
+}
+
+static const UC120_SCRIPT_OPS LumiaUSBCScriptOps = {
+	LumiaUSBCScriptRead,
+	LumiaUSBCScriptWrite,
+	LumiaUSBCScriptDelay
+};
+
+NTSTATUS LumiaUSBCRunScript(PDEVICE_CONTEXT ctx, const UC120_SCRIPT_OP *script, UC120_SCRIPT_RESULT *result)
+{
+	if (Uc120ScriptRunCached(script, &LumiaUSBCScriptOps, ctx, &ctx->ScriptCache, result))
+		return STATUS_SUCCESS;
+
+	TraceEvents(TRACE_LEVEL_ERROR, TRACE_SPI, "Register script stopped at operation %d", result->FailedOp);
+	return STATUS_IO_DEVICE_ERROR;
 }
 
 NTSTATUS
@@ -831,16 +1462,31 @@ LumiaUSBCDevicePrepareHardware(
 	UCM_CONNECTOR_PD_CONFIG pdConfig;
 	WDF_OBJECT_ATTRIBUTES attr;
 
-	DbgPrint("%!FUNC! Entry\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Entry");
 
 	devCtx = DeviceGetContext(Device);
 
 	status = LumiaUSBCProbeResources(devCtx, ResourcesTranslated, ResourcesRaw);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("LumiaUSBCProbeResources failed %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "LumiaUSBCProbeResources failed %!STATUS!", status);
+		return status;
+	}
+
+	status = LumiaUSBCCreateResources(devCtx);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "LumiaUSBCCreateResources failed %!STATUS!", status);
 		return status;
 	}
 
+	// Read once, it stays in memory for every power-up after this
+	if (!devCtx->BitstreamMemory) {
+		status = LumiaUSBCBitstreamRead(devCtx);
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "No configuration image, the chip is used as it comes up %!STATUS!", status);
+			status = STATUS_SUCCESS;
+		}
+	}
+
 	if (devCtx->Connector)
 	{
 		goto Exit;
@@ -854,7 +1500,7 @@ LumiaUSBCDevicePrepareHardware(
 	status = UcmInitializeDevice(Device, &ucmCfg);
 	if (!NT_SUCCESS(status))
 	{
-		DbgPrint("UcmInitializeDevice failed %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_UCM, "UcmInitializeDevice failed %!STATUS!", status);
 		goto Exit;
 	}
 
@@ -871,6 +1517,7 @@ LumiaUSBCDevicePrepareHardware(
 	typeCConfig.EvtSetDataRole = LumiaUSBCSetDataRole;
 
 	UCM_CONNECTOR_PD_CONFIG_INIT(&pdConfig, UcmPowerRoleSink | UcmPowerRoleSource);
+	pdConfig.EvtSetPowerRole = LumiaUSBCSetPowerRole;
 
 	connCfg.TypeCConfig = &typeCConfig;
 	connCfg.PdConfig = &pdConfig;
@@ -880,13 +1527,15 @@ LumiaUSBCDevicePrepareHardware(
 	status = UcmConnectorCreate(Device, &connCfg, &attr, &devCtx->Connector);
 	if (!NT_SUCCESS(status))
 	{
-		DbgPrint("UcmConnectorCreate failed %!STATUS!\n", status);
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_UCM, "UcmConnectorCreate failed %!STATUS!", status);
 		goto Exit;
 	}
 
+	ConnectorGetContext(devCtx->Connector)->Device = Device;
+
 	//UcmEventInitialize(&connCtx->EventSetDataRole);
 Exit:
-	DbgPrint("%!FUNC! Exit\n");
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Exit");
 	return status;
 }
 
@@ -930,301 +1579,1378 @@ NTSTATUS MyReadRegistryValue(PCWSTR registry_path, PCWSTR value_name, ULONG type
 	return rc;
 }
 
-NTSTATUS LumiaUSBCDeviceD0Entry(
-	WDFDEVICE Device,
-	WDF_POWER_DEVICE_STATE PreviousState
-)
+int LumiaUSBCBitstreamReset(void *context, int asserted)
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
-	//PCONNECTOR_CONTEXT connCtx = ConnectorGetContext(devCtx->Connector);
-	ULONG data = 0;
-	UNREFERENCED_PARAMETER(PreviousState);
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	unsigned char value = asserted ? 0 : 1;
+	NTSTATUS status;
+
+	status = SetGPIO(ctx, ctx->ResetGpio, &value);
+	if (!NT_SUCCESS(status))
+		ctx->BitstreamStatus = status;
+	return NT_SUCCESS(status);
+}
 
-	DbgPrint("%!FUNC! Entry\n");
+int LumiaUSBCBitstreamSelect(void *context, int selected)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	NTSTATUS status;
 
-	status = LumiaUSBCOpenResources(devCtx);
-	if (!NT_SUCCESS(status)) {
-		DbgPrint("LumiaUSBCOpenResources failed %!STATUS!\n", status);
-		return status;
+	if (ctx->UseFakeSpi) {
+		if (LumiaUSBCBitBangSetPin(ctx, BitBangPinCs, !selected))
+			return 1;
+		status = ctx->BitBangStatus;
+	}
+	else {
+		status = WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL,
+			selected ? IOCTL_QUP_SPI_ASSERT_CS : IOCTL_QUP_SPI_DEASSERT_CS, NULL, NULL, NULL, NULL);
 	}
 
-	UCM_CONNECTOR_TYPEC_ATTACH_PARAMS Params;
-	UCM_CONNECTOR_TYPEC_ATTACH_PARAMS_INIT(&Params, UcmTypeCPartnerUfp);
-	Params.CurrentAdvertisement = UcmTypeCCurrentDefaultUsb;
-	UcmConnectorTypeCAttach(devCtx->Connector, &Params);
+	if (!NT_SUCCESS(status))
+		ctx->BitstreamStatus = status;
+	return NT_SUCCESS(status);
+}
 
-	unsigned char value = (unsigned char)0;
-
-	SetGPIO(devCtx, devCtx->PolGpio, &value);
-	SetGPIO(devCtx, devCtx->AmselGpio, &value); // high = HDMI only, medium (unsupported) = USB only, low = both
-	value = (unsigned char)1;
-	SetGPIO(devCtx, devCtx->EnGpio, &value);
-	/*
-	SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-	if (devCtx->HaveResetGpio) {
-		delay.QuadPart = -2000; // 200us
-		value = (unsigned char)0;
-		SetGPIO(devCtx, devCtx->ResetGpio, &value);
-		SetGPIO(devCtx, devCtx->FakeSpiCs, &value);
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
-		value = (unsigned char)1;
-		SetGPIO(devCtx, devCtx->ResetGpio, &value);
-
-		delay.QuadPart = -12000; // 1200us
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
-
-		delay.QuadPart = -10; // 1us
-		value = (unsigned char)1;
-		SetGPIO(devCtx, devCtx->FakeSpiCs, &value);
-
-		for (i = 0; i < 8; i++) {
-			value = (unsigned char)0;
-			SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
-			value = (unsigned char)1;
-			SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-			KeDelayExecutionThread(KernelMode, TRUE, &delay);
-		}
+int LumiaUSBCBitstreamWrite(void *context, const unsigned char *data, unsigned int length)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	WDF_MEMORY_DESCRIPTOR descriptor;
+	NTSTATUS status;
 
-		value = (unsigned char)0;
-		SetGPIO(devCtx, devCtx->FakeSpiCs, &value);
+	// Without a controller every bit costs two or three GPIO requests, it is only a fallback
+	if (ctx->UseFakeSpi) {
+		if (BitBangWrite(&ctx->BitBang, data, length))
+			return 1;
+		status = ctx->BitBangStatus;
+	}
+	else {
+		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&descriptor, (PVOID)data, length);
+		status = WdfIoTargetSendWriteSynchronously(ctx->Spi, NULL, &descriptor, NULL, NULL, NULL);
+	}
 
-		for (i = 0; i < 71339; i++) {
-			for (j = 7; j >= 0; j--) {
-				//KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	if (!NT_SUCCESS(status))
+		ctx->BitstreamStatus = status;
+	return NT_SUCCESS(status);
+}
 
-				value = (unsigned char)((bitstream[i] >> j) & 1);
-				status = SetGPIO(devCtx, devCtx->FakeSpiMosi, &value);
-				if (!NT_SUCCESS(status))
-					return status;
+void LumiaUSBCBitstreamDelay(void *context, unsigned int us)
+{
+	LARGE_INTEGER delay;
 
-				value = (unsigned char)0;
-				status = SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-				if (!NT_SUCCESS(status))
-					return status;
+	UNREFERENCED_PARAMETER(context);
 
-				//KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	delay.QuadPart = -(LONGLONG)us * 10;
+	KeDelayExecutionThread(KernelMode, FALSE, &delay);
+}
 
-				value = (unsigned char)1;
-				status = SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-				if (!NT_SUCCESS(status))
-					return status;
-			}
-		}
+static const BITSTREAM_OPS LumiaUSBCBitstreamOps = {
+	LumiaUSBCBitstreamReset,
+	LumiaUSBCBitstreamSelect,
+	LumiaUSBCBitstreamWrite,
+	LumiaUSBCBitstreamDelay,
+	LumiaUSBCBitBangNow
+};
 
-		for (i = 0; i < 150; i++) {
-			value = (unsigned char)0;
-			SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-			//KeDelayExecutionThread(KernelMode, TRUE, &delay);
-			value = (unsigned char)1;
-			SetGPIO(devCtx, devCtx->FakeSpiClk, &value);
-			//KeDelayExecutionThread(KernelMode, TRUE, &delay);
-		}
-	}
-	*/
-	if (!NT_SUCCESS(MyReadRegistryValue(
+NTSTATUS LumiaUSBCBitstreamRead(PDEVICE_CONTEXT ctx)
+{
+	WCHAR path[128];
+	UNICODE_STRING name;
+	OBJECT_ATTRIBUTES objectAttributes;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	IO_STATUS_BLOCK io;
+	FILE_STANDARD_INFORMATION info;
+	LARGE_INTEGER offset;
+	HANDLE file;
+	PVOID buffer;
+	const unsigned char *payload;
+	unsigned int length;
+	BITSTREAM_STATUS check;
+	NTSTATUS status;
+
+	// An NT path to the image BitstreamPack wrote, nothing is loaded without one
+	RtlZeroMemory(path, sizeof(path));
+	MyReadRegistryValue(
 		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)L"VbusEnable",
+		(PCWSTR)L"BitstreamPath",
+		REG_SZ,
+		path,
+		sizeof(path) - sizeof(WCHAR));
+	if (!path[0])
+		return STATUS_SUCCESS;
+
+	ctx->BitstreamChunk = BITSTREAM_CHUNK_DEFAULT;
+	MyReadRegistryValue(
+		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+		(PCWSTR)L"BitstreamChunkBytes",
 		REG_DWORD,
-		&data,
-		sizeof(ULONG))))
-	{
-		data = 0;
+		&ctx->BitstreamChunk,
+		sizeof(ULONG));
+
+	RtlInitUnicodeString(&name, path);
+	InitializeObjectAttributes(&objectAttributes, &name, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = ZwCreateFile(&file, GENERIC_READ | SYNCHRONIZE, &objectAttributes, &io, NULL, FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = ZwQueryInformationFile(file, &io, &info, sizeof(info), FileStandardInformation);
+	if (NT_SUCCESS(status) && (info.EndOfFile.QuadPart < BITSTREAM_HEADER_SIZE ||
+		info.EndOfFile.QuadPart > BITSTREAM_HEADER_SIZE + BITSTREAM_PAYLOAD_MAX))
+		status = STATUS_INVALID_IMAGE_FORMAT;
+
+	if (NT_SUCCESS(status)) {
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = ctx->Device;
+		status = WdfMemoryCreate(&attributes, PagedPool, 0, (size_t)info.EndOfFile.QuadPart, &ctx->BitstreamMemory, &buffer);
 	}
-	value = !!data;
-	SetGPIO(devCtx, devCtx->VbusGpio, &value);
-	if (data) {
-		UCM_PD_POWER_DATA_OBJECT Pdos[1];
-		UCM_PD_POWER_DATA_OBJECT_INIT_FIXED(&Pdos[0]);
-
-		Pdos[0].FixedSupplyPdo.VoltageIn50mV = 100;         // 5V
-		Pdos[0].FixedSupplyPdo.MaximumCurrentIn10mA = 50;  // 500 mA
-		UcmConnectorPdSourceCaps(devCtx->Connector, Pdos, 1);
-		UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS PdParams;
-		UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS_INIT(&PdParams, UcmPdConnStateNotSupported);
-		PdParams.ChargingState = UcmChargingStateNotCharging;
-		UcmConnectorPdConnectionStateChanged(devCtx->Connector, &PdParams);
-		UcmConnectorPowerDirectionChanged(devCtx->Connector, TRUE, UcmPowerRoleSource);
-		UcmConnectorChargingStateChanged(devCtx->Connector, PdParams.ChargingState);
+
+	if (NT_SUCCESS(status)) {
+		offset.QuadPart = 0;
+		status = ZwReadFile(file, NULL, NULL, NULL, &io, buffer, info.EndOfFile.LowPart, &offset, NULL);
+		if (NT_SUCCESS(status) && io.Information != info.EndOfFile.LowPart)
+			status = STATUS_END_OF_FILE;
 	}
-	else
-	{
-		UCM_PD_POWER_DATA_OBJECT Pdos[1];
-		UCM_PD_POWER_DATA_OBJECT_INIT_FIXED(&Pdos[0]);
 
-		Pdos[0].FixedSupplyPdo.VoltageIn50mV = 100;         // 5V
-		Pdos[0].FixedSupplyPdo.MaximumCurrentIn10mA = 50;  // 500 mA - can be overridden in Registry
-		if (NT_SUCCESS(MyReadRegistryValue(
-			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-			(PCWSTR)L"ChargeCurrent",
-			REG_DWORD,
-			&data,
-			sizeof(ULONG))))
-		{
-			Pdos[0].FixedSupplyPdo.MaximumCurrentIn10mA = data / 10;
+	ZwClose(file);
+
+	if (NT_SUCCESS(status)) {
+		check = BitstreamParse((const unsigned char *)buffer, info.EndOfFile.LowPart, &payload, &length);
+		if (check != BitstreamOk) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Configuration image rejected, check %d", check);
+			status = STATUS_INVALID_IMAGE_FORMAT;
 		}
-		UcmConnectorPdPartnerSourceCaps(devCtx->Connector, Pdos, 1);
-		UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS PdParams;
-		UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS_INIT(&PdParams, UcmPdConnStateNotSupported);
-		PdParams.ChargingState = UcmChargingStateNominalCharging;
-		UcmConnectorPdConnectionStateChanged(devCtx->Connector, &PdParams);
-		UcmConnectorPowerDirectionChanged(devCtx->Connector, TRUE, UcmPowerRoleSink);
-		UcmConnectorTypeCCurrentAdChanged(devCtx->Connector, UcmTypeCCurrent3000mA);
-		UcmConnectorChargingStateChanged(devCtx->Connector, PdParams.ChargingState);
 	}
 
-	return status;
+	if (!NT_SUCCESS(status)) {
+		if (ctx->BitstreamMemory) {
+			WdfObjectDelete(ctx->BitstreamMemory);
+			ctx->BitstreamMemory = NULL;
+		}
+		return status;
+	}
+
+	ctx->Bitstream = (const UCHAR *)buffer;
+	ctx->BitstreamSize = info.EndOfFile.LowPart;
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Configuration image of %u bytes, CRC-32 0x%08x", length, BitstreamCrc32(0, payload, length));
+
+	return STATUS_SUCCESS;
 }
 
-NTSTATUS LumiaUSBCSelfManagedIoInit(
-	WDFDEVICE Device
-)
+//
+// Runs in D0Entry before the interrupts are connected. The image goes out in
+// raw writes the bus thread knows nothing about, so the thread is paused
+// for the load. Register transfers queued by timers or requests meanwhile
+// wait in the bus queues and run once it resumes.
+//
+NTSTATUS LumiaUSBCLoadBitstream(PDEVICE_CONTEXT ctx)
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
-	wchar_t buf[260];
-	unsigned char value = (unsigned char)0;
-	ULONG input[8], output[6];
-	LARGE_INTEGER delay;
-	LONG i = 0;// , j = 0;
-	PO_FX_DEVICE poFxDevice;
-	PO_FX_COMPONENT_IDLE_STATE idleState;
+	BITSTREAM_RESULT result;
+	BITSTREAM_STATUS check;
+	unsigned char value = 1;
 
-	memset(&poFxDevice, 0, sizeof(poFxDevice));
-	memset(&idleState, 0, sizeof(idleState));
-	poFxDevice.Version = PO_FX_VERSION_V1;
-	poFxDevice.ComponentCount = 1;
-	poFxDevice.Components[0].IdleStateCount = 1;
-	poFxDevice.Components[0].IdleStates = &idleState;
-	poFxDevice.DeviceContext = devCtx;
-	idleState.NominalPower = PO_FX_UNKNOWN_POWER;
+	LumiaUSBCBusPause(ctx);
 
-	status = PoFxRegisterDevice(WdfDeviceWdmGetPhysicalDevice(Device), &poFxDevice, &devCtx->PoHandle);
-	if (!NT_SUCCESS(status)) {
-		DbgPrint("PoFxRegisterDevice failed %!STATUS!\n", status);
-		return status;
+	ctx->BitstreamStatus = STATUS_SUCCESS;
+	ctx->BitBangStatus = STATUS_SUCCESS;
+
+	// The clock idles high, the chip must not see a stray edge when it comes out of reset
+	if (ctx->UseFakeSpi) {
+		SetGPIO(ctx, ctx->FakeSpiClk, &value);
+		if (!ctx->BitBang.Calibrated)
+			BitBangCalibrate(&ctx->BitBang);
 	}
 
-	PoFxActivateComponent(devCtx->PoHandle, 0, PO_FX_FLAG_BLOCKING);
+	check = BitstreamLoad(&LumiaUSBCBitstreamOps, ctx, ctx->Bitstream, ctx->BitstreamSize, ctx->BitstreamChunk, &result);
 
-	PoFxStartDevicePowerManagement(devCtx->PoHandle);
+	// Register transfers go back to having chip select framed by the controller
+	if (!ctx->UseFakeSpi)
+		WdfIoTargetSendIoctlSynchronously(ctx->Spi, NULL, IOCTL_QUP_SPI_AUTO_CS, NULL, NULL, NULL, NULL);
 
-	// Tell PEP to turn on the clock
-	memset(input, 0, sizeof(input));
-	input[0] = 2;
-	input[7] = 2;
-	status = PoFxPowerControl(devCtx->PoHandle, &PowerControlGuid, &input, sizeof(input), &output, sizeof(output), NULL);
-	if (!NT_SUCCESS(status)) {
-		DbgPrint("PoFxPowerControl failed %!STATUS!\n", status);
-		return status;
+	// Whatever the outcome, anything waiting on the bus gets served
+	LumiaUSBCBusResume(ctx);
+
+	STATS_BEGIN(ctx);
+	if (check == BitstreamOk)
+		ctx->Stats->BitstreamLoads++;
+	else
+		ctx->Stats->BitstreamFailures++;
+	ctx->Stats->BitstreamLoadUs = result.ElapsedUs;
+	ctx->Stats->BitstreamChunks = result.Chunks;
+	STATS_FLUSH(ctx);
+	STATS_END(ctx);
+
+	if (check != BitstreamOk) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Configuration image load failed, check %d after %u bytes %!STATUS!",
+			check, result.Bytes, ctx->BitstreamStatus);
+		return NT_SUCCESS(ctx->BitstreamStatus) ? STATUS_DEVICE_CONFIGURATION_ERROR : ctx->BitstreamStatus;
 	}
 
-	// Initialize the UC120
-	unsigned char initvals[] = { 0x0C, 0x7C, 0x31, 0x5E, 0x9D, 0x0A, 0x7A, 0x2F, 0x5C, 0x9B };
-
-	//ReadRegister(devCtx, 4, &value, 1);
-	value = 6;
-	WriteRegister(devCtx, 4, &value, 1);
-
-	//ReadRegister(devCtx, 5, &value, 1);
-	value = 0x88;
-	WriteRegister(devCtx, 5, &value, 1);
-
-	//ReadRegister(devCtx, 13, &value, 1);
-	value = 2;
-	WriteRegister(devCtx, 13, &value, 1);
-
-	WriteRegister(devCtx, 18, initvals + 0, 1);
-	WriteRegister(devCtx, 19, initvals + 1, 1);
-	WriteRegister(devCtx, 20, initvals + 2, 1);
-	WriteRegister(devCtx, 21, initvals + 3, 1);
-	WriteRegister(devCtx, 26, initvals + 4, 1);
-	WriteRegister(devCtx, 22, initvals + 5, 1);
-	WriteRegister(devCtx, 23, initvals + 6, 1);
-	WriteRegister(devCtx, 24, initvals + 7, 1);
-	WriteRegister(devCtx, 25, initvals + 8, 1);
-	WriteRegister(devCtx, 27, initvals + 9, 1);
-
-	value = 0;
-
-	delay.QuadPart = -1000000;
-	KeDelayExecutionThread(UserMode, TRUE, &delay);
-	delay.QuadPart = -100000;
-	do {
-		if (!NT_SUCCESS(ReadRegister(devCtx, 5, &value, 1)))
-			DbgPrint("Failed to read register #5 in the init waiting loop!\n");
-		KeDelayExecutionThread(UserMode, TRUE, &delay);
-		i++;
-		if (i > 500) {
-			break;
-		}
-	} while (value == 0);
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Configuration image loaded in %lu us, %u bytes in %u writes%s",
+		result.ElapsedUs, result.Bytes, result.Chunks, ctx->UseFakeSpi ? " bit-banged" : "");
 
-	DbgPrint("UC120 initialized after %d iterations with value of %x\n", i, value);
+	return STATUS_SUCCESS;
+}
 
-	/*i |= value << 16;
+NTSTATUS LumiaUSBCDeviceD0Entry(
+	WDFDEVICE Device,
+	WDF_POWER_DEVICE_STATE PreviousState
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
+	//PCONNECTOR_CONTEXT connCtx = ConnectorGetContext(devCtx->Connector);
+	UNREFERENCED_PARAMETER(PreviousState);
 
-	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)L"startdelay",
-		REG_DWORD,
-		&i,
-		sizeof(ULONG));*/
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Entry");
 
-	unsigned char registers[8];
-	NTSTATUS statuses[8];
+	status = LumiaUSBCOpenResources(devCtx);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "LumiaUSBCOpenResources failed %!STATUS!", status);
+		return status;
+	}
 
-	memset(registers, 0, sizeof(registers));
-	memset(statuses, 0, sizeof(statuses));
+	// The clock comes back on with the first register access
+	if (devCtx->ComponentIdle) {
+		devCtx->ComponentIdle = FALSE;
+		PoFxActivateComponent(devCtx->PoHandle, 0, PO_FX_FLAG_BLOCKING);
+	}
 
-	statuses[0] = ReadRegister(devCtx, 0, registers + 0, 1);
-	statuses[1] = ReadRegister(devCtx, 1, registers + 1, 1);
-	statuses[2] = ReadRegister(devCtx, 2, registers + 2, 1);
-	statuses[3] = ReadRegister(devCtx, 5, registers + 3, 1);
-	statuses[4] = ReadRegister(devCtx, 7, registers + 4, 1);
-	statuses[5] = ReadRegister(devCtx, 9, registers + 5, 1);
-	statuses[6] = ReadRegister(devCtx, 10, registers + 6, 1);
-	statuses[7] = ReadRegister(devCtx, 11, registers + 7, 1);
-	swprintf(buf, L"INIT_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x", registers[0], registers[1], registers[2], registers[3], registers[4], registers[5], registers[6], registers[7]);
-	DbgPrint("%ls\n", buf);
-
-	/*RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));*/
+	// Runtime idle only stops the clock and the chip keeps its configuration,
+	// coming back from anything else it needs the image again and its registers may be anywhere
+	if (!devCtx->Idle)
+		Uc120ScriptCacheInvalidate(&devCtx->ScriptCache);
+	if (!devCtx->Idle && devCtx->Bitstream && devCtx->HaveResetGpio) {
+		status = LumiaUSBCLoadBitstream(devCtx);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
 
-	swprintf(buf, L"S_INIT_%08x-%08x-%08x-%08x-%08x-%08x-%08x-%08x", statuses[0], statuses[1], statuses[2], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
-	DbgPrint("%ls\n", buf);
+	if (devCtx->Idle) {
+		// Woken from runtime idle, the first CC status read after this closes the wake latency window
+		devCtx->Idle = FALSE;
+		devCtx->WakeTime = KeQueryInterruptTime();
+		devCtx->WakePending = TRUE;
+		STATS_ADD(devCtx, Wakes, 1);
+		STATS_ADD(devCtx, IdleResidencyMs, (devCtx->WakeTime - devCtx->IdleEnterTime) / 10000);
+	}
 
-	/*RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
-		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
-		(PCWSTR)buf,
-		REG_DWORD,
-		&data,
-		sizeof(ULONG));*/
+	// The mux is only enabled once the orientation is known, restore it if we went to sleep attached
+	WdfWaitLockAcquire(devCtx->PdLock, NULL);
+	LumiaUSBCApplyMux(devCtx);
+	WdfWaitLockRelease(devCtx->PdLock);
+	// The power role survives D0 cycles, it only changes through EvtSetPowerRole or a PR_Swap
+	LumiaUSBCSetVbus(devCtx, devCtx->SourceMode);
 
-	DbgPrint("%!FUNC! Exit\n");
 	return status;
 }
 
-NTSTATUS
-LumiaUSBCKmCreateDevice(
-    _Inout_ PWDFDEVICE_INIT DeviceInit
-    )
-/*++
+int LumiaUSBCPdTransmit(void *context, const unsigned char *frame, unsigned int length)
+{
+	// The whole frame, byte count included, goes into the TX FIFO in one burst
+	return NT_SUCCESS(WriteRegisterAt((PDEVICE_CONTEXT)context, SpiBusPriorityInterrupt, UC120_REG_PD_TX, (unsigned char *)frame, length));
+}
 
-Routine Description:
+PD_TX_RESULT LumiaUSBCPdWaitTransmit(void *context, unsigned int timeoutUs)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	LARGE_INTEGER frequency, now;
+	LONGLONG deadline;
+	unsigned char value, done;
 
-    Worker routine called to create a device and its software resources.
+	// tReceive is about a millisecond, far below the interrupt time's resolution
+	now = KeQueryPerformanceCounter(&frequency);
+	deadline = now.QuadPart + (LONGLONG)timeoutUs * frequency.QuadPart / 1000000;
 
-Arguments:
+	// The caller is inside the interrupt work item, which is where TX done would be handled,
+	// so poll. Each read waits for the bus thread, there is no need to spin in between.
+	do {
+		if (NT_SUCCESS(ReadRegisterAt(ctx, SpiBusPriorityInterrupt, UC120_REG_INTERRUPT_STATUS, &value, 1)) && (value & UC120_INT_PD_TX_DONE)) {
+			done = value & UC120_INT_PD_TX_DONE;
+			WriteRegisterAt(ctx, SpiBusPriorityInterrupt, UC120_REG_INTERRUPT_STATUS, &done, 1);
+
+			if (done & UC120_INT_PD_TX_SUCCESS)
+				return PdTxSuccess;
+			if (done & UC120_INT_PD_TX_DISCARD)
+				return PdTxDiscarded;
+			return PdTxFailed;
+		}
+		now = KeQueryPerformanceCounter(NULL);
+	} while (now.QuadPart < deadline);
 
-    DeviceInit - Pointer to an opaque init structure. Memory for this
-                    structure will be freed by the framework when the WdfDeviceCreate
-                    succeeds. So don't access the structure after that point.
+	return PdTxFailed;
+}
+
+// How the UC120 signals Hard Reset is not known, the policy engines still reset their side
+const PD_PHY_OPS LumiaUSBCPdPhy = {
+	LumiaUSBCPdTransmit,
+	LumiaUSBCPdWaitTransmit,
+	NULL
+};
+
+// What we offer as a source: 5V at 500 mA from the OTG boost
+const unsigned long LumiaUSBCSourcePdos[] = {
+	PD_PDO_FIXED(5000, 500) | PD_PDO_FIXED_DUAL_ROLE
+};
+
+ULONG LumiaUSBCPdNow(void)
+{
+	return (ULONG)(KeQueryInterruptTime() / 10000);
+}
+
+void LumiaUSBCPdArmTimer(PDEVICE_CONTEXT ctx, ULONG next)
+{
+	if (next)
+		WdfTimerStart(ctx->PdTimer, WDF_REL_TIMEOUT_IN_MS(next));
+	else
+		WdfTimerStop(ctx->PdTimer, FALSE);
+}
+
+//
+// What each Rp level means to UCM, indexed by UC120_RP_LEVEL
+//
+static const struct {
+	UCM_TYPEC_CURRENT CurrentAdvertisement;
+	UCM_CHARGING_STATE ChargingState;
+} LumiaUSBCRpLevels[Uc120RpLevelCount] = {
+	{ UcmTypeCCurrentDefaultUsb, UcmChargingStateNotCharging },
+	{ UcmTypeCCurrentDefaultUsb, UcmChargingStateTrickleCharging },
+	{ UcmTypeCCurrent1500mA,     UcmChargingStateSlowCharging },
+	{ UcmTypeCCurrent3000mA,     UcmChargingStateNominalCharging }
+};
+
+//
+// Sends UCM whatever in next differs from what it was last told
+//
+void LumiaUSBCReportConnector(PDEVICE_CONTEXT ctx, const CONNECTOR_STATE *next)
+{
+	const CONNECTOR_STATE *reported = &ctx->Report.Reported;
+	UCM_PD_POWER_DATA_OBJECT Pdos[PD_MAX_DATA_OBJECTS];
+	UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS PdParams;
+	unsigned int changes, i;
+
+	changes = ConnectorReportDiff(&ctx->Report, next);
+
+	if (changes & CONNECTOR_REPORT_SOURCE_CAPS) {
+		for (i = 0; i < reported->SourceCapCount; i++)
+			Pdos[i].Ul = reported->SourceCaps[i];
+		UcmConnectorPdSourceCaps(ctx->Connector, Pdos, reported->SourceCapCount);
+	}
+
+	if (changes & CONNECTOR_REPORT_PARTNER_SOURCE_CAPS) {
+		for (i = 0; i < reported->PartnerSourceCapCount; i++)
+			Pdos[i].Ul = reported->PartnerSourceCaps[i];
+		UcmConnectorPdPartnerSourceCaps(ctx->Connector, Pdos, reported->PartnerSourceCapCount);
+	}
+
+	if (changes & CONNECTOR_REPORT_POWER_DIRECTION)
+		UcmConnectorPowerDirectionChanged(ctx->Connector, TRUE, (UCM_POWER_ROLE)reported->PowerRole);
+
+	if (changes & CONNECTOR_REPORT_TYPEC_CURRENT)
+		UcmConnectorTypeCCurrentAdChanged(ctx->Connector, (UCM_TYPEC_CURRENT)reported->TypeCCurrent);
+
+	if (changes & CONNECTOR_REPORT_PD_CONN_STATE) {
+		UCM_CONNECTOR_PD_CONN_STATE_CHANGED_PARAMS_INIT(&PdParams, (UCM_PD_CONN_STATE)reported->PdConnState);
+		PdParams.Rdo.Ul = reported->Rdo;
+		if (reported->ChargingState != CONNECTOR_VALUE_UNKNOWN)
+			PdParams.ChargingState = (UCM_CHARGING_STATE)reported->ChargingState;
+		UcmConnectorPdConnectionStateChanged(ctx->Connector, &PdParams);
+	}
+
+	if (changes & CONNECTOR_REPORT_CHARGING_STATE)
+		UcmConnectorChargingStateChanged(ctx->Connector, (UCM_CHARGING_STATE)reported->ChargingState);
+}
+
+void LumiaUSBCReportRpLevel(PDEVICE_CONTEXT ctx)
+{
+	CONNECTOR_STATE state;
+
+	ConnectorStateInitialize(&state);
+	state.TypeCCurrent = LumiaUSBCRpLevels[ctx->RpLevel].CurrentAdvertisement;
+	state.ChargingState = LumiaUSBCRpLevels[ctx->RpLevel].ChargingState;
+	LumiaUSBCReportConnector(ctx, &state);
+}
+
+void LumiaUSBCPdAltModeEvents(PDEVICE_CONTEXT ctx, unsigned int events)
+{
+	static const char *lanes[] = { "USB", "2 lane display + USB", "4 lane display" };
+
+	if (events & (PD_ALT_MODE_EVENT_ENTERED | PD_ALT_MODE_EVENT_USB)) {
+		STATS_SET(ctx, AltModeLanes, ctx->AltMode.Lanes);
+		LumiaUSBCApplyMux(ctx);
+	}
+
+	if (events & PD_ALT_MODE_EVENT_ENTERED) {
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_UCM, "DisplayPort mode entered in %u ms, pin assignment %x, lanes: %s",
+			ctx->AltMode.BringUpMs, ctx->AltMode.PinAssignment, lanes[ctx->AltMode.Lanes]);
+		STATS_SET(ctx, AltModeBringUpMs, ctx->AltMode.BringUpMs);
+	}
+
+	if (events & PD_ALT_MODE_EVENT_HPD)
+		TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_UCM, "DisplayPort HPD %s", ctx->AltMode.Hpd ? "high" : "low");
+}
+
+void LumiaUSBCPdSinkEvents(PDEVICE_CONTEXT ctx, unsigned int events)
+{
+	CONNECTOR_STATE state;
+	unsigned int i;
+
+	if (events & PD_SINK_EVENT_CAPABILITIES) {
+		ConnectorStateInitialize(&state);
+		for (i = 0; i < ctx->Sink.SourceCapCount; i++)
+			state.PartnerSourceCaps[i] = ctx->Sink.SourceCaps[i];
+		state.PartnerSourceCapCount = ctx->Sink.SourceCapCount;
+		LumiaUSBCReportConnector(ctx, &state);
+	}
+
+	if (events & PD_SINK_EVENT_CONTRACT) {
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_UCM, "PD contract on PDO %u: %u mV, %u mA", ctx->Sink.Contract.Position, ctx->Sink.Contract.VoltageMv, ctx->Sink.Contract.CurrentMa);
+		STATS_SET(ctx, SinkContractMv, ctx->Sink.Contract.VoltageMv);
+		STATS_SET(ctx, SinkContractMa, ctx->Sink.Contract.CurrentMa);
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_CONTRACT, ctx->Sink.Contract.VoltageMv, ctx->Sink.Contract.CurrentMa);
+
+		ConnectorStateInitialize(&state);
+		state.PdConnState = UcmPdConnStateNegotiationSucceeded;
+		state.Rdo = ctx->Sink.Contract.Rdo;
+		state.ChargingState = UcmChargingStateNominalCharging;
+		LumiaUSBCReportConnector(ctx, &state);
+
+		// Modes are entered from an explicit contract
+		LumiaUSBCPdAltModeEvents(ctx, PdAltModeStart(&ctx->AltMode, &ctx->Pd, LumiaUSBCPdNow()));
+	}
+
+	if (events & PD_SINK_EVENT_HARD_RESET) {
+		// Hard reset exits all modes, the lanes go back to USB
+		PdAltModeStop(&ctx->AltMode);
+		LumiaUSBCPdAltModeEvents(ctx, PD_ALT_MODE_EVENT_USB);
+		PdPrSwapStop(&ctx->Swap);
+	}
+
+	if (events & PD_SINK_EVENT_FAILED) {
+		// Type-C current is still there, only the explicit contract is gone
+		STATS_SET(ctx, SinkContractMv, 0);
+		STATS_SET(ctx, SinkContractMa, 0);
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_ERROR, LUMIAUSBC_EVENT_ERROR_NEGOTIATION, 0);
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_CONTRACT, 0, 0);
+
+		ConnectorStateInitialize(&state);
+		state.PdConnState = UcmPdConnStateNegotiationFailed;
+		state.ChargingState = LumiaUSBCRpLevels[ctx->RpLevel].ChargingState;
+		LumiaUSBCReportConnector(ctx, &state);
+	}
+
+	if (events & PD_SINK_EVENT_NO_PD) {
+		ConnectorStateInitialize(&state);
+		state.PdConnState = UcmPdConnStateNotSupported;
+		state.TypeCCurrent = LumiaUSBCRpLevels[ctx->RpLevel].CurrentAdvertisement;
+		state.ChargingState = LumiaUSBCRpLevels[ctx->RpLevel].ChargingState;
+		LumiaUSBCReportConnector(ctx, &state);
+	}
+}
+
+void LumiaUSBCPdSourceEvents(PDEVICE_CONTEXT ctx, unsigned int events)
+{
+	CONNECTOR_STATE state;
+
+	if (events & PD_SOURCE_EVENT_CONTRACT) {
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_UCM, "PD contract as source, RDO %x", ctx->Source.Rdo);
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_CONTRACT,
+			PD_PDO_FIXED_VOLTAGE_MV(ctx->Source.Pdos[PD_RDO_POSITION(ctx->Source.Rdo) - 1]),
+			PD_RDO_OPERATING(ctx->Source.Rdo) * 10);
+
+		ConnectorStateInitialize(&state);
+		state.PdConnState = UcmPdConnStateNegotiationSucceeded;
+		state.Rdo = ctx->Source.Rdo;
+		state.ChargingState = UcmChargingStateNotCharging;
+		LumiaUSBCReportConnector(ctx, &state);
+
+		LumiaUSBCPdAltModeEvents(ctx, PdAltModeStart(&ctx->AltMode, &ctx->Pd, LumiaUSBCPdNow()));
+	}
+
+	if (events & PD_SOURCE_EVENT_NO_PD) {
+		ConnectorStateInitialize(&state);
+		state.PdConnState = UcmPdConnStateNotSupported;
+		state.ChargingState = UcmChargingStateNotCharging;
+		LumiaUSBCReportConnector(ctx, &state);
+	}
+}
+
+void LumiaUSBCSetVbus(void *context, int on)
+{
+	PDEVICE_CONTEXT ctx = (PDEVICE_CONTEXT)context;
+	unsigned char value = on ? 1 : 0;
+
+	SetGPIO(ctx, ctx->VbusGpio, &value);
+}
+
+//
+// Switches VBUS and the policy engines over to the given role and tells UCM
+//
+void LumiaUSBCApplyPowerRole(PDEVICE_CONTEXT ctx, BOOLEAN source)
+{
+	CONNECTOR_STATE state;
+	unsigned int i;
+
+	if (ctx->Attached && source != ctx->SourceMode)
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_POWER_ROLE, source, 0);
+
+	ctx->SourceMode = source;
+	ctx->Pd.PowerRole = source ? PD_POWER_ROLE_SOURCE : PD_POWER_ROLE_SINK;
+	STATS_SET(ctx, SourceMode, source);
+	LumiaUSBCSetVbus(ctx, source);
+
+	if (!ctx->Attached)
+		return;
+
+	PdSinkStop(&ctx->Sink);
+	PdSourceStop(&ctx->Source);
+
+	// Whatever gets negotiated next belongs to the new role, even if it looks the same
+	ConnectorReportInvalidate(&ctx->Report, CONNECTOR_REPORT_PARTNER_SOURCE_CAPS | CONNECTOR_REPORT_PD_CONN_STATE);
+
+	ConnectorStateInitialize(&state);
+
+	if (source) {
+		for (i = 0; i < ctx->Source.PdoCount; i++)
+			state.SourceCaps[i] = ctx->Source.Pdos[i];
+		state.SourceCapCount = ctx->Source.PdoCount;
+		state.PowerRole = UcmPowerRoleSource;
+		state.ChargingState = UcmChargingStateNotCharging;
+		LumiaUSBCReportConnector(ctx, &state);
+
+		if (ctx->PdEnabled)
+			LumiaUSBCPdSourceEvents(ctx, PdSourceStart(&ctx->Source, &ctx->Pd, LumiaUSBCPdNow()));
+		else
+			LumiaUSBCPdSourceEvents(ctx, PD_SOURCE_EVENT_NO_PD);
+	}
+	else {
+		// Partner capabilities and the contract are reported as the sink policy negotiates them
+		state.PowerRole = UcmPowerRoleSink;
+		LumiaUSBCReportConnector(ctx, &state);
+
+		if (ctx->PdEnabled)
+			PdSinkStart(&ctx->Sink, LumiaUSBCPdNow());
+		else
+			LumiaUSBCPdSinkEvents(ctx, PD_SINK_EVENT_NO_PD);
+	}
+
+	LumiaUSBCPdPoll(ctx);
+}
+
+void LumiaUSBCPdSwapEvents(PDEVICE_CONTEXT ctx, unsigned int events)
+{
+	if (events & PD_PR_SWAP_EVENT_DONE) {
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_UCM, "Power role swap to %s took %u ms", ctx->Pd.PowerRole == PD_POWER_ROLE_SOURCE ? "source" : "sink", ctx->Swap.LatencyMs);
+		STATS_ADD(ctx, PowerRoleSwaps, 1);
+		STATS_SET(ctx, LastSwapLatencyMs, ctx->Swap.LatencyMs);
+		STATS_MAX(ctx, MaxSwapLatencyMs, ctx->Swap.LatencyMs);
+
+		ctx->PowerRoleRequested = FALSE;
+		LumiaUSBCApplyPowerRole(ctx, ctx->Pd.PowerRole == PD_POWER_ROLE_SOURCE ? TRUE : FALSE);
+	}
+
+	if (events & PD_PR_SWAP_EVENT_FAILED) {
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_UCM, "Power role swap failed");
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_ERROR, LUMIAUSBC_EVENT_ERROR_POWER_ROLE, 0);
+
+		if (ctx->PowerRoleRequested) {
+			ctx->PowerRoleRequested = FALSE;
+			UcmConnectorPowerDirectionChanged(ctx->Connector, FALSE, ctx->SourceMode ? UcmPowerRoleSource : UcmPowerRoleSink);
+		}
+
+		// VBUS may already be down, start over in the role we had
+		if (events & PD_PR_SWAP_EVENT_RECOVER)
+			LumiaUSBCApplyPowerRole(ctx, ctx->SourceMode);
+	}
+}
+
+//
+// Runs the policy timers until nothing fires and rearms the timer for the earliest deadline
+//
+void LumiaUSBCPdPoll(PDEVICE_CONTEXT ctx)
+{
+	unsigned int sinkEvents, sourceEvents, swapEvents, altModeEvents;
+	ULONG sinkNext, sourceNext, swapNext, altModeNext, next;
+
+	do {
+		sinkEvents = PdSinkPoll(&ctx->Sink, &ctx->Pd, LumiaUSBCPdNow(), &sinkNext);
+		sourceEvents = PdSourcePoll(&ctx->Source, &ctx->Pd, LumiaUSBCPdNow(), &sourceNext);
+		swapEvents = PdPrSwapPoll(&ctx->Swap, LumiaUSBCPdNow(), &swapNext);
+		altModeEvents = PdAltModePoll(&ctx->AltMode, &ctx->Pd, LumiaUSBCPdNow(), &altModeNext);
+		LumiaUSBCPdSinkEvents(ctx, sinkEvents);
+		LumiaUSBCPdSourceEvents(ctx, sourceEvents);
+		LumiaUSBCPdSwapEvents(ctx, swapEvents);
+		LumiaUSBCPdAltModeEvents(ctx, altModeEvents);
+	} while (sinkEvents | sourceEvents | swapEvents | altModeEvents);
+
+	next = sinkNext;
+	if (!next || (sourceNext && sourceNext < next))
+		next = sourceNext;
+	if (!next || (swapNext && swapNext < next))
+		next = swapNext;
+	if (!next || (altModeNext && altModeNext < next))
+		next = altModeNext;
+	LumiaUSBCPdArmTimer(ctx, next);
+}
+
+void LumiaUSBCPdTimer(WDFTIMER Timer)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(WdfTimerGetParentObject(Timer));
+
+	WdfWaitLockAcquire(ctx->PdLock, NULL);
+	LumiaUSBCPdPoll(ctx);
+	WdfWaitLockRelease(ctx->PdLock);
+}
+
+void LumiaUSBCPdMessageReceived(PDEVICE_CONTEXT ctx, PPD_MESSAGE message)
+{
+	unsigned short header = PdMessageHeader(message);
+
+	// Soft_Reset is answered by the policy engine of our role, a swap in progress is over
+	if (PD_HEADER_COUNT(header) == 0 && PD_HEADER_TYPE(header) == PD_CTRL_SOFT_RESET && PdPrSwapBusy(&ctx->Swap)) {
+		PdPrSwapStop(&ctx->Swap);
+		LumiaUSBCPdSwapEvents(ctx, PD_PR_SWAP_EVENT_FAILED);
+	}
+
+	LumiaUSBCPdAltModeEvents(ctx, PdAltModeHandleMessage(&ctx->AltMode, &ctx->Pd, message, LumiaUSBCPdNow()));
+
+	// Accept and PS_RDY belong to the swap while one is running
+	if (PdPrSwapBusy(&ctx->Swap) || (PD_HEADER_COUNT(header) == 0 && PD_HEADER_TYPE(header) == PD_CTRL_PR_SWAP))
+		LumiaUSBCPdSwapEvents(ctx, PdPrSwapHandleMessage(&ctx->Swap, &ctx->Pd, message, LumiaUSBCPdNow()));
+	else if (ctx->SourceMode)
+		LumiaUSBCPdSourceEvents(ctx, PdSourceHandleMessage(&ctx->Source, &ctx->Pd, message, LumiaUSBCPdNow()));
+	else
+		LumiaUSBCPdSinkEvents(ctx, PdSinkHandleMessage(&ctx->Sink, &ctx->Pd, message, LumiaUSBCPdNow()));
+
+	LumiaUSBCPdPoll(ctx);
+}
+
+//
+// Called with PdLock held
+//
+void LumiaUSBCPdService(PDEVICE_CONTEXT ctx, unsigned char interruptStatus)
+{
+	PPD_MESSAGE message;
+	PD_MESSAGE overflow;
+	int i;
+
+	if (!ctx->PdEnabled || !(interruptStatus & (UC120_INT_PD_HARD_RESET | UC120_INT_PD_RX)))
+		return;
+
+	if (interruptStatus & UC120_INT_PD_HARD_RESET) {
+		PdProtocolReset(&ctx->Pd);
+
+		// Hard reset exits all modes, the lanes go back to USB
+		PdAltModeStop(&ctx->AltMode);
+		LumiaUSBCPdAltModeEvents(ctx, PD_ALT_MODE_EVENT_USB);
+
+		// Roles go back to what they were at attach and the contract is negotiated again
+		PdPrSwapStop(&ctx->Swap);
+		if (ctx->Attached) {
+			if (!ctx->SourceMode)
+				LumiaUSBCPdSinkEvents(ctx, PD_SINK_EVENT_FAILED);
+			LumiaUSBCApplyPowerRole(ctx, ctx->SourceMode);
+		}
+
+		return;
+	}
+
+	// Drain the RX FIFO straight into the ring, one burst per frame
+	for (i = 0; i < PD_RING_SIZE; i++) {
+		message = PdProtocolRxSlot(&ctx->Pd);
+		if (!message)
+			message = &overflow;
+
+		if (!NT_SUCCESS(ReadRegisterAt(ctx, SpiBusPriorityInterrupt, UC120_REG_PD_RX, (unsigned char *)message, PD_MESSAGE_FRAME_SIZE)) ||
+			message->Length == 0)
+			break;
+
+		if (message != &overflow)
+			PdProtocolRxCommit(&ctx->Pd);
+		else
+			ctx->Pd.RxDropped++;
+	}
+
+	while ((message = PdProtocolRxPeek(&ctx->Pd)) != NULL) {
+		LumiaUSBCPdMessageReceived(ctx, message);
+		PdProtocolRxConsume(&ctx->Pd);
+	}
+}
+
+void LumiaUSBCApplyMux(PDEVICE_CONTEXT ctx)
+{
+	MUX_STEP steps[MUX_MAX_STEPS];
+	LARGE_INTEGER start, end, frequency;
+	unsigned char current, target = 0, value;
+	unsigned int count, i;
+	LONG latencyUs;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	// Polarity high routes the lanes for a flipped plug, accessories stay unflipped
+	if (ctx->Orientation == Uc120OrientationCc2)
+		target |= MUX_PIN_POL;
+
+	// high = HDMI only, medium (unsupported) = USB only, low = both
+	if (ctx->AltMode.Lanes == PdAltModeLanesDisplay)
+		target |= MUX_PIN_AMSEL;
+
+	if (ctx->Attached)
+		target |= MUX_PIN_EN;
+
+	// After a power transition the pins may be anywhere, assume the worst: enabled the other way round
+	current = ctx->MuxStateValid ? ctx->MuxState : (unsigned char)((target ^ MUX_PINS_CONFIG) | MUX_PIN_EN);
+
+	count = MuxPlanTransition(current, target, ctx->HaveMuxGpio, steps);
+	if (count == 0)
+		return;
+
+	start = KeQueryPerformanceCounter(&frequency);
+	ctx->MuxState = current;
+
+	for (i = 0; i < count; i++) {
+		if (ctx->HaveMuxGpio) {
+			value = steps[i].Value;
+			status = SetGPIO(ctx, ctx->MuxGpio, &value);
+		}
+		else {
+			value = steps[i].Value ? 1 : 0;
+			status = SetGPIO(ctx, steps[i].Mask == MUX_PIN_EN ? ctx->EnGpio :
+				steps[i].Mask == MUX_PIN_POL ? ctx->PolGpio : ctx->AmselGpio, &value);
+		}
+
+		// The later steps are only legal after this one, and the pins are now anywhere. Replanning
+		// from the worst case on the next call puts them right, even for the same target.
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "Mux step %u of %u failed %!STATUS!", i + 1, count, status);
+			ctx->MuxStateValid = FALSE;
+			return;
+		}
+
+		ctx->MuxState = (UCHAR)((ctx->MuxState & ~steps[i].Mask) | steps[i].Value);
+		NT_ASSERT(MuxStateIsLegal(ctx->MuxState, current, target));
+	}
+
+	end = KeQueryPerformanceCounter(NULL);
+	ctx->MuxState = target;
+	ctx->MuxStateValid = TRUE;
+
+	latencyUs = (LONG)((end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+	STATS_BEGIN(ctx);
+	ctx->Stats->MuxReconfigurations++;
+	ctx->Stats->MuxGpioWrites += count;
+	ctx->Stats->LastMuxLatencyUs = latencyUs;
+	if (ctx->Stats->MaxMuxLatencyUs < latencyUs)
+		ctx->Stats->MaxMuxLatencyUs = latencyUs;
+	STATS_FLUSH(ctx);
+	STATS_END(ctx);
+}
+
+void LumiaUSBCReportAttach(PDEVICE_CONTEXT devCtx)
+{
+	UCM_CONNECTOR_TYPEC_ATTACH_PARAMS Params;
+
+	UCM_CONNECTOR_TYPEC_ATTACH_PARAMS_INIT(&Params, UcmTypeCPartnerUfp);
+	Params.CurrentAdvertisement = UcmTypeCCurrentDefaultUsb;
+	if (!devCtx->SourceMode) {
+		Params.CurrentAdvertisement = LumiaUSBCRpLevels[devCtx->RpLevel].CurrentAdvertisement;
+		Params.ChargingState = LumiaUSBCRpLevels[devCtx->RpLevel].ChargingState;
+	}
+	UcmConnectorTypeCAttach(devCtx->Connector, &Params);
+	ConnectorReportAttach(&devCtx->Report, devCtx->SourceMode ? CONNECTOR_VALUE_UNKNOWN : Params.CurrentAdvertisement,
+		devCtx->SourceMode ? CONNECTOR_VALUE_UNKNOWN : Params.ChargingState);
+
+	// The partner is reported as UFP, so we are the DFP that drives mode discovery
+	devCtx->Pd.DataRole = PD_DATA_ROLE_DFP;
+
+	LumiaUSBCApplyPowerRole(devCtx, devCtx->SourceMode);
+}
+
+void LumiaUSBCUpdateAttachState(PDEVICE_CONTEXT ctx, unsigned char ccStatus)
+{
+	LumiaUSBCSetAttachState(ctx, Uc120IsAttached(ccStatus) ? TRUE : FALSE, Uc120DecodeOrientation(ccStatus), Uc120DecodeRp(ccStatus)->Level);
+}
+
+void LumiaUSBCSetAttachState(PDEVICE_CONTEXT ctx, BOOLEAN attached, UC120_ORIENTATION orientation, UC120_RP_LEVEL rpLevel)
+{
+	if (attached == ctx->Attached) {
+		if (!attached || ctx->SourceMode || rpLevel == ctx->RpLevel)
+			return;
+
+		// The source changed its Rp while attached, follow it unless a PD contract governs the current
+		ctx->RpLevel = rpLevel;
+		STATS_SET(ctx, TypeCCurrentMa, Uc120RpDecodeTable[rpLevel].CurrentMa);
+
+		WdfWaitLockAcquire(ctx->PdLock, NULL);
+		if (!ctx->Sink.ContractValid)
+			LumiaUSBCReportRpLevel(ctx);
+		WdfWaitLockRelease(ctx->PdLock);
+		return;
+	}
+
+	ctx->Attached = attached;
+	ctx->RpLevel = attached && !ctx->SourceMode ? rpLevel : Uc120RpOpen;
+	STATS_SET(ctx, Attached, attached);
+
+	ctx->Orientation = attached ? orientation : Uc120OrientationNone;
+	if (attached)
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_UCM, "Partner attached on %s", ctx->Orientation == Uc120OrientationCc2 ? "CC2" : ctx->Orientation == Uc120OrientationCc1 ? "CC1" : "both CC pins");
+
+	// UcmCx has no notion of plug orientation, it only shows up in the diagnostics
+	STATS_SET(ctx, Orientation, ctx->Orientation);
+	STATS_SET(ctx, TypeCCurrentMa, Uc120RpDecodeTable[ctx->RpLevel].CurrentMa);
+
+	WdfWaitLockAcquire(ctx->PdLock, NULL);
+	PdProtocolReset(&ctx->Pd);
+	PdSinkStop(&ctx->Sink);
+	PdSourceStop(&ctx->Source);
+	PdPrSwapStop(&ctx->Swap);
+	PdAltModeStop(&ctx->AltMode);
+	WdfTimerStop(ctx->PdTimer, FALSE);
+	LumiaUSBCApplyMux(ctx);
+	WdfWaitLockRelease(ctx->PdLock);
+
+	if (attached) {
+		// Stay in D0 for as long as something is plugged in. The attach reported without
+		// detection never ends, runtime idle is left disabled then instead.
+		if (ctx->CcAttachDetection && !ctx->IdleStopped) {
+			WdfDeviceStopIdle(ctx->Device, FALSE);
+			ctx->IdleStopped = TRUE;
+		}
+
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_ATTACH, ctx->Orientation, ctx->SourceMode ? 0 : Uc120RpDecodeTable[ctx->RpLevel].CurrentMa);
+
+		WdfWaitLockAcquire(ctx->PdLock, NULL);
+		LumiaUSBCReportAttach(ctx);
+		WdfWaitLockRelease(ctx->PdLock);
+
+	}
+	else {
+		UcmConnectorTypeCDetach(ctx->Connector);
+		ConnectorReportInvalidate(&ctx->Report, CONNECTOR_REPORT_ALL);
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_DETACH, 0, 0);
+
+		if (ctx->IdleStopped) {
+			ctx->IdleStopped = FALSE;
+			WdfDeviceResumeIdle(ctx->Device);
+		}
+	}
+}
+
+//
+// Only CC states that held for their debounce time reach the attach logic
+//
+void LumiaUSBCCcSample(PDEVICE_CONTEXT ctx, unsigned char ccStatus)
+{
+	unsigned long next;
+	unsigned int events;
+	ULONG latencyMs;
+
+	if (!ctx->CcAttachDetection)
+		return;
+
+	WdfWaitLockAcquire(ctx->CcLock, NULL);
+
+	// The first CC status read after a wake closes the latency window, attached or not. Waiting
+	// for an attach would count a spurious wake and a later plug-in as one slow wake. Nothing
+	// read for a whole idle timeout means the wake was for something else, a request say.
+	latencyMs = ctx->WakePending ? (ULONG)((KeQueryInterruptTime() - ctx->WakeTime) / 10000) : 0;
+	if (ctx->WakePending && latencyMs <= ctx->IdleTimeoutMs) {
+		STATS_SET(ctx, LastWakeLatencyMs, latencyMs);
+		STATS_MAX(ctx, MaxWakeLatencyMs, latencyMs);
+
+		if (latencyMs > ctx->WakeLatencyBudgetMs) {
+			// Idling costs more than the budget allows, keep the controller powered from now on
+			TraceEvents(TRACE_LEVEL_WARNING, TRACE_POWER, "Wake to CC status took %u ms, over the %u ms budget, disabling runtime idle", latencyMs, ctx->WakeLatencyBudgetMs);
+			STATS_ADD(ctx, WakeBudgetExceeded, 1);
+			LumiaUSBCAssignIdleSettings(ctx->Device, ctx->IdleTimeoutMs, FALSE);
+		}
+	}
+	ctx->WakePending = FALSE;
+
+	events = CcDebounceSample(&ctx->CcDebounce, (unsigned char)(ccStatus & (UC120_CC1 | UC120_CC2)), LumiaUSBCPdNow(), &next);
+	if (next)
+		WdfTimerStart(ctx->CcTimer, WDF_REL_TIMEOUT_IN_MS(next));
+	else
+		WdfTimerStop(ctx->CcTimer, FALSE);
+
+	if (events & CC_DEBOUNCE_EVENT_CHANGED)
+		LumiaUSBCUpdateAttachState(ctx, ctx->CcDebounce.Stable);
+
+	WdfWaitLockRelease(ctx->CcLock);
+}
+
+void LumiaUSBCCcTimer(WDFTIMER Timer)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	unsigned long next;
+	unsigned int events;
+
+	WdfWaitLockAcquire(ctx->CcLock, NULL);
+
+	events = CcDebouncePoll(&ctx->CcDebounce, LumiaUSBCPdNow(), &next);
+	if (next)
+		WdfTimerStart(ctx->CcTimer, WDF_REL_TIMEOUT_IN_MS(next));
+
+	if (events & CC_DEBOUNCE_EVENT_CHANGED)
+		LumiaUSBCUpdateAttachState(ctx, ctx->CcDebounce.Stable);
+
+	WdfWaitLockRelease(ctx->CcLock);
+}
+
+//
+// Puts the statistics block in a section so IOCTL_LUMIAUSBC_MAP_STATISTICS
+// can hand out read-only views of it. Without one the counters still work,
+// they just cannot be mapped.
+//
+NTSTATUS LumiaUSBCStatsCreate(PDEVICE_CONTEXT ctx)
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	OBJECT_ATTRIBUTES objectAttributes;
+	LARGE_INTEGER size;
+	SIZE_T viewSize = 0;
+	PVOID section;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = ctx->Device;
+	status = WdfWaitLockCreate(&attributes, &ctx->StatsLock);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfWaitLockCreate(&attributes, &ctx->SnapshotLock);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	SnapshotStreamInitialize(&ctx->Snapshots, UC120_SNAPSHOT_COUNT);
+
+	ctx->Stats = &ctx->StatsFallback;
+
+	size.QuadPart = sizeof(LUMIAUSBC_STATISTICS);
+	InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = ZwCreateSection(&ctx->StatsSection, SECTION_ALL_ACCESS, &objectAttributes, &size, PAGE_READWRITE, SEC_COMMIT, NULL);
+	if (NT_SUCCESS(status)) {
+		status = ObReferenceObjectByHandle(ctx->StatsSection, SECTION_MAP_WRITE, NULL, KernelMode, &section, NULL);
+		if (NT_SUCCESS(status)) {
+			status = MmMapViewInSystemSpace(section, &ctx->StatsView, &viewSize);
+			ObDereferenceObject(section);
+		}
+	}
+
+	if (NT_SUCCESS(status)) {
+		ctx->Stats = (PLUMIAUSBC_STATISTICS)ctx->StatsView;
+	}
+	else {
+		TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "No statistics section, counters cannot be mapped %!STATUS!", status);
+		if (ctx->StatsSection) {
+			ZwClose(ctx->StatsSection);
+			ctx->StatsSection = NULL;
+		}
+		ctx->StatsView = NULL;
+	}
+
+	ctx->Stats->Version = LUMIAUSBC_STATISTICS_VERSION;
+	ctx->Stats->Size = sizeof(LUMIAUSBC_STATISTICS);
+
+	return STATUS_SUCCESS;
+}
+
+void LumiaUSBCDeviceCleanup(WDFOBJECT Object)
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(Object);
+
+	// Views mapped by clients keep the section alive until they unmap them
+	if (ctx->StatsView)
+		MmUnmapViewInSystemSpace(ctx->StatsView);
+	if (ctx->StatsSection)
+		ZwClose(ctx->StatsSection);
+}
+
+void LumiaUSBCWriteCounter(PCWSTR name, LONG value)
+{
+	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+		name,
+		REG_DWORD,
+		&value,
+		sizeof(LONG));
+}
+
+void LumiaUSBCPublishStatistics(PDEVICE_CONTEXT ctx)
+{
+	STATS_BEGIN(ctx);
+	STATS_FLUSH(ctx);
+	STATS_END(ctx);
+
+	LumiaUSBCWriteCounter(L"InitProbeMatches", ctx->Stats->InitProbeMatches);
+	LumiaUSBCWriteCounter(L"InitProbeMismatches", ctx->Stats->InitProbeMismatches);
+	LumiaUSBCWriteCounter(L"InitProbeNotReady", ctx->Stats->InitProbeNotReady);
+	LumiaUSBCWriteCounter(L"InitProbeErrors", ctx->Stats->InitProbeErrors);
+	LumiaUSBCWriteCounter(L"InitTimeSavedMs", ctx->Stats->InitTimeSavedMs);
+	LumiaUSBCWriteCounter(L"LastInitTimeMs", ctx->Stats->LastInitTimeMs);
+	LumiaUSBCWriteCounter(L"IdleTransitions", ctx->Stats->IdleTransitions);
+	LumiaUSBCWriteCounter(L"IdleResidencyMs", ctx->Stats->IdleResidencyMs);
+	LumiaUSBCWriteCounter(L"Wakes", ctx->Stats->Wakes);
+	LumiaUSBCWriteCounter(L"LastWakeLatencyMs", ctx->Stats->LastWakeLatencyMs);
+	LumiaUSBCWriteCounter(L"MaxWakeLatencyMs", ctx->Stats->MaxWakeLatencyMs);
+	LumiaUSBCWriteCounter(L"WakeBudgetExceeded", ctx->Stats->WakeBudgetExceeded);
+	LumiaUSBCWriteCounter(L"ClockSwitches", ctx->Stats->ClockSwitches);
+	LumiaUSBCWriteCounter(L"ClockOnMs", ctx->Stats->ClockOnMs);
+	LumiaUSBCWriteCounter(L"ClockOnMsSpi", ctx->Stats->ClockOnMsSpi);
+	LumiaUSBCWriteCounter(L"ClockOnMsInterrupt", ctx->Stats->ClockOnMsInterrupt);
+	LumiaUSBCWriteCounter(L"ClockOnMsInit", ctx->Stats->ClockOnMsInit);
+	LumiaUSBCWriteCounter(L"PdTxMessages", (LONG)ctx->Pd.TxMessages);
+	LumiaUSBCWriteCounter(L"PdTxRetries", (LONG)ctx->Pd.TxRetries);
+	LumiaUSBCWriteCounter(L"PdTxFailures", (LONG)ctx->Pd.TxFailures);
+	LumiaUSBCWriteCounter(L"PdRxMessages", (LONG)ctx->Pd.RxMessages);
+	LumiaUSBCWriteCounter(L"PdRxDuplicates", (LONG)ctx->Pd.RxDuplicates);
+	LumiaUSBCWriteCounter(L"PdRxDropped", (LONG)ctx->Pd.RxDropped);
+	LumiaUSBCWriteCounter(L"SinkNegotiations", (LONG)ctx->Sink.Negotiations);
+	LumiaUSBCWriteCounter(L"SinkRejects", (LONG)ctx->Sink.Rejects);
+	LumiaUSBCWriteCounter(L"SinkFailures", (LONG)ctx->Sink.Failures);
+	LumiaUSBCWriteCounter(L"SinkContractMv", ctx->Stats->SinkContractMv);
+	LumiaUSBCWriteCounter(L"SinkContractMa", ctx->Stats->SinkContractMa);
+	LumiaUSBCWriteCounter(L"TypeCCurrentMa", ctx->Stats->TypeCCurrentMa);
+	LumiaUSBCWriteCounter(L"Orientation", ctx->Stats->Orientation);
+	LumiaUSBCWriteCounter(L"AltModeLanes", ctx->Stats->AltModeLanes);
+	LumiaUSBCWriteCounter(L"AltModeBringUpMs", ctx->Stats->AltModeBringUpMs);
+	LumiaUSBCWriteCounter(L"AltModeEntries", (LONG)ctx->AltMode.Entries);
+	LumiaUSBCWriteCounter(L"AltModeFailures", (LONG)ctx->AltMode.Failures);
+	LumiaUSBCWriteCounter(L"PowerRoleSwaps", ctx->Stats->PowerRoleSwaps);
+	LumiaUSBCWriteCounter(L"PowerRoleSwapFailures", (LONG)ctx->Swap.Failures);
+	LumiaUSBCWriteCounter(L"LastSwapLatencyMs", ctx->Stats->LastSwapLatencyMs);
+	LumiaUSBCWriteCounter(L"MaxSwapLatencyMs", ctx->Stats->MaxSwapLatencyMs);
+	LumiaUSBCWriteCounter(L"MuxReconfigurations", ctx->Stats->MuxReconfigurations);
+	LumiaUSBCWriteCounter(L"MuxGpioWrites", ctx->Stats->MuxGpioWrites);
+	LumiaUSBCWriteCounter(L"LastMuxLatencyUs", ctx->Stats->LastMuxLatencyUs);
+	LumiaUSBCWriteCounter(L"MaxMuxLatencyUs", ctx->Stats->MaxMuxLatencyUs);
+	LumiaUSBCWriteCounter(L"GpioWritesIssued", ctx->Stats->GpioWritesIssued);
+	LumiaUSBCWriteCounter(L"GpioWritesSuppressed", ctx->Stats->GpioWritesSuppressed);
+	LumiaUSBCWriteCounter(L"BitBangTransactions", ctx->BitBang.Transactions);
+	LumiaUSBCWriteCounter(L"BitBangFailures", ctx->BitBang.Failures);
+	LumiaUSBCWriteCounter(L"BitBangBytesPerSec", BitBangThroughput(&ctx->BitBang));
+	LumiaUSBCWriteCounter(L"BitBangStallUs", ctx->BitBang.StallUs);
+	LumiaUSBCWriteCounter(L"BitBangBitTimeNs", ctx->BitBang.BitTimeNs);
+	LumiaUSBCWriteCounter(L"BitBangLastJitterNs", ctx->BitBang.LastJitterNs);
+	LumiaUSBCWriteCounter(L"BitBangMaxJitterNs", ctx->BitBang.MaxJitterNs);
+	LumiaUSBCWriteCounter(L"CcTransitionsAccepted", ctx->CcDebounce.Accepted);
+	LumiaUSBCWriteCounter(L"CcTransitionsSuppressed", ctx->CcDebounce.Suppressed);
+	LumiaUSBCWriteCounter(L"InterruptServices", ctx->InterruptStats.Services);
+	LumiaUSBCWriteCounter(L"InterruptEvents", ctx->InterruptStats.Events);
+	LumiaUSBCWriteCounter(L"InterruptLateEvents", ctx->InterruptStats.LateEvents);
+	LumiaUSBCWriteCounter(L"InterruptRounds", ctx->InterruptStats.Rounds);
+	LumiaUSBCWriteCounter(L"InterruptOverruns", ctx->InterruptStats.Overruns);
+	LumiaUSBCWriteCounter(L"InterruptAckFailures", ctx->InterruptStats.AckFailures);
+	LumiaUSBCWriteCounter(L"SpiBusRequests", ctx->Bus.Requests);
+	LumiaUSBCWriteCounter(L"SpiBusTransactions", ctx->Bus.Transactions);
+	LumiaUSBCWriteCounter(L"SpiBusMergedReads", ctx->Bus.MergedReads);
+	LumiaUSBCWriteCounter(L"SpiBusFailures", ctx->Bus.Failures);
+	LumiaUSBCWriteCounter(L"SpiBusMaxDepth", ctx->Bus.MaxDepth);
+	LumiaUSBCWriteCounter(L"SpiBusAvgWaitUsInterrupt", SpiBusAverageWaitUs(&ctx->Bus, SpiBusPriorityInterrupt));
+	LumiaUSBCWriteCounter(L"SpiBusAvgWaitUsControl", SpiBusAverageWaitUs(&ctx->Bus, SpiBusPriorityControl));
+	LumiaUSBCWriteCounter(L"SpiBusAvgWaitUsDiagnostic", SpiBusAverageWaitUs(&ctx->Bus, SpiBusPriorityDiagnostic));
+	LumiaUSBCWriteCounter(L"SpiBusMaxWaitUsInterrupt", ctx->Bus.MaxWaitUs[SpiBusPriorityInterrupt]);
+	LumiaUSBCWriteCounter(L"SpiBusMaxWaitUsControl", ctx->Bus.MaxWaitUs[SpiBusPriorityControl]);
+	LumiaUSBCWriteCounter(L"SpiBusMaxWaitUsDiagnostic", ctx->Bus.MaxWaitUs[SpiBusPriorityDiagnostic]);
+	LumiaUSBCWriteCounter(L"SpiReadStrategy", ctx->Stats->SpiReadStrategy);
+	LumiaUSBCWriteCounter(L"SpiReadStrategiesCorrect", ctx->Stats->SpiReadStrategiesCorrect);
+	LumiaUSBCWriteCounter(L"InitScriptTransactions", ctx->Stats->InitScriptTransactions);
+	LumiaUSBCWriteCounter(L"InitScriptAccesses", ctx->Stats->InitScriptAccesses);
+	LumiaUSBCWriteCounter(L"InterruptScriptTransactions", ctx->Stats->InterruptScriptTransactions);
+	LumiaUSBCWriteCounter(L"InterruptScriptAccesses", ctx->Stats->InterruptScriptAccesses);
+	LumiaUSBCWriteCounter(L"BitstreamLoads", ctx->Stats->BitstreamLoads);
+	LumiaUSBCWriteCounter(L"BitstreamFailures", ctx->Stats->BitstreamFailures);
+	LumiaUSBCWriteCounter(L"BitstreamLoadUs", ctx->Stats->BitstreamLoadUs);
+	LumiaUSBCWriteCounter(L"BitstreamChunks", ctx->Stats->BitstreamChunks);
+
+	WdfWaitLockAcquire(ctx->SnapshotLock, NULL);
+	LumiaUSBCWriteCounter(L"SnapshotRecords", ctx->Snapshots.Snapshots);
+	LumiaUSBCWriteCounter(L"SnapshotKeyframes", ctx->Snapshots.Keyframes);
+	LumiaUSBCWriteCounter(L"SnapshotEncodedPercent", SnapshotStreamRatio(&ctx->Snapshots));
+	WdfWaitLockRelease(ctx->SnapshotLock);
+
+	LumiaUSBCWriteCounter(L"UcmNotifications", ctx->Report.Notifications);
+	LumiaUSBCWriteCounter(L"UcmNotificationsSuppressed", ctx->Report.Suppressed);
+	LumiaUSBCWriteCounter(L"SourceContracts", (LONG)ctx->Source.Contracts);
+
+	if (ctx->ProfileInterrupts)
+		LumiaUSBCPublishInterruptProfile(ctx);
+}
+
+static const PCWSTR LumiaUSBCProfileCounters[IRQ_PROFILE_SOURCES][4] = {
+	{ L"PlugDetectInterruptRateMilliHz", L"PlugDetectInterruptMaxBurst", L"PlugDetectInterruptStatusBit", L"PlugDetectInterruptStatusPct" },
+	{ L"Uc120InterruptRateMilliHz", L"Uc120InterruptMaxBurst", L"Uc120InterruptStatusBit", L"Uc120InterruptStatusPct" },
+	{ L"Mystery1InterruptRateMilliHz", L"Mystery1InterruptMaxBurst", L"Mystery1InterruptStatusBit", L"Mystery1InterruptStatusPct" },
+	{ L"Mystery2InterruptRateMilliHz", L"Mystery2InterruptMaxBurst", L"Mystery2InterruptStatusBit", L"Mystery2InterruptStatusPct" }
+};
+
+//
+// Rate, longest burst and the UC120 status bit that most often comes with
+// each interrupt. The raw records go along so the analysis can be run
+// again elsewhere with other windows.
+//
+void LumiaUSBCPublishInterruptProfile(PDEVICE_CONTEXT ctx)
+{
+	IRQ_PROFILE_RECORD *records;
+	IRQ_PROFILE_RESULT result;
+	ULONG count, i;
+	unsigned int percent;
+	int bit;
+
+	records = ExAllocatePool(PagedPool, sizeof(IRQ_PROFILE_RECORD) * IRQ_PROFILE_DEPTH);
+	if (!records)
+		return;
+
+	WdfWaitLockAcquire(ctx->ProfileLock, NULL);
+	count = IrqProfileDump(&ctx->Profile, records, IRQ_PROFILE_DEPTH);
+	WdfWaitLockRelease(ctx->ProfileLock);
+
+	IrqProfileAnalyze(records, count, IRQ_PROFILE_BURST_GAP_US, IRQ_PROFILE_WINDOW_US, &result);
+
+	for (i = 0; i < IRQ_PROFILE_SOURCES; i++) {
+		bit = IrqProfileBestBit(&result.Sources[i], &percent);
+		LumiaUSBCWriteCounter(LumiaUSBCProfileCounters[i][0], result.Sources[i].RateMilliHz);
+		LumiaUSBCWriteCounter(LumiaUSBCProfileCounters[i][1], result.Sources[i].MaxBurst);
+		LumiaUSBCWriteCounter(LumiaUSBCProfileCounters[i][2], bit);
+		LumiaUSBCWriteCounter(LumiaUSBCProfileCounters[i][3], percent);
+	}
+
+	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+		(PCWSTR)L"InterruptProfileDump",
+		REG_BINARY,
+		records,
+		count * sizeof(IRQ_PROFILE_RECORD));
+
+	ExFreePool(records);
+}
+
+UC120_INIT_PROBE_RESULT LumiaUSBCProbeInitState(PDEVICE_CONTEXT ctx)
+{
+	UC120_INIT_PROBE_RESULT result;
+	unsigned char control[2], mode, config[UC120_CONFIG_COUNT];
+
+	// Registers 4-5 and 18-27 are contiguous, so they are read in bursts
+	if (!NT_SUCCESS(ReadRegister(ctx, UC120_REG_CONTROL, control, sizeof(control))) ||
+		!NT_SUCCESS(ReadRegister(ctx, UC120_REG_MODE, &mode, 1)) ||
+		!NT_SUCCESS(ReadRegister(ctx, UC120_REG_CONFIG_FIRST, config, sizeof(config))))
+	{
+		STATS_ADD(ctx, InitProbeErrors, 1);
+		return Uc120InitProbeMismatch;
+	}
+
+	result = Uc120CheckInitState(control, mode, config);
+	switch (result) {
+	case Uc120InitProbeMatch:
+		STATS_ADD(ctx, InitProbeMatches, 1);
+		break;
+	case Uc120InitProbeNotReady:
+		STATS_ADD(ctx, InitProbeNotReady, 1);
+		break;
+	default:
+		STATS_ADD(ctx, InitProbeMismatches, 1);
+		break;
+	}
+
+	return result;
+}
+
+//
+// Configures the UC120, or only checks it if it kept its configuration. The caller holds the clock.
+//
+void LumiaUSBCInitializeChip(PDEVICE_CONTEXT ctx)
+{
+	UC120_SCRIPT_RESULT script;
+	ULONGLONG start;
+	ULONG elapsedMs, fullInitMs = 0;
+
+	// Skip the write sequence and settle delays if the chip kept its configuration
+	start = KeQueryInterruptTime();
+	if (LumiaUSBCProbeInitState(ctx) == Uc120InitProbeMatch) {
+		elapsedMs = (ULONG)((KeQueryInterruptTime() - start) / 10000);
+		if (NT_SUCCESS(MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"InitFullTimeMs",
+			REG_DWORD,
+			&fullInitMs,
+			sizeof(ULONG))) && fullInitMs > elapsedMs)
+		{
+			STATS_ADD(ctx, InitTimeSavedMs, fullInitMs - elapsedMs);
+		}
+		STATS_SET(ctx, LastInitTimeMs, elapsedMs);
+		TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "UC120 already configured, skipped initialization");
+		goto Initialized;
+	}
+
+	// Initialize the UC120
+	if (!NT_SUCCESS(LumiaUSBCRunScript(ctx, Uc120InitScript, &script)))
+		LumiaUSBCPostEvent(ctx, LUMIAUSBC_EVENT_ERROR, LUMIAUSBC_EVENT_ERROR_INIT, (unsigned int)script.FailedOp);
+	STATS_SET(ctx, InitScriptTransactions, script.Transactions);
+	STATS_SET(ctx, InitScriptAccesses, script.Accesses);
+
+	elapsedMs = (ULONG)((KeQueryInterruptTime() - start) / 10000);
+	STATS_SET(ctx, LastInitTimeMs, elapsedMs);
+	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+		(PCWSTR)L"InitFullTimeMs",
+		REG_DWORD,
+		&elapsedMs,
+		sizeof(ULONG));
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "UC120 initialized after %u iterations with value of %x in %u transactions",
+		script.Polls, script.WaitValue, script.Transactions);
+
+Initialized:
+
+	// The configuration registers now hold known values to check reads against
+	LumiaUSBCProbeReadStrategy(ctx);
+}
+
+NTSTATUS LumiaUSBCSelfManagedIoInit(
+	WDFDEVICE Device
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
+	PO_FX_DEVICE poFxDevice;
+	PO_FX_COMPONENT_IDLE_STATE idleState;
+
+	memset(&poFxDevice, 0, sizeof(poFxDevice));
+	memset(&idleState, 0, sizeof(idleState));
+	poFxDevice.Version = PO_FX_VERSION_V1;
+	poFxDevice.ComponentCount = 1;
+	poFxDevice.Components[0].IdleStateCount = 1;
+	poFxDevice.Components[0].IdleStates = &idleState;
+	poFxDevice.DeviceContext = devCtx;
+	idleState.NominalPower = PO_FX_UNKNOWN_POWER;
+
+	status = PoFxRegisterDevice(WdfDeviceWdmGetPhysicalDevice(Device), &poFxDevice, &devCtx->PoHandle);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_POWER, "PoFxRegisterDevice failed %!STATUS!", status);
+		return status;
+	}
+
+	PoFxActivateComponent(devCtx->PoHandle, 0, PO_FX_FLAG_BLOCKING);
+
+	PoFxStartDevicePowerManagement(devCtx->PoHandle);
+
+	// Hold the clock for the whole bring-up instead of toggling it per access
+	LumiaUSBCClockAcquire(devCtx, PepClockReasonInit);
+
+	LumiaUSBCInitializeChip(devCtx);
+
+	/*i |= value << 16;
+
+	RtlWriteRegistryValue(RTL_REGISTRY_ABSOLUTE,
+		(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+		(PCWSTR)L"startdelay",
+		REG_DWORD,
+		&i,
+		sizeof(ULONG));*/
+
+	unsigned char registers[UC120_SNAPSHOT_COUNT];
+	NTSTATUS statuses[UC120_SNAPSHOT_COUNT];
+
+	memset(registers, 0, sizeof(registers));
+	memset(statuses, 0, sizeof(statuses));
+
+	LumiaUSBCReadRegisters(devCtx, SpiBusPriorityDiagnostic, Uc120SnapshotRegisters, registers, statuses, ARRAYSIZE(registers));
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "INIT_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x",
+		registers[0], registers[1], registers[UC120_SNAPSHOT_INTERRUPT_STATUS], registers[3], registers[4], registers[5], registers[6], registers[7]);
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "S_INIT %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS!",
+		statuses[0], statuses[1], statuses[UC120_SNAPSHOT_INTERRUPT_STATUS], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
+
+	LumiaUSBCClockRelease(devCtx, PepClockReasonInit);
+
+	if (devCtx->CcAttachDetection) {
+		if (NT_SUCCESS(statuses[UC120_SNAPSHOT_CC_STATUS]))
+			LumiaUSBCCcSample(devCtx, registers[UC120_SNAPSHOT_CC_STATUS]);
+	}
+	else {
+		// The port is reported attached with the pins set for CC1, as before attach detection
+		WdfWaitLockAcquire(devCtx->CcLock, NULL);
+		LumiaUSBCSetAttachState(devCtx, TRUE, Uc120OrientationNone, Uc120Rp3000mA);
+		WdfWaitLockRelease(devCtx->CcLock);
+	}
+
+	TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Exit");
+	return status;
+}
+
+//
+// Runs after every D0Entry but the first. Back from a system sleep state the chip may have lost
+// power or been reloaded with its image, runtime idle leaves it configured.
+//
+NTSTATUS LumiaUSBCSelfManagedIoRestart(
+	WDFDEVICE Device
+)
+{
+	PDEVICE_CONTEXT devCtx = DeviceGetContext(Device);
+
+	if (devCtx->Reinitialize) {
+		devCtx->Reinitialize = FALSE;
+		LumiaUSBCClockAcquire(devCtx, PepClockReasonInit);
+		LumiaUSBCInitializeChip(devCtx);
+		LumiaUSBCClockRelease(devCtx, PepClockReasonInit);
+	}
+
+	// D0Exit stopped the PD timer, deadlines that passed meanwhile are handled now and it is rearmed
+	if (devCtx->PdEnabled) {
+		WdfWaitLockAcquire(devCtx->PdLock, NULL);
+		LumiaUSBCPdPoll(devCtx);
+		WdfWaitLockRelease(devCtx->PdLock);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS LumiaUSBCAssignIdleSettings(WDFDEVICE Device, ULONG timeoutMs, BOOLEAN enabled)
+{
+	WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS idleSettings;
+
+	WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
+		&idleSettings,
+		IdleCanWakeFromS0
+	);
+	idleSettings.IdleTimeoutType = DriverManagedIdleTimeout;
+	idleSettings.IdleTimeout = timeoutMs;
+	idleSettings.Enabled = enabled ? WdfTrue : WdfFalse;
+
+	return WdfDeviceAssignS0IdleSettings(
+		Device,
+		&idleSettings
+	);
+}
+
+NTSTATUS LumiaUSBCArmWakeFromS0(
+	WDFDEVICE Device
+)
+{
+	DeviceGetContext(Device)->ArmedForWake = TRUE;
+	return STATUS_SUCCESS;
+}
+
+void LumiaUSBCDisarmWakeFromS0(
+	WDFDEVICE Device
+)
+{
+	DeviceGetContext(Device)->ArmedForWake = FALSE;
+}
+
+NTSTATUS
+LumiaUSBCKmCreateDevice(
+    _Inout_ PWDFDEVICE_INIT DeviceInit
+    )
+/*++
+
+Routine Description:
+
+    Worker routine called to create a device and its software resources.
+
+Arguments:
+
+    DeviceInit - Pointer to an opaque init structure. Memory for this
+                    structure will be freed by the framework when the WdfDeviceCreate
+                    succeeds. So don't access the structure after that point.
 
 Return Value:
 
@@ -1234,6 +2960,12 @@ Return Value:
 {
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
 	WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
+	WDF_POWER_POLICY_EVENT_CALLBACKS powerPolicyCallbacks;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	ULONG softwareGoodCrc = 0;
+	PD_SINK_LIMITS sinkLimits;
+	ULONG data, pdDebounceMs;
     PDEVICE_CONTEXT deviceContext;
     WDFDEVICE device;
 	UCM_MANAGER_CONFIG ucmConfig;
@@ -1247,10 +2979,18 @@ Return Value:
 	pnpPowerCallbacks.EvtDeviceD0Entry = LumiaUSBCDeviceD0Entry;
 	pnpPowerCallbacks.EvtDeviceD0Exit = LumiaUSBCDeviceD0Exit;
 	pnpPowerCallbacks.EvtDeviceSelfManagedIoInit = LumiaUSBCSelfManagedIoInit;
-	//pnpPowerCallbacks.EvtDeviceSelfManagedIoRestart = Fdo_EvtDeviceSelfManagedIoRestart;
+	pnpPowerCallbacks.EvtDeviceSelfManagedIoRestart = LumiaUSBCSelfManagedIoRestart;
 	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
+	WDF_POWER_POLICY_EVENT_CALLBACKS_INIT(&powerPolicyCallbacks);
+	powerPolicyCallbacks.EvtDeviceArmWakeFromS0 = LumiaUSBCArmWakeFromS0;
+	powerPolicyCallbacks.EvtDeviceDisarmWakeFromS0 = LumiaUSBCDisarmWakeFromS0;
+	WdfDeviceInitSetPowerPolicyEventCallbacks(DeviceInit, &powerPolicyCallbacks);
+
+	WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, LumiaUSBCKmEvtIoInCallerContext);
+
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, DEVICE_CONTEXT);
+	deviceAttributes.EvtCleanupCallback = LumiaUSBCDeviceCleanup;
 
     status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
 
@@ -1272,6 +3012,193 @@ Return Value:
 		deviceContext->Device = device;
 		deviceContext->Connector = NULL;
 
+		// Counters are taken from here on
+		status = LumiaUSBCStatsCreate(deviceContext);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		// The UC120 clock is reference counted and released after a short hysteresis
+		deviceContext->ClockHysteresisMs = 10;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"ClockHysteresisMs",
+			REG_DWORD,
+			&deviceContext->ClockHysteresisMs,
+			sizeof(ULONG));
+		PepClockInitialize(&deviceContext->Clock, LumiaUSBCClockSet, deviceContext,
+			(ULONGLONG)deviceContext->ClockHysteresisMs * 10000);
+
+		// The PD FIFOs and interrupt bits are not confirmed yet, without this the port only does Type-C current
+		data = 0;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"PdEnable",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		deviceContext->PdEnabled = !!data;
+
+		// Whether the UC120 sends GoodCRC itself or leaves it to the protocol layer
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"PdSoftwareGoodCrc",
+			REG_DWORD,
+			&softwareGoodCrc,
+			sizeof(ULONG));
+		PdProtocolInitialize(&deviceContext->Pd, &LumiaUSBCPdPhy, deviceContext, !softwareGoodCrc);
+
+		// What the charger input accepts; ChargeCurrent used to be the fixed 5V PDO current
+		sinkLimits.MaxVoltageMv = 5000;
+		sinkLimits.MinVoltageMv = 4750;
+		sinkLimits.MaxCurrentMa = 3000;
+		if (NT_SUCCESS(MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"SinkMaxVoltageMv",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG))))
+		{
+			sinkLimits.MaxVoltageMv = data;
+		}
+		if (NT_SUCCESS(MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"ChargeCurrent",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG))))
+		{
+			sinkLimits.MaxCurrentMa = data;
+		}
+		// Nominal half clock period of the fake SPI bus, the stalls are calibrated against it
+		data = 1;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"BitBangHalfPeriodUs",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		BitBangInitialize(&deviceContext->BitBang, &LumiaUSBCBitBangOps, deviceContext, data);
+		SpiBusInitialize(&deviceContext->Bus);
+		KeInitializeEvent(&deviceContext->BusWake, SynchronizationEvent, FALSE);
+		KeInitializeEvent(&deviceContext->BusIdle, NotificationEvent, FALSE);
+		deviceContext->BusThread = NULL;
+		deviceContext->BusPaused = FALSE;
+		deviceContext->ReadStrategy = UC120_READ_STRATEGY_DEFAULT;
+		deviceContext->Stats->SpiReadStrategy = UC120_READ_STRATEGY_DEFAULT;
+
+		PdSinkInitialize(&deviceContext->Sink, &sinkLimits);
+		ConnectorReportInitialize(&deviceContext->Report);
+		PdAltModeInitialize(&deviceContext->AltMode);
+
+		// Initial power role, afterwards it follows EvtSetPowerRole and PR_Swap
+		data = 0;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"VbusEnable",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		deviceContext->SourceMode = !!data;
+		deviceContext->Pd.PowerRole = data ? PD_POWER_ROLE_SOURCE : PD_POWER_ROLE_SINK;
+
+		PdSourceInitialize(&deviceContext->Source, LumiaUSBCSourcePdos, ARRAYSIZE(LumiaUSBCSourcePdos));
+
+		// Partners asking us to power them are turned down unless configured otherwise
+		data = 0;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"PrSwapToSource",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		PdPrSwapInitialize(&deviceContext->Swap, LumiaUSBCSetVbus, deviceContext, !!data);
+
+		// Attach detection reads CC_STATUS, whose layout is not confirmed yet
+		data = 0;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"CcAttachDetection",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		deviceContext->CcAttachDetection = !!data;
+
+		// CC debounce times, the specification minimums unless configured otherwise
+		data = TYPEC_T_CC_DEBOUNCE_MS;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"CcDebounceMs",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		pdDebounceMs = TYPEC_T_PD_DEBOUNCE_MS;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"PdDebounceMs",
+			REG_DWORD,
+			&pdDebounceMs,
+			sizeof(ULONG));
+		CcDebounceInitialize(&deviceContext->CcDebounce, data, pdDebounceMs);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		status = WdfWaitLockCreate(&attributes, &deviceContext->ClockLock);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_TIMER_CONFIG_INIT(&timerConfig, LumiaUSBCClockTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+		status = WdfTimerCreate(&timerConfig, &attributes, &deviceContext->ClockTimer);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		status = WdfWaitLockCreate(&attributes, &deviceContext->PdLock);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		// Interrupt profiling is for finding out what the unknown interrupt lines do, off unless asked for
+		data = 0;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"InterruptProfiling",
+			REG_DWORD,
+			&data,
+			sizeof(ULONG));
+		deviceContext->ProfileInterrupts = !!data;
+		IrqProfileInitialize(&deviceContext->Profile);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		status = WdfWaitLockCreate(&attributes, &deviceContext->ProfileLock);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_TIMER_CONFIG_INIT(&timerConfig, LumiaUSBCPdTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+		status = WdfTimerCreate(&timerConfig, &attributes, &deviceContext->PdTimer);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		status = WdfWaitLockCreate(&attributes, &deviceContext->CcLock);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_TIMER_CONFIG_INIT(&timerConfig, LumiaUSBCCcTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+		status = WdfTimerCreate(&timerConfig, &attributes, &deviceContext->CcTimer);
+		if (!NT_SUCCESS(status))
+			return status;
+
 		UCM_MANAGER_CONFIG_INIT(&ucmConfig);
 		status = UcmInitializeDevice(device, &ucmConfig);
 		if (!NT_SUCCESS(status))
@@ -1292,18 +3219,25 @@ Return Value:
 			return status;
 		}*/
 
-		WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS  idleSettings;
-
-		WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
-			&idleSettings,
-			IdleCannotWakeFromS0
-		);
-		idleSettings.IdleTimeoutType = DriverManagedIdleTimeout;
+		// Idle while nothing is attached, the budget bounds how long a wake may take to report an attach
+		deviceContext->IdleTimeoutMs = 2000;
+		deviceContext->WakeLatencyBudgetMs = 250;
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"IdleTimeoutMs",
+			REG_DWORD,
+			&deviceContext->IdleTimeoutMs,
+			sizeof(ULONG));
+		MyReadRegistryValue(
+			(PCWSTR)L"\\Registry\\Machine\\System\\usbc",
+			(PCWSTR)L"WakeLatencyBudgetMs",
+			REG_DWORD,
+			&deviceContext->WakeLatencyBudgetMs,
+			sizeof(ULONG));
 
-		status = WdfDeviceAssignS0IdleSettings(
-			device,
-			&idleSettings
-		);
+		// Without attach detection the port is always reported attached and there is no detach to idle
+		// after. Idling would also close the VBUS and mux pins under a partner that may well be there.
+		status = LumiaUSBCAssignIdleSettings(device, deviceContext->IdleTimeoutMs, deviceContext->CcAttachDetection);
 		if (!NT_SUCCESS(status)) {
 			return status;
 		}
@@ -1312,7 +3246,7 @@ Return Value:
         // Create a device interface so that applications can find and talk
         // to us.
         //
-        /*status = WdfDeviceCreateDeviceInterface(
+        status = WdfDeviceCreateDeviceInterface(
             device,
             &GUID_DEVINTERFACE_LumiaUSBCKm,
             NULL // ReferenceString
@@ -1323,7 +3257,7 @@ Return Value:
             // Initialize the I/O Package and any Queues
             //
             status = LumiaUSBCKmQueueInitialize(device);
-        }*/
+        }
     }
 
     return status;
@@ -15,12 +15,65 @@ Environment:
 --*/
 
 #include "public.h"
+#include "Uc120.h"
+#include "Uc120Script.h"
+#include "InterruptTrace.h"
+#include "PepClock.h"
+#include "PdPolicy.h"
+#include "PdAltMode.h"
+#include "Mux.h"
+#include "BitBang.h"
+#include "SpiBus.h"
+#include "ConnectorReport.h"
+#include "CcDebounce.h"
+#include "EventQueue.h"
+#include "SeqLock.h"
+#include "IrqProfile.h"
+#include "Bitstream.h"
+#include "SnapshotStream.h"
 #include <UcmCx.h>
 
 EXTERN_C_START
 
 DEFINE_GUID(PowerControlGuid, 0x9942B45EL, 0x2C94, 0x41F3, 0xA1, 0x5C, 0xC1, 0xA5, 0x91, 0xC7, 4, 0x69);
 
+//
+// Counters live in the statistics block from public.h, which monitoring
+// clients map read-only. Updates are serialized by StatsLock and bracketed
+// by the block's sequence counter. The block is pageable, so they are made
+// at passive level only; the interrupts are all passive-level too.
+//
+#define STATS_BEGIN(ctx) \
+	do { WdfWaitLockAcquire((ctx)->StatsLock, NULL); SeqLockWriteBegin(&(ctx)->Stats->Sequence); } while (0)
+#define STATS_END(ctx) \
+	do { SeqLockWriteEnd(&(ctx)->Stats->Sequence); WdfWaitLockRelease((ctx)->StatsLock); } while (0)
+#define STATS_ADD(ctx, field, n) \
+	do { STATS_BEGIN(ctx); (ctx)->Stats->field += (int)(n); STATS_END(ctx); } while (0)
+#define STATS_SET(ctx, field, v) \
+	do { STATS_BEGIN(ctx); (ctx)->Stats->field = (int)(v); STATS_END(ctx); } while (0)
+#define STATS_MAX(ctx, field, v) \
+	do { \
+		STATS_BEGIN(ctx); \
+		if ((ctx)->Stats->field < (int)(v)) \
+			(ctx)->Stats->field = (int)(v); \
+		STATS_END(ctx); \
+	} while (0)
+
+//
+// GPIO writes happen on every bit-banged edge, too often for the lock, and
+// interrupts must not wait behind the bus thread holding it. They are
+// counted in the device context and moved into the block by whoever next
+// updates it, between STATS_BEGIN and STATS_END.
+//
+#define STATS_FLUSH(ctx) \
+	do { \
+		ULONG source_; \
+		(ctx)->Stats->GpioWritesIssued += InterlockedExchange(&(ctx)->GpioWritesIssued, 0); \
+		(ctx)->Stats->GpioWritesSuppressed += InterlockedExchange(&(ctx)->GpioWritesSuppressed, 0); \
+		for (source_ = 0; source_ < LUMIAUSBC_INTERRUPT_SOURCES; source_++) \
+			(ctx)->Stats->Interrupts[source_] += InterlockedExchange(&(ctx)->Interrupts[source_], 0); \
+	} while (0)
+
 //
 // The device context performs the same job as
 // a WDM device extension in the driver frameworks
@@ -32,6 +85,9 @@ typedef struct _DEVICE_CONTEXT
 	POHANDLE PoHandle;
 	LARGE_INTEGER SpiId;
 	WDFIOTARGET Spi;
+	UC120_READ_STRATEGY ReadStrategy;
+	// What the register scripts last read or wrote of the registers only the driver changes
+	UC120_SCRIPT_CACHE ScriptCache;
 	BOOLEAN UseFakeSpi;
 	LARGE_INTEGER FakeSpiMosiId;
 	WDFIOTARGET FakeSpiMosi;
@@ -41,6 +97,17 @@ typedef struct _DEVICE_CONTEXT
 	WDFIOTARGET FakeSpiCs;
 	LARGE_INTEGER FakeSpiClkId;
 	WDFIOTARGET FakeSpiClk;
+	BIT_BANG BitBang;
+	NTSTATUS BitBangStatus;
+	// Every register transfer, real or bit-banged, runs on one real-time thread that owns the bus
+	SPI_BUS Bus;
+	NTSTATUS BusStatus;
+	KEVENT BusWake;
+	PKTHREAD BusThread;
+	BOOLEAN BusStop;
+	// Set while the configuration image goes out, requests queue up and run once it is cleared
+	volatile BOOLEAN BusPaused;
+	KEVENT BusIdle;
 	LARGE_INTEGER VbusGpioId;
 	WDFIOTARGET VbusGpio;
 	LARGE_INTEGER PolGpioId;
@@ -52,15 +119,98 @@ typedef struct _DEVICE_CONTEXT
 	LARGE_INTEGER ResetGpioId;
 	WDFIOTARGET ResetGpio;
 	BOOLEAN HaveResetGpio;
+	// Configuration image read once from BitstreamPath, loaded whenever the chip lost power
+	WDFMEMORY BitstreamMemory;
+	const UCHAR *Bitstream;
+	ULONG BitstreamSize;
+	ULONG BitstreamChunk;
+	NTSTATUS BitstreamStatus;
+	// Optional connection listing Pol, Amsel and En on one controller, in MUX_PIN_* order
+	LARGE_INTEGER MuxGpioId;
+	WDFIOTARGET MuxGpio;
+	BOOLEAN HaveMuxGpio;
+	UCHAR MuxState;
+	BOOLEAN MuxStateValid;
+	// Pending for STATS_FLUSH
+	volatile LONG GpioWritesIssued;
+	volatile LONG GpioWritesSuppressed;
+	volatile LONG Interrupts[LUMIAUSBC_INTERRUPT_SOURCES];
 	WDFINTERRUPT PlugDetectInterrupt;
 	WDFINTERRUPT Uc120Interrupt;
+	// Written under PdLock
+	UC120_INTERRUPT_STATS InterruptStats;
 	WDFINTERRUPT MysteryInterrupt1;
 	WDFINTERRUPT MysteryInterrupt2;
+	// Opt-in, connects every interrupt resource and records them to find out what the unknown ones signal
+	BOOLEAN ProfileInterrupts;
+	IRQ_PROFILE Profile;
+	WDFWAITLOCK ProfileLock;
+	BOOLEAN SourceMode;
+	// Opt-in until the CC status register layout is confirmed. Without it the port is
+	// reported attached from bring-up on, as it always was.
+	BOOLEAN CcAttachDetection;
+	// Raw CC status goes through the debouncer before it changes Attached
+	CC_DEBOUNCE CcDebounce;
+	WDFWAITLOCK CcLock;
+	WDFTIMER CcTimer;
+	BOOLEAN Attached;
+	UC120_RP_LEVEL RpLevel;
+	UC120_ORIENTATION Orientation;
+	BOOLEAN IdleStopped;
+	BOOLEAN ArmedForWake;
+	BOOLEAN Idle;
+	// PoFx component idled in D0Exit, for runtime idle and system sleep alike
+	BOOLEAN ComponentIdle;
+	// Set when leaving D0 for a system sleep state, the chip is checked and set up again on return
+	BOOLEAN Reinitialize;
+	BOOLEAN WakePending;
+	ULONG IdleTimeoutMs;
+	ULONG WakeLatencyBudgetMs;
+	ULONGLONG IdleEnterTime;
+	ULONGLONG WakeTime;
+	PEP_CLOCK Clock;
+	WDFWAITLOCK ClockLock;
+	WDFTIMER ClockTimer;
+	ULONG ClockHysteresisMs;
+	// Opt-in until the PD FIFO registers and interrupt bits are confirmed
+	BOOLEAN PdEnabled;
+	PD_PROTOCOL Pd;
+	PD_SINK Sink;
+	PD_SOURCE Source;
+	PD_PR_SWAP Swap;
+	BOOLEAN PowerRoleRequested;
+	PD_ALT_MODE AltMode;
+	WDFWAITLOCK PdLock;
+	WDFTIMER PdTimer;
+	CONNECTOR_REPORT Report;
+	// Records for IOCTL_LUMIAUSBC_WAIT_EVENTS, and requests waiting for one
+	EVENT_QUEUE Events;
+	WDFWAITLOCK EventLock;
+	WDFQUEUE EventRequests;
+	// Points into a section that clients can map, or at StatsFallback if it could not be created
+	PLUMIAUSBC_STATISTICS Stats;
+	LUMIAUSBC_STATISTICS StatsFallback;
+	HANDLE StatsSection;
+	PVOID StatsView;
+	WDFWAITLOCK StatsLock;
+	// Every interrupt's register dump, delta encoded, for IOCTL_LUMIAUSBC_READ_SNAPSHOTS
+	SNAPSHOT_STREAM Snapshots;
+	WDFWAITLOCK SnapshotLock;
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
+//
+// Last value written through a GPIO connection, lets writes that would not
+// change the pins be skipped. Attached to every I/O target we open.
+//
+typedef struct _GPIO_SHADOW
+{
+	BOOLEAN Valid;
+	UCHAR Value;
+} GPIO_SHADOW, *PGPIO_SHADOW;
+
 typedef struct _CONNECTOR_CONTEXT
 {
-	int dummy;
+	WDFDEVICE Device;
 
 } CONNECTOR_CONTEXT, *PCONNECTOR_CONTEXT;
 
@@ -71,6 +221,7 @@ typedef struct _CONNECTOR_CONTEXT
 //
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONNECTOR_CONTEXT, ConnectorGetContext)
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(GPIO_SHADOW, GpioGetShadow)
 
 //
 // Function to initialize the device and its callbacks
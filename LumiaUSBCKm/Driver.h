@@ -19,6 +19,7 @@ Environment:
 #include <initguid.h>
 
 #include "device.h"
+#include "queue.h"
 #include "trace.h"
 
 EXTERN_C_START
@@ -0,0 +1,137 @@
+/*++
+
+Module Name:
+
+    eventqueue.c
+
+Abstract:
+
+    Connector event records and their batch format.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "EventQueue.h"
+
+void
+EventQueueInitialize(
+	PEVENT_QUEUE queue
+)
+{
+	// Sequence numbers start at one so a consumer can use zero for "none yet"
+	queue->Head = 0;
+	queue->Count = 0;
+	queue->Next = 1;
+	queue->Lost = 0;
+	queue->TotalLost = 0;
+	queue->Posted = 0;
+	queue->Batches = 0;
+}
+
+void
+EventQueuePost(
+	PEVENT_QUEUE queue,
+	unsigned int type,
+	unsigned long long time,
+	unsigned int data0,
+	unsigned int data1
+)
+{
+	LUMIAUSBC_EVENT_RECORD *record;
+
+	if (queue->Count == EVENT_QUEUE_DEPTH) {
+		queue->Head = (queue->Head + 1) % EVENT_QUEUE_DEPTH;
+		queue->Count--;
+		queue->Lost++;
+		queue->TotalLost++;
+	}
+
+	record = &queue->Records[(queue->Head + queue->Count) % EVENT_QUEUE_DEPTH];
+	queue->Count++;
+	record->Sequence = queue->Next;
+	record->Type = type;
+	record->Time = time;
+	record->Data[0] = data0;
+	record->Data[1] = data1;
+
+	queue->Next++;
+	if (!queue->Next)
+		queue->Next = 1;
+	queue->Posted++;
+}
+
+unsigned int
+EventQueueDrain(
+	PEVENT_QUEUE queue,
+	void *buffer,
+	unsigned int length
+)
+{
+	LUMIAUSBC_EVENT_BATCH *batch = (LUMIAUSBC_EVENT_BATCH *)buffer;
+	unsigned int capacity, count, i;
+
+	if (length < LUMIAUSBC_EVENT_BATCH_SIZE(1))
+		return 0;
+
+	capacity = (unsigned int)((length - LUMIAUSBC_EVENT_BATCH_SIZE(1)) / sizeof(LUMIAUSBC_EVENT_RECORD)) + 1;
+	count = EventQueuePending(queue);
+	if (count > capacity)
+		count = capacity;
+
+	batch->Version = LUMIAUSBC_EVENT_VERSION;
+	batch->Count = count;
+	batch->Lost = queue->Lost;
+	batch->Reserved = 0;
+
+	for (i = 0; i < count; i++) {
+		batch->Records[i] = queue->Records[queue->Head];
+		queue->Head = (queue->Head + 1) % EVENT_QUEUE_DEPTH;
+	}
+	queue->Count -= count;
+
+	queue->Lost = 0;
+	queue->Batches++;
+
+	return (unsigned int)LUMIAUSBC_EVENT_BATCH_SIZE(count ? count : 1);
+}
+
+int
+EventBatchParse(
+	const void *buffer,
+	unsigned int length,
+	unsigned int *expected,
+	unsigned int *missed
+)
+{
+	const LUMIAUSBC_EVENT_BATCH *batch = (const LUMIAUSBC_EVENT_BATCH *)buffer;
+	unsigned int i, sequence;
+
+	*missed = 0;
+
+	if (length < LUMIAUSBC_EVENT_BATCH_SIZE(1) || batch->Version != LUMIAUSBC_EVENT_VERSION ||
+		!batch->Count || length < LUMIAUSBC_EVENT_BATCH_SIZE(batch->Count))
+		return -1;
+
+	for (i = 0; i < batch->Count; i++) {
+		sequence = batch->Records[i].Sequence;
+		if (!sequence)
+			return -1;
+
+		if (*expected && sequence != *expected) {
+			// Numbers only move forward, anything else is not from this queue
+			if (sequence - *expected > 0x7FFFFFFF)
+				return -1;
+			// Zero is skipped when the numbers wrap
+			*missed += sequence - *expected - (sequence < *expected ? 1 : 0);
+		}
+
+		*expected = sequence + 1;
+		if (!*expected)
+			*expected = 1;
+	}
+
+	return (int)batch->Count;
+}
@@ -0,0 +1,86 @@
+/*++
+
+Module Name:
+
+    eventqueue.h
+
+Abstract:
+
+    Connector events waiting to be picked up by user mode. The queue keeps
+    the newest records, numbering each one, and lays them out in the
+    LUMIAUSBC_EVENT_BATCH format from public.h. There are no kernel
+    dependencies, so consumers can check the format against the same code.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Public.h"
+
+// Records kept while nobody is reading, the oldest are dropped beyond that
+#define EVENT_QUEUE_DEPTH 64
+
+typedef struct _EVENT_QUEUE
+{
+	LUMIAUSBC_EVENT_RECORD Records[EVENT_QUEUE_DEPTH];
+
+	// Ring position of the oldest unread record and how many there are
+	unsigned int Head;
+	unsigned int Count;
+	// Sequence number for the next record, never zero
+	unsigned int Next;
+
+	// Dropped since the last batch, and since the start
+	unsigned int Lost;
+	unsigned long TotalLost;
+	unsigned long Posted;
+	unsigned long Batches;
+} EVENT_QUEUE, *PEVENT_QUEUE;
+
+void
+EventQueueInitialize(
+	PEVENT_QUEUE queue
+);
+
+void
+EventQueuePost(
+	PEVENT_QUEUE queue,
+	unsigned int type,
+	unsigned long long time,
+	unsigned int data0,
+	unsigned int data1
+);
+
+static __inline unsigned int EventQueuePending(const EVENT_QUEUE *queue)
+{
+	return queue->Count;
+}
+
+//
+// Moves as many of the oldest records as fit into buffer as a batch.
+// Returns the bytes written, zero if length cannot hold a single record.
+//
+unsigned int
+EventQueueDrain(
+	PEVENT_QUEUE queue,
+	void *buffer,
+	unsigned int length
+);
+
+//
+// For consumers: checks a completed batch of length bytes and returns its
+// record count, or -1 if it is malformed. *expected holds the sequence
+// number the batch should start at, zero for any, and is advanced past
+// it; *missed receives how many records never arrived before it.
+//
+int
+EventBatchParse(
+	const void *buffer,
+	unsigned int length,
+	unsigned int *expected,
+	unsigned int *missed
+);
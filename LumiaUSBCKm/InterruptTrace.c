@@ -0,0 +1,42 @@
+/*++
+
+Module Name:
+
+    interrupttrace.c
+
+Abstract:
+
+    Per-interrupt trace messages of the interrupt work items.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include <ntddk.h>
+#include "Uc120.h"
+#include "InterruptTrace.h"
+#include "Trace.h"
+#include "InterruptTrace.tmh"
+
+void LumiaUSBCTraceUc120Interrupt(void)
+{
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_INTERRUPT, "Got an interrupt from the UC120");
+}
+
+void LumiaUSBCTraceUc120Dump(const unsigned char *registers, const NTSTATUS *statuses)
+{
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_INTERRUPT, "UC120_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x",
+		registers[0], registers[1], registers[UC120_SNAPSHOT_INTERRUPT_STATUS], registers[3], registers[4], registers[5], registers[6], registers[7]);
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_INTERRUPT, "S_UC120 %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS!",
+		statuses[0], statuses[1], statuses[UC120_SNAPSHOT_INTERRUPT_STATUS], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
+}
+
+void LumiaUSBCTracePlugDetDump(const unsigned char *registers, const NTSTATUS *statuses)
+{
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_INTERRUPT, "PLUGDET_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x",
+		registers[0], registers[1], registers[UC120_SNAPSHOT_INTERRUPT_STATUS], registers[3], registers[4], registers[5], registers[6], registers[7]);
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_INTERRUPT, "S_PLUGDET %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS! %!STATUS!",
+		statuses[0], statuses[1], statuses[UC120_SNAPSHOT_INTERRUPT_STATUS], statuses[3], statuses[4], statuses[5], statuses[6], statuses[7]);
+}
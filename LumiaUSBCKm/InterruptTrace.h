@@ -0,0 +1,27 @@
+/*++
+
+Module Name:
+
+    interrupttrace.h
+
+Abstract:
+
+    The messages the interrupt work items log on every interrupt. They
+    live in a file of their own, built against nothing but ntddk.h and
+    the WPP header, so the host trace benchmark compiles these exact
+    call sites.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#pragma once
+
+// Entry into Uc120InterruptWorkItem
+void LumiaUSBCTraceUc120Interrupt(void);
+
+// The register snapshot each work item read, and the status of each read
+void LumiaUSBCTraceUc120Dump(const unsigned char *registers, const NTSTATUS *statuses);
+void LumiaUSBCTracePlugDetDump(const unsigned char *registers, const NTSTATUS *statuses);
@@ -0,0 +1,205 @@
+/*++
+
+Module Name:
+
+    irqprofile.c
+
+Abstract:
+
+    Interrupt recording and rate, burst and correlation analysis.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "IrqProfile.h"
+
+void
+IrqProfileInitialize(
+	PIRQ_PROFILE profile
+)
+{
+	unsigned int i;
+
+	profile->Recorded = 0;
+
+	for (i = 0; i < IRQ_PROFILE_SOURCES; i++) {
+		profile->Interrupts[i] = 0;
+		profile->LastUs[i] = 0;
+		profile->Burst[i] = 0;
+	}
+}
+
+static void IrqProfileRecord(PIRQ_PROFILE profile, unsigned char source, unsigned char status, unsigned int nowUs)
+{
+	IRQ_PROFILE_RECORD *record = &profile->Records[profile->Recorded % IRQ_PROFILE_DEPTH];
+
+	record->TimeUs = nowUs;
+	record->Source = source;
+	record->Status = status;
+	record->Reserved = 0;
+	profile->Recorded++;
+}
+
+unsigned int
+IrqProfileInterrupt(
+	PIRQ_PROFILE profile,
+	unsigned int source,
+	unsigned int nowUs
+)
+{
+	if (source >= IRQ_PROFILE_SOURCES)
+		return 0;
+
+	if (profile->Interrupts[source] && nowUs - profile->LastUs[source] <= IRQ_PROFILE_BURST_GAP_US)
+		profile->Burst[source]++;
+	else
+		profile->Burst[source] = 1;
+
+	profile->Interrupts[source]++;
+	profile->LastUs[source] = nowUs;
+	IrqProfileRecord(profile, (unsigned char)source, 0, nowUs);
+
+	return profile->Burst[source];
+}
+
+void
+IrqProfileStatus(
+	PIRQ_PROFILE profile,
+	unsigned char status,
+	unsigned int nowUs
+)
+{
+	if (status)
+		IrqProfileRecord(profile, IRQ_PROFILE_STATUS, status, nowUs);
+}
+
+unsigned int
+IrqProfileDump(
+	const IRQ_PROFILE *profile,
+	IRQ_PROFILE_RECORD *records,
+	unsigned int capacity
+)
+{
+	unsigned long first;
+	unsigned int count, i;
+
+	count = profile->Recorded < IRQ_PROFILE_DEPTH ? (unsigned int)profile->Recorded : IRQ_PROFILE_DEPTH;
+	if (count > capacity)
+		count = capacity;
+
+	first = profile->Recorded - count;
+	for (i = 0; i < count; i++)
+		records[i] = profile->Records[(first + i) % IRQ_PROFILE_DEPTH];
+
+	return count;
+}
+
+void
+IrqProfileAnalyze(
+	const IRQ_PROFILE_RECORD *records,
+	unsigned int count,
+	unsigned int burstGapUs,
+	unsigned int windowUs,
+	IRQ_PROFILE_RESULT *result
+)
+{
+	IRQ_PROFILE_SOURCE_RESULT *source;
+	unsigned int firstUs[IRQ_PROFILE_SOURCES], lastUs[IRQ_PROFILE_SOURCES], burst[IRQ_PROFILE_SOURCES];
+	unsigned int i, j, bit, spanUs;
+	unsigned char bits;
+	int seen;
+
+	for (i = 0; i < IRQ_PROFILE_SOURCES; i++) {
+		source = &result->Sources[i];
+		source->Interrupts = 0;
+		source->RateMilliHz = 0;
+		source->Bursts = 0;
+		source->MaxBurst = 0;
+		source->Unrelated = 0;
+		for (bit = 0; bit < 8; bit++)
+			source->Correlated[bit] = 0;
+		firstUs[i] = lastUs[i] = burst[i] = 0;
+	}
+	result->StatusRecords = 0;
+
+	for (i = 0; i < count; i++) {
+		if (records[i].Source == IRQ_PROFILE_STATUS) {
+			result->StatusRecords++;
+			continue;
+		}
+		if (records[i].Source >= IRQ_PROFILE_SOURCES)
+			continue;
+
+		source = &result->Sources[records[i].Source];
+
+		if (source->Interrupts && records[i].TimeUs - lastUs[records[i].Source] <= burstGapUs) {
+			burst[records[i].Source]++;
+		}
+		else {
+			burst[records[i].Source] = 1;
+			source->Bursts++;
+		}
+		if (burst[records[i].Source] > source->MaxBurst)
+			source->MaxBurst = burst[records[i].Source];
+
+		if (!source->Interrupts)
+			firstUs[records[i].Source] = records[i].TimeUs;
+		lastUs[records[i].Source] = records[i].TimeUs;
+		source->Interrupts++;
+
+		// Status records on either side, the register is usually read after the interrupt but may race it
+		bits = 0;
+		seen = 0;
+		for (j = i; j-- > 0 && records[i].TimeUs - records[j].TimeUs <= windowUs; ) {
+			if (records[j].Source == IRQ_PROFILE_STATUS) {
+				bits |= records[j].Status;
+				seen = 1;
+			}
+		}
+		for (j = i + 1; j < count && records[j].TimeUs - records[i].TimeUs <= windowUs; j++) {
+			if (records[j].Source == IRQ_PROFILE_STATUS) {
+				bits |= records[j].Status;
+				seen = 1;
+			}
+		}
+
+		if (!seen)
+			source->Unrelated++;
+		for (bit = 0; bit < 8; bit++) {
+			if (bits & (1 << bit))
+				source->Correlated[bit]++;
+		}
+	}
+
+	for (i = 0; i < IRQ_PROFILE_SOURCES; i++) {
+		source = &result->Sources[i];
+		spanUs = lastUs[i] - firstUs[i];
+		if (source->Interrupts > 1 && spanUs)
+			source->RateMilliHz = (unsigned int)((unsigned long long)(source->Interrupts - 1) * 1000000000ULL / spanUs);
+	}
+}
+
+int
+IrqProfileBestBit(
+	const IRQ_PROFILE_SOURCE_RESULT *source,
+	unsigned int *percent
+)
+{
+	int best = -1;
+	unsigned int bit;
+
+	*percent = 0;
+
+	for (bit = 0; bit < 8; bit++) {
+		if (source->Correlated[bit] && (best < 0 || source->Correlated[bit] > source->Correlated[best]))
+			best = (int)bit;
+	}
+
+	if (best >= 0)
+		*percent = source->Correlated[best] * 100 / source->Interrupts;
+
+	return best;
+}
@@ -0,0 +1,129 @@
+/*++
+
+Module Name:
+
+    irqprofile.h
+
+Abstract:
+
+    Interrupt profiling for lines whose purpose is unknown. Interrupts and
+    the UC120 status bits they led to are recorded with their times, and
+    the analysis works out how often each line fires, in what bursts, and
+    which status bits tend to come with it. The record layout is fixed so
+    the analysis can be run again on a dump from the registry. There are
+    no kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+// Sources are numbered as LUMIAUSBC_INTERRUPT_* in public.h
+#define IRQ_PROFILE_SOURCES 4
+// Source of a record holding UC120 interrupt status bits rather than an interrupt
+#define IRQ_PROFILE_STATUS  0xFF
+
+#define IRQ_PROFILE_DEPTH 512
+
+// Interrupts closer together than this belong to one burst
+#define IRQ_PROFILE_BURST_GAP_US 1000
+// Status bits seen this close to an interrupt count as coming with it
+#define IRQ_PROFILE_WINDOW_US    5000
+// A burst this long is a line nobody acknowledges, it has to be shut off
+#define IRQ_PROFILE_STORM_BURST  1000
+
+typedef struct _IRQ_PROFILE_RECORD
+{
+	// Microseconds, wrapping
+	unsigned int TimeUs;
+	unsigned char Source;
+	unsigned char Status;
+	unsigned short Reserved;
+} IRQ_PROFILE_RECORD;
+
+typedef struct _IRQ_PROFILE
+{
+	IRQ_PROFILE_RECORD Records[IRQ_PROFILE_DEPTH];
+	// Records made so far, the newest is at (Recorded - 1) % IRQ_PROFILE_DEPTH
+	unsigned long Recorded;
+
+	unsigned long Interrupts[IRQ_PROFILE_SOURCES];
+	unsigned int LastUs[IRQ_PROFILE_SOURCES];
+	unsigned int Burst[IRQ_PROFILE_SOURCES];
+} IRQ_PROFILE, *PIRQ_PROFILE;
+
+typedef struct _IRQ_PROFILE_SOURCE_RESULT
+{
+	unsigned int Interrupts;
+	// Interrupts per 1000 seconds between the first and the last one
+	unsigned int RateMilliHz;
+	unsigned int Bursts;
+	unsigned int MaxBurst;
+	// Interrupts with a status record carrying the bit within the window
+	unsigned int Correlated[8];
+	// Interrupts with no status record within the window at all
+	unsigned int Unrelated;
+} IRQ_PROFILE_SOURCE_RESULT;
+
+typedef struct _IRQ_PROFILE_RESULT
+{
+	IRQ_PROFILE_SOURCE_RESULT Sources[IRQ_PROFILE_SOURCES];
+	unsigned int StatusRecords;
+} IRQ_PROFILE_RESULT;
+
+void
+IrqProfileInitialize(
+	PIRQ_PROFILE profile
+);
+
+//
+// Records an interrupt, returns the length of the burst it is part of
+//
+unsigned int
+IrqProfileInterrupt(
+	PIRQ_PROFILE profile,
+	unsigned int source,
+	unsigned int nowUs
+);
+
+void
+IrqProfileStatus(
+	PIRQ_PROFILE profile,
+	unsigned char status,
+	unsigned int nowUs
+);
+
+//
+// Copies the records still held, oldest first, returns how many
+//
+unsigned int
+IrqProfileDump(
+	const IRQ_PROFILE *profile,
+	IRQ_PROFILE_RECORD *records,
+	unsigned int capacity
+);
+
+//
+// Works out the results from records in the order they were made
+//
+void
+IrqProfileAnalyze(
+	const IRQ_PROFILE_RECORD *records,
+	unsigned int count,
+	unsigned int burstGapUs,
+	unsigned int windowUs,
+	IRQ_PROFILE_RESULT *result
+);
+
+//
+// The status bit most often seen with a source's interrupts, -1 if none,
+// and the percentage of its interrupts it came with
+//
+int
+IrqProfileBestBit(
+	const IRQ_PROFILE_SOURCE_RESULT *source,
+	unsigned int *percent
+);
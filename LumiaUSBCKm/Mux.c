@@ -0,0 +1,67 @@
+/*++
+
+Module Name:
+
+    mux.c
+
+Abstract:
+
+    Planning of SuperSpeed mux reconfigurations.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Mux.h"
+
+unsigned int
+MuxPlanTransition(
+	unsigned char current,
+	unsigned char target,
+	int atomic,
+	MUX_STEP *steps
+)
+{
+	static const unsigned char configPins[] = { MUX_PIN_POL, MUX_PIN_AMSEL };
+	unsigned char state = current & MUX_PINS_ALL;
+	unsigned int i, count = 0;
+
+	target &= MUX_PINS_ALL;
+
+	if (state == target)
+		return 0;
+
+	// All pins switch in the same instant, nothing in between can be seen
+	if (atomic) {
+		steps[0].Mask = MUX_PINS_ALL;
+		steps[0].Value = target;
+		return 1;
+	}
+
+	// Break before make: never move the selects while the lanes are connected
+	if ((state & MUX_PIN_EN) && ((state ^ target) & MUX_PINS_CONFIG)) {
+		steps[count].Mask = MUX_PIN_EN;
+		steps[count].Value = 0;
+		state &= ~MUX_PIN_EN;
+		count++;
+	}
+
+	for (i = 0; i < sizeof(configPins); i++) {
+		if ((state ^ target) & configPins[i]) {
+			steps[count].Mask = configPins[i];
+			steps[count].Value = target & configPins[i];
+			state ^= configPins[i];
+			count++;
+		}
+	}
+
+	if ((state ^ target) & MUX_PIN_EN) {
+		steps[count].Mask = MUX_PIN_EN;
+		steps[count].Value = target & MUX_PIN_EN;
+		count++;
+	}
+
+	return count;
+}
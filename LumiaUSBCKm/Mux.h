@@ -0,0 +1,65 @@
+/*++
+
+Module Name:
+
+    mux.h
+
+Abstract:
+
+    Planning of SuperSpeed mux reconfigurations. The mux is controlled by
+    the polarity, alternate mode select and enable pins; this works out
+    the pin writes that take it from one state to another without ever
+    passing lanes through a configuration that is neither the old nor the
+    new one. No kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+//
+// Mux state bits. When the pins share a GPIO connection they are listed
+// in this order, so the state is also the value written to it.
+//
+#define MUX_PIN_POL     0x01
+#define MUX_PIN_AMSEL   0x02
+#define MUX_PIN_EN      0x04
+
+#define MUX_PINS_CONFIG (MUX_PIN_POL | MUX_PIN_AMSEL)
+#define MUX_PINS_ALL    (MUX_PINS_CONFIG | MUX_PIN_EN)
+
+#define MUX_MAX_STEPS   4
+
+typedef struct _MUX_STEP
+{
+	// Pins written by this step, all of them at once for an atomic write
+	unsigned char Mask;
+	unsigned char Value;
+} MUX_STEP;
+
+//
+// Fills steps with the writes taking the mux from current to target and
+// returns their number. With atomic set all pins are written together.
+//
+unsigned int
+MuxPlanTransition(
+	unsigned char current,
+	unsigned char target,
+	int atomic,
+	MUX_STEP *steps
+);
+
+//
+// Returns nonzero if state may be seen on the way from one state to another:
+// the mux is disabled, or enabled with either the old or the new configuration.
+//
+static __inline int MuxStateIsLegal(unsigned char state, unsigned char from, unsigned char to)
+{
+	if (!(state & MUX_PIN_EN))
+		return 1;
+
+	return state == from || (state & MUX_PINS_CONFIG) == (to & MUX_PINS_CONFIG);
+}
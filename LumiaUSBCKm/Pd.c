@@ -0,0 +1,218 @@
+/*++
+
+Module Name:
+
+    pd.c
+
+Abstract:
+
+    USB Power Delivery protocol layer.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Pd.h"
+
+void
+PdProtocolInitialize(
+	PPD_PROTOCOL protocol,
+	const PD_PHY_OPS *phy,
+	void *context,
+	int autoGoodCrc
+)
+{
+	protocol->Phy = phy;
+	protocol->Context = context;
+	protocol->AutoGoodCrc = autoGoodCrc;
+	protocol->PowerRole = PD_POWER_ROLE_SINK;
+	protocol->DataRole = PD_DATA_ROLE_UFP;
+	protocol->SpecRevision = PD_SPEC_REV_2_0;
+	protocol->TxMessages = 0;
+	protocol->TxRetries = 0;
+	protocol->TxFailures = 0;
+	protocol->HardResets = 0;
+	protocol->RxMessages = 0;
+	protocol->RxDuplicates = 0;
+	protocol->RxDropped = 0;
+
+	PdProtocolReset(protocol);
+}
+
+void
+PdProtocolReset(
+	PPD_PROTOCOL protocol
+)
+{
+	protocol->TxMessageId = 0;
+	protocol->RxMessageId = -1;
+	protocol->Rx.Head = 0;
+	protocol->Rx.Tail = 0;
+}
+
+int
+PdProtocolHardReset(
+	PPD_PROTOCOL protocol
+)
+{
+	int sent = protocol->Phy->HardReset ? protocol->Phy->HardReset(protocol->Context) : 0;
+
+	protocol->HardResets++;
+	PdProtocolReset(protocol);
+
+	return sent;
+}
+
+PPD_MESSAGE
+PdProtocolTxBuffer(
+	PPD_PROTOCOL protocol
+)
+{
+	return &protocol->Tx;
+}
+
+static void PdProtocolFrame(PPD_PROTOCOL protocol, PPD_MESSAGE message, unsigned int type, unsigned int id, unsigned int count)
+{
+	unsigned short header = PD_HEADER(type, protocol->DataRole, protocol->SpecRevision, protocol->PowerRole, id, count);
+
+	message->Length = (unsigned char)(2 + 4 * count);
+	message->Header[0] = (unsigned char)header;
+	message->Header[1] = (unsigned char)(header >> 8);
+}
+
+PD_TX_RESULT
+PdProtocolTransmit(
+	PPD_PROTOCOL protocol,
+	unsigned int type,
+	unsigned int count
+)
+{
+	PD_TX_RESULT result = PdTxFailed;
+	unsigned int retries = protocol->SpecRevision >= PD_SPEC_REV_3_0 ? PD_N_RETRY_COUNT_REV30 : PD_N_RETRY_COUNT_REV20;
+	unsigned int attempt;
+
+	if (count == 0 && type == PD_CTRL_SOFT_RESET) {
+		protocol->TxMessageId = 0;
+		protocol->RxMessageId = -1;
+	}
+
+	PdProtocolFrame(protocol, &protocol->Tx, type, protocol->TxMessageId, count);
+
+	// Retransmit with the same MessageID until GoodCRC or nRetryCount is exhausted
+	for (attempt = 0; attempt <= retries; attempt++) {
+		if (attempt)
+			protocol->TxRetries++;
+
+		if (!protocol->Phy->Transmit(protocol->Context, (const unsigned char *)&protocol->Tx, 1 + protocol->Tx.Length))
+			continue;
+
+		result = protocol->Phy->WaitTransmit(protocol->Context, PD_T_RECEIVE_US);
+		if (result != PdTxFailed)
+			break;
+	}
+
+	if (result == PdTxSuccess) {
+		protocol->TxMessages++;
+		protocol->TxMessageId = (protocol->TxMessageId + 1) & 7;
+	}
+	else if (result == PdTxFailed) {
+		protocol->TxFailures++;
+	}
+
+	return result;
+}
+
+PPD_MESSAGE
+PdProtocolRxSlot(
+	PPD_PROTOCOL protocol
+)
+{
+	PPD_RING ring = &protocol->Rx;
+
+	if (ring->Head - ring->Tail >= PD_RING_SIZE)
+		return 0;
+
+	return &ring->Messages[ring->Head % PD_RING_SIZE];
+}
+
+int
+PdProtocolRxCommit(
+	PPD_PROTOCOL protocol
+)
+{
+	PPD_RING ring = &protocol->Rx;
+	PPD_MESSAGE message = &ring->Messages[ring->Head % PD_RING_SIZE];
+	PD_MESSAGE goodCrc;
+	unsigned short header;
+	unsigned int type, count, id;
+
+	if (message->Length < 2 || message->Length > PD_MESSAGE_FRAME_SIZE - 1) {
+		protocol->RxDropped++;
+		return 0;
+	}
+
+	header = PdMessageHeader(message);
+	type = PD_HEADER_TYPE(header);
+	count = PD_HEADER_COUNT(header);
+	id = PD_HEADER_ID(header);
+
+	if (message->Length != 2 + 4 * count || PD_HEADER_EXTENDED(header)) {
+		protocol->RxDropped++;
+		return 0;
+	}
+
+	// GoodCRC belongs to the transmit path, the PHY reports it there
+	if (count == 0 && type == PD_CTRL_GOODCRC)
+		return 0;
+
+	if (!protocol->AutoGoodCrc) {
+		PdProtocolFrame(protocol, &goodCrc, PD_CTRL_GOODCRC, id, 0);
+		protocol->Phy->Transmit(protocol->Context, (const unsigned char *)&goodCrc, 1 + goodCrc.Length);
+	}
+
+	if (count == 0 && type == PD_CTRL_SOFT_RESET) {
+		protocol->TxMessageId = 0;
+		protocol->RxMessageId = -1;
+	}
+	else if ((int)id == protocol->RxMessageId) {
+		// A retransmission of a message we already acknowledged
+		protocol->RxDuplicates++;
+		return 0;
+	}
+
+	protocol->RxMessageId = (int)id;
+
+	// Follow the partner down to the lower revision
+	if (PD_HEADER_SPEC_REV(header) < protocol->SpecRevision && PD_HEADER_SPEC_REV(header) != 0)
+		protocol->SpecRevision = (unsigned char)PD_HEADER_SPEC_REV(header);
+
+	protocol->RxMessages++;
+	ring->Head++;
+	return 1;
+}
+
+PPD_MESSAGE
+PdProtocolRxPeek(
+	PPD_PROTOCOL protocol
+)
+{
+	PPD_RING ring = &protocol->Rx;
+
+	if (ring->Head == ring->Tail)
+		return 0;
+
+	return &ring->Messages[ring->Tail % PD_RING_SIZE];
+}
+
+void
+PdProtocolRxConsume(
+	PPD_PROTOCOL protocol
+)
+{
+	PPD_RING ring = &protocol->Rx;
+
+	if (ring->Head != ring->Tail)
+		ring->Tail++;
+}
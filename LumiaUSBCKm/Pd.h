@@ -0,0 +1,242 @@
+/*++
+
+Module Name:
+
+    pd.h
+
+Abstract:
+
+    USB Power Delivery protocol layer. Messages are kept in preallocated
+    buffers laid out exactly like the UC120 PD FIFO frames, so the PHY
+    can burst them in and out without intermediate copies. The PHY is
+    reached through callbacks, so the layer also runs against a
+    simulated PHY outside the kernel.
+
+    The structures are not synchronized, callers serialize access.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+//
+// Message header fields
+//
+#define PD_HEADER_TYPE(h)        ((h) & 0x1F)
+#define PD_HEADER_DATA_ROLE(h)   (((h) >> 5) & 1)
+#define PD_HEADER_SPEC_REV(h)    (((h) >> 6) & 3)
+#define PD_HEADER_POWER_ROLE(h)  (((h) >> 8) & 1)
+#define PD_HEADER_ID(h)          (((h) >> 9) & 7)
+#define PD_HEADER_COUNT(h)       (((h) >> 12) & 7)
+#define PD_HEADER_EXTENDED(h)    (((h) >> 15) & 1)
+
+#define PD_HEADER(type, dataRole, specRev, powerRole, id, count) \
+	((unsigned short)(((type) & 0x1F) | (((dataRole) & 1) << 5) | (((specRev) & 3) << 6) | \
+	(((powerRole) & 1) << 8) | (((id) & 7) << 9) | (((count) & 7) << 12)))
+
+#define PD_SPEC_REV_2_0 1
+#define PD_SPEC_REV_3_0 2
+
+#define PD_POWER_ROLE_SINK   0
+#define PD_POWER_ROLE_SOURCE 1
+#define PD_DATA_ROLE_UFP     0
+#define PD_DATA_ROLE_DFP     1
+
+//
+// Control messages (no data objects)
+//
+#define PD_CTRL_GOODCRC          0x01
+#define PD_CTRL_GOTOMIN          0x02
+#define PD_CTRL_ACCEPT           0x03
+#define PD_CTRL_REJECT           0x04
+#define PD_CTRL_PING             0x05
+#define PD_CTRL_PS_RDY           0x06
+#define PD_CTRL_GET_SOURCE_CAP   0x07
+#define PD_CTRL_GET_SINK_CAP     0x08
+#define PD_CTRL_DR_SWAP          0x09
+#define PD_CTRL_PR_SWAP          0x0A
+#define PD_CTRL_VCONN_SWAP       0x0B
+#define PD_CTRL_WAIT             0x0C
+#define PD_CTRL_SOFT_RESET       0x0D
+#define PD_CTRL_NOT_SUPPORTED    0x10
+
+//
+// Data messages
+//
+#define PD_DATA_SOURCE_CAPABILITIES 0x01
+#define PD_DATA_REQUEST             0x02
+#define PD_DATA_BIST                0x03
+#define PD_DATA_SINK_CAPABILITIES   0x04
+#define PD_DATA_VENDOR_DEFINED      0x0F
+
+#define PD_MAX_DATA_OBJECTS 7
+
+//
+// Timing and retry values from the specification
+//
+#define PD_T_RECEIVE_US          1100
+#define PD_N_RETRY_COUNT_REV20   3
+#define PD_N_RETRY_COUNT_REV30   2
+
+//
+// A message as framed by the UC120 PD FIFO: a byte count followed by the
+// little endian header and data objects.
+//
+typedef struct _PD_MESSAGE
+{
+	unsigned char Length;
+	unsigned char Header[2];
+	unsigned char Data[4 * PD_MAX_DATA_OBJECTS];
+} PD_MESSAGE, *PPD_MESSAGE;
+
+#define PD_MESSAGE_FRAME_SIZE (1 + 2 + 4 * PD_MAX_DATA_OBJECTS)
+
+#define PD_RING_SIZE 8
+
+typedef struct _PD_RING
+{
+	PD_MESSAGE Messages[PD_RING_SIZE];
+	unsigned int Head;
+	unsigned int Tail;
+} PD_RING, *PPD_RING;
+
+typedef enum _PD_TX_RESULT
+{
+	PdTxSuccess,
+	PdTxFailed,
+	PdTxDiscarded
+} PD_TX_RESULT;
+
+typedef struct _PD_PHY_OPS
+{
+	// Sends a complete frame in a single transaction
+	int (*Transmit)(void *context, const unsigned char *frame, unsigned int length);
+	// Waits up to timeoutUs for the partner's GoodCRC
+	PD_TX_RESULT (*WaitTransmit)(void *context, unsigned int timeoutUs);
+	// Signals Hard Reset, null if the PHY has no way to
+	int (*HardReset)(void *context);
+} PD_PHY_OPS;
+
+typedef struct _PD_PROTOCOL
+{
+	const PD_PHY_OPS *Phy;
+	void *Context;
+
+	// Set if the PHY answers received messages with GoodCRC by itself
+	int AutoGoodCrc;
+
+	unsigned char PowerRole;
+	unsigned char DataRole;
+	unsigned char SpecRevision;
+	unsigned char TxMessageId;
+	int RxMessageId;
+
+	PD_RING Rx;
+	PD_MESSAGE Tx;
+
+	unsigned long TxMessages;
+	unsigned long TxRetries;
+	unsigned long TxFailures;
+	unsigned long HardResets;
+	unsigned long RxMessages;
+	unsigned long RxDuplicates;
+	unsigned long RxDropped;
+} PD_PROTOCOL, *PPD_PROTOCOL;
+
+static __inline unsigned short PdMessageHeader(const PD_MESSAGE *message)
+{
+	return (unsigned short)(message->Header[0] | (message->Header[1] << 8));
+}
+
+static __inline unsigned long PdMessageObject(const PD_MESSAGE *message, unsigned int index)
+{
+	const unsigned char *p = message->Data + 4 * index;
+
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static __inline void PdMessageSetObject(PD_MESSAGE *message, unsigned int index, unsigned long value)
+{
+	unsigned char *p = message->Data + 4 * index;
+
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+void
+PdProtocolInitialize(
+	PPD_PROTOCOL protocol,
+	const PD_PHY_OPS *phy,
+	void *context,
+	int autoGoodCrc
+);
+
+//
+// Resets message IDs and drops queued messages, on attach, detach or reset
+//
+void
+PdProtocolReset(
+	PPD_PROTOCOL protocol
+);
+
+//
+// Signals Hard Reset and resets the layer. Returns nonzero if the PHY sent it.
+//
+int
+PdProtocolHardReset(
+	PPD_PROTOCOL protocol
+);
+
+//
+// Returns the transmit buffer, data objects go into it before PdProtocolTransmit
+//
+PPD_MESSAGE
+PdProtocolTxBuffer(
+	PPD_PROTOCOL protocol
+);
+
+//
+// Sends the message in the transmit buffer, retrying while no GoodCRC arrives.
+// Soft_Reset resets the message IDs first, so it always goes out as ID 0.
+//
+PD_TX_RESULT
+PdProtocolTransmit(
+	PPD_PROTOCOL protocol,
+	unsigned int type,
+	unsigned int count
+);
+
+//
+// Returns the ring slot to burst the next received frame into, or NULL if full
+//
+PPD_MESSAGE
+PdProtocolRxSlot(
+	PPD_PROTOCOL protocol
+);
+
+//
+// Validates the frame in the slot returned by PdProtocolRxSlot and queues it.
+// Returns nonzero if a new message was queued.
+//
+int
+PdProtocolRxCommit(
+	PPD_PROTOCOL protocol
+);
+
+//
+// Returns the oldest queued message or NULL, PdProtocolRxConsume releases it
+//
+PPD_MESSAGE
+PdProtocolRxPeek(
+	PPD_PROTOCOL protocol
+);
+
+void
+PdProtocolRxConsume(
+	PPD_PROTOCOL protocol
+);
@@ -0,0 +1,314 @@
+/*++
+
+Module Name:
+
+    pdaltmode.c
+
+Abstract:
+
+    DisplayPort alternate mode entry over structured VDMs.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "PdAltMode.h"
+
+#define PD_TIME_REACHED(now, deadline) ((long)((now) - (deadline)) >= 0)
+
+#define PD_ALT_MODE_BUSY_RETRIES 3
+
+static unsigned int PdAltModeGiveUp(PPD_ALT_MODE altMode)
+{
+	altMode->State = PdAltModeStateDone;
+	altMode->Deadline = 0;
+	altMode->Lanes = PdAltModeLanesUsb;
+	return PD_ALT_MODE_EVENT_USB;
+}
+
+static unsigned int PdAltModeSend(PPD_ALT_MODE altMode, PPD_PROTOCOL protocol, unsigned long now)
+{
+	PPD_MESSAGE tx = PdProtocolTxBuffer(protocol);
+	unsigned int svid = PD_SVID_DP, position = altMode->ModePosition, command, count = 1, timeout = PD_T_VDM_SENDER_RESPONSE_MS;
+
+	switch (altMode->State) {
+	case PdAltModeStateDiscoverIdentity:
+		svid = PD_SID;
+		position = 0;
+		command = PD_VDM_DISCOVER_IDENTITY;
+		break;
+	case PdAltModeStateDiscoverSvids:
+		svid = PD_SID;
+		position = 0;
+		command = PD_VDM_DISCOVER_SVIDS;
+		break;
+	case PdAltModeStateDiscoverModes:
+		position = 0;
+		command = PD_VDM_DISCOVER_MODES;
+		break;
+	case PdAltModeStateEnterMode:
+		command = PD_VDM_ENTER_MODE;
+		timeout = PD_T_VDM_WAIT_MODE_ENTRY_MS;
+		break;
+	case PdAltModeStateStatusUpdate:
+		command = PD_VDM_DP_STATUS_UPDATE;
+		PdMessageSetObject(tx, count++, PD_DP_STATUS_DFP_D_CONNECTED);
+		break;
+	case PdAltModeStateConfigure:
+		command = PD_VDM_DP_CONFIGURE;
+		PdMessageSetObject(tx, count++, PD_DP_CONFIGURE(altMode->PinAssignment));
+		break;
+	default:
+		return 0;
+	}
+
+	PdMessageSetObject(tx, 0, PD_VDM_HEADER(svid, position, PD_VDM_REQ, command));
+
+	if (PdProtocolTransmit(protocol, PD_DATA_VENDOR_DEFINED, count) != PdTxSuccess) {
+		altMode->Failures++;
+		return PdAltModeGiveUp(altMode);
+	}
+
+	altMode->Deadline = now + timeout;
+	return 0;
+}
+
+static unsigned int PdAltModeAdvance(PPD_ALT_MODE altMode, PPD_PROTOCOL protocol, PD_ALT_MODE_STATE state, unsigned long now)
+{
+	altMode->State = state;
+	altMode->Retries = 0;
+	return PdAltModeSend(altMode, protocol, now);
+}
+
+//
+// Picks the pin assignment for the partner's mode VDO, zero if it cannot take our video
+//
+static unsigned int PdAltModeSelectPins(unsigned long mode, int multiFunction)
+{
+	unsigned int pins;
+
+	if (!(mode & PD_DP_MODE_UFP_D))
+		return 0;
+
+	// A plug reports its UFP_D pin assignments in the DFP_D field
+	pins = (mode & PD_DP_MODE_RECEPTACLE) ? PD_DP_MODE_UFP_D_PINS(mode) : PD_DP_MODE_DFP_D_PINS(mode);
+
+	if (multiFunction && (pins & PD_DP_PIN_D))
+		return PD_DP_PIN_D;
+	if (pins & PD_DP_PIN_C)
+		return PD_DP_PIN_C;
+	if (pins & PD_DP_PIN_E)
+		return PD_DP_PIN_E;
+	if (pins & PD_DP_PIN_D)
+		return PD_DP_PIN_D;
+
+	return 0;
+}
+
+void
+PdAltModeInitialize(
+	PPD_ALT_MODE altMode
+)
+{
+	altMode->Entries = 0;
+	altMode->Failures = 0;
+	altMode->BringUpMs = 0;
+
+	PdAltModeStop(altMode);
+}
+
+unsigned int
+PdAltModeStart(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+)
+{
+	// Only the DFP initiates discovery, and only once per attach
+	if (altMode->State != PdAltModeStateIdle || protocol->DataRole != PD_DATA_ROLE_DFP)
+		return 0;
+
+	altMode->StartTime = now;
+	return PdAltModeAdvance(altMode, protocol, PdAltModeStateDiscoverIdentity, now);
+}
+
+void
+PdAltModeStop(
+	PPD_ALT_MODE altMode
+)
+{
+	altMode->State = PdAltModeStateIdle;
+	altMode->Deadline = 0;
+	altMode->Retries = 0;
+	altMode->SvidCount = 0;
+	altMode->ModePosition = 0;
+	altMode->ModeVdo = 0;
+	altMode->PinAssignment = 0;
+	altMode->MultiFunction = 0;
+	altMode->Hpd = 0;
+	altMode->Lanes = PdAltModeLanesUsb;
+}
+
+unsigned int
+PdAltModeHandleMessage(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+)
+{
+	unsigned short header = PdMessageHeader(message);
+	unsigned int count = PD_HEADER_COUNT(header);
+	unsigned long vdm, vdo;
+	unsigned int i, command, events = 0;
+
+	if (count == 0 || PD_HEADER_TYPE(header) != PD_DATA_VENDOR_DEFINED)
+		return 0;
+
+	vdm = PdMessageObject(message, 0);
+	if (!(vdm & PD_VDM_STRUCTURED))
+		return 0;
+
+	command = PD_VDM_COMMAND(vdm);
+
+	if (command == PD_VDM_ATTENTION && PD_VDM_SVID(vdm) == PD_SVID_DP && count > 1) {
+		altMode->Hpd = (PdMessageObject(message, 1) & PD_DP_STATUS_HPD) != 0;
+		return PD_ALT_MODE_EVENT_HPD;
+	}
+
+	// Everything else is a response to the request in flight
+	if (PD_VDM_COMMAND_TYPE(vdm) == PD_VDM_REQ || altMode->State == PdAltModeStateIdle ||
+		altMode->State == PdAltModeStateActive || altMode->State == PdAltModeStateDone)
+		return 0;
+
+	// The poll resends once the partner had time to become ready
+	if (PD_VDM_COMMAND_TYPE(vdm) == PD_VDM_BUSY) {
+		altMode->Deadline = now + PD_T_VDM_BUSY_MS;
+		return 0;
+	}
+
+	if (PD_VDM_COMMAND_TYPE(vdm) == PD_VDM_NAK) {
+		altMode->Failures++;
+		return PdAltModeGiveUp(altMode);
+	}
+
+	switch (altMode->State) {
+	case PdAltModeStateDiscoverIdentity:
+		if (command != PD_VDM_DISCOVER_IDENTITY)
+			break;
+		events = PdAltModeAdvance(altMode, protocol, PdAltModeStateDiscoverSvids, now);
+		break;
+
+	case PdAltModeStateDiscoverSvids:
+		if (command != PD_VDM_DISCOVER_SVIDS)
+			break;
+
+		// Two SVIDs per VDO, a zero SVID terminates the list
+		for (i = 1; i < count && altMode->SvidCount + 2 <= PD_ALT_MODE_MAX_SVIDS; i++) {
+			vdo = PdMessageObject(message, i);
+			if (vdo >> 16)
+				altMode->Svids[altMode->SvidCount++] = (unsigned short)(vdo >> 16);
+			if (vdo & 0xFFFF)
+				altMode->Svids[altMode->SvidCount++] = (unsigned short)vdo;
+		}
+
+		for (i = 0; i < altMode->SvidCount; i++) {
+			if (altMode->Svids[i] == PD_SVID_DP)
+				break;
+		}
+
+		if (i == altMode->SvidCount) {
+			events = PdAltModeGiveUp(altMode);
+			break;
+		}
+
+		events = PdAltModeAdvance(altMode, protocol, PdAltModeStateDiscoverModes, now);
+		break;
+
+	case PdAltModeStateDiscoverModes:
+		if (command != PD_VDM_DISCOVER_MODES || PD_VDM_SVID(vdm) != PD_SVID_DP)
+			break;
+
+		for (i = 1; i < count; i++) {
+			vdo = PdMessageObject(message, i);
+			if (PdAltModeSelectPins(vdo, 0)) {
+				altMode->ModePosition = i;
+				altMode->ModeVdo = vdo;
+				break;
+			}
+		}
+
+		if (!altMode->ModePosition) {
+			events = PdAltModeGiveUp(altMode);
+			break;
+		}
+
+		events = PdAltModeAdvance(altMode, protocol, PdAltModeStateEnterMode, now);
+		break;
+
+	case PdAltModeStateEnterMode:
+		if (command != PD_VDM_ENTER_MODE)
+			break;
+		events = PdAltModeAdvance(altMode, protocol, PdAltModeStateStatusUpdate, now);
+		break;
+
+	case PdAltModeStateStatusUpdate:
+		if (command != PD_VDM_DP_STATUS_UPDATE)
+			break;
+
+		if (count > 1) {
+			vdo = PdMessageObject(message, 1);
+			altMode->MultiFunction = (vdo & PD_DP_STATUS_MULTI_FUNCTION) != 0;
+			altMode->Hpd = (vdo & PD_DP_STATUS_HPD) != 0;
+		}
+
+		altMode->PinAssignment = PdAltModeSelectPins(altMode->ModeVdo, altMode->MultiFunction);
+		events = PdAltModeAdvance(altMode, protocol, PdAltModeStateConfigure, now);
+		break;
+
+	case PdAltModeStateConfigure:
+		if (command != PD_VDM_DP_CONFIGURE)
+			break;
+
+		// Pin assignment D keeps two lanes for USB, C and E give all four to the display
+		altMode->Lanes = altMode->PinAssignment == PD_DP_PIN_D ? PdAltModeLanesDisplayUsb : PdAltModeLanesDisplay;
+		altMode->State = PdAltModeStateActive;
+		altMode->Deadline = 0;
+		altMode->BringUpMs = now - altMode->StartTime;
+		altMode->Entries++;
+		events = PD_ALT_MODE_EVENT_ENTERED;
+		break;
+
+	default:
+		break;
+	}
+
+	return events;
+}
+
+unsigned int
+PdAltModePoll(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	unsigned int events = 0;
+
+	if (altMode->Deadline && PD_TIME_REACHED(now, altMode->Deadline)) {
+		// Retry what timed out or was answered BUSY, then settle for USB
+		if (++altMode->Retries > PD_ALT_MODE_BUSY_RETRIES) {
+			altMode->Failures++;
+			events = PdAltModeGiveUp(altMode);
+		}
+		else {
+			events = PdAltModeSend(altMode, protocol, now);
+		}
+	}
+
+	*next = altMode->Deadline ? (PD_TIME_REACHED(now, altMode->Deadline) ? 1 : altMode->Deadline - now) : 0;
+	return events;
+}
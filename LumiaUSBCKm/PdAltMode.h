@@ -0,0 +1,174 @@
+/*++
+
+Module Name:
+
+    pdaltmode.h
+
+Abstract:
+
+    DisplayPort alternate mode entry over structured VDMs, run as the
+    DFP. Like the other PD layers it has no kernel dependencies; times
+    are milliseconds from any monotonic clock.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Pd.h"
+
+//
+// Structured VDM header
+//
+#define PD_VDM_SVID(h)              (((h) >> 16) & 0xFFFF)
+#define PD_VDM_STRUCTURED           (1UL << 15)
+#define PD_VDM_POSITION(h)          (((h) >> 8) & 7)
+#define PD_VDM_COMMAND_TYPE(h)      (((h) >> 6) & 3)
+#define PD_VDM_COMMAND(h)           ((h) & 0x1F)
+
+#define PD_VDM_HEADER(svid, position, commandType, command) \
+	(((unsigned long)(svid) << 16) | PD_VDM_STRUCTURED | (((unsigned long)(position) & 7) << 8) | \
+	(((commandType) & 3) << 6) | ((command) & 0x1F))
+
+#define PD_VDM_REQ  0
+#define PD_VDM_ACK  1
+#define PD_VDM_NAK  2
+#define PD_VDM_BUSY 3
+
+#define PD_VDM_DISCOVER_IDENTITY 1
+#define PD_VDM_DISCOVER_SVIDS    2
+#define PD_VDM_DISCOVER_MODES    3
+#define PD_VDM_ENTER_MODE        4
+#define PD_VDM_EXIT_MODE         5
+#define PD_VDM_ATTENTION         6
+#define PD_VDM_DP_STATUS_UPDATE  16
+#define PD_VDM_DP_CONFIGURE      17
+
+#define PD_SID      0xFF00
+#define PD_SVID_DP  0xFF01
+
+//
+// DisplayPort mode, status and configure VDOs
+//
+#define PD_DP_MODE_UFP_D            0x01
+#define PD_DP_MODE_RECEPTACLE       0x40
+#define PD_DP_MODE_DFP_D_PINS(m)    (((m) >> 8) & 0xFF)
+#define PD_DP_MODE_UFP_D_PINS(m)    (((m) >> 16) & 0xFF)
+
+#define PD_DP_PIN_C                 0x04
+#define PD_DP_PIN_D                 0x08
+#define PD_DP_PIN_E                 0x10
+
+#define PD_DP_STATUS_DFP_D_CONNECTED 0x01
+#define PD_DP_STATUS_MULTI_FUNCTION 0x10
+#define PD_DP_STATUS_HPD            0x80
+
+#define PD_DP_CONFIGURE_UFP_D       0x02
+#define PD_DP_CONFIGURE_DP13        (1UL << 2)
+#define PD_DP_CONFIGURE(pin)        (PD_DP_CONFIGURE_UFP_D | PD_DP_CONFIGURE_DP13 | ((unsigned long)(pin) << 8))
+
+//
+// Timing values from the specification, in milliseconds
+//
+#define PD_T_VDM_SENDER_RESPONSE_MS 30
+#define PD_T_VDM_WAIT_MODE_ENTRY_MS 50
+#define PD_T_VDM_BUSY_MS            50
+
+#define PD_ALT_MODE_MAX_SVIDS 12
+
+typedef enum _PD_ALT_MODE_STATE
+{
+	PdAltModeStateIdle,
+	PdAltModeStateDiscoverIdentity,
+	PdAltModeStateDiscoverSvids,
+	PdAltModeStateDiscoverModes,
+	PdAltModeStateEnterMode,
+	PdAltModeStateStatusUpdate,
+	PdAltModeStateConfigure,
+	PdAltModeStateActive,
+	PdAltModeStateDone
+} PD_ALT_MODE_STATE;
+
+//
+// How the SuperSpeed lanes end up being used
+//
+typedef enum _PD_ALT_MODE_LANES
+{
+	PdAltModeLanesUsb,
+	PdAltModeLanesDisplayUsb,
+	PdAltModeLanesDisplay
+} PD_ALT_MODE_LANES;
+
+#define PD_ALT_MODE_EVENT_ENTERED   0x01
+#define PD_ALT_MODE_EVENT_USB       0x02
+#define PD_ALT_MODE_EVENT_HPD       0x04
+
+typedef struct _PD_ALT_MODE
+{
+	PD_ALT_MODE_STATE State;
+	unsigned long Deadline;
+	unsigned long StartTime;
+	unsigned int Retries;
+
+	unsigned short Svids[PD_ALT_MODE_MAX_SVIDS];
+	unsigned int SvidCount;
+
+	unsigned int ModePosition;
+	unsigned long ModeVdo;
+	unsigned int PinAssignment;
+	int MultiFunction;
+	int Hpd;
+
+	PD_ALT_MODE_LANES Lanes;
+	unsigned long BringUpMs;
+
+	unsigned long Entries;
+	unsigned long Failures;
+} PD_ALT_MODE, *PPD_ALT_MODE;
+
+void
+PdAltModeInitialize(
+	PPD_ALT_MODE altMode
+);
+
+//
+// Starts discovery once an explicit contract is in place, returns
+// PD_ALT_MODE_EVENT_* flags
+//
+unsigned int
+PdAltModeStart(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+);
+
+void
+PdAltModeStop(
+	PPD_ALT_MODE altMode
+);
+
+//
+// Feeds a received message to the manager, returns PD_ALT_MODE_EVENT_* flags
+//
+unsigned int
+PdAltModeHandleMessage(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+);
+
+//
+// Runs expired timers, returns PD_ALT_MODE_EVENT_* flags. *next receives the
+// milliseconds until the next deadline, or zero if none is armed.
+//
+unsigned int
+PdAltModePoll(
+	PPD_ALT_MODE altMode,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+);
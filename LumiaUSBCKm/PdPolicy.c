@@ -0,0 +1,619 @@
+/*++
+
+Module Name:
+
+    pdpolicy.c
+
+Abstract:
+
+    USB Power Delivery policy engines.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "PdPolicy.h"
+
+#define PD_TIME_REACHED(now, deadline) ((long)((now) - (deadline)) >= 0)
+
+int
+PdSinkSelect(
+	const unsigned long *pdos,
+	unsigned int count,
+	const PD_SINK_LIMITS *limits,
+	PD_SINK_SELECTION *selection
+)
+{
+	PD_SINK_SELECTION best, candidate;
+	unsigned int i, minMv, maxMv;
+	unsigned long pdo;
+
+	best.Position = 0;
+	best.PowerMw = 0;
+	best.VoltageMv = 0;
+
+	for (i = 0; i < count && i < PD_MAX_DATA_OBJECTS; i++) {
+		pdo = pdos[i];
+		candidate.Position = i + 1;
+
+		switch (PD_PDO_TYPE(pdo)) {
+		case PD_PDO_TYPE_FIXED:
+			minMv = maxMv = PD_PDO_FIXED_VOLTAGE_MV(pdo);
+			candidate.CurrentMa = PD_PDO_FIXED_CURRENT_MA(pdo);
+			break;
+		case PD_PDO_TYPE_VARIABLE:
+			minMv = PD_PDO_MIN_VOLTAGE_MV(pdo);
+			maxMv = PD_PDO_MAX_VOLTAGE_MV(pdo);
+			candidate.CurrentMa = PD_PDO_VARIABLE_CURRENT_MA(pdo);
+			break;
+		case PD_PDO_TYPE_BATTERY:
+			minMv = PD_PDO_MIN_VOLTAGE_MV(pdo);
+			maxMv = PD_PDO_MAX_VOLTAGE_MV(pdo);
+			candidate.CurrentMa = minMv ? PD_PDO_BATTERY_POWER_MW(pdo) * 1000 / minMv : 0;
+			break;
+		default:
+			// Programmable supplies need a PPS capable charger IC
+			continue;
+		}
+
+		// The whole output range has to be within what the input stage accepts
+		if (minMv == 0 || maxMv > limits->MaxVoltageMv || minMv < limits->MinVoltageMv)
+			continue;
+
+		if (candidate.CurrentMa > limits->MaxCurrentMa)
+			candidate.CurrentMa = limits->MaxCurrentMa;
+
+		// Variable and battery supplies are only guaranteed to deliver their minimum voltage
+		candidate.VoltageMv = minMv;
+		candidate.PowerMw = minMv * candidate.CurrentMa / 1000;
+
+		if (PD_PDO_TYPE(pdo) == PD_PDO_TYPE_BATTERY) {
+			candidate.Rdo = PD_RDO(candidate.Position, candidate.PowerMw / 250, candidate.PowerMw / 250);
+		}
+		else {
+			candidate.Rdo = PD_RDO(candidate.Position, candidate.CurrentMa / 10, candidate.CurrentMa / 10);
+		}
+
+		// Prefer more power, then the lower voltage for less conversion loss
+		if (candidate.PowerMw > best.PowerMw ||
+			(candidate.PowerMw == best.PowerMw && best.Position && candidate.VoltageMv < best.VoltageMv))
+		{
+			best = candidate;
+		}
+	}
+
+	if (!best.Position)
+		return 0;
+
+	best.Rdo |= PD_RDO_USB_COMM_CAPABLE | PD_RDO_NO_USB_SUSPEND;
+	if (best.CurrentMa < limits->MaxCurrentMa)
+		best.Rdo |= PD_RDO_CAPABILITY_MISMATCH;
+
+	*selection = best;
+	return 1;
+}
+
+static void PdSinkArm(PPD_SINK sink, PD_SINK_STATE state, unsigned long deadline)
+{
+	sink->State = state;
+	sink->Deadline = deadline;
+}
+
+static unsigned int PdSinkRequest(PPD_SINK sink, PPD_PROTOCOL protocol, unsigned long now)
+{
+	PdMessageSetObject(PdProtocolTxBuffer(protocol), 0, sink->Requested.Rdo);
+
+	if (PdProtocolTransmit(protocol, PD_DATA_REQUEST, 1) != PdTxSuccess) {
+		sink->Failures++;
+		PdSinkArm(sink, PdSinkStateWaitCapabilities, 0);
+		return PD_SINK_EVENT_FAILED;
+	}
+
+	sink->Negotiations++;
+	PdSinkArm(sink, PdSinkStateWaitAccept, now + PD_T_SENDER_RESPONSE_MS);
+	return 0;
+}
+
+//
+// Hard Reset ends the explicit contract and the source starts over from vSafe5V, so
+// the sink waits for capabilities again. If none come the partner does not speak PD.
+//
+static unsigned int PdSinkHardReset(PPD_SINK sink, PPD_PROTOCOL protocol, unsigned long now)
+{
+	sink->Failures++;
+	sink->ContractValid = 0;
+	PdProtocolHardReset(protocol);
+	PdSinkArm(sink, PdSinkStateWaitCapabilities, now + PD_T_NO_RESPONSE_MS);
+	return PD_SINK_EVENT_FAILED | PD_SINK_EVENT_HARD_RESET;
+}
+
+static void PdSinkSendCapabilities(PPD_SINK sink, PPD_PROTOCOL protocol)
+{
+	PPD_MESSAGE tx = PdProtocolTxBuffer(protocol);
+	unsigned int count = 1;
+
+	PdMessageSetObject(tx, 0, PD_PDO_FIXED(5000, sink->Limits.MaxCurrentMa));
+	if (sink->Limits.MaxVoltageMv > 5000) {
+		PdMessageSetObject(tx, 1, PD_PDO_VARIABLE(5000, sink->Limits.MaxVoltageMv, sink->Limits.MaxCurrentMa));
+		count++;
+	}
+
+	PdProtocolTransmit(protocol, PD_DATA_SINK_CAPABILITIES, count);
+}
+
+void
+PdSinkInitialize(
+	PPD_SINK sink,
+	const PD_SINK_LIMITS *limits
+)
+{
+	sink->Limits = *limits;
+	sink->Negotiations = 0;
+	sink->Rejects = 0;
+	sink->Failures = 0;
+
+	PdSinkStop(sink);
+}
+
+void
+PdSinkStart(
+	PPD_SINK sink,
+	unsigned long now
+)
+{
+	sink->SourceCapCount = 0;
+	sink->ContractValid = 0;
+	PdSinkArm(sink, PdSinkStateWaitCapabilities, now + PD_T_TYPEC_SINK_WAIT_CAP_MS);
+}
+
+void
+PdSinkStop(
+	PPD_SINK sink
+)
+{
+	sink->SourceCapCount = 0;
+	sink->ContractValid = 0;
+	PdSinkArm(sink, PdSinkStateDisabled, 0);
+}
+
+unsigned int
+PdSinkHandleMessage(
+	PPD_SINK sink,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+)
+{
+	unsigned short header = PdMessageHeader(message);
+	unsigned int type = PD_HEADER_TYPE(header);
+	unsigned int count = PD_HEADER_COUNT(header);
+	unsigned int i;
+
+	if (sink->State == PdSinkStateDisabled)
+		return 0;
+
+	if (count) {
+		if (type != PD_DATA_SOURCE_CAPABILITIES)
+			return 0;
+
+		for (i = 0; i < count; i++)
+			sink->SourceCaps[i] = PdMessageObject(message, i);
+		sink->SourceCapCount = count;
+
+		if (!PdSinkSelect(sink->SourceCaps, count, &sink->Limits, &sink->Requested)) {
+			sink->Failures++;
+			PdSinkArm(sink, PdSinkStateWaitCapabilities, 0);
+			return PD_SINK_EVENT_CAPABILITIES | PD_SINK_EVENT_FAILED;
+		}
+
+		return PD_SINK_EVENT_CAPABILITIES | PdSinkRequest(sink, protocol, now);
+	}
+
+	switch (type) {
+	case PD_CTRL_ACCEPT:
+		if (sink->State == PdSinkStateWaitAccept)
+			PdSinkArm(sink, PdSinkStateWaitPsRdy, now + PD_T_PS_TRANSITION_MS);
+		break;
+
+	case PD_CTRL_REJECT:
+		if (sink->State != PdSinkStateWaitAccept)
+			break;
+		sink->Rejects++;
+		if (sink->ContractValid) {
+			// The explicit contract we had stays in place
+			PdSinkArm(sink, PdSinkStateReady, 0);
+			break;
+		}
+		PdSinkArm(sink, PdSinkStateWaitCapabilities, 0);
+		return PD_SINK_EVENT_FAILED;
+
+	case PD_CTRL_WAIT:
+		if (sink->State == PdSinkStateWaitAccept)
+			PdSinkArm(sink, PdSinkStateWaitRetry, now + PD_T_SINK_REQUEST_MS);
+		break;
+
+	case PD_CTRL_PS_RDY:
+		if (sink->State != PdSinkStateWaitPsRdy)
+			break;
+		sink->Contract = sink->Requested;
+		sink->ContractValid = 1;
+		PdSinkArm(sink, PdSinkStateReady, 0);
+		return PD_SINK_EVENT_CONTRACT;
+
+	case PD_CTRL_GET_SINK_CAP:
+		PdSinkSendCapabilities(sink, protocol);
+		break;
+
+	case PD_CTRL_SOFT_RESET:
+		// Accept it, then the source follows up with fresh capabilities
+		if (PdProtocolTransmit(protocol, PD_CTRL_ACCEPT, 0) != PdTxSuccess)
+			return PdSinkHardReset(sink, protocol, now);
+		PdSinkArm(sink, PdSinkStateWaitCapabilities, 0);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+unsigned int
+PdSinkPoll(
+	PPD_SINK sink,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	unsigned int events = 0;
+
+	if (sink->Deadline && PD_TIME_REACHED(now, sink->Deadline)) {
+		switch (sink->State) {
+		case PdSinkStateWaitCapabilities:
+			// Nothing but Type-C current from this partner
+			PdSinkArm(sink, PdSinkStateWaitCapabilities, 0);
+			events = PD_SINK_EVENT_NO_PD;
+			break;
+
+		case PdSinkStateWaitAccept:
+		case PdSinkStateWaitPsRdy:
+			// SenderResponseTimer or PSTransitionTimer ran out, the specification calls for Hard Reset
+			events = PdSinkHardReset(sink, protocol, now);
+			break;
+
+		case PdSinkStateWaitRetry:
+			events = PdSinkRequest(sink, protocol, now);
+			break;
+
+		default:
+			sink->Deadline = 0;
+			break;
+		}
+	}
+
+	*next = sink->Deadline ? (PD_TIME_REACHED(now, sink->Deadline) ? 1 : sink->Deadline - now) : 0;
+	return events;
+}
+
+static unsigned int PdSourceSendCapabilities(PPD_SOURCE source, PPD_PROTOCOL protocol, unsigned long now)
+{
+	PPD_MESSAGE tx = PdProtocolTxBuffer(protocol);
+	unsigned int i;
+
+	for (i = 0; i < source->PdoCount; i++)
+		PdMessageSetObject(tx, i, source->Pdos[i]);
+
+	if (PdProtocolTransmit(protocol, PD_DATA_SOURCE_CAPABILITIES, source->PdoCount) == PdTxSuccess) {
+		source->State = PdSourceStateWaitRequest;
+		source->Deadline = now + PD_T_SENDER_RESPONSE_MS;
+		return 0;
+	}
+
+	// No GoodCRC, the partner may not speak PD at all
+	source->State = PdSourceStateSendCapabilities;
+	if (++source->CapsCount >= PD_N_CAPS_COUNT) {
+		source->Deadline = 0;
+		return PD_SOURCE_EVENT_NO_PD;
+	}
+
+	source->Deadline = now + PD_T_TYPEC_SEND_SOURCE_CAP_MS;
+	return 0;
+}
+
+void
+PdSourceInitialize(
+	PPD_SOURCE source,
+	const unsigned long *pdos,
+	unsigned int count
+)
+{
+	unsigned int i;
+
+	for (i = 0; i < count && i < PD_MAX_DATA_OBJECTS; i++)
+		source->Pdos[i] = pdos[i];
+	source->PdoCount = i;
+	source->Contracts = 0;
+	source->Rejects = 0;
+
+	PdSourceStop(source);
+}
+
+unsigned int
+PdSourceStart(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+)
+{
+	source->CapsCount = 0;
+	source->ContractValid = 0;
+	return PdSourceSendCapabilities(source, protocol, now);
+}
+
+void
+PdSourceStop(
+	PPD_SOURCE source
+)
+{
+	source->State = PdSourceStateDisabled;
+	source->Deadline = 0;
+	source->ContractValid = 0;
+}
+
+unsigned int
+PdSourceHandleMessage(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+)
+{
+	unsigned short header = PdMessageHeader(message);
+	unsigned int type = PD_HEADER_TYPE(header);
+	unsigned int count = PD_HEADER_COUNT(header);
+	unsigned long rdo;
+	unsigned int position;
+
+	if (source->State == PdSourceStateDisabled)
+		return 0;
+
+	if (count == 0) {
+		// Soft_Reset is accepted first, after which both ask for the capabilities again
+		if (type == PD_CTRL_SOFT_RESET)
+			PdProtocolTransmit(protocol, PD_CTRL_ACCEPT, 0);
+		if (type == PD_CTRL_GET_SOURCE_CAP || type == PD_CTRL_SOFT_RESET) {
+			source->CapsCount = 0;
+			return PdSourceSendCapabilities(source, protocol, now);
+		}
+		return 0;
+	}
+
+	if (type != PD_DATA_REQUEST || (source->State != PdSourceStateWaitRequest && source->State != PdSourceStateReady))
+		return 0;
+
+	rdo = PdMessageObject(message, 0);
+	position = PD_RDO_POSITION(rdo);
+
+	if (position == 0 || position > source->PdoCount ||
+		PD_PDO_TYPE(source->Pdos[position - 1]) != PD_PDO_TYPE_FIXED ||
+		PD_RDO_OPERATING(rdo) * 10 > PD_PDO_FIXED_CURRENT_MA(source->Pdos[position - 1]))
+	{
+		source->Rejects++;
+		PdProtocolTransmit(protocol, PD_CTRL_REJECT, 0);
+		if (!source->ContractValid) {
+			source->State = PdSourceStateWaitRequest;
+			source->Deadline = now + PD_T_SENDER_RESPONSE_MS;
+		}
+		return 0;
+	}
+
+	// Every PDO we offer is a 5V rail that is already up, so PS_RDY follows right away
+	if (PdProtocolTransmit(protocol, PD_CTRL_ACCEPT, 0) != PdTxSuccess ||
+		PdProtocolTransmit(protocol, PD_CTRL_PS_RDY, 0) != PdTxSuccess)
+	{
+		source->CapsCount = 0;
+		return PdSourceSendCapabilities(source, protocol, now);
+	}
+
+	source->Rdo = rdo;
+	source->ContractValid = 1;
+	source->Contracts++;
+	source->State = PdSourceStateReady;
+	source->Deadline = 0;
+	return PD_SOURCE_EVENT_CONTRACT;
+}
+
+unsigned int
+PdSourcePoll(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	unsigned int events = 0;
+
+	if (source->Deadline && PD_TIME_REACHED(now, source->Deadline)) {
+		if (source->State == PdSourceStateWaitRequest && !source->ContractValid) {
+			// No Request in time, advertise again
+			events = PdSourceSendCapabilities(source, protocol, now);
+		}
+		else if (source->State == PdSourceStateSendCapabilities) {
+			events = PdSourceSendCapabilities(source, protocol, now);
+		}
+		else {
+			source->Deadline = 0;
+		}
+	}
+
+	*next = source->Deadline ? (PD_TIME_REACHED(now, source->Deadline) ? 1 : source->Deadline - now) : 0;
+	return events;
+}
+
+static unsigned int PdPrSwapFinish(PPD_PR_SWAP swap, unsigned int events, unsigned long now)
+{
+	if (events & PD_PR_SWAP_EVENT_DONE) {
+		swap->LatencyMs = now - swap->StartTime;
+		swap->Swaps++;
+	}
+	else {
+		swap->Failures++;
+	}
+
+	swap->State = PdPrSwapStateIdle;
+	swap->Deadline = 0;
+	return events;
+}
+
+//
+// Both sides agreed, the old source powers down first
+//
+static unsigned int PdPrSwapTransition(PPD_PR_SWAP swap, PPD_PROTOCOL protocol, unsigned long now)
+{
+	if (protocol->PowerRole == PD_POWER_ROLE_SOURCE) {
+		swap->SetVbus(swap->Context, 0);
+		protocol->PowerRole = PD_POWER_ROLE_SINK;
+
+		if (PdProtocolTransmit(protocol, PD_CTRL_PS_RDY, 0) != PdTxSuccess)
+			return PdPrSwapFinish(swap, PD_PR_SWAP_EVENT_FAILED | PD_PR_SWAP_EVENT_RECOVER, now);
+
+		swap->State = PdPrSwapStateWaitSourceOn;
+		swap->Deadline = now + PD_T_PS_SOURCE_ON_MS;
+	}
+	else {
+		swap->State = PdPrSwapStateWaitSourceOff;
+		swap->Deadline = now + PD_T_PS_SOURCE_OFF_MS;
+	}
+
+	return 0;
+}
+
+void
+PdPrSwapInitialize(
+	PPD_PR_SWAP swap,
+	PD_SET_VBUS *setVbus,
+	void *context,
+	int acceptToSource
+)
+{
+	swap->SetVbus = setVbus;
+	swap->Context = context;
+	swap->AcceptToSource = acceptToSource;
+	swap->LatencyMs = 0;
+	swap->Swaps = 0;
+	swap->Failures = 0;
+
+	PdPrSwapStop(swap);
+}
+
+unsigned int
+PdPrSwapRequest(
+	PPD_PR_SWAP swap,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+)
+{
+	if (swap->State != PdPrSwapStateIdle)
+		return 0;
+
+	swap->StartTime = now;
+
+	if (PdProtocolTransmit(protocol, PD_CTRL_PR_SWAP, 0) != PdTxSuccess)
+		return PdPrSwapFinish(swap, PD_PR_SWAP_EVENT_FAILED, now);
+
+	swap->State = PdPrSwapStateWaitAccept;
+	swap->Deadline = now + PD_T_SENDER_RESPONSE_MS;
+	return 0;
+}
+
+void
+PdPrSwapStop(
+	PPD_PR_SWAP swap
+)
+{
+	swap->State = PdPrSwapStateIdle;
+	swap->Deadline = 0;
+}
+
+unsigned int
+PdPrSwapHandleMessage(
+	PPD_PR_SWAP swap,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+)
+{
+	unsigned short header = PdMessageHeader(message);
+	unsigned int type = PD_HEADER_TYPE(header);
+
+	if (PD_HEADER_COUNT(header) != 0)
+		return 0;
+
+	switch (type) {
+	case PD_CTRL_PR_SWAP:
+		if (swap->State != PdPrSwapStateIdle)
+			break;
+
+		if (protocol->PowerRole == PD_POWER_ROLE_SINK && !swap->AcceptToSource) {
+			PdProtocolTransmit(protocol, PD_CTRL_REJECT, 0);
+			break;
+		}
+
+		swap->StartTime = now;
+		if (PdProtocolTransmit(protocol, PD_CTRL_ACCEPT, 0) != PdTxSuccess)
+			break;
+		return PdPrSwapTransition(swap, protocol, now);
+
+	case PD_CTRL_ACCEPT:
+		if (swap->State == PdPrSwapStateWaitAccept)
+			return PdPrSwapTransition(swap, protocol, now);
+		break;
+
+	case PD_CTRL_REJECT:
+	case PD_CTRL_WAIT:
+		if (swap->State == PdPrSwapStateWaitAccept)
+			return PdPrSwapFinish(swap, PD_PR_SWAP_EVENT_FAILED, now);
+		break;
+
+	case PD_CTRL_PS_RDY:
+		if (swap->State == PdPrSwapStateWaitSourceOff) {
+			// The old source is off, take over VBUS and tell it so
+			swap->SetVbus(swap->Context, 1);
+			protocol->PowerRole = PD_POWER_ROLE_SOURCE;
+			PdProtocolTransmit(protocol, PD_CTRL_PS_RDY, 0);
+			return PdPrSwapFinish(swap, PD_PR_SWAP_EVENT_DONE, now);
+		}
+		if (swap->State == PdPrSwapStateWaitSourceOn)
+			return PdPrSwapFinish(swap, PD_PR_SWAP_EVENT_DONE, now);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+unsigned int
+PdPrSwapPoll(
+	PPD_PR_SWAP swap,
+	unsigned long now,
+	unsigned long *next
+)
+{
+	unsigned int events = 0;
+
+	if (swap->Deadline && PD_TIME_REACHED(now, swap->Deadline)) {
+		// Past Accept the partner may already have dropped VBUS
+		events = PD_PR_SWAP_EVENT_FAILED;
+		if (swap->State != PdPrSwapStateWaitAccept)
+			events |= PD_PR_SWAP_EVENT_RECOVER;
+		PdPrSwapFinish(swap, events, now);
+	}
+
+	*next = swap->Deadline ? (PD_TIME_REACHED(now, swap->Deadline) ? 1 : swap->Deadline - now) : 0;
+	return events;
+}
@@ -0,0 +1,338 @@
+/*++
+
+Module Name:
+
+    pdpolicy.h
+
+Abstract:
+
+    USB Power Delivery policy engines built on the protocol layer in pd.h.
+    Like the protocol layer they carry no kernel dependencies; times are
+    passed in as milliseconds from any monotonic clock.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Pd.h"
+
+//
+// Power data objects
+//
+#define PD_PDO_TYPE(p)              (((p) >> 30) & 3)
+#define PD_PDO_TYPE_FIXED           0
+#define PD_PDO_TYPE_BATTERY         1
+#define PD_PDO_TYPE_VARIABLE        2
+#define PD_PDO_TYPE_AUGMENTED       3
+
+#define PD_PDO_FIXED_VOLTAGE_MV(p)  ((((p) >> 10) & 0x3FF) * 50)
+#define PD_PDO_FIXED_CURRENT_MA(p)  (((p) & 0x3FF) * 10)
+#define PD_PDO_MAX_VOLTAGE_MV(p)    ((((p) >> 20) & 0x3FF) * 50)
+#define PD_PDO_MIN_VOLTAGE_MV(p)    ((((p) >> 10) & 0x3FF) * 50)
+#define PD_PDO_VARIABLE_CURRENT_MA(p) (((p) & 0x3FF) * 10)
+#define PD_PDO_BATTERY_POWER_MW(p)  (((p) & 0x3FF) * 250)
+
+#define PD_PDO_FIXED_DUAL_ROLE      (1UL << 29)
+
+#define PD_PDO_FIXED(mv, ma)        ((unsigned long)((((mv) / 50) & 0x3FF) << 10) | (((ma) / 10) & 0x3FF))
+#define PD_PDO_VARIABLE(minMv, maxMv, ma) \
+	((unsigned long)(PD_PDO_TYPE_VARIABLE) << 30 | (unsigned long)(((maxMv) / 50) & 0x3FF) << 20 | \
+	(unsigned long)(((minMv) / 50) & 0x3FF) << 10 | (((ma) / 10) & 0x3FF))
+
+//
+// Request data objects
+//
+#define PD_RDO_POSITION(r)          (((r) >> 28) & 7)
+#define PD_RDO_CAPABILITY_MISMATCH  (1UL << 26)
+#define PD_RDO_USB_COMM_CAPABLE     (1UL << 25)
+#define PD_RDO_NO_USB_SUSPEND       (1UL << 24)
+#define PD_RDO_OPERATING(r)         (((r) >> 10) & 0x3FF)
+#define PD_RDO_MAXIMUM(r)           ((r) & 0x3FF)
+
+#define PD_RDO(position, operating, maximum) \
+	(((unsigned long)((position) & 7) << 28) | ((unsigned long)((operating) & 0x3FF) << 10) | ((maximum) & 0x3FF))
+
+//
+// Timing values from the specification, in milliseconds
+//
+#define PD_T_SENDER_RESPONSE_MS     27
+#define PD_T_PS_TRANSITION_MS       500
+#define PD_T_SINK_REQUEST_MS        100
+#define PD_T_TYPEC_SINK_WAIT_CAP_MS 465
+#define PD_T_TYPEC_SEND_SOURCE_CAP_MS 150
+#define PD_T_PS_SOURCE_OFF_MS       920
+#define PD_T_PS_SOURCE_ON_MS        480
+#define PD_T_NO_RESPONSE_MS         5500
+#define PD_N_CAPS_COUNT             50
+
+//
+// Sink policy
+//
+typedef struct _PD_SINK_LIMITS
+{
+	unsigned int MaxVoltageMv;
+	unsigned int MinVoltageMv;
+	unsigned int MaxCurrentMa;
+} PD_SINK_LIMITS;
+
+typedef struct _PD_SINK_SELECTION
+{
+	unsigned int Position;
+	unsigned int VoltageMv;
+	unsigned int CurrentMa;
+	unsigned int PowerMw;
+	unsigned long Rdo;
+} PD_SINK_SELECTION;
+
+typedef enum _PD_SINK_STATE
+{
+	PdSinkStateDisabled,
+	PdSinkStateWaitCapabilities,
+	PdSinkStateWaitAccept,
+	PdSinkStateWaitPsRdy,
+	PdSinkStateWaitRetry,
+	PdSinkStateReady
+} PD_SINK_STATE;
+
+#define PD_SINK_EVENT_CAPABILITIES  0x01
+#define PD_SINK_EVENT_CONTRACT      0x02
+#define PD_SINK_EVENT_FAILED        0x04
+#define PD_SINK_EVENT_NO_PD         0x08
+// The sink signalled Hard Reset, modes and swaps are over
+#define PD_SINK_EVENT_HARD_RESET    0x10
+
+typedef struct _PD_SINK
+{
+	PD_SINK_STATE State;
+	PD_SINK_LIMITS Limits;
+	unsigned long Deadline;
+
+	unsigned long SourceCaps[PD_MAX_DATA_OBJECTS];
+	unsigned int SourceCapCount;
+
+	PD_SINK_SELECTION Requested;
+	PD_SINK_SELECTION Contract;
+	int ContractValid;
+
+	unsigned long Negotiations;
+	unsigned long Rejects;
+	unsigned long Failures;
+} PD_SINK, *PPD_SINK;
+
+//
+// Picks the source capability giving the most power within the limits.
+// Returns zero if none is usable.
+//
+int
+PdSinkSelect(
+	const unsigned long *pdos,
+	unsigned int count,
+	const PD_SINK_LIMITS *limits,
+	PD_SINK_SELECTION *selection
+);
+
+void
+PdSinkInitialize(
+	PPD_SINK sink,
+	const PD_SINK_LIMITS *limits
+);
+
+//
+// Starts waiting for Source_Capabilities after a sink attach
+//
+void
+PdSinkStart(
+	PPD_SINK sink,
+	unsigned long now
+);
+
+void
+PdSinkStop(
+	PPD_SINK sink
+);
+
+//
+// Feeds a received message to the engine, returns PD_SINK_EVENT_* flags
+//
+unsigned int
+PdSinkHandleMessage(
+	PPD_SINK sink,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+);
+
+//
+// Runs expired timers, returns PD_SINK_EVENT_* flags. *next receives the
+// milliseconds until the next deadline, or zero if none is armed.
+//
+unsigned int
+PdSinkPoll(
+	PPD_SINK sink,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+);
+
+//
+// Source policy
+//
+typedef enum _PD_SOURCE_STATE
+{
+	PdSourceStateDisabled,
+	PdSourceStateSendCapabilities,
+	PdSourceStateWaitRequest,
+	PdSourceStateReady
+} PD_SOURCE_STATE;
+
+#define PD_SOURCE_EVENT_CONTRACT    0x01
+#define PD_SOURCE_EVENT_NO_PD       0x02
+
+typedef struct _PD_SOURCE
+{
+	PD_SOURCE_STATE State;
+	unsigned long Deadline;
+	unsigned int CapsCount;
+
+	unsigned long Pdos[PD_MAX_DATA_OBJECTS];
+	unsigned int PdoCount;
+
+	unsigned long Rdo;
+	int ContractValid;
+
+	unsigned long Contracts;
+	unsigned long Rejects;
+} PD_SOURCE, *PPD_SOURCE;
+
+void
+PdSourceInitialize(
+	PPD_SOURCE source,
+	const unsigned long *pdos,
+	unsigned int count
+);
+
+//
+// Starts advertising Source_Capabilities after a source attach, returns
+// PD_SOURCE_EVENT_* flags
+//
+unsigned int
+PdSourceStart(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+);
+
+void
+PdSourceStop(
+	PPD_SOURCE source
+);
+
+//
+// Feeds a received message to the engine, returns PD_SOURCE_EVENT_* flags
+//
+unsigned int
+PdSourceHandleMessage(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+);
+
+//
+// Runs expired timers, returns PD_SOURCE_EVENT_* flags. *next receives the
+// milliseconds until the next deadline, or zero if none is armed.
+//
+unsigned int
+PdSourcePoll(
+	PPD_SOURCE source,
+	PPD_PROTOCOL protocol,
+	unsigned long now,
+	unsigned long *next
+);
+
+//
+// Power role swap. VBUS is switched through a callback at the points the
+// specification puts it; the protocol's power role follows the swap.
+//
+typedef void PD_SET_VBUS(void *context, int on);
+
+typedef enum _PD_PR_SWAP_STATE
+{
+	PdPrSwapStateIdle,
+	PdPrSwapStateWaitAccept,
+	PdPrSwapStateWaitSourceOff,
+	PdPrSwapStateWaitSourceOn
+} PD_PR_SWAP_STATE;
+
+#define PD_PR_SWAP_EVENT_DONE       0x01
+#define PD_PR_SWAP_EVENT_FAILED     0x02
+// VBUS was already off when the swap failed, the port needs error recovery
+#define PD_PR_SWAP_EVENT_RECOVER    0x04
+
+typedef struct _PD_PR_SWAP
+{
+	PD_PR_SWAP_STATE State;
+	unsigned long Deadline;
+	unsigned long StartTime;
+
+	PD_SET_VBUS *SetVbus;
+	void *Context;
+
+	// Whether a partner request that would make us the source is accepted
+	int AcceptToSource;
+
+	unsigned long LatencyMs;
+	unsigned long Swaps;
+	unsigned long Failures;
+} PD_PR_SWAP, *PPD_PR_SWAP;
+
+void
+PdPrSwapInitialize(
+	PPD_PR_SWAP swap,
+	PD_SET_VBUS *setVbus,
+	void *context,
+	int acceptToSource
+);
+
+//
+// Sends PR_Swap to the partner, returns PD_PR_SWAP_EVENT_* flags
+//
+unsigned int
+PdPrSwapRequest(
+	PPD_PR_SWAP swap,
+	PPD_PROTOCOL protocol,
+	unsigned long now
+);
+
+void
+PdPrSwapStop(
+	PPD_PR_SWAP swap
+);
+
+//
+// Returns nonzero while a swap is in progress. Messages should go to
+// PdPrSwapHandleMessage then, as well as any PR_Swap request.
+//
+static __inline int PdPrSwapBusy(const PD_PR_SWAP *swap)
+{
+	return swap->State != PdPrSwapStateIdle;
+}
+
+unsigned int
+PdPrSwapHandleMessage(
+	PPD_PR_SWAP swap,
+	PPD_PROTOCOL protocol,
+	const PD_MESSAGE *message,
+	unsigned long now
+);
+
+unsigned int
+PdPrSwapPoll(
+	PPD_PR_SWAP swap,
+	unsigned long now,
+	unsigned long *next
+);
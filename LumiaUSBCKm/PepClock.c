@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+
+    pepclock.c
+
+Abstract:
+
+    Reference counted UC120 clock requests with a release hysteresis.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "PepClock.h"
+
+static void PepClockSwitchOff(PPEP_CLOCK clock, unsigned long long now)
+{
+	clock->ReleasePending = 0;
+	clock->On = 0;
+	clock->OnTime += now - clock->OnSince;
+	clock->SetClock(clock->Context, 0);
+}
+
+void
+PepClockInitialize(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_SET *setClock,
+	void *context,
+	unsigned long long hysteresis
+)
+{
+	int i;
+
+	clock->SetClock = setClock;
+	clock->Context = context;
+	clock->Hysteresis = hysteresis;
+	clock->On = 0;
+	clock->References = 0;
+	clock->ReleasePending = 0;
+	clock->ReleaseDeadline = 0;
+	clock->OnSince = 0;
+	clock->Switches = 0;
+	clock->OnTime = 0;
+
+	for (i = 0; i < PepClockReasonCount; i++) {
+		clock->ReasonReferences[i] = 0;
+		clock->ReasonSince[i] = 0;
+		clock->ReasonOnTime[i] = 0;
+	}
+}
+
+void
+PepClockAcquire(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_REASON reason,
+	unsigned long long now
+)
+{
+	if (clock->ReasonReferences[reason]++ == 0)
+		clock->ReasonSince[reason] = now;
+
+	clock->References++;
+	clock->ReleasePending = 0;
+
+	if (!clock->On) {
+		clock->On = 1;
+		clock->OnSince = now;
+		clock->Switches++;
+		clock->SetClock(clock->Context, 1);
+	}
+}
+
+int
+PepClockRelease(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_REASON reason,
+	unsigned long long now
+)
+{
+	if (--clock->ReasonReferences[reason] == 0)
+		clock->ReasonOnTime[reason] += now - clock->ReasonSince[reason];
+
+	if (--clock->References != 0)
+		return 0;
+
+	if (clock->Hysteresis == 0) {
+		PepClockSwitchOff(clock, now);
+		return 0;
+	}
+
+	clock->ReleasePending = 1;
+	clock->ReleaseDeadline = now + clock->Hysteresis;
+	return 1;
+}
+
+unsigned long long
+PepClockExpire(
+	PPEP_CLOCK clock,
+	unsigned long long now
+)
+{
+	if (!clock->ReleasePending || clock->References != 0)
+		return 0;
+
+	if (now < clock->ReleaseDeadline)
+		return clock->ReleaseDeadline - now;
+
+	PepClockSwitchOff(clock, now);
+	return 0;
+}
+
+void
+PepClockFlush(
+	PPEP_CLOCK clock,
+	unsigned long long now
+)
+{
+	if (clock->On && clock->References == 0)
+		PepClockSwitchOff(clock, now);
+}
@@ -0,0 +1,102 @@
+/*++
+
+Module Name:
+
+    pepclock.h
+
+Abstract:
+
+    Reference counted UC120 clock requests with a release hysteresis.
+    The actual clock switch goes through a callback, so the bookkeeping
+    can run against a mock power-control routine outside the kernel.
+
+    The structure is not synchronized, callers serialize access to it.
+    Times are in caller-defined ticks (100ns interrupt time in the driver).
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+typedef enum _PEP_CLOCK_REASON
+{
+	PepClockReasonSpi,
+	PepClockReasonInterrupt,
+	PepClockReasonInit,
+	PepClockReasonCount
+} PEP_CLOCK_REASON;
+
+typedef void PEP_CLOCK_SET(void *context, int on);
+
+typedef struct _PEP_CLOCK
+{
+	PEP_CLOCK_SET *SetClock;
+	void *Context;
+	unsigned long long Hysteresis;
+
+	int On;
+	int References;
+	int ReleasePending;
+	unsigned long long ReleaseDeadline;
+	unsigned long long OnSince;
+
+	int ReasonReferences[PepClockReasonCount];
+	unsigned long long ReasonSince[PepClockReasonCount];
+
+	// Accounting
+	unsigned long Switches;
+	unsigned long long OnTime;
+	unsigned long long ReasonOnTime[PepClockReasonCount];
+} PEP_CLOCK, *PPEP_CLOCK;
+
+void
+PepClockInitialize(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_SET *setClock,
+	void *context,
+	unsigned long long hysteresis
+);
+
+//
+// Takes a reference, switching the clock on if it was off. A pending
+// delayed release is cancelled, so back-to-back bursts pay nothing.
+//
+void
+PepClockAcquire(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_REASON reason,
+	unsigned long long now
+);
+
+//
+// Drops a reference. Returns nonzero when this was the last one and the
+// caller has to call PepClockExpire once the hysteresis has elapsed.
+//
+int
+PepClockRelease(
+	PPEP_CLOCK clock,
+	PEP_CLOCK_REASON reason,
+	unsigned long long now
+);
+
+//
+// Switches the clock off if the delayed release is still due. Returns the
+// ticks left to wait if called before the deadline, zero otherwise.
+//
+unsigned long long
+PepClockExpire(
+	PPEP_CLOCK clock,
+	unsigned long long now
+);
+
+//
+// Switches the clock off right away if no references are held
+//
+void
+PepClockFlush(
+	PPEP_CLOCK clock,
+	unsigned long long now
+);
@@ -15,10 +15,183 @@ Environment:
 
 --*/
 
+#pragma once
+
 //
 // Define an Interface Guid so that apps can find the device and talk to it.
 //
 
+#ifdef DEFINE_GUID
 DEFINE_GUID(GUID_DEVINTERFACE_LumiaUSBCKm,
 	0xeca28b08, 0x54d9, 0x4c81, 0x95, 0xbd, 0xe5, 0x5c, 0xf9, 0xc6, 0xf3, 0xfd);
 // {eca28b08-54d9-4c81-95bd-e55cf9c6f3fd}
+#endif
+
+//
+// Connector events. The request stays pending until something happens and
+// then completes with every record queued since the last one. Keep one
+// outstanding at all times to see events as they occur.
+//
+// Output: LUMIAUSBC_EVENT_BATCH followed by Count records
+//
+
+#ifdef CTL_CODE
+#define IOCTL_LUMIAUSBC_WAIT_EVENTS \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
+
+#define LUMIAUSBC_EVENT_VERSION 1
+
+// Data[0] plug orientation, 1 CC1, 2 CC2, 0 if it could not be told,
+// Data[1] Type-C current advertised to us in mA, zero as source
+#define LUMIAUSBC_EVENT_ATTACH      1
+#define LUMIAUSBC_EVENT_DETACH      2
+// Data[0] 1 when we now source VBUS, 0 when we sink it
+#define LUMIAUSBC_EVENT_POWER_ROLE  3
+// Data[0] mV, Data[1] mA, both zero when the contract is gone
+#define LUMIAUSBC_EVENT_CONTRACT    4
+// Data[0] LUMIAUSBC_EVENT_ERROR_*, Data[1] depends on the error
+#define LUMIAUSBC_EVENT_ERROR       5
+
+// Data[1] index of the script operation that failed
+#define LUMIAUSBC_EVENT_ERROR_INIT          1
+#define LUMIAUSBC_EVENT_ERROR_NEGOTIATION   2
+#define LUMIAUSBC_EVENT_ERROR_POWER_ROLE    3
+// Data[1] interrupt bits that could not be acknowledged
+#define LUMIAUSBC_EVENT_ERROR_ACKNOWLEDGE   4
+
+typedef struct _LUMIAUSBC_EVENT_RECORD
+{
+	// Increments by one per event, a gap means the records in between were lost
+	unsigned int Sequence;
+	unsigned int Type;
+	// Interrupt time in 100 ns units
+	unsigned long long Time;
+	unsigned int Data[2];
+} LUMIAUSBC_EVENT_RECORD, *PLUMIAUSBC_EVENT_RECORD;
+
+typedef struct _LUMIAUSBC_EVENT_BATCH
+{
+	unsigned int Version;
+	unsigned int Count;
+	// Records overwritten before they could be delivered since the last batch
+	unsigned int Lost;
+	unsigned int Reserved;
+	LUMIAUSBC_EVENT_RECORD Records[1];
+} LUMIAUSBC_EVENT_BATCH, *PLUMIAUSBC_EVENT_BATCH;
+
+#define LUMIAUSBC_EVENT_BATCH_SIZE(count) \
+	(sizeof(LUMIAUSBC_EVENT_BATCH) + ((count) - 1) * sizeof(LUMIAUSBC_EVENT_RECORD))
+
+//
+// Maps the statistics block below read-only into the calling process and
+// returns its address as an unsigned long long. The caller needs
+// SeSystemProfilePrivilege. The view can neither be unmapped nor made
+// writable and lasts as long as the process, so map it once.
+//
+
+#ifdef CTL_CODE
+#define IOCTL_LUMIAUSBC_MAP_STATISTICS \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
+
+#define LUMIAUSBC_STATISTICS_VERSION 1
+
+// Indices into Interrupts, the unknown lines are only connected while profiling
+#define LUMIAUSBC_INTERRUPT_PLUG_DETECT 0
+#define LUMIAUSBC_INTERRUPT_UC120       1
+#define LUMIAUSBC_INTERRUPT_MYSTERY1    2
+#define LUMIAUSBC_INTERRUPT_MYSTERY2    3
+#define LUMIAUSBC_INTERRUPT_SOURCES     4
+
+// Registers in UC120_SNAPSHOT order, see uc120.h
+#define LUMIAUSBC_SNAPSHOT_REGISTERS 8
+
+//
+// Counters and connector state. The driver updates it under Sequence as
+// described in seqlock.h, copy it with SeqLockCopy for a consistent
+// snapshot. Every field is naturally aligned on every architecture.
+//
+typedef struct _LUMIAUSBC_STATISTICS
+{
+	unsigned int Sequence;
+	unsigned int Version;
+	unsigned int Size;
+	unsigned int Reserved;
+
+	// Registers read on the last interrupt, and the interrupt time in 100 ns units
+	unsigned long long SnapshotTime;
+	unsigned char Snapshot[LUMIAUSBC_SNAPSHOT_REGISTERS];
+
+	// Connector state
+	int Attached;
+	int SourceMode;
+	int Orientation;
+	int TypeCCurrentMa;
+	int SinkContractMv;
+	int SinkContractMa;
+
+	// Register transfers as they went out on the SPI bus, merged reads count once
+	unsigned int SpiTransactions;
+	unsigned int SpiBytes;
+	unsigned int SpiErrors;
+
+	unsigned int Interrupts[LUMIAUSBC_INTERRUPT_SOURCES];
+
+	int InitProbeMatches;
+	int InitProbeMismatches;
+	int InitProbeNotReady;
+	int InitProbeErrors;
+	int InitTimeSavedMs;
+	int LastInitTimeMs;
+	int IdleTransitions;
+	int IdleResidencyMs;
+	int Wakes;
+	int LastWakeLatencyMs;
+	int MaxWakeLatencyMs;
+	int WakeBudgetExceeded;
+	int ClockSwitches;
+	int ClockOnMs;
+	int ClockOnMsSpi;
+	int ClockOnMsInterrupt;
+	int ClockOnMsInit;
+	int AltModeLanes;
+	int AltModeBringUpMs;
+	int PowerRoleSwaps;
+	int LastSwapLatencyMs;
+	int MaxSwapLatencyMs;
+	int MuxReconfigurations;
+	int MuxGpioWrites;
+	int LastMuxLatencyUs;
+	int MaxMuxLatencyUs;
+	int GpioWritesIssued;
+	int GpioWritesSuppressed;
+	int SpiReadStrategy;
+	int SpiReadStrategiesCorrect;
+	int InitScriptTransactions;
+	int InitScriptAccesses;
+	int InterruptScriptTransactions;
+	int InterruptScriptAccesses;
+
+	// Configuration image loads, the last one's duration and the writes it took
+	unsigned int BitstreamLoads;
+	unsigned int BitstreamFailures;
+	unsigned int BitstreamLoadUs;
+	unsigned int BitstreamChunks;
+} LUMIAUSBC_STATISTICS, *PLUMIAUSBC_STATISTICS;
+
+//
+// Copies out the register dumps of recent interrupts, oldest first, as
+// many as fit. Each is the snapshot above at the time it was taken.
+//
+// Output: a capture as described in snapshotstream.h, decode it with
+// SnapshotStreamDecode. Times are interrupt time in 100 ns units. At most
+// LUMIAUSBC_SNAPSHOT_CAPTURE_SIZE bytes.
+//
+
+#ifdef CTL_CODE
+#define IOCTL_LUMIAUSBC_READ_SNAPSHOTS \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
+
+#define LUMIAUSBC_SNAPSHOT_CAPTURE_SIZE 4224
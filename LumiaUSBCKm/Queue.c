@@ -0,0 +1,313 @@
+/*++
+
+Module Name:
+
+    queue.c
+
+Abstract:
+
+    This file contains the queue entry points and callbacks.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "queue.tmh"
+
+// Keeps the client from making its view writable, or from unmapping it
+#ifndef SEC_NO_CHANGE
+#define SEC_NO_CHANGE 0x00400000
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, LumiaUSBCKmQueueInitialize)
+#endif
+
+NTSTATUS
+LumiaUSBCKmQueueInitialize(
+    _In_ WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+     The I/O dispatch callbacks for the frameworks device object
+     are configured in this function.
+
+     A single default I/O Queue is configured for parallel request
+     processing. Event requests with nothing to return yet are parked in
+     a manual queue until an event is posted.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(Device);
+	WDFQUEUE queue;
+	NTSTATUS status;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	PAGED_CODE();
+
+	EventQueueInitialize(&ctx->Events);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	status = WdfWaitLockCreate(&attributes, &ctx->EventLock);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfWaitLockCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	// Nothing here touches the hardware, waiting on events must not keep the controller out of idle
+	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchParallel);
+	queueConfig.EvtIoDeviceControl = LumiaUSBCKmEvtIoDeviceControl;
+	queueConfig.PowerManaged = WdfFalse;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, &attributes, &queue);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &ctx->EventRequests);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed %!STATUS!", status);
+		return status;
+	}
+
+	return status;
+}
+
+//
+// Completes the request with every queued record that fits. Called with
+// EventLock held and at least one record queued.
+//
+static void LumiaUSBCCompleteEvents(PDEVICE_CONTEXT ctx, WDFREQUEST Request)
+{
+	NTSTATUS status;
+	PVOID buffer;
+	size_t length;
+	unsigned int written = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, LUMIAUSBC_EVENT_BATCH_SIZE(1), &buffer, &length);
+	if (NT_SUCCESS(status)) {
+		written = EventQueueDrain(&ctx->Events, buffer, length > MAXULONG ? MAXULONG : (unsigned int)length);
+		if (!written)
+			status = STATUS_BUFFER_TOO_SMALL;
+	}
+
+	WdfRequestCompleteWithInformation(Request, status, written);
+}
+
+void
+LumiaUSBCPostEvent(
+	PDEVICE_CONTEXT ctx,
+	unsigned int type,
+	unsigned int data0,
+	unsigned int data1
+)
+{
+	WDFREQUEST request;
+
+	WdfWaitLockAcquire(ctx->EventLock, NULL);
+
+	EventQueuePost(&ctx->Events, type, KeQueryInterruptTime(), data0, data1);
+
+	// A request cancelled in the meantime is simply not returned, the records wait for the next one
+	if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(ctx->EventRequests, &request)))
+		LumiaUSBCCompleteEvents(ctx, request);
+
+	WdfWaitLockRelease(ctx->EventLock);
+}
+
+//
+// Maps the statistics block into the calling process, read-only
+//
+static NTSTATUS LumiaUSBCMapStatistics(PDEVICE_CONTEXT ctx, WDFREQUEST Request, size_t *written)
+{
+	unsigned long long *address;
+	PVOID base = NULL;
+	SIZE_T viewSize = 0;
+	NTSTATUS status;
+
+	if (WdfRequestGetRequestorMode(Request) != UserMode)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	if (!ctx->StatsSection)
+		return STATUS_NOT_SUPPORTED;
+
+	if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_SYSTEM_PROFILE_PRIVILEGE), UserMode))
+		return STATUS_PRIVILEGE_NOT_HELD;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(unsigned long long), (PVOID *)&address, NULL);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = ZwMapViewOfSection(ctx->StatsSection, ZwCurrentProcess(), &base, 0, 0, NULL, &viewSize,
+		ViewUnmap, SEC_NO_CHANGE, PAGE_READONLY);
+	if (!NT_SUCCESS(status)) {
+		TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "ZwMapViewOfSection failed %!STATUS!", status);
+		return status;
+	}
+
+	*address = (ULONG_PTR)base;
+	*written = sizeof(unsigned long long);
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Copies the snapshot capture into the request's output buffer
+//
+static NTSTATUS LumiaUSBCReadSnapshots(PDEVICE_CONTEXT ctx, WDFREQUEST Request, size_t *written)
+{
+	PVOID buffer;
+	size_t length;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, SNAPSHOT_STREAM_BLOCK_HEADER, &buffer, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WdfWaitLockAcquire(ctx->SnapshotLock, NULL);
+	*written = SnapshotStreamCopy(&ctx->Snapshots, buffer, length > MAXULONG ? MAXULONG : (unsigned int)length);
+	WdfWaitLockRelease(ctx->SnapshotLock);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+LumiaUSBCKmEvtIoInCallerContext(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Runs in the thread that sent the request. Mapping the statistics
+    block needs the caller's process and privileges, so that request is
+    handled here; every other one goes on to the queues.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+    Request - Handle to a framework request object.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+	WDF_REQUEST_PARAMETERS parameters;
+	NTSTATUS status;
+	size_t written = 0;
+
+	WDF_REQUEST_PARAMETERS_INIT(&parameters);
+	WdfRequestGetParameters(Request, &parameters);
+
+	if (parameters.Type != WdfRequestTypeDeviceControl ||
+		parameters.Parameters.DeviceIoControl.IoControlCode != IOCTL_LUMIAUSBC_MAP_STATISTICS)
+	{
+		status = WdfDeviceEnqueueRequest(Device, Request);
+		if (!NT_SUCCESS(status))
+			WdfRequestComplete(Request, status);
+		return;
+	}
+
+	status = LumiaUSBCMapStatistics(DeviceGetContext(Device), Request, &written);
+	WdfRequestCompleteWithInformation(Request, status, written);
+}
+
+VOID
+LumiaUSBCKmEvtIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+    )
+/*++
+
+Routine Description:
+
+    This event is invoked when the framework receives IRP_MJ_DEVICE_CONTROL request.
+
+Arguments:
+
+    Queue -  Handle to the framework queue object that is associated with the
+             I/O request.
+
+    Request - Handle to a framework request object.
+
+    OutputBufferLength - Size of the output buffer in bytes
+
+    InputBufferLength - Size of the input buffer in bytes
+
+    IoControlCode - I/O control code.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+	PDEVICE_CONTEXT ctx = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+	NTSTATUS status;
+	size_t written = 0;
+
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE, "%!FUNC! IoControlCode %x, OutputBufferLength %Iu", IoControlCode, OutputBufferLength);
+
+	if (IoControlCode == IOCTL_LUMIAUSBC_READ_SNAPSHOTS) {
+		status = LumiaUSBCReadSnapshots(ctx, Request, &written);
+		WdfRequestCompleteWithInformation(Request, status, written);
+		return;
+	}
+
+	if (IoControlCode != IOCTL_LUMIAUSBC_WAIT_EVENTS) {
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+		return;
+	}
+
+	if (OutputBufferLength < LUMIAUSBC_EVENT_BATCH_SIZE(1)) {
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return;
+	}
+
+	// Checked and parked under the lock so a record posted in between cannot be missed
+	WdfWaitLockAcquire(ctx->EventLock, NULL);
+
+	if (EventQueuePending(&ctx->Events)) {
+		LumiaUSBCCompleteEvents(ctx, Request);
+	}
+	else {
+		status = WdfRequestForwardToIoQueue(Request, ctx->EventRequests);
+		if (!NT_SUCCESS(status)) {
+			TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfRequestForwardToIoQueue failed %!STATUS!", status);
+			WdfRequestComplete(Request, status);
+		}
+	}
+
+	WdfWaitLockRelease(ctx->EventLock);
+}
@@ -0,0 +1,42 @@
+/*++
+
+Module Name:
+
+    queue.h
+
+Abstract:
+
+    This file contains the queue definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+//
+// Events are posted whenever the connector changes and handed to whoever
+// is waiting on IOCTL_LUMIAUSBC_WAIT_EVENTS
+//
+NTSTATUS
+LumiaUSBCKmQueueInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+void
+LumiaUSBCPostEvent(
+	PDEVICE_CONTEXT ctx,
+	unsigned int type,
+	unsigned int data0,
+	unsigned int data1
+);
+
+//
+// Events from the framework
+//
+EVT_WDF_IO_IN_CALLER_CONTEXT LumiaUSBCKmEvtIoInCallerContext;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL LumiaUSBCKmEvtIoDeviceControl;
+
+EXTERN_C_END
@@ -0,0 +1,46 @@
+/*++
+
+Module Name:
+
+    seqlock.c
+
+Abstract:
+
+    Consistent copies of data guarded by a sequence counter.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "SeqLock.h"
+
+unsigned int
+SeqLockCopy(
+	const volatile unsigned int *sequence,
+	const volatile void *source,
+	void *destination,
+	unsigned int length,
+	unsigned int attempts
+)
+{
+	const volatile unsigned int *from = (const volatile unsigned int *)source;
+	unsigned int *to = (unsigned int *)destination;
+	unsigned int attempt, start, i;
+
+	for (attempt = 1; attempt <= attempts; attempt++) {
+		start = SeqLockReadBegin(sequence);
+		if (start & 1)
+			continue;
+
+		// Word by word, so no single value is ever torn even if the copy as a whole is
+		for (i = 0; i < length / sizeof(unsigned int); i++)
+			to[i] = from[i];
+
+		if (!SeqLockReadRetry(sequence, start))
+			return attempt;
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+    seqlock.h
+
+Abstract:
+
+    Sequence counter protocol for data one side writes and the other only
+    reads, such as the statistics block mapped into monitoring clients.
+    The counter is odd while an update is in progress and readers retry
+    until they copied the data between two equal, even values. Writers
+    must be serialized among themselves. The fences are compiler
+    intrinsics, so there are no kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#if defined(_M_ARM)
+#define SEQ_LOCK_FENCE() do { _ReadWriteBarrier(); __dmb(_ARM_BARRIER_ISH); } while (0)
+#elif defined(_M_ARM64)
+#define SEQ_LOCK_FENCE() do { _ReadWriteBarrier(); __dmb(_ARM64_BARRIER_ISH); } while (0)
+#elif defined(_M_AMD64)
+#define SEQ_LOCK_FENCE() do { _ReadWriteBarrier(); __faststorefence(); } while (0)
+#else
+#define SEQ_LOCK_FENCE() do { _ReadWriteBarrier(); _mm_mfence(); } while (0)
+#endif
+#else
+#define SEQ_LOCK_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+static __inline void SeqLockWriteBegin(volatile unsigned int *sequence)
+{
+	*sequence = *sequence + 1;
+	SEQ_LOCK_FENCE();
+}
+
+static __inline void SeqLockWriteEnd(volatile unsigned int *sequence)
+{
+	SEQ_LOCK_FENCE();
+	*sequence = *sequence + 1;
+}
+
+static __inline unsigned int SeqLockReadBegin(const volatile unsigned int *sequence)
+{
+	unsigned int start = *sequence;
+
+	SEQ_LOCK_FENCE();
+	return start;
+}
+
+//
+// Nonzero if what was read since SeqLockReadBegin returned start may be torn
+//
+static __inline int SeqLockReadRetry(const volatile unsigned int *sequence, unsigned int start)
+{
+	SEQ_LOCK_FENCE();
+	return (start & 1) || *sequence != start;
+}
+
+//
+// Copies length bytes, a multiple of four, from source into destination
+// once no update overlapped the copy. Gives up after attempts tries and
+// returns zero; otherwise returns the try it succeeded on.
+//
+unsigned int
+SeqLockCopy(
+	const volatile unsigned int *sequence,
+	const volatile void *source,
+	void *destination,
+	unsigned int length,
+	unsigned int attempts
+);
@@ -0,0 +1,267 @@
+/*++
+
+Module Name:
+
+    snapshotstream.c
+
+Abstract:
+
+    Delta encoding of register snapshots into a ring of blocks, and the
+    decoder for the captures copied out of it.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "SnapshotStream.h"
+
+// A delta with every register changed and the longest time, the largest record there is
+#define SNAPSHOT_STREAM_RECORD_MAX (1 + 10 + SNAPSHOT_STREAM_REGISTERS_MAX / 8 + SNAPSHOT_STREAM_REGISTERS_MAX)
+
+static unsigned int SnapshotStreamPutTime(unsigned char *p, unsigned long long time)
+{
+	unsigned int length = 0;
+
+	while (time >= 0x80) {
+		p[length++] = (unsigned char)(time | 0x80);
+		time >>= 7;
+	}
+	p[length++] = (unsigned char)time;
+
+	return length;
+}
+
+static int SnapshotStreamGetTime(const unsigned char *p, unsigned int length, unsigned int *offset, unsigned long long *time)
+{
+	unsigned int shift;
+
+	*time = 0;
+	for (shift = 0; shift < 64 && *offset < length; shift += 7) {
+		unsigned char byte = p[(*offset)++];
+
+		*time |= (unsigned long long)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+static unsigned int SnapshotStreamEncodeKey(const SNAPSHOT_STREAM *stream, unsigned char *record, unsigned long long time, const unsigned char *values)
+{
+	unsigned int length, i;
+
+	record[0] = SNAPSHOT_STREAM_KEY;
+	length = 1 + SnapshotStreamPutTime(record + 1, time);
+	for (i = 0; i < stream->Registers; i++)
+		record[length++] = values[i];
+
+	return length;
+}
+
+static unsigned int SnapshotStreamEncodeDelta(const SNAPSHOT_STREAM *stream, unsigned char *record, unsigned long long time, const unsigned char *values)
+{
+	unsigned int length, mask, i;
+
+	record[0] = SNAPSHOT_STREAM_DELTA;
+	length = 1 + SnapshotStreamPutTime(record + 1, time - stream->LastTime);
+
+	mask = length;
+	for (i = 0; i < (stream->Registers + 7) / 8; i++)
+		record[length++] = 0;
+
+	for (i = 0; i < stream->Registers; i++) {
+		if (values[i] != stream->Last[i]) {
+			record[mask + i / 8] |= (unsigned char)(1 << (i % 8));
+			record[length++] = values[i];
+		}
+	}
+
+	return length;
+}
+
+void
+SnapshotStreamInitialize(
+	PSNAPSHOT_STREAM stream,
+	unsigned int registers
+)
+{
+	unsigned int i;
+
+	stream->Registers = registers < SNAPSHOT_STREAM_REGISTERS_MAX ? registers : SNAPSHOT_STREAM_REGISTERS_MAX;
+	for (i = 0; i < SNAPSHOT_STREAM_REGISTERS_MAX; i++)
+		stream->Last[i] = 0;
+	stream->LastTime = 0;
+
+	stream->Block = 0;
+	stream->Filled = 0;
+	stream->NextSequence = 0;
+	for (i = 0; i < SNAPSHOT_STREAM_BLOCKS; i++) {
+		stream->Sequence[i] = 0;
+		stream->Used[i] = 0;
+	}
+
+	stream->Snapshots = 0;
+	stream->Keyframes = 0;
+	stream->RawBytes = 0;
+	stream->EncodedBytes = 0;
+}
+
+unsigned int
+SnapshotStreamAppend(
+	PSNAPSHOT_STREAM stream,
+	unsigned long long time,
+	const unsigned char *values
+)
+{
+	unsigned char record[SNAPSHOT_STREAM_RECORD_MAX];
+	unsigned int length, i;
+	int keyframe;
+
+	// A time going backwards cannot be a delta, start over from a keyframe
+	keyframe = !stream->Filled || time < stream->LastTime;
+	length = keyframe ?
+		SnapshotStreamEncodeKey(stream, record, time, values) :
+		SnapshotStreamEncodeDelta(stream, record, time, values);
+
+	// Full, move on to the oldest block. It starts with a keyframe so it decodes on its own.
+	if (!stream->Filled || stream->Used[stream->Block] + length > SNAPSHOT_STREAM_BLOCK_SIZE) {
+		if (stream->Filled)
+			stream->Block = (stream->Block + 1) % SNAPSHOT_STREAM_BLOCKS;
+		if (stream->Filled < SNAPSHOT_STREAM_BLOCKS)
+			stream->Filled++;
+
+		stream->Sequence[stream->Block] = stream->NextSequence++;
+		stream->Used[stream->Block] = 0;
+
+		if (!keyframe) {
+			keyframe = 1;
+			length = SnapshotStreamEncodeKey(stream, record, time, values);
+		}
+	}
+
+	for (i = 0; i < length; i++)
+		stream->Data[stream->Block][stream->Used[stream->Block] + i] = record[i];
+	stream->Used[stream->Block] += length;
+
+	for (i = 0; i < stream->Registers; i++)
+		stream->Last[i] = values[i];
+	stream->LastTime = time;
+
+	stream->Snapshots++;
+	if (keyframe)
+		stream->Keyframes++;
+	stream->RawBytes += stream->Registers + 8;
+	stream->EncodedBytes += length;
+
+	return length;
+}
+
+unsigned int
+SnapshotStreamCopy(
+	const SNAPSHOT_STREAM *stream,
+	unsigned char *capture,
+	unsigned int size
+)
+{
+	unsigned int blocks, total, first, offset, block, n, i;
+
+	// Newest blocks first until the next one would not fit
+	total = 0;
+	for (blocks = 0; blocks < stream->Filled; blocks++) {
+		block = (stream->Block + SNAPSHOT_STREAM_BLOCKS - blocks) % SNAPSHOT_STREAM_BLOCKS;
+		if (size - total < SNAPSHOT_STREAM_BLOCK_HEADER + stream->Used[block])
+			break;
+		total += SNAPSHOT_STREAM_BLOCK_HEADER + stream->Used[block];
+	}
+
+	first = (stream->Block + SNAPSHOT_STREAM_BLOCKS + 1 - blocks) % SNAPSHOT_STREAM_BLOCKS;
+	offset = 0;
+	for (n = 0; n < blocks; n++) {
+		unsigned char *header = capture + offset;
+
+		block = (first + n) % SNAPSHOT_STREAM_BLOCKS;
+		header[0] = (unsigned char)stream->Sequence[block];
+		header[1] = (unsigned char)(stream->Sequence[block] >> 8);
+		header[2] = (unsigned char)(stream->Sequence[block] >> 16);
+		header[3] = (unsigned char)(stream->Sequence[block] >> 24);
+		header[4] = (unsigned char)stream->Used[block];
+		header[5] = (unsigned char)(stream->Used[block] >> 8);
+		header[6] = (unsigned char)stream->Registers;
+		header[7] = SNAPSHOT_STREAM_VERSION;
+		offset += SNAPSHOT_STREAM_BLOCK_HEADER;
+
+		for (i = 0; i < stream->Used[block]; i++)
+			capture[offset++] = stream->Data[block][i];
+	}
+
+	return offset;
+}
+
+int
+SnapshotStreamDecode(
+	const unsigned char *capture,
+	unsigned int length,
+	SNAPSHOT_STREAM_VISIT *visit,
+	void *context
+)
+{
+	unsigned char values[SNAPSHOT_STREAM_REGISTERS_MAX];
+	unsigned long long time, value;
+	unsigned int offset, end, registers, mask, i;
+	int count = 0, keyed;
+
+	for (offset = 0; offset < length; offset = end) {
+		if (length - offset < SNAPSHOT_STREAM_BLOCK_HEADER)
+			return -1;
+
+		end = offset + SNAPSHOT_STREAM_BLOCK_HEADER + (capture[offset + 4] | ((unsigned int)capture[offset + 5] << 8));
+		registers = capture[offset + 6];
+		if (capture[offset + 7] != SNAPSHOT_STREAM_VERSION || registers > SNAPSHOT_STREAM_REGISTERS_MAX || end > length)
+			return -1;
+
+		// Deltas only make sense after the block's keyframe
+		keyed = 0;
+		time = 0;
+		offset += SNAPSHOT_STREAM_BLOCK_HEADER;
+
+		while (offset < end) {
+			unsigned char type = capture[offset++];
+
+			if (!SnapshotStreamGetTime(capture, end, &offset, &value))
+				return -1;
+
+			if (type == SNAPSHOT_STREAM_KEY) {
+				if (end - offset < registers)
+					return -1;
+				for (i = 0; i < registers; i++)
+					values[i] = capture[offset++];
+				time = value;
+				keyed = 1;
+			} else if (type == SNAPSHOT_STREAM_DELTA && keyed) {
+				mask = offset;
+				offset += (registers + 7) / 8;
+				if (offset > end)
+					return -1;
+				for (i = 0; i < registers; i++) {
+					if (capture[mask + i / 8] & (1 << (i % 8))) {
+						if (offset >= end)
+							return -1;
+						values[i] = capture[offset++];
+					}
+				}
+				time += value;
+			} else {
+				return -1;
+			}
+
+			if (visit)
+				visit(context, time, values, registers, type == SNAPSHOT_STREAM_KEY);
+			count++;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+
+    snapshotstream.h
+
+Abstract:
+
+    Register snapshots kept as a delta-encoded capture in a fixed buffer.
+    Each snapshot stores the time since the previous one, a mask of the
+    registers that changed and only their new values. The buffer is a
+    ring of blocks, each starting with a keyframe holding every register,
+    so a block can be decoded on its own once older ones are overwritten.
+    The encoder and decoder carry no kernel dependencies and are shared
+    with the host tools.
+
+    The structures are not synchronized, callers serialize access.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#define SNAPSHOT_STREAM_VERSION 1
+
+// Registers per snapshot, so the change mask fits in four bytes
+#define SNAPSHOT_STREAM_REGISTERS_MAX 32
+
+// Record bytes per block, and blocks in the ring
+#define SNAPSHOT_STREAM_BLOCK_SIZE 256
+#define SNAPSHOT_STREAM_BLOCKS 16
+
+//
+// A capture is the blocks oldest first, each one a header followed by its
+// records:
+//
+//   header  sequence (4 bytes), record bytes (2), registers (1), version (1)
+//   key     0x01, time, every register
+//   delta   0x02, time since the previous record, change mask, changed registers
+//
+// Times are in the caller's units, LEB128 encoded. Multi-byte fields are
+// little endian, the mask has bit n of byte n / 8 set for register n.
+//
+#define SNAPSHOT_STREAM_BLOCK_HEADER 8
+#define SNAPSHOT_STREAM_CAPTURE_SIZE (SNAPSHOT_STREAM_BLOCKS * (SNAPSHOT_STREAM_BLOCK_HEADER + SNAPSHOT_STREAM_BLOCK_SIZE))
+
+#define SNAPSHOT_STREAM_KEY   0x01
+#define SNAPSHOT_STREAM_DELTA 0x02
+
+typedef struct _SNAPSHOT_STREAM
+{
+	unsigned int Registers;
+
+	// What the next delta is taken against
+	unsigned char Last[SNAPSHOT_STREAM_REGISTERS_MAX];
+	unsigned long long LastTime;
+
+	// Block being written, blocks holding records, and the next block's sequence number
+	unsigned int Block;
+	unsigned int Filled;
+	unsigned int NextSequence;
+	unsigned int Sequence[SNAPSHOT_STREAM_BLOCKS];
+	unsigned int Used[SNAPSHOT_STREAM_BLOCKS];
+	unsigned char Data[SNAPSHOT_STREAM_BLOCKS][SNAPSHOT_STREAM_BLOCK_SIZE];
+
+	// Accounting, raw being the values plus an 8 byte time per snapshot
+	unsigned long Snapshots;
+	unsigned long Keyframes;
+	unsigned long long RawBytes;
+	unsigned long long EncodedBytes;
+} SNAPSHOT_STREAM, *PSNAPSHOT_STREAM;
+
+void
+SnapshotStreamInitialize(
+	PSNAPSHOT_STREAM stream,
+	unsigned int registers
+);
+
+//
+// Appends a snapshot of Registers values. Returns the bytes it took.
+//
+unsigned int
+SnapshotStreamAppend(
+	PSNAPSHOT_STREAM stream,
+	unsigned long long time,
+	const unsigned char *values
+);
+
+//
+// Copies out as many of the newest blocks as fit, oldest first. Returns
+// the bytes written.
+//
+unsigned int
+SnapshotStreamCopy(
+	const SNAPSHOT_STREAM *stream,
+	unsigned char *capture,
+	unsigned int size
+);
+
+typedef void SNAPSHOT_STREAM_VISIT(void *context, unsigned long long time, const unsigned char *values, unsigned int registers, int keyframe);
+
+//
+// Calls visit for every snapshot in a capture, oldest first. Returns how
+// many there were, or -1 if the capture is malformed.
+//
+int
+SnapshotStreamDecode(
+	const unsigned char *capture,
+	unsigned int length,
+	SNAPSHOT_STREAM_VISIT *visit,
+	void *context
+);
+
+//
+// Encoded bytes per 100 raw ones so far
+//
+static __inline unsigned long SnapshotStreamRatio(const SNAPSHOT_STREAM *stream)
+{
+	return stream->RawBytes ? (unsigned long)(stream->EncodedBytes * 100 / stream->RawBytes) : 0;
+}
@@ -0,0 +1,232 @@
+/*++
+
+Module Name:
+
+    spibus.c
+
+Abstract:
+
+    Lock-free request queue and scheduling for the SPI bus owner.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "SpiBus.h"
+
+void
+SpiBusInitialize(
+	PSPI_BUS bus
+)
+{
+	unsigned int priority;
+
+	for (priority = 0; priority < SpiBusPriorityCount; priority++) {
+		bus->Pending[priority] = 0;
+		bus->Head[priority] = 0;
+		bus->Tail[priority] = 0;
+		bus->Completed[priority] = 0;
+		bus->WaitUs[priority] = 0;
+		bus->MaxWaitUs[priority] = 0;
+	}
+
+	bus->Depth = 0;
+	bus->Requests = 0;
+	bus->Transactions = 0;
+	bus->MergedReads = 0;
+	bus->Failures = 0;
+	bus->MaxDepth = 0;
+}
+
+int
+SpiBusSubmit(
+	PSPI_BUS bus,
+	SPI_BUS_REQUEST *requests,
+	unsigned int count,
+	unsigned long long now
+)
+{
+	SPI_BUS_REQUEST * volatile *pending;
+	SPI_BUS_REQUEST *head, *observed;
+	unsigned int i;
+
+	if (!count)
+		return 0;
+
+	// The list is newest first, so the chain runs from the last request back to the first
+	for (i = 0; i < count; i++) {
+		requests[i].Next = i ? &requests[i - 1] : 0;
+		requests[i].QueuedUs = now;
+		requests[i].Succeeded = 0;
+	}
+
+	// The owner only ever takes the whole list, so a head that was popped and
+	// pushed again in between is still the right thing to link behind
+	pending = &bus->Pending[requests[0].Priority];
+	head = *pending;
+	for (;;) {
+		requests[0].Next = head;
+		observed = (SPI_BUS_REQUEST *)SPI_BUS_COMPARE_EXCHANGE(pending, &requests[count - 1], head);
+		if (observed == head)
+			break;
+		head = observed;
+	}
+
+	return head == 0;
+}
+
+//
+// Moves everything pushed since the last call onto the owner's lists, oldest first
+//
+static void SpiBusCollect(PSPI_BUS bus)
+{
+	SPI_BUS_REQUEST *list, *next, *reversed;
+	unsigned int priority, count;
+
+	for (priority = 0; priority < SpiBusPriorityCount; priority++) {
+		if (!bus->Pending[priority])
+			continue;
+
+		list = (SPI_BUS_REQUEST *)SPI_BUS_EXCHANGE(&bus->Pending[priority], 0);
+
+		for (reversed = 0, count = 0; list; list = next, count++) {
+			next = list->Next;
+			list->Next = reversed;
+			reversed = list;
+		}
+
+		if (!reversed)
+			continue;
+
+		if (bus->Tail[priority])
+			bus->Tail[priority]->Next = reversed;
+		else
+			bus->Head[priority] = reversed;
+
+		while (reversed->Next)
+			reversed = reversed->Next;
+		bus->Tail[priority] = reversed;
+
+		bus->Depth += count;
+		bus->Requests += count;
+	}
+
+	if (bus->Depth > bus->MaxDepth)
+		bus->MaxDepth = bus->Depth;
+}
+
+//
+// Pulls reads queued behind the first one that overlap or touch its span
+// onto the batch. A queued write is a barrier, reads behind it stay put.
+//
+static unsigned int SpiBusMergeReads(PSPI_BUS bus, unsigned int priority, SPI_BUS_REQUEST *batch, int *first, int *last)
+{
+	SPI_BUS_REQUEST *previous, *request, *tail = batch;
+	unsigned int merged = 0, changed = 1;
+	int low, high;
+
+	while (changed) {
+		changed = 0;
+
+		for (previous = 0, request = bus->Head[priority]; request && !request->Write; ) {
+			low = request->Register < *first ? request->Register : *first;
+			high = request->Register + (int)request->Length > *last ? request->Register + (int)request->Length : *last;
+
+			if ((request->Flags & SPI_BUS_REQUEST_NO_MERGE) || request->Mode != batch->Mode ||
+				request->Register > *last || request->Register + (int)request->Length < *first ||
+				high - low > SPI_BUS_MERGE_MAX) {
+				previous = request;
+				request = request->Next;
+				continue;
+			}
+
+			if (previous)
+				previous->Next = request->Next;
+			else
+				bus->Head[priority] = request->Next;
+			if (bus->Tail[priority] == request)
+				bus->Tail[priority] = previous;
+
+			tail->Next = request;
+			tail = request;
+			request = request->Next;
+			tail->Next = 0;
+
+			*first = low;
+			*last = high;
+			merged++;
+			changed = 1;
+		}
+	}
+
+	return merged;
+}
+
+unsigned int
+SpiBusRun(
+	PSPI_BUS bus,
+	const SPI_BUS_OPS *ops,
+	void *context
+)
+{
+	SPI_BUS_REQUEST *batch, *request, *next;
+	unsigned char span[SPI_BUS_MERGE_MAX];
+	unsigned int priority, count = 0, i;
+	unsigned long long start;
+	unsigned long wait;
+	int first, last, ok;
+
+	SpiBusCollect(bus);
+
+	for (priority = 0; priority < SpiBusPriorityCount && !bus->Head[priority]; priority++);
+	if (priority == SpiBusPriorityCount)
+		return 0;
+
+	batch = bus->Head[priority];
+	bus->Head[priority] = batch->Next;
+	if (!batch->Next)
+		bus->Tail[priority] = 0;
+	batch->Next = 0;
+
+	first = batch->Register;
+	last = batch->Register + (int)batch->Length;
+
+	if (!batch->Write && !(batch->Flags & SPI_BUS_REQUEST_NO_MERGE) && batch->Length <= SPI_BUS_MERGE_MAX)
+		bus->MergedReads += SpiBusMergeReads(bus, priority, batch, &first, &last);
+
+	start = ops->Now(context);
+	bus->Transactions++;
+
+	if (!batch->Next) {
+		ok = ops->Transfer(context, batch->Mode, batch->Register, batch->Data, batch->Length, batch->Write);
+	}
+	else {
+		ok = ops->Transfer(context, batch->Mode, first, span, (unsigned int)(last - first), 0);
+		for (request = batch; ok && request; request = request->Next) {
+			for (i = 0; i < request->Length; i++)
+				request->Data[i] = span[request->Register - first + i];
+		}
+	}
+
+	if (!ok)
+		bus->Failures++;
+
+	for (request = batch; request; request = next) {
+		next = request->Next;
+
+		wait = start > request->QueuedUs ? (unsigned long)(start - request->QueuedUs) : 0;
+		bus->WaitUs[priority] += wait;
+		if (wait > bus->MaxWaitUs[priority])
+			bus->MaxWaitUs[priority] = wait;
+		bus->Completed[priority]++;
+		bus->Depth--;
+		count++;
+
+		request->Succeeded = ok;
+		ops->Complete(context, request);
+	}
+
+	return count;
+}
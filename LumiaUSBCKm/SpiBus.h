@@ -0,0 +1,135 @@
+/*++
+
+Module Name:
+
+    spibus.h
+
+Abstract:
+
+    Register transactions handed to the single thread that owns the SPI
+    bus. Any number of threads queue requests without taking a lock; the
+    owner runs them by priority class and folds queued reads of
+    neighbouring registers into one transfer. Transfers and completion go
+    through callbacks, so the queue carries no kernel dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SPI_BUS_COMPARE_EXCHANGE(dest, exchange, comparand) \
+	_InterlockedCompareExchangePointer((void * volatile *)(dest), (exchange), (comparand))
+#define SPI_BUS_EXCHANGE(dest, value) _InterlockedExchangePointer((void * volatile *)(dest), (value))
+#else
+#define SPI_BUS_COMPARE_EXCHANGE(dest, exchange, comparand) __sync_val_compare_and_swap((dest), (comparand), (exchange))
+#define SPI_BUS_EXCHANGE(dest, value) __atomic_exchange_n((dest), (value), __ATOMIC_ACQ_REL)
+#endif
+
+// Longest span two reads may be merged into
+#define SPI_BUS_MERGE_MAX 16
+
+typedef enum _SPI_BUS_PRIORITY
+{
+	// Servicing a chip interrupt, PD message timing depends on it
+	SpiBusPriorityInterrupt,
+	// Bring-up, configuration and polling
+	SpiBusPriorityControl,
+	// Probes and register dumps nobody is waiting on
+	SpiBusPriorityDiagnostic,
+	SpiBusPriorityCount
+} SPI_BUS_PRIORITY;
+
+// The register has read side effects, such as a FIFO, so the read is never merged
+#define SPI_BUS_REQUEST_NO_MERGE 0x01
+
+typedef struct _SPI_BUS_REQUEST
+{
+	struct _SPI_BUS_REQUEST *Next;
+
+	SPI_BUS_PRIORITY Priority;
+	unsigned int Flags;
+	// Passed through to the transfer, reads only merge with reads of the same mode
+	int Mode;
+	int Register;
+	unsigned char *Data;
+	unsigned int Length;
+	int Write;
+
+	// For the submitter, say to find what to signal on completion
+	void *Owner;
+
+	unsigned long long QueuedUs;
+	int Succeeded;
+} SPI_BUS_REQUEST;
+
+typedef struct _SPI_BUS_OPS
+{
+	// Runs one register transfer on the bus, returns nonzero on success
+	int (*Transfer)(void *context, int mode, int reg, unsigned char *data, unsigned int length, int write);
+	// The request may be freed as soon as this is called
+	void (*Complete)(void *context, SPI_BUS_REQUEST *request);
+	// Monotonic time in microseconds
+	unsigned long long (*Now)(void *context);
+} SPI_BUS_OPS;
+
+typedef struct _SPI_BUS
+{
+	// Newest first, pushed to by any thread
+	SPI_BUS_REQUEST * volatile Pending[SpiBusPriorityCount];
+
+	// Oldest first, only touched by the owner
+	SPI_BUS_REQUEST *Head[SpiBusPriorityCount];
+	SPI_BUS_REQUEST *Tail[SpiBusPriorityCount];
+	unsigned int Depth;
+
+	// Accounting, written by the owner only
+	unsigned long Requests;
+	unsigned long Transactions;
+	unsigned long MergedReads;
+	unsigned long Failures;
+	unsigned int MaxDepth;
+	unsigned long Completed[SpiBusPriorityCount];
+	unsigned long long WaitUs[SpiBusPriorityCount];
+	unsigned long MaxWaitUs[SpiBusPriorityCount];
+} SPI_BUS, *PSPI_BUS;
+
+void
+SpiBusInitialize(
+	PSPI_BUS bus
+);
+
+//
+// Queues count requests from an array, all of the first one's priority, to
+// be run in array order relative to each other. Safe from any number of
+// threads at once. Returns nonzero if the priority class had nothing
+// queued, in which case the owner may be waiting and needs waking.
+//
+int
+SpiBusSubmit(
+	PSPI_BUS bus,
+	SPI_BUS_REQUEST *requests,
+	unsigned int count,
+	unsigned long long now
+);
+
+//
+// Owner only. Runs the next transfer, merging reads where it can, and
+// completes the requests it covered. Returns how many that was, zero if
+// nothing was queued.
+//
+unsigned int
+SpiBusRun(
+	PSPI_BUS bus,
+	const SPI_BUS_OPS *ops,
+	void *context
+);
+
+static __inline unsigned long SpiBusAverageWaitUs(const SPI_BUS *bus, SPI_BUS_PRIORITY priority)
+{
+	return bus->Completed[priority] ? (unsigned long)(bus->WaitUs[priority] / bus->Completed[priority]) : 0;
+}
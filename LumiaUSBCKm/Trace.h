@@ -28,6 +28,11 @@ Environment:
         WPP_DEFINE_BIT(TRACE_DRIVER)                                   \
         WPP_DEFINE_BIT(TRACE_DEVICE)                                   \
         WPP_DEFINE_BIT(TRACE_QUEUE)                                    \
+        WPP_DEFINE_BIT(TRACE_SPI)                                      \
+        WPP_DEFINE_BIT(TRACE_GPIO)                                     \
+        WPP_DEFINE_BIT(TRACE_INTERRUPT)                                \
+        WPP_DEFINE_BIT(TRACE_POWER)                                    \
+        WPP_DEFINE_BIT(TRACE_UCM)                                      \
         )                             
 
 #define WPP_FLAG_LEVEL_LOGGER(flag, level)                                  \
@@ -43,6 +48,12 @@ Environment:
 #define WPP_LEVEL_FLAGS_ENABLED(lvl, flags) \
            (WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= lvl)
 
+//
+// The in-flight recorder keeps everything below TRACE_LEVEL_VERBOSE. Messages
+// on the interrupt and transfer paths are logged at TRACE_LEVEL_VERBOSE, so
+// unless a session enables them they cost the level check and nothing else.
+//
+
 //           
 // WPP orders static parameters before dynamic parameters. To support the Trace function
 // defined below which sets FLAGS=MYDRIVER_ALL_INFO, a custom macro must be defined to
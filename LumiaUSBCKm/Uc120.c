@@ -0,0 +1,213 @@
+/*++
+
+Module Name:
+
+    uc120.c
+
+Abstract:
+
+    UC120 chip logic operating on plain register values.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Uc120.h"
+
+const unsigned char Uc120ConfigValues[UC120_CONFIG_COUNT] = {
+	0x0C, 0x7C, 0x31, 0x5E, 0x0A, 0x7A, 0x2F, 0x5C, 0x9D, 0x9B
+};
+
+#define UC120_SNAPSHOT_ADDRESS(name) UC120_REG_##name,
+const unsigned char Uc120SnapshotRegisters[UC120_SNAPSHOT_COUNT] = {
+	UC120_SNAPSHOT(UC120_SNAPSHOT_ADDRESS)
+};
+#undef UC120_SNAPSHOT_ADDRESS
+
+#define UC120_REGISTER_INFO_ENTRY(name, address, width, access, flags) \
+	{ #name, (address), (width), (access), (flags) },
+const UC120_REGISTER_INFO Uc120RegisterMap[] = {
+	UC120_REGISTERS(UC120_REGISTER_INFO_ENTRY)
+};
+#undef UC120_REGISTER_INFO_ENTRY
+
+const unsigned int Uc120RegisterMapCount = sizeof(Uc120RegisterMap) / sizeof(Uc120RegisterMap[0]);
+
+#define UC120_FIELD_INFO_ENTRY(reg, name, mask) { UC120_REG_##reg, (mask), #name },
+const UC120_FIELD_INFO Uc120FieldMap[] = {
+	UC120_FIELDS(UC120_FIELD_INFO_ENTRY)
+};
+#undef UC120_FIELD_INFO_ENTRY
+
+const unsigned int Uc120FieldMapCount = sizeof(Uc120FieldMap) / sizeof(Uc120FieldMap[0]);
+
+// Default USB power is 500 mA for USB 2.0, which is all the UC120 side runs at
+const UC120_RP_DECODE Uc120RpDecodeTable[Uc120RpLevelCount] = {
+	{ Uc120RpOpen,    0 },
+	{ Uc120RpDefault, 500 },
+	{ Uc120Rp1500mA,  1500 },
+	{ Uc120Rp3000mA,  3000 }
+};
+
+const UC120_REGISTER_INFO *
+Uc120LookupRegister(
+	int reg
+)
+{
+	unsigned int i;
+
+	for (i = 0; i < Uc120RegisterMapCount; i++) {
+		if (reg >= Uc120RegisterMap[i].Address && reg < Uc120RegisterMap[i].Address + Uc120RegisterMap[i].Width)
+			return &Uc120RegisterMap[i];
+	}
+
+	return 0;
+}
+
+UC120_INIT_PROBE_RESULT
+Uc120CheckInitState(
+	const unsigned char *control,
+	unsigned char mode,
+	const unsigned char *config
+)
+{
+	int i;
+
+	// Register 5 reads back as zero until the chip has come up
+	if (control[1] == 0)
+		return Uc120InitProbeNotReady;
+
+	if ((control[0] & UC120_CONTROL_INIT_MASK) != (UC120_CONTROL_INIT & UC120_CONTROL_INIT_MASK))
+		return Uc120InitProbeMismatch;
+
+	if ((control[1] & UC120_STATUS_INIT_MASK) != (UC120_STATUS_INIT & UC120_STATUS_INIT_MASK))
+		return Uc120InitProbeMismatch;
+
+	if (mode != UC120_MODE_INIT)
+		return Uc120InitProbeMismatch;
+
+	for (i = 0; i < UC120_CONFIG_COUNT; i++) {
+		if (config[i] != Uc120ConfigValues[i])
+			return Uc120InitProbeMismatch;
+	}
+
+	return Uc120InitProbeMatch;
+}
+
+int
+Uc120IsAttached(
+	unsigned char ccStatus
+)
+{
+	return (ccStatus & (UC120_CC1 | UC120_CC2)) != 0;
+}
+
+const UC120_RP_DECODE *
+Uc120DecodeRp(
+	unsigned char ccStatus
+)
+{
+	unsigned int cc1 = Uc120Get_CC1(ccStatus), cc2 = Uc120Get_CC2(ccStatus);
+
+	// Only one pin sees Rp, the other is open or VCONN. Take the stronger one
+	// so a briefly floating pin during a plug event never lowers the level.
+	return &Uc120RpDecodeTable[cc1 > cc2 ? cc1 : cc2];
+}
+
+UC120_ORIENTATION
+Uc120DecodeOrientation(
+	unsigned char ccStatus
+)
+{
+	unsigned int cc1 = Uc120Get_CC1(ccStatus), cc2 = Uc120Get_CC2(ccStatus);
+
+	// Accessories terminate both pins the same way and have no orientation
+	if (cc1 == cc2)
+		return Uc120OrientationNone;
+
+	return cc1 > cc2 ? Uc120OrientationCc1 : Uc120OrientationCc2;
+}
+
+unsigned int
+Uc120ProbeReadStrategies(
+	UC120_READ *read,
+	void *context,
+	unsigned int rounds
+)
+{
+	unsigned char value, burst[UC120_CONFIG_COUNT];
+	unsigned int mask = 0, round;
+	int strategy, reg, i, correct;
+
+	for (strategy = 0; strategy < Uc120ReadStrategyCount; strategy++) {
+		correct = 1;
+
+		// The registers all hold different values and are read in turn, so a strategy
+		// that returns the previous transfer's answer cannot pass by accident
+		for (round = 0; correct && round < rounds; round++) {
+			for (reg = UC120_REG_CONFIG_FIRST; correct && reg <= UC120_REG_CONFIG_LAST; reg++) {
+				correct = read(context, (UC120_READ_STRATEGY)strategy, reg, &value, 1) &&
+					value == *UC120_CONFIG_VALUE(reg);
+			}
+
+			if (correct)
+				correct = read(context, (UC120_READ_STRATEGY)strategy, UC120_REG_CONFIG_FIRST, burst, sizeof(burst));
+
+			for (i = 0; correct && i < UC120_CONFIG_COUNT; i++)
+				correct = burst[i] == Uc120ConfigValues[i];
+		}
+
+		if (correct)
+			mask |= 1U << strategy;
+	}
+
+	return mask;
+}
+
+static unsigned int Uc120BitCount(unsigned char bits)
+{
+	unsigned int count;
+
+	for (count = 0; bits; bits &= bits - 1)
+		count++;
+
+	return count;
+}
+
+unsigned char
+Uc120ServiceInterrupts(
+	const UC120_INTERRUPT_OPS *ops,
+	void *context,
+	unsigned char status,
+	UC120_INTERRUPT_STATS *stats
+)
+{
+	unsigned char handled = 0;
+	unsigned int round;
+
+	stats->Services++;
+
+	for (round = 0; status && round < UC120_INTERRUPT_MAX_ROUNDS; round++) {
+		// Clearing first means an event raised while handling sets its bit again and is read next round
+		if (!ops->Acknowledge(context, status))
+			stats->AckFailures++;
+
+		stats->Events += Uc120BitCount(status);
+		if (round)
+			stats->LateEvents += Uc120BitCount(status);
+
+		ops->Handle(context, status);
+		handled |= status;
+
+		if (!ops->ReadStatus(context, &status))
+			status = 0;
+	}
+
+	stats->Rounds += round;
+	if (status)
+		stats->Overruns++;
+
+	return handled;
+}
@@ -0,0 +1,359 @@
+/*++
+
+Module Name:
+
+    uc120.h
+
+Abstract:
+
+    UC120 register definitions and the chip logic that only works on
+    register values. Nothing in here depends on the kernel, so the same
+    code can be built into host-side tools.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+//
+// The register map, the one place register numbers and bits are spelled
+// out. Everything else about a register, from the constants below to the
+// driver's read plans and cache policy and the names host tools print,
+// is generated from these lists.
+//
+// X(name, address, width, access, flags)
+//
+// Registers the driver only ever reads and whose meaning is not known are
+// taken to be volatile. Layouts worked out from traces but not confirmed
+// on hardware carry UC120_REG_UNVERIFIED, and so do the fields in them;
+// the driver only relies on them when told to.
+//
+#define UC120_REGISTERS(X) \
+	X(UNKNOWN0,           0,  1, Uc120AccessRead,       UC120_REG_VOLATILE) \
+	X(UNKNOWN1,           1,  1, Uc120AccessRead,       UC120_REG_VOLATILE) \
+	X(INTERRUPT_STATUS,   2,  1, Uc120AccessWriteClear, UC120_REG_VOLATILE) \
+	X(INTERRUPT_STATUS2,  3,  1, Uc120AccessWriteClear, UC120_REG_VOLATILE) \
+	X(CONTROL,            4,  1, Uc120AccessReadWrite,  0) \
+	X(STATUS,             5,  1, Uc120AccessReadWrite,  UC120_REG_VOLATILE) \
+	X(CC_STATUS,          7,  1, Uc120AccessRead,       UC120_REG_VOLATILE | UC120_REG_UNVERIFIED) \
+	X(UNKNOWN9,           9,  1, Uc120AccessRead,       UC120_REG_VOLATILE) \
+	X(UNKNOWN10,         10,  1, Uc120AccessRead,       UC120_REG_VOLATILE) \
+	X(UNKNOWN11,         11,  1, Uc120AccessRead,       UC120_REG_VOLATILE) \
+	X(MODE,              13,  1, Uc120AccessReadWrite,  0) \
+	X(PD_TX,             14,  1, Uc120AccessWrite,      UC120_REG_FIFO | UC120_REG_UNVERIFIED) \
+	X(PD_RX,             15,  1, Uc120AccessRead,       UC120_REG_FIFO | UC120_REG_VOLATILE | UC120_REG_UNVERIFIED) \
+	X(CONFIG,            18, 10, Uc120AccessReadWrite,  0)
+
+//
+// X(register, name, mask)
+//
+// Only the interrupt enable and mask bits are known from the original
+// bring-up. The CC change and PD bits of the interrupt status and the CC
+// pin fields are unverified.
+//
+#define UC120_FIELDS(X) \
+	X(INTERRUPT_STATUS, INT_CC_CHANGE,            0x01) \
+	X(INTERRUPT_STATUS, INT_PD_RX,                0x02) \
+	X(INTERRUPT_STATUS, INT_PD_TX_SUCCESS,        0x04) \
+	X(INTERRUPT_STATUS, INT_PD_TX_FAILED,         0x08) \
+	X(INTERRUPT_STATUS, INT_PD_TX_DISCARD,        0x10) \
+	X(INTERRUPT_STATUS, INT_PD_HARD_RESET,        0x20) \
+	X(CONTROL,          CONTROL_INTERRUPT_ENABLE, 0x01) \
+	X(STATUS,           STATUS_INTERRUPT_MASK,    0x80) \
+	X(CC_STATUS,        CC1,                      0x03) \
+	X(CC_STATUS,        CC2,                      0x0C)
+
+//
+// Registers dumped after bring-up and on every interrupt, in dump order
+//
+#define UC120_SNAPSHOT(X) \
+	X(UNKNOWN0) \
+	X(UNKNOWN1) \
+	X(INTERRUPT_STATUS) \
+	X(STATUS) \
+	X(CC_STATUS) \
+	X(UNKNOWN9) \
+	X(UNKNOWN10) \
+	X(UNKNOWN11)
+
+typedef enum _UC120_ACCESS
+{
+	Uc120AccessRead,
+	Uc120AccessWrite,
+	Uc120AccessReadWrite,
+	// Reads as set bits, writing 1 clears them
+	Uc120AccessWriteClear
+} UC120_ACCESS;
+
+// The chip changes the register on its own
+#define UC120_REG_VOLATILE 0x01
+// A single address however long the burst, reading it pops
+#define UC120_REG_FIFO     0x02
+// Inferred, not confirmed against the chip
+#define UC120_REG_UNVERIFIED 0x04
+
+// UC120_REG_<name> and UC120_WIDTH_<name>
+#define UC120_REGISTER_ADDRESS(name, address, width, access, flags) \
+	UC120_REG_##name = (address), UC120_WIDTH_##name = (width),
+enum { UC120_REGISTERS(UC120_REGISTER_ADDRESS) UC120_REG_END };
+#undef UC120_REGISTER_ADDRESS
+
+// UC120_<name> holds the field mask, Uc120Get_<name> extracts it from a register value
+#define UC120_FIELD_MASK(reg, name, mask) UC120_##name = (mask),
+enum { UC120_FIELDS(UC120_FIELD_MASK) UC120_FIELD_END };
+#undef UC120_FIELD_MASK
+
+#define UC120_FIELD_ACCESSOR(reg, name, mask) \
+	static __inline unsigned int Uc120Get_##name(unsigned char value) \
+	{ \
+		return (value & (mask)) / ((mask) & -(mask)); \
+	}
+UC120_FIELDS(UC120_FIELD_ACCESSOR)
+#undef UC120_FIELD_ACCESSOR
+
+// UC120_SNAPSHOT_<name> is the register's index in a snapshot
+#define UC120_SNAPSHOT_INDEX(name) UC120_SNAPSHOT_##name,
+enum { UC120_SNAPSHOT(UC120_SNAPSHOT_INDEX) UC120_SNAPSHOT_COUNT };
+#undef UC120_SNAPSHOT_INDEX
+
+extern const unsigned char Uc120SnapshotRegisters[UC120_SNAPSHOT_COUNT];
+
+//
+// Register masks, bit n for register n. A cacheable register is one only
+// the driver changes, so the last value written to or read from it would
+// still be current, Uc120ScriptRunCached keeps them. FIFO reads are never merged.
+//
+#define UC120_REGISTER_SPAN(address, width) ((((1UL << (width)) - 1)) << (address))
+
+#define UC120_REGISTER_CACHEABLE(name, address, width, access, flags) \
+	| (((flags) & (UC120_REG_VOLATILE | UC120_REG_FIFO)) || (access) != Uc120AccessReadWrite ? 0 : UC120_REGISTER_SPAN(address, width))
+#define UC120_REGISTER_IS_FIFO(name, address, width, access, flags) \
+	| ((flags) & UC120_REG_FIFO ? UC120_REGISTER_SPAN(address, width) : 0)
+
+static __inline unsigned long Uc120RegisterSpan(int reg, unsigned int length)
+{
+	if (reg < 0 || reg >= 32 || !length)
+		return 0;
+	return ((length >= 32 ? 0xFFFFFFFFUL : (1UL << length) - 1) << reg) & 0xFFFFFFFFUL;
+}
+
+#define UC120_CACHEABLE_REGISTERS (0UL UC120_REGISTERS(UC120_REGISTER_CACHEABLE))
+#define UC120_FIFO_REGISTERS      (0UL UC120_REGISTERS(UC120_REGISTER_IS_FIFO))
+
+//
+// For tools printing register values, generated from the lists above
+//
+typedef struct _UC120_REGISTER_INFO
+{
+	const char *Name;
+	unsigned char Address;
+	unsigned char Width;
+	UC120_ACCESS Access;
+	unsigned int Flags;
+} UC120_REGISTER_INFO;
+
+typedef struct _UC120_FIELD_INFO
+{
+	unsigned char Address;
+	unsigned char Mask;
+	const char *Name;
+} UC120_FIELD_INFO;
+
+extern const UC120_REGISTER_INFO Uc120RegisterMap[];
+extern const unsigned int Uc120RegisterMapCount;
+extern const UC120_FIELD_INFO Uc120FieldMap[];
+extern const unsigned int Uc120FieldMapCount;
+
+//
+// The map entry covering reg, or null if the register is not in the map
+//
+const UC120_REGISTER_INFO *
+Uc120LookupRegister(
+	int reg
+);
+
+#define UC120_REG_CONFIG_FIRST UC120_REG_CONFIG
+#define UC120_REG_CONFIG_LAST  (UC120_REG_CONFIG + UC120_WIDTH_CONFIG - 1)
+#define UC120_CONFIG_COUNT     UC120_WIDTH_CONFIG
+
+#define UC120_INT_PD_TX_DONE (UC120_INT_PD_TX_SUCCESS | UC120_INT_PD_TX_FAILED | UC120_INT_PD_TX_DISCARD)
+
+//
+// Values programmed during bring-up. The interrupt enable/mask bits are
+// flipped by Uc120InterruptEnable afterwards, so they are ignored when
+// checking whether the chip is still configured.
+//
+#define UC120_CONTROL_INIT  0x06
+#define UC120_STATUS_INIT   0x88
+#define UC120_MODE_INIT     0x02
+
+#define UC120_CONTROL_INIT_MASK ((unsigned char)~UC120_CONTROL_INTERRUPT_ENABLE)
+#define UC120_STATUS_INIT_MASK  ((unsigned char)~UC120_STATUS_INTERRUPT_MASK)
+
+//
+// Configuration values for registers 18 to 27, indexed by register number
+//
+extern const unsigned char Uc120ConfigValues[UC120_CONFIG_COUNT];
+
+#define UC120_CONFIG_VALUE(reg) (&Uc120ConfigValues[(reg) - UC120_REG_CONFIG_FIRST])
+
+typedef enum _UC120_INIT_PROBE_RESULT
+{
+	Uc120InitProbeMatch,
+	Uc120InitProbeMismatch,
+	Uc120InitProbeNotReady
+} UC120_INIT_PROBE_RESULT;
+
+//
+// Decides whether a previously configured chip can skip bring-up, given
+// the contents of registers 4-5, 13 and 18-27 as read back from it.
+//
+UC120_INIT_PROBE_RESULT
+Uc120CheckInitState(
+	const unsigned char *control,
+	unsigned char mode,
+	const unsigned char *config
+);
+
+//
+// Returns nonzero if the CC status shows a partner on either CC pin
+//
+int
+Uc120IsAttached(
+	unsigned char ccStatus
+);
+
+//
+// Current advertised by the source's Rp, as seen on the active CC pin
+// while we are the sink. The values are the CC status pin encoding.
+//
+typedef enum _UC120_RP_LEVEL
+{
+	Uc120RpOpen,
+	Uc120RpDefault,
+	Uc120Rp1500mA,
+	Uc120Rp3000mA,
+	Uc120RpLevelCount
+} UC120_RP_LEVEL;
+
+typedef struct _UC120_RP_DECODE
+{
+	UC120_RP_LEVEL Level;
+	unsigned int CurrentMa;
+} UC120_RP_DECODE;
+
+extern const UC120_RP_DECODE Uc120RpDecodeTable[Uc120RpLevelCount];
+
+//
+// Decodes the Rp level from the CC status, using whichever pin carries it
+//
+const UC120_RP_DECODE *
+Uc120DecodeRp(
+	unsigned char ccStatus
+);
+
+//
+// Plug orientation, from which CC pin carries the partner's termination
+//
+typedef enum _UC120_ORIENTATION
+{
+	Uc120OrientationNone,
+	Uc120OrientationCc1,
+	Uc120OrientationCc2
+} UC120_ORIENTATION;
+
+UC120_ORIENTATION
+Uc120DecodeOrientation(
+	unsigned char ccStatus
+);
+
+//
+// Ways of reading a register over the SPI controller, cheapest first. The
+// chip's answer may trail the command by a few bytes, so the split
+// transfers throw away that many reads before keeping one.
+//
+typedef enum _UC120_READ_STRATEGY
+{
+	Uc120ReadFullDuplex,
+	Uc120ReadDummy0,
+	Uc120ReadDummy1,
+	Uc120ReadDummy2,
+	Uc120ReadDummy3,
+	Uc120ReadStrategyCount
+} UC120_READ_STRATEGY;
+
+#define UC120_READ_DUMMIES(strategy) ((unsigned int)((strategy) - Uc120ReadDummy0))
+
+// What the driver always did before the strategy was probed
+#define UC120_READ_STRATEGY_DEFAULT Uc120ReadDummy2
+
+typedef int UC120_READ(void *context, UC120_READ_STRATEGY strategy, int reg, unsigned char *value, unsigned int length);
+
+//
+// Reads the configuration registers, which hold known values once the
+// chip is set up, with every strategy for the given number of rounds.
+// Returns a mask with bit n set if strategy n was right every time.
+//
+unsigned int
+Uc120ProbeReadStrategies(
+	UC120_READ *read,
+	void *context,
+	unsigned int rounds
+);
+
+//
+// Picks the cheapest strategy from a probe mask, or fallback if none worked
+//
+static __inline UC120_READ_STRATEGY Uc120CheapestReadStrategy(unsigned int mask, UC120_READ_STRATEGY fallback)
+{
+	int strategy;
+
+	for (strategy = 0; strategy < Uc120ReadStrategyCount; strategy++) {
+		if (mask & (1U << strategy))
+			return (UC120_READ_STRATEGY)strategy;
+	}
+
+	return fallback;
+}
+
+//
+// Interrupt status servicing. The status register is write 1 to clear, so
+// only the bits that were read get acknowledged, before they are handled:
+// anything raised in between stays set for the next read.
+//
+#define UC120_INTERRUPT_MAX_ROUNDS 8
+
+typedef struct _UC120_INTERRUPT_OPS
+{
+	// Return nonzero on success
+	int (*ReadStatus)(void *context, unsigned char *status);
+	int (*Acknowledge)(void *context, unsigned char bits);
+	void (*Handle)(void *context, unsigned char bits);
+} UC120_INTERRUPT_OPS;
+
+typedef struct _UC120_INTERRUPT_STATS
+{
+	unsigned long Services;
+	// Status bits handled, and those that only turned up on a re-read
+	unsigned long Events;
+	unsigned long LateEvents;
+	unsigned long Rounds;
+	// Gave up with bits still pending, the interrupt fires again for them
+	unsigned long Overruns;
+	unsigned long AckFailures;
+} UC120_INTERRUPT_STATS;
+
+//
+// Acknowledges and handles status, which was just read from the chip, then
+// reads again until nothing is pending. Returns every bit that was handled.
+//
+unsigned char
+Uc120ServiceInterrupts(
+	const UC120_INTERRUPT_OPS *ops,
+	void *context,
+	unsigned char status,
+	UC120_INTERRUPT_STATS *stats
+);
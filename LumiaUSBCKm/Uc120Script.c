@@ -0,0 +1,273 @@
+/*++
+
+Module Name:
+
+    uc120script.c
+
+Abstract:
+
+    UC120 register script engine and the driver's sequences.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Uc120.h"
+#include "Uc120Script.h"
+
+#define UC120_SCRIPT_BIT(reg) (1UL << (reg))
+
+const UC120_SCRIPT_OP Uc120InitScript[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, UC120_CONTROL_INIT),
+	UC120_SCRIPT_WRITE(UC120_REG_STATUS, UC120_STATUS_INIT),
+	UC120_SCRIPT_WRITE(UC120_REG_MODE, UC120_MODE_INIT),
+	UC120_SCRIPT_WRITE_BLOCK(UC120_REG_CONFIG_FIRST, Uc120ConfigValues, UC120_CONFIG_COUNT),
+	// Register 5 reads back as zero until the chip has taken the configuration
+	UC120_SCRIPT_DELAY(100),
+	UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 501),
+	UC120_SCRIPT_END()
+};
+
+const UC120_SCRIPT_OP Uc120InterruptEnableScript[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_INTERRUPT_STATUS, 0xFF),
+	UC120_SCRIPT_WRITE(UC120_REG_INTERRUPT_STATUS2, 0xFF),
+	UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0, UC120_CONTROL_INTERRUPT_ENABLE),
+	UC120_SCRIPT_MODIFY(UC120_REG_STATUS, UC120_STATUS_INTERRUPT_MASK, 0),
+	UC120_SCRIPT_END()
+};
+
+const UC120_SCRIPT_OP Uc120InterruptDisableScript[] = {
+	UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, UC120_CONTROL_INTERRUPT_ENABLE, 0),
+	UC120_SCRIPT_END()
+};
+
+//
+// Issues one transfer per run of consecutive registers in the mask, lowest first
+//
+static int Uc120ScriptBursts(
+	int (*transfer)(void *context, int reg, unsigned char *value, unsigned int length),
+	void *context,
+	unsigned long mask,
+	unsigned char *image,
+	UC120_SCRIPT_RESULT *result
+)
+{
+	int reg = 0, first;
+
+	while (reg < UC120_SCRIPT_REG_COUNT) {
+		if (!(mask & UC120_SCRIPT_BIT(reg))) {
+			reg++;
+			continue;
+		}
+
+		for (first = reg; reg < UC120_SCRIPT_REG_COUNT && (mask & UC120_SCRIPT_BIT(reg)); reg++);
+
+		result->Transactions++;
+		result->Bytes += reg - first;
+		if (!transfer(context, first, image + first, reg - first))
+			return 0;
+	}
+
+	return 1;
+}
+
+//
+// Copies the registers in mask between the cache and the image
+//
+static void Uc120ScriptCacheCopy(unsigned char *to, const unsigned char *from, unsigned long mask)
+{
+	int reg;
+
+	for (reg = 0; reg < UC120_SCRIPT_REG_COUNT; reg++) {
+		if (mask & UC120_SCRIPT_BIT(reg))
+			to[reg] = from[reg];
+	}
+}
+
+//
+// Runs the register writes and modifies in [first, last). They commute, so
+// each register is read at most once, before anything is written, and the
+// final values go out in as few bursts as possible.
+//
+static int Uc120ScriptSegment(
+	const UC120_SCRIPT_OP *script,
+	int first,
+	int last,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_CACHE *cache,
+	UC120_SCRIPT_RESULT *result
+)
+{
+	unsigned char image[UC120_SCRIPT_REG_COUNT];
+	unsigned long read = 0, dirty = 0, known = 0;
+	const UC120_SCRIPT_OP *op;
+	int i;
+	unsigned int j;
+
+	// Only a modify of a register the segment has not fully set needs its old value
+	for (i = first; i < last; i++) {
+		op = &script[i];
+		if (op->Type == Uc120ScriptWriteBlock) {
+			if (op->Register + op->Count > UC120_SCRIPT_REG_COUNT)
+				return 0;
+			for (j = 0; j < op->Count; j++)
+				dirty |= UC120_SCRIPT_BIT(op->Register + j);
+			result->Accesses += op->Count;
+			continue;
+		}
+
+		if (op->Register >= UC120_SCRIPT_REG_COUNT)
+			return 0;
+
+		if (op->Type == Uc120ScriptModify) {
+			if (op->Mask != 0xFF && !(dirty & UC120_SCRIPT_BIT(op->Register)))
+				read |= UC120_SCRIPT_BIT(op->Register);
+			result->Accesses++;
+		}
+
+		dirty |= UC120_SCRIPT_BIT(op->Register);
+		result->Accesses++;
+	}
+
+	// Nobody else changes a cacheable register, so a value the cache holds needs no read
+	if (cache) {
+		known = read & cache->Valid & UC120_CACHEABLE_REGISTERS;
+		Uc120ScriptCacheCopy(image, cache->Values, known);
+		for (read &= ~known; known; known &= known - 1)
+			result->CachedReads++;
+	}
+
+	if (!Uc120ScriptBursts(ops->Read, context, read, image, result))
+		return 0;
+
+	if (cache) {
+		Uc120ScriptCacheCopy(cache->Values, image, read & UC120_CACHEABLE_REGISTERS);
+		cache->Valid |= read & UC120_CACHEABLE_REGISTERS;
+	}
+
+	for (i = first; i < last; i++) {
+		op = &script[i];
+		switch (op->Type) {
+		case Uc120ScriptWrite:
+			image[op->Register] = op->Value;
+			break;
+		case Uc120ScriptWriteBlock:
+			for (j = 0; j < op->Count; j++)
+				image[op->Register + j] = op->Data[j];
+			break;
+		default:
+			image[op->Register] = (unsigned char)((image[op->Register] & ~op->Mask) | op->Value);
+			break;
+		}
+	}
+
+	if (!Uc120ScriptBursts(ops->Write, context, dirty, image, result)) {
+		// Some of the bursts may have gone out, the registers are anywhere now
+		if (cache)
+			cache->Valid &= ~dirty;
+		return 0;
+	}
+
+	if (cache) {
+		Uc120ScriptCacheCopy(cache->Values, image, dirty & UC120_CACHEABLE_REGISTERS);
+		cache->Valid |= dirty & UC120_CACHEABLE_REGISTERS;
+	}
+
+	return 1;
+}
+
+static int Uc120ScriptWait(
+	const UC120_SCRIPT_OP *op,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_RESULT *result
+)
+{
+	unsigned int poll;
+	int equal;
+
+	for (poll = 0; poll < op->Count; poll++) {
+		if (poll && op->Time)
+			ops->Delay(context, op->Time);
+
+		result->Transactions++;
+		result->Bytes++;
+		result->Polls++;
+		if (!ops->Read(context, op->Register, &result->WaitValue, 1))
+			continue;
+
+		equal = (result->WaitValue & op->Mask) == op->Value;
+		if (equal == (op->Type == Uc120ScriptWaitEqual))
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+Uc120ScriptRun(
+	const UC120_SCRIPT_OP *script,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_RESULT *result
+)
+{
+	return Uc120ScriptRunCached(script, ops, context, 0, result);
+}
+
+int
+Uc120ScriptRunCached(
+	const UC120_SCRIPT_OP *script,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_CACHE *cache,
+	UC120_SCRIPT_RESULT *result
+)
+{
+	int i = 0, first, ok;
+
+	result->Transactions = 0;
+	result->Accesses = 0;
+	result->Bytes = 0;
+	result->Polls = 0;
+	result->WaitValue = 0;
+	result->CachedReads = 0;
+	result->FailedOp = -1;
+
+	for (;;) {
+		for (first = i; script[i].Type == Uc120ScriptWrite || script[i].Type == Uc120ScriptWriteBlock ||
+			script[i].Type == Uc120ScriptModify; i++);
+
+		if (i > first && !Uc120ScriptSegment(script, first, i, ops, context, cache, result)) {
+			result->FailedOp = first;
+			return 0;
+		}
+
+		switch (script[i].Type) {
+		case Uc120ScriptEnd:
+			return 1;
+		case Uc120ScriptDelay:
+			if (script[i].Time)
+				ops->Delay(context, script[i].Time);
+			ok = 1;
+			break;
+		case Uc120ScriptWaitEqual:
+		case Uc120ScriptWaitNotEqual:
+			ok = Uc120ScriptWait(&script[i], ops, context, result);
+			break;
+		default:
+			ok = 1;
+			break;
+		}
+
+		if (!ok) {
+			result->FailedOp = i;
+			return 0;
+		}
+
+		i++;
+	}
+}
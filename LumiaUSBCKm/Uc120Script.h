@@ -0,0 +1,147 @@
+/*++
+
+Module Name:
+
+    uc120script.h
+
+Abstract:
+
+    Declarative UC120 register sequences and the engine that runs them.
+    Register accesses between two ordering points are taken to commute,
+    so the engine is free to gather them into as few bursts as the
+    register layout allows. Like uc120.h it carries no kernel
+    dependencies.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+// Registers a script may touch, the chip has fewer
+#define UC120_SCRIPT_REG_COUNT 32
+
+typedef enum _UC120_SCRIPT_OP_TYPE
+{
+	Uc120ScriptEnd,
+	// Register = Value
+	Uc120ScriptWrite,
+	// Count registers from Register = Data[0..Count-1]
+	Uc120ScriptWriteBlock,
+	// Register = (Register & ~Mask) | Value
+	Uc120ScriptModify,
+	// Ordering point, everything before it reaches the chip first
+	Uc120ScriptFence,
+	// Ordering point, then sleeps Time milliseconds
+	Uc120ScriptDelay,
+	// Ordering point, then reads the register until (Register & Mask) == Value,
+	// sleeping Time milliseconds between at most Count reads
+	Uc120ScriptWaitEqual,
+	// As above, until (Register & Mask) != Value
+	Uc120ScriptWaitNotEqual
+} UC120_SCRIPT_OP_TYPE;
+
+typedef struct _UC120_SCRIPT_OP
+{
+	UC120_SCRIPT_OP_TYPE Type;
+	unsigned char Register;
+	unsigned char Mask;
+	unsigned char Value;
+	unsigned short Time;
+	unsigned short Count;
+	const unsigned char *Data;
+} UC120_SCRIPT_OP;
+
+#define UC120_SCRIPT_WRITE(reg, value)          { Uc120ScriptWrite, (reg), 0xFF, (value), 0, 0, 0 }
+#define UC120_SCRIPT_WRITE_BLOCK(reg, data, count) { Uc120ScriptWriteBlock, (reg), 0xFF, 0, 0, (count), (data) }
+#define UC120_SCRIPT_MODIFY(reg, clear, set)    { Uc120ScriptModify, (reg), (unsigned char)((clear) | (set)), (set), 0, 0, 0 }
+#define UC120_SCRIPT_FENCE()                    { Uc120ScriptFence, 0, 0, 0, 0, 0, 0 }
+#define UC120_SCRIPT_DELAY(ms)                  { Uc120ScriptDelay, 0, 0, 0, (ms), 0, 0 }
+#define UC120_SCRIPT_WAIT(reg, mask, value, ms, polls)     { Uc120ScriptWaitEqual, (reg), (mask), (value), (ms), (polls), 0 }
+#define UC120_SCRIPT_WAIT_NOT(reg, mask, value, ms, polls) { Uc120ScriptWaitNotEqual, (reg), (mask), (value), (ms), (polls), 0 }
+#define UC120_SCRIPT_END()                      { Uc120ScriptEnd, 0, 0, 0, 0, 0, 0 }
+
+typedef struct _UC120_SCRIPT_OPS
+{
+	// Register accesses starting at reg, return nonzero on success
+	int (*Read)(void *context, int reg, unsigned char *value, unsigned int length);
+	int (*Write)(void *context, int reg, unsigned char *value, unsigned int length);
+	// Sleeps, the engine never calls it with zero
+	void (*Delay)(void *context, unsigned int ms);
+} UC120_SCRIPT_OPS;
+
+typedef struct _UC120_SCRIPT_RESULT
+{
+	// Bus transactions issued, and the register accesses the script spelled out
+	unsigned int Transactions;
+	unsigned int Accesses;
+	unsigned int Bytes;
+
+	// Reads spent in wait operations, and the last value one of them saw
+	unsigned int Polls;
+	unsigned char WaitValue;
+
+	// Register reads a modify did not need because the cache knew the value
+	unsigned int CachedReads;
+
+	// Index of the operation that failed or timed out, -1 if none did
+	int FailedOp;
+} UC120_SCRIPT_RESULT;
+
+//
+// Last known values of the registers in UC120_CACHEABLE_REGISTERS, those
+// only the driver changes. Filled by what scripts read and write; must be
+// invalidated whenever the chip may have lost its registers.
+//
+typedef struct _UC120_SCRIPT_CACHE
+{
+	// Bit n set while Values[n] is what register n holds
+	unsigned long Valid;
+	unsigned char Values[UC120_SCRIPT_REG_COUNT];
+} UC120_SCRIPT_CACHE;
+
+static __inline void Uc120ScriptCacheInvalidate(UC120_SCRIPT_CACHE *cache)
+{
+	cache->Valid = 0;
+}
+
+//
+// Runs a script ending in UC120_SCRIPT_END. Returns nonzero if every
+// access succeeded and every wait was satisfied; it stops at the first
+// operation that was not.
+//
+int
+Uc120ScriptRun(
+	const UC120_SCRIPT_OP *script,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_RESULT *result
+);
+
+//
+// As Uc120ScriptRun, but a modify of a cacheable register takes its old
+// value from the cache rather than reading it. The cache may be NULL.
+//
+int
+Uc120ScriptRunCached(
+	const UC120_SCRIPT_OP *script,
+	const UC120_SCRIPT_OPS *ops,
+	void *context,
+	UC120_SCRIPT_CACHE *cache,
+	UC120_SCRIPT_RESULT *result
+);
+
+//
+// Bring-up: control, status and mode, then the configuration block, then
+// wait for the status register to come up
+//
+extern const UC120_SCRIPT_OP Uc120InitScript[];
+
+//
+// Clears pending interrupts and unmasks them, run whenever the interrupt is enabled
+//
+extern const UC120_SCRIPT_OP Uc120InterruptEnableScript[];
+
+extern const UC120_SCRIPT_OP Uc120InterruptDisableScript[];
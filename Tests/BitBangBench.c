@@ -0,0 +1,267 @@
+/*++
+
+Module Name:
+
+    bitbangbench.c
+
+Abstract:
+
+    Benchmarks the fake SPI path on the mock GPIO backend. The first
+    table runs calibrated transfers for a range of GPIO IOCTL costs
+    and reports bit time, throughput and jitter in virtual time. The
+    second runs the driver's queueing arrangement: producer threads
+    submit register reads through spibus.c to one owner thread, which
+    clocks them out with bitbang.c and yields between transactions.
+    It reports the real time requests waited in the queue.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "MockGpio.h"
+#include "SpiBus.h"
+
+#define TIMING_TRANSFERS 20000
+#define QUEUE_REQUESTS 20000
+
+typedef struct _TIMING_CASE
+{
+	unsigned int IoctlNs;
+	unsigned int JitterNs;
+} TIMING_CASE;
+
+static const TIMING_CASE TimingCases[] = {
+	{ 200, 0 },
+	{ 500, 0 },
+	{ 500, 1000 },
+	{ 1000, 0 },
+	{ 1000, 5000 },
+	{ 3000, 0 },
+};
+
+static void RunTiming(const TIMING_CASE *c)
+{
+	MOCK_GPIO mock;
+	BIT_BANG bitBang;
+	unsigned char data[2];
+	unsigned long long jitterTotal = 0;
+	unsigned int i;
+
+	MockGpioInitialize(&mock, 1);
+	mock.IoctlNs = c->IoctlNs;
+	mock.JitterNs = c->JitterNs;
+	mock.UseShadow = 1;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	BitBangCalibrate(&bitBang);
+
+	for (i = 0; i < TIMING_TRANSFERS; i++) {
+		BitBangTransfer(&bitBang, (unsigned char)((i & 0x1F) << 3), data, sizeof(data), 0);
+		jitterTotal += bitBang.LastJitterNs;
+	}
+
+	printf("%5u ns IOCTL, %5u ns jitter: stall %u us, bit %5lu ns, %6lu bytes/s, jitter avg %5lu ns max %5lu ns\n",
+		c->IoctlNs, c->JitterNs, bitBang.StallUs, bitBang.BitTimeNs, BitBangThroughput(&bitBang),
+		(unsigned long)(jitterTotal / TIMING_TRANSFERS), bitBang.MaxJitterNs);
+}
+
+typedef struct _BUS_OWNER
+{
+	SPI_BUS Bus;
+	MOCK_GPIO Mock;
+	BIT_BANG BitBang;
+
+	// The driver's BusWake event, set by a submit that found its queue empty
+	pthread_mutex_t Lock;
+	pthread_cond_t Wake;
+	int Woken;
+	int Stop;
+} BUS_OWNER;
+
+typedef struct _SUBMISSION
+{
+	pthread_mutex_t Lock;
+	pthread_cond_t Done;
+	int Remaining;
+} SUBMISSION;
+
+static unsigned long long RealNowUs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int OwnerTransfer(void *context, int mode, int reg, unsigned char *data, unsigned int length, int write)
+{
+	BUS_OWNER *owner = (BUS_OWNER *)context;
+
+	(void)mode;
+	return BitBangTransfer(&owner->BitBang, (unsigned char)((reg << 3) | (write ? 1 : 0)), data, length, write);
+}
+
+static void OwnerComplete(void *context, SPI_BUS_REQUEST *request)
+{
+	SUBMISSION *submission = (SUBMISSION *)request->Owner;
+
+	(void)context;
+
+	pthread_mutex_lock(&submission->Lock);
+	if (--submission->Remaining == 0)
+		pthread_cond_signal(&submission->Done);
+	pthread_mutex_unlock(&submission->Lock);
+}
+
+static unsigned long long OwnerNow(void *context)
+{
+	(void)context;
+	return RealNowUs();
+}
+
+static const SPI_BUS_OPS OwnerOps = { OwnerTransfer, OwnerComplete, OwnerNow };
+
+//
+// LumiaUSBCBusThread: sleep until woken, then run the queues dry
+//
+static void *OwnerThread(void *context)
+{
+	BUS_OWNER *owner = (BUS_OWNER *)context;
+
+	for (;;) {
+		pthread_mutex_lock(&owner->Lock);
+		while (!owner->Woken && !owner->Stop)
+			pthread_cond_wait(&owner->Wake, &owner->Lock);
+		owner->Woken = 0;
+		pthread_mutex_unlock(&owner->Lock);
+
+		while (SpiBusRun(&owner->Bus, &OwnerOps, owner))
+			sched_yield();
+
+		if (owner->Stop)
+			break;
+	}
+
+	return NULL;
+}
+
+static BUS_OWNER Owner;
+
+//
+// LumiaUSBCBusSubmit: queue the requests, wake the owner if needed, wait for all of them
+//
+static void Submit(SPI_BUS_REQUEST *requests, unsigned int count)
+{
+	SUBMISSION submission;
+	unsigned int i;
+
+	pthread_mutex_init(&submission.Lock, NULL);
+	pthread_cond_init(&submission.Done, NULL);
+	submission.Remaining = (int)count;
+
+	for (i = 0; i < count; i++)
+		requests[i].Owner = &submission;
+
+	if (SpiBusSubmit(&Owner.Bus, requests, count, RealNowUs())) {
+		pthread_mutex_lock(&Owner.Lock);
+		Owner.Woken = 1;
+		pthread_cond_signal(&Owner.Wake);
+		pthread_mutex_unlock(&Owner.Lock);
+	}
+
+	pthread_mutex_lock(&submission.Lock);
+	while (submission.Remaining)
+		pthread_cond_wait(&submission.Done, &submission.Lock);
+	pthread_mutex_unlock(&submission.Lock);
+
+	pthread_cond_destroy(&submission.Done);
+	pthread_mutex_destroy(&submission.Lock);
+}
+
+static void *Producer(void *context)
+{
+	unsigned int seed = (unsigned int)(size_t)context, i, j, count;
+	unsigned char data[4][2];
+	SPI_BUS_REQUEST requests[4];
+
+	for (i = 0; i < QUEUE_REQUESTS; i += count) {
+		seed = seed * 1103515245 + 12345;
+		count = 1 + (seed >> 16) % 4;
+
+		// Runs of neighbouring one-byte reads, the owner may fold them into one transfer
+		memset(requests, 0, sizeof(requests));
+		for (j = 0; j < count; j++) {
+			requests[j].Priority = (seed >> 20) & 1 ? SpiBusPriorityInterrupt : SpiBusPriorityControl;
+			requests[j].Register = (int)(((seed >> 24) & 0x0F) + j);
+			requests[j].Data = data[j];
+			requests[j].Length = 1;
+		}
+
+		Submit(requests, count);
+	}
+
+	return NULL;
+}
+
+static void RunQueue(unsigned int producers)
+{
+	pthread_t owner, threads[16];
+	unsigned long long start, elapsed;
+	unsigned int i;
+
+	memset(&Owner, 0, sizeof(Owner));
+	SpiBusInitialize(&Owner.Bus);
+	MockGpioInitialize(&Owner.Mock, 1);
+	Owner.Mock.UseShadow = 1;
+	BitBangInitialize(&Owner.BitBang, &MockGpioOps, &Owner.Mock, 1);
+	BitBangCalibrate(&Owner.BitBang);
+	pthread_mutex_init(&Owner.Lock, NULL);
+	pthread_cond_init(&Owner.Wake, NULL);
+
+	pthread_create(&owner, NULL, OwnerThread, &Owner);
+
+	start = RealNowUs();
+	for (i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, Producer, (void *)(size_t)(i + 1));
+	for (i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = RealNowUs() - start;
+
+	pthread_mutex_lock(&Owner.Lock);
+	Owner.Stop = 1;
+	pthread_cond_signal(&Owner.Wake);
+	pthread_mutex_unlock(&Owner.Lock);
+	pthread_join(owner, NULL);
+
+	printf("%2u producers: %7lu requests in %7lu transfers, %6lu merged, %8.0f requests/s, max depth %2u, "
+		"wait avg/max interrupt %4lu/%6lu us control %4lu/%6lu us\n",
+		producers, Owner.Bus.Requests, Owner.Bus.Transactions, Owner.Bus.MergedReads,
+		elapsed ? Owner.Bus.Requests * 1e6 / elapsed : 0.0, Owner.Bus.MaxDepth,
+		SpiBusAverageWaitUs(&Owner.Bus, SpiBusPriorityInterrupt), Owner.Bus.MaxWaitUs[SpiBusPriorityInterrupt],
+		SpiBusAverageWaitUs(&Owner.Bus, SpiBusPriorityControl), Owner.Bus.MaxWaitUs[SpiBusPriorityControl]);
+
+	pthread_cond_destroy(&Owner.Wake);
+	pthread_mutex_destroy(&Owner.Lock);
+}
+
+int main(void)
+{
+	static const unsigned int producers[] = { 1, 2, 4, 8, 16 };
+	unsigned int i;
+
+	printf("BitBangBench timing, virtual time\n");
+	for (i = 0; i < sizeof(TimingCases) / sizeof(TimingCases[0]); i++)
+		RunTiming(&TimingCases[i]);
+
+	printf("BitBangBench queueing, real time\n");
+	for (i = 0; i < sizeof(producers) / sizeof(producers[0]); i++)
+		RunQueue(producers[i]);
+
+	return 0;
+}
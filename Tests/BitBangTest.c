@@ -0,0 +1,214 @@
+/*++
+
+Module Name:
+
+    bitbangtest.c
+
+Abstract:
+
+    Tests for the bit-bang engine in bitbang.c against the mock GPIO
+    backend: what goes out on the wire, calibration of the stalls, the
+    jitter and throughput accounting, and recovery from a failed pin.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "MockGpio.h"
+
+static void TestWire(void)
+{
+	static const unsigned char data[] = { 0x00, 0xFF, 0xA5, 0x3C, 0x80 };
+	MOCK_GPIO mock, reference;
+	BIT_BANG bitBang;
+	unsigned char read[4], expected;
+	unsigned int i, j;
+	int shadow;
+
+	// The command and the data go out MSB first in one CS frame, the shadow changes nothing on the wire
+	for (shadow = 0; shadow <= 1; shadow++) {
+		MockGpioInitialize(&mock, 7);
+		mock.UseShadow = shadow;
+		BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+
+		CHECK(BitBangTransfer(&bitBang, 0x41, (unsigned char *)data, sizeof(data), 1));
+		CHECK_EQUAL(mock.CapturedBytes, 1 + sizeof(data));
+		CHECK_EQUAL(mock.CapturedBits, 0);
+		CHECK_EQUAL(mock.Captured[0], 0x41);
+		CHECK(memcmp(&mock.Captured[1], data, sizeof(data)) == 0);
+		CHECK_EQUAL(mock.Level[BitBangPinCs], 1);
+		CHECK_EQUAL(mock.Level[BitBangPinClk], 1);
+
+		if (shadow)
+			CHECK(MockGpioSuppressed(&mock) > 0);
+		else
+			CHECK_EQUAL(MockGpioIssued(&mock), 2 + 8 * (1 + sizeof(data)) * 3);
+	}
+
+	// Reads sample MISO before the falling edge, one GPIO read per bit
+	MockGpioInitialize(&mock, 11);
+	reference = mock;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	CHECK(BitBangTransfer(&bitBang, 0x50, read, sizeof(read), 0));
+	CHECK_EQUAL(mock.Reads, 8 * sizeof(read));
+	CHECK_EQUAL(mock.CapturedBytes, 1 + sizeof(read));
+	CHECK_EQUAL(mock.Captured[0], 0x50);
+	for (i = 0; i < sizeof(read); i++) {
+		for (expected = 0, j = 0; j < 8; j++)
+			expected = (unsigned char)((expected << 1) | (MockGpioRandom(&reference) & 1));
+		CHECK_EQUAL(read[i], expected);
+	}
+
+	// A bare write clocks bytes without touching CS or the transaction count
+	MockGpioInitialize(&mock, 1);
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	mock.Level[BitBangPinCs] = 0;
+	CHECK(BitBangWrite(&bitBang, data, sizeof(data)));
+	CHECK_EQUAL(mock.CapturedBytes, sizeof(data));
+	CHECK_EQUAL(mock.Issued[BitBangPinCs], 0);
+	CHECK_EQUAL(bitBang.Transactions, 0);
+	CHECK_EQUAL(bitBang.Bytes, sizeof(data));
+}
+
+typedef struct _CALIBRATION_CASE
+{
+	unsigned int HalfPeriodUs;
+	unsigned int IoctlNs;
+	unsigned int StallUs;
+} CALIBRATION_CASE;
+
+static const CALIBRATION_CASE CalibrationCases[] = {
+	// What is left of the half period once the pin write is paid for, rounded
+	{ 1, 0, 1 },
+	{ 1, 300, 1 },
+	{ 1, 600, 0 },
+	{ 1, 2000, 0 },
+	{ 2, 300, 2 },
+	{ 2, 1400, 1 },
+	{ 5, 800, 4 },
+	{ 10, 250, 10 },
+};
+
+static void TestCalibration(void)
+{
+	const CALIBRATION_CASE *c;
+	MOCK_GPIO mock;
+	BIT_BANG bitBang;
+	unsigned char data[2] = { 0 };
+	unsigned long expectedNs;
+	unsigned int i;
+
+	// Uncalibrated, every phase stalls the full half period
+	MockGpioInitialize(&mock, 1);
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 3);
+	CHECK_EQUAL(bitBang.StallUs, 3);
+	CHECK(!bitBang.Calibrated);
+
+	for (i = 0; i < sizeof(CalibrationCases) / sizeof(CalibrationCases[0]); i++) {
+		c = &CalibrationCases[i];
+
+		MockGpioInitialize(&mock, 1);
+		mock.IoctlNs = c->IoctlNs;
+		BitBangInitialize(&bitBang, &MockGpioOps, &mock, c->HalfPeriodUs);
+
+		CHECK(BitBangCalibrate(&bitBang));
+		CHECK(bitBang.Calibrated);
+		// Timed on the microsecond clock, so within a microsecond over the cycles
+		CHECK(bitBang.EdgeCostNs <= c->IoctlNs + 1000 / 32 && bitBang.EdgeCostNs + 1000 / 32 >= c->IoctlNs);
+		CHECK_EQUAL(bitBang.StallUs, c->StallUs);
+		// Calibration never selects the chip
+		CHECK_EQUAL(mock.CapturedBits + mock.CapturedBytes, 0);
+
+		// A written bit is two stalls and three pin writes
+		CHECK(BitBangTransfer(&bitBang, 0x01, data, sizeof(data), 1));
+		expectedNs = 2 * c->StallUs * 1000 + 3 * c->IoctlNs;
+		CHECK(bitBang.BitTimeNs + 250 >= expectedNs && bitBang.BitTimeNs <= expectedNs + 250);
+	}
+}
+
+static void TestJitterAndThroughput(void)
+{
+	MOCK_GPIO mock;
+	BIT_BANG bitBang;
+	unsigned char data[3];
+	unsigned int i;
+
+	// Steady edges: the only jitter left is the microsecond clock's rounding
+	MockGpioInitialize(&mock, 1);
+	mock.IoctlNs = 500;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	for (i = 0; i < 100; i++)
+		CHECK(BitBangTransfer(&bitBang, 0x10, data, sizeof(data), 0));
+	CHECK(bitBang.MaxJitterNs <= 1000 / 32 + 1);
+	CHECK_EQUAL(bitBang.Transactions, 100);
+	CHECK_EQUAL(bitBang.Bytes, 400);
+	CHECK_EQUAL(BitBangThroughput(&bitBang), (unsigned long)(bitBang.Bytes * 1000000 / bitBang.BusyUs));
+	CHECK_EQUAL(bitBang.BusyUs, mock.NowNs / 1000);
+
+	// Edges stretched at random show up as jitter against the running average
+	MockGpioInitialize(&mock, 1);
+	mock.IoctlNs = 500;
+	mock.JitterNs = 4000;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	for (i = 0; i < 100; i++)
+		CHECK(BitBangTransfer(&bitBang, 0x10, data, sizeof(data), 0));
+	CHECK(bitBang.MaxJitterNs > 100);
+	CHECK(bitBang.MaxJitterNs < 6000);
+
+	// A stall that overshoots slows the bit down but is not jitter
+	MockGpioInitialize(&mock, 1);
+	mock.StallSlackNs = 3000;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	for (i = 0; i < 10; i++)
+		CHECK(BitBangTransfer(&bitBang, 0x10, data, sizeof(data), 0));
+	CHECK_EQUAL(bitBang.BitTimeNs, 8000);
+	CHECK_EQUAL(bitBang.MaxJitterNs, 0);
+	CHECK_EQUAL(mock.Stalls, 10 * 32 * 2);
+}
+
+static void TestFailure(void)
+{
+	MOCK_GPIO mock;
+	BIT_BANG bitBang;
+	unsigned char data[2] = { 0x12, 0x34 };
+
+	// A pin write that fails mid-frame still deselects the chip
+	MockGpioInitialize(&mock, 1);
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	mock.FailAfter = 30;
+	CHECK(!BitBangTransfer(&bitBang, 0x09, data, sizeof(data), 1));
+	CHECK_EQUAL(bitBang.Failures, 1);
+	CHECK_EQUAL(bitBang.Transactions, 0);
+	CHECK_EQUAL(bitBang.Bytes, 0);
+	CHECK_EQUAL(mock.Level[BitBangPinCs], 1);
+
+	// The next frame starts clean
+	mock.CapturedBytes = mock.CapturedBits = 0;
+	CHECK(BitBangTransfer(&bitBang, 0x09, data, sizeof(data), 1));
+	CHECK_EQUAL(mock.CapturedBytes, 3);
+	CHECK_EQUAL(mock.Captured[1], 0x12);
+
+	// The failed write dropped the pin's shadow, so it goes out again
+	MockGpioInitialize(&mock, 1);
+	mock.UseShadow = 1;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+	CHECK(BitBangCalibrate(&bitBang));
+	mock.FailAfter = 1;
+	CHECK(!BitBangTransfer(&bitBang, 0x09, data, sizeof(data), 1));
+	CHECK_EQUAL(mock.Issued[BitBangPinCs], 3);
+	CHECK_EQUAL(mock.Level[BitBangPinCs], 1);
+}
+
+int main(void)
+{
+	TestWire();
+	TestCalibration();
+	TestJitterAndThroughput();
+	TestFailure();
+
+	return TestExit("BitBangTest");
+}
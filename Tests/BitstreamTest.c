@@ -0,0 +1,510 @@
+/*++
+
+Module Name:
+
+    bitstreamtest.c
+
+Abstract:
+
+    Tests for the configuration image format and loading sequence in
+    bitstream.c. Images are packed the way BitstreamPack packs them and
+    loaded over a mock SPI transport that keeps what went out while the
+    chip was selected, so delivery is checked byte for byte along with
+    the number of writes it took. The bit-bang fallback is loaded the
+    same way over the mock GPIO backend.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "MockGpio.h"
+#include "Bitstream.h"
+
+// The size of the image the commented out GPIO loader used to send
+#define IMAGE_PAYLOAD 71339
+
+#define MOCK_SPI_LOG 16
+
+// Virtual cost of a write request, and of each byte at 8 MHz
+#define MOCK_SPI_WRITE_US 50
+#define MOCK_SPI_BYTE_US  1
+
+typedef enum _MOCK_SPI_OP
+{
+	MockSpiReset,
+	MockSpiSelect,
+	MockSpiWrite,
+	MockSpiDelay
+} MOCK_SPI_OP;
+
+typedef struct _MOCK_SPI_EVENT
+{
+	MOCK_SPI_OP Op;
+	unsigned int Value;
+} MOCK_SPI_EVENT;
+
+typedef struct _MOCK_SPI
+{
+	int Selected;
+	int InReset;
+	unsigned long long NowUs;
+
+	// The first calls made, and how many there were
+	MOCK_SPI_EVENT Log[MOCK_SPI_LOG];
+	unsigned int Events;
+
+	// Bytes written while selected and out of reset, and those clocked with the chip deselected
+	unsigned char Wire[BITSTREAM_PAYLOAD_MAX + 64];
+	unsigned int WireBytes;
+	unsigned int DeselectedBytes;
+	unsigned int Writes;
+	unsigned int LargestWrite;
+	// Bytes written while the chip was held in reset
+	unsigned int Lost;
+
+	// Calls of each kind that fail, counting from 1, or never if zero
+	unsigned int FailWriteAt;
+	unsigned int FailSelectAt;
+	unsigned int FailResetAt;
+	unsigned int Selects;
+	unsigned int Resets;
+} MOCK_SPI;
+
+static MOCK_SPI Spi;
+
+static void MockSpiLog(MOCK_SPI *spi, MOCK_SPI_OP op, unsigned int value)
+{
+	if (spi->Events < MOCK_SPI_LOG) {
+		spi->Log[spi->Events].Op = op;
+		spi->Log[spi->Events].Value = value;
+	}
+	spi->Events++;
+}
+
+//
+// LumiaUSBCBitstreamReset
+//
+static int MockSpiResetPin(void *context, int asserted)
+{
+	MOCK_SPI *spi = (MOCK_SPI *)context;
+
+	MockSpiLog(spi, MockSpiReset, (unsigned int)asserted);
+	if (++spi->Resets == spi->FailResetAt)
+		return 0;
+
+	spi->InReset = asserted;
+	return 1;
+}
+
+//
+// LumiaUSBCBitstreamSelect, IOCTL_QUP_SPI_ASSERT_CS and IOCTL_QUP_SPI_DEASSERT_CS
+//
+static int MockSpiSelectChip(void *context, int selected)
+{
+	MOCK_SPI *spi = (MOCK_SPI *)context;
+
+	MockSpiLog(spi, MockSpiSelect, (unsigned int)selected);
+	if (++spi->Selects == spi->FailSelectAt)
+		return 0;
+
+	spi->Selected = selected;
+	return 1;
+}
+
+//
+// LumiaUSBCBitstreamWrite, one write request to the SPI target
+//
+static int MockSpiWriteBytes(void *context, const unsigned char *data, unsigned int length)
+{
+	MOCK_SPI *spi = (MOCK_SPI *)context;
+
+	MockSpiLog(spi, MockSpiWrite, length);
+	if (++spi->Writes == spi->FailWriteAt)
+		return 0;
+
+	spi->NowUs += MOCK_SPI_WRITE_US + (unsigned long long)length * MOCK_SPI_BYTE_US;
+	if (length > spi->LargestWrite)
+		spi->LargestWrite = length;
+
+	if (spi->InReset) {
+		spi->Lost += length;
+	}
+	else if (!spi->Selected) {
+		spi->DeselectedBytes += length;
+	}
+	else if (spi->WireBytes + length <= sizeof(spi->Wire)) {
+		memcpy(spi->Wire + spi->WireBytes, data, length);
+		spi->WireBytes += length;
+	}
+
+	return 1;
+}
+
+static void MockSpiDelayUs(void *context, unsigned int us)
+{
+	MOCK_SPI *spi = (MOCK_SPI *)context;
+
+	MockSpiLog(spi, MockSpiDelay, us);
+	spi->NowUs += us;
+}
+
+static unsigned long long MockSpiNow(void *context)
+{
+	return ((MOCK_SPI *)context)->NowUs;
+}
+
+static const BITSTREAM_OPS MockSpiOps = {
+	MockSpiResetPin,
+	MockSpiSelectChip,
+	MockSpiWriteBytes,
+	MockSpiDelayUs,
+	MockSpiNow
+};
+
+static void MockSpiInitialize(MOCK_SPI *spi)
+{
+	memset(spi, 0, sizeof(*spi));
+	// The chip comes up deselected and out of reset, the clock anywhere
+	spi->NowUs = 123456789;
+}
+
+//
+// What BitstreamPack writes: the header, then the raw bitstream
+//
+static unsigned int MakeImage(unsigned char *image, unsigned int length, unsigned int seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < length; i++) {
+		seed = seed * 1103515245 + 12345;
+		image[BITSTREAM_HEADER_SIZE + i] = (unsigned char)(seed >> 16);
+	}
+	BitstreamPack(image, image + BITSTREAM_HEADER_SIZE, length);
+
+	return BITSTREAM_HEADER_SIZE + length;
+}
+
+static unsigned char Image[BITSTREAM_HEADER_SIZE + IMAGE_PAYLOAD + 64];
+
+static void TestPacker(void)
+{
+	static const unsigned char check[] = "123456789";
+	static const unsigned char expected[BITSTREAM_HEADER_SIZE] = {
+		'U', 'C', 'B', 'S', 1, 0, 0, 0, BITSTREAM_HEADER_SIZE, 0, 0, 0, 9, 0, 0, 0, 0x26, 0x39, 0xF4, 0xCB
+	};
+	unsigned char header[BITSTREAM_HEADER_SIZE];
+	unsigned int size;
+
+	// The standard check value, and the same result run over several buffers
+	CHECK_EQUAL(BitstreamCrc32(0, check, 9), 0xCBF43926);
+	CHECK_EQUAL(BitstreamCrc32(BitstreamCrc32(BitstreamCrc32(0, check, 2), check + 2, 0), check + 2, 7), 0xCBF43926);
+	CHECK_EQUAL(BitstreamCrc32(0, check, 0), 0);
+
+	BitstreamPack(header, check, 9);
+	CHECK(!memcmp(header, expected, sizeof(header)));
+
+	size = MakeImage(Image, IMAGE_PAYLOAD, 1);
+	CHECK_EQUAL(size, BITSTREAM_HEADER_SIZE + IMAGE_PAYLOAD);
+	CHECK_EQUAL(Image[12] | (Image[13] << 8) | (Image[14] << 16), IMAGE_PAYLOAD);
+}
+
+typedef struct _PARSE_CASE
+{
+	// Replaces the header word at Offset, or flips a byte there when Flip is set
+	unsigned int Offset;
+	unsigned int Word;
+	int Flip;
+	int SizeDelta;
+	BITSTREAM_STATUS Expected;
+} PARSE_CASE;
+
+static const PARSE_CASE ParseCases[] = {
+	{ 0, 0, 0, 0, BitstreamOk },
+	// Padding after the payload is ignored
+	{ 0, 0, 0, 8, BitstreamOk },
+	{ 0, 0, 0, -101, BitstreamTruncated },
+	{ 0, 0, 0, -1, BitstreamTruncated },
+	{ 0, 0x53424356, 0, 0, BitstreamBadMagic },
+	{ 4, 2, 0, 0, BitstreamBadVersion },
+	{ 8, 16, 0, 0, BitstreamBadLength },
+	{ 8, 0xFFFFFFF0, 0, 0, BitstreamTruncated },
+	{ 12, 0, 0, 0, BitstreamBadLength },
+	{ 12, BITSTREAM_PAYLOAD_MAX + 1, 0, 0, BitstreamBadLength },
+	{ 12, 101, 0, 0, BitstreamTruncated },
+	{ 16, 0, 0, 0, BitstreamBadChecksum },
+	{ BITSTREAM_HEADER_SIZE + 50, 0, 1, 0, BitstreamBadChecksum },
+	{ BITSTREAM_HEADER_SIZE + 99, 0, 1, 0, BitstreamBadChecksum },
+};
+
+static void PutWord(unsigned char *p, unsigned int value)
+{
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+static void TestParse(void)
+{
+	unsigned char image[BITSTREAM_HEADER_SIZE + 100 + 16];
+	const unsigned char *payload;
+	BITSTREAM_RESULT result;
+	BITSTREAM_STATUS status;
+	unsigned int i, size, length;
+
+	for (i = 0; i < sizeof(ParseCases) / sizeof(ParseCases[0]); i++) {
+		size = MakeImage(image, 100, i);
+		if (ParseCases[i].Flip)
+			image[ParseCases[i].Offset] ^= 0x10;
+		else if (ParseCases[i].Offset || ParseCases[i].Word)
+			PutWord(image + ParseCases[i].Offset, ParseCases[i].Word);
+		size += ParseCases[i].SizeDelta;
+
+		payload = NULL;
+		length = 0;
+		status = BitstreamParse(image, size, &payload, &length);
+		CHECK_EQUAL(status, ParseCases[i].Expected);
+		if (status == BitstreamOk) {
+			CHECK(payload == image + BITSTREAM_HEADER_SIZE);
+			CHECK_EQUAL(length, 100);
+		}
+
+		// A rejected image never gets near the chip
+		MockSpiInitialize(&Spi);
+		CHECK_EQUAL(BitstreamLoad(&MockSpiOps, &Spi, image, size, 0, &result), ParseCases[i].Expected);
+		if (ParseCases[i].Expected != BitstreamOk) {
+			CHECK_EQUAL(Spi.Events, 0);
+			CHECK_EQUAL(result.Chunks, 0);
+			CHECK_EQUAL(result.Bytes, 0);
+		}
+	}
+
+	// A later, longer header: the payload starts where it says
+	MakeImage(image + 16, 100, 7);
+	memmove(image, image + 16, BITSTREAM_HEADER_SIZE);
+	memset(image + BITSTREAM_HEADER_SIZE, 0xEE, 16);
+	PutWord(image + 8, BITSTREAM_HEADER_SIZE + 16);
+	CHECK_EQUAL(BitstreamParse(image, sizeof(image), &payload, &length), BitstreamOk);
+	CHECK(payload == image + BITSTREAM_HEADER_SIZE + 16);
+	CHECK_EQUAL(length, 100);
+}
+
+typedef struct _CHUNK_CASE
+{
+	unsigned int Chunk;
+	unsigned int Chunks;
+	unsigned int LargestWrite;
+} CHUNK_CASE;
+
+static const CHUNK_CASE ChunkCases[] = {
+	// BitstreamChunkBytes left at zero means BITSTREAM_CHUNK_DEFAULT
+	{ 0, 18, 4096 },
+	{ BITSTREAM_CHUNK_DEFAULT, 18, 4096 },
+	{ 4095, 18, 4095 },
+	{ 1, IMAGE_PAYLOAD, BITSTREAM_TRAIL_BYTES },
+	{ 64, 1115, 64 },
+	{ 65536, 2, 65536 },
+	{ IMAGE_PAYLOAD, 1, IMAGE_PAYLOAD },
+	{ BITSTREAM_PAYLOAD_MAX, 1, IMAGE_PAYLOAD },
+};
+
+static void TestDelivery(void)
+{
+	static const unsigned char zeros[BITSTREAM_TRAIL_BYTES] = { 0 };
+	static const MOCK_SPI_EVENT prologue[] = {
+		{ MockSpiSelect, 1 }, { MockSpiReset, 1 }, { MockSpiDelay, BITSTREAM_RESET_US }, { MockSpiReset, 0 },
+		{ MockSpiDelay, BITSTREAM_CLEAR_US }, { MockSpiSelect, 0 }, { MockSpiWrite, BITSTREAM_LEAD_BYTES }, { MockSpiSelect, 1 }
+	};
+	const CHUNK_CASE *c;
+	BITSTREAM_RESULT result;
+	unsigned int i, j, size;
+
+	size = MakeImage(Image, IMAGE_PAYLOAD, 3);
+
+	for (i = 0; i < sizeof(ChunkCases) / sizeof(ChunkCases[0]); i++) {
+		c = &ChunkCases[i];
+		MockSpiInitialize(&Spi);
+
+		CHECK_EQUAL(BitstreamLoad(&MockSpiOps, &Spi, Image, size, c->Chunk, &result), BitstreamOk);
+		CHECK_EQUAL(result.Chunks, c->Chunks);
+		CHECK_EQUAL(result.Bytes, IMAGE_PAYLOAD);
+		CHECK_EQUAL(result.Crc32, BitstreamCrc32(0, Image + BITSTREAM_HEADER_SIZE, IMAGE_PAYLOAD));
+
+		// Reset with the chip selected, 8 clocks deselected, then one frame of image and start-up clocks
+		for (j = 0; j < sizeof(prologue) / sizeof(prologue[0]); j++) {
+			CHECK_EQUAL(Spi.Log[j].Op, prologue[j].Op);
+			CHECK_EQUAL(Spi.Log[j].Value, prologue[j].Value);
+		}
+		CHECK_EQUAL(Spi.Events, sizeof(prologue) / sizeof(prologue[0]) + c->Chunks + 2);
+		CHECK_EQUAL(Spi.Writes, c->Chunks + 2);
+		CHECK_EQUAL(Spi.LargestWrite, c->LargestWrite);
+		CHECK_EQUAL(Spi.DeselectedBytes, BITSTREAM_LEAD_BYTES);
+		CHECK_EQUAL(Spi.Lost, 0);
+
+		// Byte for byte what was packed
+		CHECK_EQUAL(Spi.WireBytes, IMAGE_PAYLOAD + BITSTREAM_TRAIL_BYTES);
+		CHECK(!memcmp(Spi.Wire, Image + BITSTREAM_HEADER_SIZE, IMAGE_PAYLOAD));
+		CHECK(!memcmp(Spi.Wire + IMAGE_PAYLOAD, zeros, BITSTREAM_TRAIL_BYTES));
+
+		CHECK(!Spi.Selected);
+		CHECK(!Spi.InReset);
+
+		// The load time reported is all of it: delays, requests and bytes
+		CHECK_EQUAL(result.ElapsedUs, BITSTREAM_RESET_US + BITSTREAM_CLEAR_US + (c->Chunks + 2) * MOCK_SPI_WRITE_US +
+			(BITSTREAM_LEAD_BYTES + IMAGE_PAYLOAD + BITSTREAM_TRAIL_BYTES) * MOCK_SPI_BYTE_US);
+	}
+}
+
+typedef struct _FAILURE_CASE
+{
+	unsigned int FailWriteAt;
+	unsigned int FailSelectAt;
+	unsigned int FailResetAt;
+	unsigned int Chunks;
+} FAILURE_CASE;
+
+static const FAILURE_CASE FailureCases[] = {
+	// Lead clocks, a chunk in the middle, the last chunk, the start-up clocks
+	{ 1, 0, 0, 0 },
+	{ 5, 0, 0, 3 },
+	{ 19, 0, 0, 17 },
+	{ 20, 0, 0, 18 },
+	// Each chip select change
+	{ 0, 1, 0, 0 },
+	{ 0, 2, 0, 0 },
+	{ 0, 3, 0, 0 },
+	{ 0, 4, 0, 18 },
+	// Going into reset and coming out of it
+	{ 0, 0, 1, 0 },
+	{ 0, 0, 2, 0 },
+};
+
+static void TestTransferFailures(void)
+{
+	const FAILURE_CASE *c;
+	BITSTREAM_RESULT result;
+	unsigned int i, size;
+
+	size = MakeImage(Image, IMAGE_PAYLOAD, 5);
+
+	for (i = 0; i < sizeof(FailureCases) / sizeof(FailureCases[0]); i++) {
+		c = &FailureCases[i];
+		MockSpiInitialize(&Spi);
+		Spi.FailWriteAt = c->FailWriteAt;
+		Spi.FailSelectAt = c->FailSelectAt;
+		Spi.FailResetAt = c->FailResetAt;
+
+		CHECK_EQUAL(BitstreamLoad(&MockSpiOps, &Spi, Image, size, 0, &result), BitstreamTransferFailed);
+		CHECK_EQUAL(result.Chunks, c->Chunks);
+		CHECK_EQUAL(result.Bytes, c->Chunks < 18 ? c->Chunks * 4096 : IMAGE_PAYLOAD);
+		CHECK_EQUAL(Spi.Lost, 0);
+
+		// Nothing more is written after a failure, and the chip is always deselected in the end
+		CHECK_EQUAL(Spi.Writes, c->FailWriteAt ? c->FailWriteAt : c->FailSelectAt == 4 ? 20 : c->FailSelectAt == 3 ? 1 : 0);
+		if (c->FailSelectAt != 4)
+			CHECK(!Spi.Selected);
+		if (c->FailResetAt != 2)
+			CHECK(!Spi.InReset);
+	}
+}
+
+//
+// LumiaUSBCBitstreamSelect and LumiaUSBCBitstreamWrite with UseFakeSpi set
+//
+typedef struct _FALLBACK
+{
+	MOCK_GPIO Gpio;
+	BIT_BANG BitBang;
+	unsigned int Writes;
+} FALLBACK;
+
+static int FallbackReset(void *context, int asserted)
+{
+	(void)context;
+	(void)asserted;
+	return 1;
+}
+
+static int FallbackSelect(void *context, int selected)
+{
+	FALLBACK *fallback = (FALLBACK *)context;
+
+	return MockGpioOps.SetPin(&fallback->Gpio, BitBangPinCs, !selected);
+}
+
+static int FallbackWrite(void *context, const unsigned char *data, unsigned int length)
+{
+	FALLBACK *fallback = (FALLBACK *)context;
+
+	fallback->Writes++;
+	return BitBangWrite(&fallback->BitBang, data, length);
+}
+
+static void FallbackDelay(void *context, unsigned int us)
+{
+	FALLBACK *fallback = (FALLBACK *)context;
+
+	MockGpioOps.Stall(&fallback->Gpio, us);
+}
+
+static unsigned long long FallbackNow(void *context)
+{
+	FALLBACK *fallback = (FALLBACK *)context;
+
+	return MockGpioOps.Now(&fallback->Gpio);
+}
+
+static const BITSTREAM_OPS FallbackOps = {
+	FallbackReset,
+	FallbackSelect,
+	FallbackWrite,
+	FallbackDelay,
+	FallbackNow
+};
+
+static void TestBitBangFallback(void)
+{
+	static const unsigned char zeros[BITSTREAM_TRAIL_BYTES] = { 0 };
+	// What the GPIO mock can capture in one frame, trailing clocks included
+	enum { Payload = MOCK_GPIO_CAPTURE - BITSTREAM_TRAIL_BYTES };
+	static FALLBACK fallback;
+	unsigned char image[BITSTREAM_HEADER_SIZE + Payload];
+	BITSTREAM_RESULT result;
+	unsigned int size;
+
+	size = MakeImage(image, Payload, 9);
+
+	MockGpioInitialize(&fallback.Gpio, 3);
+	BitBangInitialize(&fallback.BitBang, &MockGpioOps, &fallback.Gpio, 1);
+	fallback.Writes = 0;
+
+	CHECK_EQUAL(BitstreamLoad(&FallbackOps, &fallback, image, size, 64, &result), BitstreamOk);
+	CHECK_EQUAL(result.Chunks, (Payload + 63) / 64);
+	CHECK_EQUAL(fallback.Writes, result.Chunks + 2);
+
+	// The same bytes on the wire, the lead clocks went out deselected
+	CHECK_EQUAL(fallback.Gpio.CapturedBytes, Payload + BITSTREAM_TRAIL_BYTES);
+	CHECK_EQUAL(fallback.Gpio.CapturedBits, 0);
+	CHECK(!memcmp(fallback.Gpio.Captured, image + BITSTREAM_HEADER_SIZE, Payload));
+	CHECK(!memcmp(fallback.Gpio.Captured + Payload, zeros, BITSTREAM_TRAIL_BYTES));
+	CHECK_EQUAL(fallback.BitBang.Bytes, BITSTREAM_LEAD_BYTES + Payload + BITSTREAM_TRAIL_BYTES);
+	CHECK_EQUAL(fallback.Gpio.Level[BitBangPinCs], 1);
+
+	// But at a GPIO request or more per clock edge, where the controller took one per chunk
+	CHECK(MockGpioIssued(&fallback.Gpio) >= 2 * 8 * (BITSTREAM_LEAD_BYTES + Payload + BITSTREAM_TRAIL_BYTES));
+}
+
+int main(void)
+{
+	TestPacker();
+	TestParse();
+	TestDelivery();
+	TestTransferFailures();
+	TestBitBangFallback();
+
+	return TestExit("BitstreamTest");
+}
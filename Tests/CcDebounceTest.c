@@ -0,0 +1,271 @@
+/*++
+
+Module Name:
+
+    ccdebouncetest.c
+
+Abstract:
+
+    Tests for the CC debounce in ccdebounce.c on a virtual clock. Raw
+    pin states are fed the way LumiaUSBCCcSample feeds them, the debounce
+    timer fires when LumiaUSBCCcTimer would, and only what comes out the
+    other side counts as an attach state change.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include <limits.h>
+#include "Test.h"
+#include "CcDebounce.h"
+
+// Rd seen on CC1 or CC2, at the default and 3 A Rp levels
+#define CC1_DEFAULT 0x01
+#define CC1_3A      0x03
+#define CC2_DEFAULT 0x04
+
+#define MAX_REPORTS 64
+
+typedef struct _DEBOUNCE_SIM
+{
+	CC_DEBOUNCE Debounce;
+	unsigned long Now;
+
+	// CcTimer
+	int TimerArmed;
+	unsigned long TimerAt;
+
+	// LumiaUSBCUpdateAttachState calls
+	unsigned long ReportTime[MAX_REPORTS];
+	unsigned char ReportState[MAX_REPORTS];
+	unsigned int Reports;
+	unsigned long LastReportTime;
+} DEBOUNCE_SIM;
+
+static void SimReport(DEBOUNCE_SIM *sim, unsigned int events)
+{
+	if (!(events & CC_DEBOUNCE_EVENT_CHANGED))
+		return;
+
+	if (sim->Reports < MAX_REPORTS) {
+		sim->ReportTime[sim->Reports] = sim->Now;
+		sim->ReportState[sim->Reports] = sim->Debounce.Stable;
+	}
+	sim->LastReportTime = sim->Now;
+	sim->Reports++;
+}
+
+//
+// LumiaUSBCCcTimer, for every expiry up to the given time
+//
+static void SimAdvance(DEBOUNCE_SIM *sim, unsigned long until)
+{
+	unsigned long next;
+	unsigned int events;
+
+	while (sim->TimerArmed && (long)(until - sim->TimerAt) >= 0) {
+		sim->Now = sim->TimerAt;
+		sim->TimerArmed = 0;
+
+		events = CcDebouncePoll(&sim->Debounce, sim->Now, &next);
+		if (next) {
+			sim->TimerArmed = 1;
+			sim->TimerAt = sim->Now + next;
+		}
+		SimReport(sim, events);
+	}
+
+	sim->Now = until;
+}
+
+//
+// LumiaUSBCCcSample
+//
+static void SimSample(DEBOUNCE_SIM *sim, unsigned long now, unsigned char state)
+{
+	unsigned long next;
+	unsigned int events;
+
+	SimAdvance(sim, now);
+
+	events = CcDebounceSample(&sim->Debounce, state, now, &next);
+	sim->TimerArmed = next != 0;
+	sim->TimerAt = now + next;
+	SimReport(sim, events);
+}
+
+static void SimInitialize(DEBOUNCE_SIM *sim, unsigned long start)
+{
+	memset(sim, 0, sizeof(*sim));
+	CcDebounceInitialize(&sim->Debounce, TYPEC_T_CC_DEBOUNCE_MS, TYPEC_T_PD_DEBOUNCE_MS);
+	sim->Now = start;
+}
+
+typedef struct _STEP
+{
+	unsigned long Time;
+	unsigned char State;
+} STEP;
+
+typedef struct _BOUNCE_CASE
+{
+	STEP Samples[12];
+	unsigned int Count;
+	STEP Reports[3];
+	unsigned int ReportCount;
+	unsigned long Suppressed;
+} BOUNCE_CASE;
+
+static const BOUNCE_CASE BounceCases[] = {
+	// A clean attach takes tCCDebounce
+	{ { { 0, CC1_DEFAULT } }, 1, { { 100, CC1_DEFAULT } }, 1, 0 },
+	// A connector going in wobbles; the clock starts again with the last change
+	{ { { 0, CC1_DEFAULT }, { 20, 0 }, { 30, CC1_DEFAULT }, { 45, 0 }, { 50, CC1_DEFAULT } }, 5,
+		{ { 150, CC1_DEFAULT } }, 1, 2 },
+	// Resampling the pending state does not restart the clock
+	{ { { 0, CC1_DEFAULT }, { 40, CC1_DEFAULT }, { 99, CC1_DEFAULT } }, 3, { { 100, CC1_DEFAULT } }, 1, 0 },
+	// Short of tCCDebounce, nothing happened at all
+	{ { { 0, CC1_DEFAULT }, { 99, 0 } }, 2, { { 0 } }, 0, 1 },
+	// Leaving takes only tPDDebounce
+	{ { { 0, CC1_DEFAULT }, { 500, 0 } }, 2, { { 100, CC1_DEFAULT }, { 510, 0 } }, 2, 0 },
+	// A glitch shorter than that is not a detach
+	{ { { 0, CC1_DEFAULT }, { 300, 0 }, { 309, CC1_DEFAULT } }, 3, { { 100, CC1_DEFAULT } }, 1, 1 },
+	// Nor is a chattering contact
+	{ { { 0, CC1_DEFAULT }, { 300, 0 }, { 305, CC1_DEFAULT }, { 308, 0 }, { 312, CC1_DEFAULT }, { 319, 0 },
+		{ 320, CC1_DEFAULT } }, 7, { { 100, CC1_DEFAULT } }, 1, 3 },
+	// The source raising Rp is a change too, on tPDDebounce
+	{ { { 0, CC1_DEFAULT }, { 200, CC1_3A } }, 2, { { 100, CC1_DEFAULT }, { 210, CC1_3A } }, 2, 0 },
+	// Settling on the other pin replaces the candidate
+	{ { { 0, CC1_DEFAULT }, { 50, CC2_DEFAULT } }, 2, { { 150, CC2_DEFAULT } }, 1, 1 },
+	// Unplugged and plugged back in the other way round
+	{ { { 0, CC1_DEFAULT }, { 200, 0 }, { 240, CC2_DEFAULT } }, 3,
+		{ { 100, CC1_DEFAULT }, { 210, 0 }, { 340, CC2_DEFAULT } }, 3, 0 },
+};
+
+static void RunBounceCase(const BOUNCE_CASE *c, unsigned long start)
+{
+	DEBOUNCE_SIM sim;
+	unsigned int i;
+
+	SimInitialize(&sim, start);
+	for (i = 0; i < c->Count; i++)
+		SimSample(&sim, start + c->Samples[i].Time, c->Samples[i].State);
+	SimAdvance(&sim, start + 10000);
+
+	CHECK_EQUAL(sim.Reports, c->ReportCount);
+	for (i = 0; i < c->ReportCount && i < sim.Reports; i++) {
+		CHECK_EQUAL(sim.ReportTime[i] - start, c->Reports[i].Time);
+		CHECK_EQUAL(sim.ReportState[i], c->Reports[i].State);
+	}
+
+	CHECK_EQUAL(sim.Debounce.Accepted, c->ReportCount);
+	CHECK_EQUAL(sim.Debounce.Suppressed, c->Suppressed);
+	CHECK(!sim.TimerArmed);
+	CHECK(!sim.Debounce.Pending);
+}
+
+static void TestBounceCases(void)
+{
+	unsigned int i;
+
+	// From zero, and across the clock wrapping
+	for (i = 0; i < sizeof(BounceCases) / sizeof(BounceCases[0]); i++) {
+		RunBounceCase(&BounceCases[i], 0);
+		RunBounceCase(&BounceCases[i], ULONG_MAX - 120);
+	}
+}
+
+static void TestTimerResult(void)
+{
+	CC_DEBOUNCE debounce;
+	unsigned long next;
+
+	// The time left is what the driver arms the timer with, and a late timer still accepts
+	CcDebounceInitialize(&debounce, TYPEC_T_CC_DEBOUNCE_MS, TYPEC_T_PD_DEBOUNCE_MS);
+	CHECK_EQUAL(CcDebounceSample(&debounce, CC1_DEFAULT, 1000, &next), 0);
+	CHECK_EQUAL(next, 100);
+	CHECK_EQUAL(CcDebouncePoll(&debounce, 1030, &next), 0);
+	CHECK_EQUAL(next, 70);
+	CHECK_EQUAL(CcDebouncePoll(&debounce, 1250, &next), CC_DEBOUNCE_EVENT_CHANGED);
+	CHECK_EQUAL(next, 0);
+	CHECK_EQUAL(debounce.Stable, CC1_DEFAULT);
+
+	// Nothing pending, nothing to arm
+	CHECK_EQUAL(CcDebouncePoll(&debounce, 1300, &next), 0);
+	CHECK_EQUAL(next, 0);
+	CHECK_EQUAL(CcDebounceSample(&debounce, CC1_DEFAULT, 1300, &next), 0);
+	CHECK_EQUAL(next, 0);
+
+	// A zero debounce time accepts on the sample itself
+	CcDebounceInitialize(&debounce, 0, 0);
+	CHECK_EQUAL(CcDebounceSample(&debounce, CC2_DEFAULT, 5, &next), CC_DEBOUNCE_EVENT_CHANGED);
+	CHECK_EQUAL(next, 0);
+	CHECK_EQUAL(debounce.Stable, CC2_DEFAULT);
+}
+
+//
+// Plugs and unplugs with a burst of bouncing at every change, and checks
+// the driver saw exactly the intended states, each once and on time
+//
+static void TestScriptedChatter(void)
+{
+	static const unsigned char states[] = { 0, CC1_DEFAULT, CC1_3A, CC2_DEFAULT };
+	DEBOUNCE_SIM sim;
+	unsigned int seed = 2024, segment, bounces, i, changes = 0, expected = 0;
+	unsigned long now = 0, last, due;
+	unsigned char stable = 0, next, sample = 0;
+	int mismatches = 0;
+
+	SimInitialize(&sim, 0);
+
+	for (segment = 0; segment < 500; segment++) {
+		do {
+			seed = seed * 1103515245 + 12345;
+			next = states[(seed >> 16) % 4];
+		} while (next == stable);
+
+		// Alternate between the old and the new state, never holding either long enough
+		seed = seed * 1103515245 + 12345;
+		bounces = (seed >> 16) % 8;
+		for (i = 0; i <= 2 * bounces; i++) {
+			seed = seed * 1103515245 + 12345;
+			now += 1 + (seed >> 16) % 8;
+			if (sample != (i % 2 ? stable : next))
+				changes++;
+			sample = i % 2 ? stable : next;
+			SimSample(&sim, now, sample);
+		}
+
+		// The last sample is the new state; it is acted on one debounce time later
+		last = now;
+		due = last + (stable == 0 ? TYPEC_T_CC_DEBOUNCE_MS : TYPEC_T_PD_DEBOUNCE_MS);
+		now += 200 + (seed >> 24);
+		SimAdvance(&sim, now);
+
+		if (sim.Reports != expected + 1 || sim.Debounce.Stable != next || sim.LastReportTime != due)
+			mismatches++;
+		expected++;
+		stable = next;
+	}
+
+	CHECK_EQUAL(mismatches, 0);
+	CHECK_EQUAL(sim.Reports, expected);
+	CHECK_EQUAL(sim.Debounce.Accepted, expected);
+	CHECK_EQUAL(sim.Debounce.Stable, stable);
+
+	// Each raw change either opened a candidate or withdrew one, and only the last candidate of a burst survived
+	CHECK_EQUAL(changes, sim.Debounce.Accepted + 2 * sim.Debounce.Suppressed);
+	CHECK(sim.Debounce.Suppressed > sim.Debounce.Accepted);
+}
+
+int main(void)
+{
+	TestBounceCases();
+	TestTimerResult();
+	TestScriptedChatter();
+
+	return TestExit("CcDebounceTest");
+}
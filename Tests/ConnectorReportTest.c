@@ -0,0 +1,275 @@
+/*++
+
+Module Name:
+
+    connectorreporttest.c
+
+Abstract:
+
+    Tests for the UCM notification diffing in connectorreport.c. A mock
+    dispatcher sends what LumiaUSBCReportConnector sends for each change
+    and logs the calls, so order and suppression are checked across a
+    scripted attach, negotiation, role swap and detach.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "ConnectorReport.h"
+
+// Stand-ins for the UCM enumerations, which the diffing carries as plain ints
+enum { ROLE_SINK = 1, ROLE_SOURCE = 2 };
+enum { CURRENT_DEFAULT = 1, CURRENT_1500 = 2, CURRENT_3000 = 3 };
+enum { CHARGING_NOMINAL = 1, CHARGING_SLOW = 2, CHARGING_NOT = 3 };
+enum { PD_NOT_SUPPORTED = 1, PD_FAILED = 2, PD_SUCCEEDED = 3 };
+
+#define LOG_SIZE 64
+
+typedef struct _MOCK_UCM
+{
+	CONNECTOR_REPORT Report;
+
+	// Notifications in the order they were sent
+	unsigned int Log[LOG_SIZE];
+	unsigned int Calls;
+
+	// What UCM was last told
+	int PowerRole;
+	int TypeCCurrent;
+	int ChargingState;
+	int PdConnState;
+	unsigned long Rdo;
+	unsigned int PartnerSourceCapCount;
+} MOCK_UCM;
+
+static void MockInitialize(MOCK_UCM *ucm)
+{
+	memset(ucm, 0, sizeof(*ucm));
+	ConnectorReportInitialize(&ucm->Report);
+}
+
+//
+// LumiaUSBCReportConnector with the UCM calls logged
+//
+static unsigned int Report(MOCK_UCM *ucm, const CONNECTOR_STATE *next)
+{
+	const CONNECTOR_STATE *reported = &ucm->Report.Reported;
+	unsigned int changes, bit;
+
+	changes = ConnectorReportDiff(&ucm->Report, next);
+
+	for (bit = 1; bit <= CONNECTOR_REPORT_ALL; bit <<= 1) {
+		if (!(changes & bit))
+			continue;
+
+		if (ucm->Calls < LOG_SIZE)
+			ucm->Log[ucm->Calls] = bit;
+		ucm->Calls++;
+
+		switch (bit) {
+		case CONNECTOR_REPORT_PARTNER_SOURCE_CAPS:
+			ucm->PartnerSourceCapCount = reported->PartnerSourceCapCount;
+			break;
+		case CONNECTOR_REPORT_POWER_DIRECTION:
+			ucm->PowerRole = reported->PowerRole;
+			break;
+		case CONNECTOR_REPORT_TYPEC_CURRENT:
+			ucm->TypeCCurrent = reported->TypeCCurrent;
+			break;
+		case CONNECTOR_REPORT_PD_CONN_STATE:
+			ucm->PdConnState = reported->PdConnState;
+			ucm->Rdo = reported->Rdo;
+			if (reported->ChargingState != CONNECTOR_VALUE_UNKNOWN)
+				ucm->ChargingState = reported->ChargingState;
+			break;
+		case CONNECTOR_REPORT_CHARGING_STATE:
+			ucm->ChargingState = reported->ChargingState;
+			break;
+		}
+	}
+
+	return changes;
+}
+
+static void TestNothingKnown(void)
+{
+	MOCK_UCM ucm;
+	CONNECTOR_STATE state;
+
+	MockInitialize(&ucm);
+	ConnectorStateInitialize(&state);
+	CHECK_EQUAL(Report(&ucm, &state), 0);
+	CHECK_EQUAL(ucm.Report.Notifications, 0);
+	CHECK_EQUAL(ucm.Report.Suppressed, 0);
+}
+
+static void FullState(CONNECTOR_STATE *state)
+{
+	ConnectorStateInitialize(state);
+	state->SourceCaps[0] = 0x0801912CUL;
+	state->SourceCapCount = 1;
+	state->PartnerSourceCaps[0] = 0x2601912CUL;
+	state->PartnerSourceCaps[1] = 0x0002D0C8UL;
+	state->PartnerSourceCapCount = 2;
+	state->PowerRole = ROLE_SINK;
+	state->TypeCCurrent = CURRENT_3000;
+	state->PdConnState = PD_SUCCEEDED;
+	state->Rdo = 0x1304B12CUL;
+	state->ChargingState = CHARGING_NOMINAL;
+}
+
+static void TestOrderAndSuppression(void)
+{
+	MOCK_UCM ucm;
+	CONNECTOR_STATE state;
+	unsigned int i;
+
+	// Everything new goes out once, in the order UCM needs, the charging state riding on the PD one
+	MockInitialize(&ucm);
+	FullState(&state);
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_ALL & ~CONNECTOR_REPORT_CHARGING_STATE);
+	CHECK_EQUAL(ucm.Calls, 5);
+	for (i = 1; i < ucm.Calls; i++)
+		CHECK(ucm.Log[i] > ucm.Log[i - 1]);
+	CHECK_EQUAL(ucm.Log[4], CONNECTOR_REPORT_PD_CONN_STATE);
+	CHECK_EQUAL(ucm.ChargingState, CHARGING_NOMINAL);
+	CHECK_EQUAL(ucm.Report.Notifications, 5);
+
+	// The same state again sends nothing, every field counts as suppressed
+	CHECK_EQUAL(Report(&ucm, &state), 0);
+	CHECK_EQUAL(ucm.Calls, 5);
+	CHECK_EQUAL(ucm.Report.Suppressed, 6);
+
+	// Capabilities compare by content and count
+	state.PartnerSourceCaps[1] = 0x0002D096UL;
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_PARTNER_SOURCE_CAPS);
+	state.PartnerSourceCapCount = 1;
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_PARTNER_SOURCE_CAPS);
+	CHECK_EQUAL(ucm.PartnerSourceCapCount, 1);
+
+	// A count of zero leaves the capabilities alone
+	state.PartnerSourceCapCount = 0;
+	CHECK_EQUAL(Report(&ucm, &state), 0);
+	CHECK_EQUAL(ucm.Report.Reported.PartnerSourceCapCount, 1);
+
+	// A new contract in the same connection state is reported, the charging state alone too
+	state.Rdo = 0x2304B12CUL;
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_PD_CONN_STATE);
+	CHECK_EQUAL(ucm.Rdo, 0x2304B12CUL);
+	state.ChargingState = CHARGING_SLOW;
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_CHARGING_STATE);
+
+	// Both at once still only take the PD notification
+	state.PdConnState = PD_FAILED;
+	state.ChargingState = CHARGING_NOMINAL;
+	CHECK_EQUAL(Report(&ucm, &state), CONNECTOR_REPORT_PD_CONN_STATE);
+	CHECK_EQUAL(ucm.ChargingState, CHARGING_NOMINAL);
+}
+
+typedef struct _SCRIPT_STEP
+{
+	// Attach with this current and charging state before the report, if nonzero
+	int AttachCurrent;
+	int AttachCharging;
+	// Forgotten before the report
+	unsigned int Invalidate;
+
+	int PowerRole;
+	int TypeCCurrent;
+	int ChargingState;
+	int PdConnState;
+	unsigned long Rdo;
+	unsigned int PartnerCaps;
+	unsigned int SourceCaps;
+
+	unsigned int Changes;
+} SCRIPT_STEP;
+
+#define U CONNECTOR_VALUE_UNKNOWN
+
+static const SCRIPT_STEP Script[] = {
+	// Attach to a 3A charger; the Rp report right after repeats what the attach carried
+	{ CURRENT_3000, CHARGING_NOMINAL, 0, U, CURRENT_3000, CHARGING_NOMINAL, U, 0, 0, 0, 0 },
+	// Source capabilities, then the contract
+	{ 0, 0, 0, U, U, U, U, 0, 3, 0, CONNECTOR_REPORT_PARTNER_SOURCE_CAPS },
+	{ 0, 0, 0, U, U, CHARGING_NOMINAL, PD_SUCCEEDED, 0x1304B12CUL, 0, 0, CONNECTOR_REPORT_PD_CONN_STATE },
+	// The charger resends the same capabilities and the same contract is agreed again
+	{ 0, 0, 0, U, U, U, U, 0, 3, 0, 0 },
+	{ 0, 0, 0, U, U, CHARGING_NOMINAL, PD_SUCCEEDED, 0x1304B12CUL, 0, 0, 0 },
+	// Rp drops to 1.5A, UCM hears the current and the charging state
+	{ 0, 0, 0, U, CURRENT_1500, CHARGING_SLOW, U, 0, 0, 0, CONNECTOR_REPORT_TYPEC_CURRENT | CONNECTOR_REPORT_CHARGING_STATE },
+	{ 0, 0, 0, U, CURRENT_1500, CHARGING_SLOW, U, 0, 0, 0, 0 },
+	// Swap to source: the negotiation state is forgotten, our capabilities and the role go out
+	{ 0, 0, CONNECTOR_REPORT_PARTNER_SOURCE_CAPS | CONNECTOR_REPORT_PD_CONN_STATE,
+		ROLE_SOURCE, U, CHARGING_NOT, U, 0, 0, 1,
+		CONNECTOR_REPORT_SOURCE_CAPS | CONNECTOR_REPORT_POWER_DIRECTION | CONNECTOR_REPORT_CHARGING_STATE },
+	// The contract as source looks like the one before but belongs to the new role
+	{ 0, 0, 0, U, U, CHARGING_NOT, PD_SUCCEEDED, 0x1304B12CUL, 0, 0, CONNECTOR_REPORT_PD_CONN_STATE },
+	// Detach and attach to a phone charger without PD
+	{ CURRENT_DEFAULT, CHARGING_SLOW, 0, U, CURRENT_DEFAULT, CHARGING_SLOW, U, 0, 0, 0, 0 },
+	{ 0, 0, 0, U, CURRENT_DEFAULT, CHARGING_SLOW, PD_NOT_SUPPORTED, 0, 0, 0, CONNECTOR_REPORT_PD_CONN_STATE },
+};
+
+static void TestScript(void)
+{
+	static const unsigned long caps[3] = { 0x2601912CUL, 0x0002D0C8UL, 0x0003C096UL };
+	const SCRIPT_STEP *step;
+	MOCK_UCM ucm;
+	CONNECTOR_STATE state;
+	unsigned int i, j, unconditional = 0;
+
+	MockInitialize(&ucm);
+
+	for (i = 0; i < sizeof(Script) / sizeof(Script[0]); i++) {
+		step = &Script[i];
+
+		if (step->AttachCurrent) {
+			ConnectorReportAttach(&ucm.Report, step->AttachCurrent, step->AttachCharging);
+			ucm.TypeCCurrent = step->AttachCurrent;
+			ucm.ChargingState = step->AttachCharging;
+		}
+		ConnectorReportInvalidate(&ucm.Report, step->Invalidate);
+
+		ConnectorStateInitialize(&state);
+		state.PowerRole = step->PowerRole;
+		state.TypeCCurrent = step->TypeCCurrent;
+		state.ChargingState = step->ChargingState;
+		state.PdConnState = step->PdConnState;
+		state.Rdo = step->Rdo;
+		for (j = 0; j < step->PartnerCaps; j++)
+			state.PartnerSourceCaps[j] = caps[j];
+		state.PartnerSourceCapCount = step->PartnerCaps;
+		state.SourceCaps[0] = 0x0801912CUL;
+		state.SourceCapCount = step->SourceCaps;
+
+		CHECK_EQUAL(Report(&ucm, &state), step->Changes);
+
+		// What UCM knows always matches what the driver thinks it was told
+		if (ucm.Report.Reported.TypeCCurrent != U)
+			CHECK_EQUAL(ucm.TypeCCurrent, ucm.Report.Reported.TypeCCurrent);
+		if (ucm.Report.Reported.ChargingState != U)
+			CHECK_EQUAL(ucm.ChargingState, ucm.Report.Reported.ChargingState);
+
+		// The driver used to send all five on every report
+		unconditional += 5;
+	}
+
+	CHECK_EQUAL(ucm.Calls, 9);
+	CHECK_EQUAL(ucm.PowerRole, ROLE_SOURCE);
+	CHECK_EQUAL(ucm.PdConnState, PD_NOT_SUPPORTED);
+	CHECK_EQUAL(ucm.Report.Notifications, ucm.Calls + 2);
+	CHECK(ucm.Calls * 5 < unconditional);
+}
+
+int main(void)
+{
+	TestNothingKnown();
+	TestOrderAndSuppression();
+	TestScript();
+
+	return TestExit("ConnectorReportTest");
+}
@@ -0,0 +1,313 @@
+/*++
+
+Module Name:
+
+    eventqueuetest.c
+
+Abstract:
+
+    Round trip tests for the connector event records in eventqueue.c:
+    records posted by the driver are drained into batches the way
+    IOCTL_LUMIAUSBC_WAIT_EVENTS completes them, copied out as bytes, and
+    parsed back the way a monitor in user mode would.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stddef.h>
+#include <string.h>
+#include "Test.h"
+#include "EventQueue.h"
+
+#define BUFFER_RECORDS 80
+
+typedef union _BATCH_BUFFER
+{
+	LUMIAUSBC_EVENT_BATCH Batch;
+	unsigned char Bytes[LUMIAUSBC_EVENT_BATCH_SIZE(BUFFER_RECORDS)];
+} BATCH_BUFFER;
+
+//
+// Drains into one buffer and hands the consumer a byte copy of what the request completed with
+//
+static unsigned int Transfer(EVENT_QUEUE *queue, BATCH_BUFFER *out, unsigned int length)
+{
+	BATCH_BUFFER request;
+	unsigned int written;
+
+	memset(&request, 0xCC, sizeof(request));
+	written = EventQueueDrain(queue, &request, length);
+	CHECK(written <= length);
+
+	memset(out, 0, sizeof(*out));
+	memcpy(out->Bytes, request.Bytes, written);
+	return written;
+}
+
+static void TestLayout(void)
+{
+	// The batch is shared with user mode, so its layout may not move
+	CHECK_EQUAL(sizeof(LUMIAUSBC_EVENT_RECORD), 24);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_RECORD, Sequence), 0);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_RECORD, Type), 4);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_RECORD, Time), 8);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_RECORD, Data), 16);
+
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_BATCH, Version), 0);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_BATCH, Count), 4);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_BATCH, Lost), 8);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_EVENT_BATCH, Records), 16);
+	CHECK_EQUAL(LUMIAUSBC_EVENT_BATCH_SIZE(1), 40);
+	CHECK_EQUAL(LUMIAUSBC_EVENT_BATCH_SIZE(3), 88);
+}
+
+static void TestRoundTrip(void)
+{
+	static const LUMIAUSBC_EVENT_RECORD posted[] = {
+		{ 0, LUMIAUSBC_EVENT_ATTACH, 1000, { 2, 1500 } },
+		{ 0, LUMIAUSBC_EVENT_CONTRACT, 250000, { 9000, 2000 } },
+		{ 0, LUMIAUSBC_EVENT_POWER_ROLE, 0x123456789ULL, { 1, 0 } },
+		{ 0, LUMIAUSBC_EVENT_ERROR, 0xFFFFFFFFFFFFFFFFULL, { LUMIAUSBC_EVENT_ERROR_ACKNOWLEDGE, 0xA5 } },
+		{ 0, LUMIAUSBC_EVENT_DETACH, 0, { 0, 0 } },
+	};
+	EVENT_QUEUE queue;
+	BATCH_BUFFER out;
+	unsigned int i, count = sizeof(posted) / sizeof(posted[0]), written, expected = 0, missed;
+
+	EventQueueInitialize(&queue);
+	for (i = 0; i < count; i++)
+		EventQueuePost(&queue, posted[i].Type, posted[i].Time, posted[i].Data[0], posted[i].Data[1]);
+	CHECK_EQUAL(EventQueuePending(&queue), count);
+
+	written = Transfer(&queue, &out, sizeof(out));
+	CHECK_EQUAL(written, LUMIAUSBC_EVENT_BATCH_SIZE(count));
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), (int)count);
+	CHECK_EQUAL(missed, 0);
+	CHECK_EQUAL(expected, count + 1);
+	CHECK_EQUAL(out.Batch.Version, LUMIAUSBC_EVENT_VERSION);
+	CHECK_EQUAL(out.Batch.Lost, 0);
+	CHECK_EQUAL(out.Batch.Reserved, 0);
+
+	// Every field comes back as posted, numbered from one
+	for (i = 0; i < count; i++) {
+		CHECK_EQUAL(out.Batch.Records[i].Sequence, i + 1);
+		CHECK_EQUAL(out.Batch.Records[i].Type, posted[i].Type);
+		CHECK(out.Batch.Records[i].Time == posted[i].Time);
+		CHECK_EQUAL(out.Batch.Records[i].Data[0], posted[i].Data[0]);
+		CHECK_EQUAL(out.Batch.Records[i].Data[1], posted[i].Data[1]);
+	}
+
+	CHECK_EQUAL(EventQueuePending(&queue), 0);
+	CHECK_EQUAL(queue.Posted, count);
+	CHECK_EQUAL(queue.Batches, 1);
+}
+
+static void TestSmallBuffers(void)
+{
+	EVENT_QUEUE queue;
+	BATCH_BUFFER out;
+	unsigned int i, written, expected = 0, missed, received = 0;
+
+	EventQueueInitialize(&queue);
+	for (i = 0; i < 10; i++)
+		EventQueuePost(&queue, LUMIAUSBC_EVENT_ATTACH, i, i, 0);
+
+	// Too small for one record: nothing written, nothing taken
+	CHECK_EQUAL(EventQueueDrain(&queue, &out, LUMIAUSBC_EVENT_BATCH_SIZE(1) - 1), 0);
+	CHECK_EQUAL(EventQueuePending(&queue), 10);
+
+	// A buffer between two sizes takes the whole records that fit, oldest first
+	while (EventQueuePending(&queue)) {
+		written = Transfer(&queue, &out, LUMIAUSBC_EVENT_BATCH_SIZE(3) + 10);
+		CHECK_EQUAL(written, LUMIAUSBC_EVENT_BATCH_SIZE(out.Batch.Count));
+		CHECK_EQUAL(out.Batch.Count, received + 3 <= 10 ? 3 : 10 - received);
+		CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), (int)out.Batch.Count);
+		CHECK_EQUAL(missed, 0);
+		CHECK_EQUAL(out.Batch.Records[0].Data[0], received);
+		received += out.Batch.Count;
+	}
+
+	CHECK_EQUAL(received, 10);
+	CHECK_EQUAL(queue.Batches, 4);
+}
+
+static void TestOverflowAndWrap(void)
+{
+	EVENT_QUEUE queue;
+	BATCH_BUFFER out;
+	unsigned int i, written, expected, missed;
+
+	// Nobody reading: the oldest are dropped, and both the header and the numbering say how many
+	EventQueueInitialize(&queue);
+	for (i = 0; i < EVENT_QUEUE_DEPTH + 10; i++)
+		EventQueuePost(&queue, LUMIAUSBC_EVENT_CONTRACT, i, i, 0);
+	CHECK_EQUAL(EventQueuePending(&queue), EVENT_QUEUE_DEPTH);
+
+	expected = 1;
+	written = Transfer(&queue, &out, sizeof(out));
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), EVENT_QUEUE_DEPTH);
+	CHECK_EQUAL(missed, 10);
+	CHECK_EQUAL(out.Batch.Lost, 10);
+	CHECK_EQUAL(out.Batch.Records[0].Sequence, 11);
+	CHECK_EQUAL(out.Batch.Records[0].Data[0], 10);
+	CHECK_EQUAL(queue.TotalLost, 10);
+
+	// The count restarts with each batch
+	EventQueuePost(&queue, LUMIAUSBC_EVENT_DETACH, 0, 0, 0);
+	written = Transfer(&queue, &out, sizeof(out));
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), 1);
+	CHECK_EQUAL(missed, 0);
+	CHECK_EQUAL(out.Batch.Lost, 0);
+
+	// Numbers wrap past zero, which is never used
+	EventQueueInitialize(&queue);
+	queue.Next = 0xFFFFFFFE;
+	for (i = 0; i < 4; i++)
+		EventQueuePost(&queue, LUMIAUSBC_EVENT_ATTACH, i, i, 0);
+	written = Transfer(&queue, &out, sizeof(out));
+	CHECK_EQUAL(out.Batch.Records[0].Sequence, 0xFFFFFFFE);
+	CHECK_EQUAL(out.Batch.Records[1].Sequence, 0xFFFFFFFF);
+	CHECK_EQUAL(out.Batch.Records[2].Sequence, 1);
+	CHECK_EQUAL(out.Batch.Records[3].Sequence, 2);
+
+	expected = 0xFFFFFFFE;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), 4);
+	CHECK_EQUAL(missed, 0);
+	CHECK_EQUAL(expected, 3);
+
+	expected = 0xFFFFFFFD;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), 4);
+	CHECK_EQUAL(missed, 1);
+
+	// A gap across the wrap does not count zero
+	out.Batch.Records[0] = out.Batch.Records[3];
+	out.Batch.Count = 1;
+	expected = 0xFFFFFFFF;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, LUMIAUSBC_EVENT_BATCH_SIZE(1), &expected, &missed), 1);
+	CHECK_EQUAL(missed, 2);
+}
+
+static void TestMalformed(void)
+{
+	EVENT_QUEUE queue;
+	BATCH_BUFFER out, copy;
+	unsigned int i, written, expected, missed;
+
+	EventQueueInitialize(&queue);
+	for (i = 0; i < 3; i++)
+		EventQueuePost(&queue, LUMIAUSBC_EVENT_ATTACH, i, i, 0);
+	written = Transfer(&queue, &out, sizeof(out));
+
+	expected = 0;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), 3);
+
+	// Short, or shorter than the count says
+	expected = 0;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, LUMIAUSBC_EVENT_BATCH_SIZE(1) - 1, &expected, &missed), -1);
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written - 1, &expected, &missed), -1);
+
+	copy = out;
+	copy.Batch.Version = LUMIAUSBC_EVENT_VERSION + 1;
+	CHECK_EQUAL(EventBatchParse(copy.Bytes, written, &expected, &missed), -1);
+
+	copy = out;
+	copy.Batch.Count = 0;
+	CHECK_EQUAL(EventBatchParse(copy.Bytes, written, &expected, &missed), -1);
+
+	copy = out;
+	copy.Batch.Records[1].Sequence = 0;
+	CHECK_EQUAL(EventBatchParse(copy.Bytes, written, &expected, &missed), -1);
+
+	// Numbers going backwards did not come from this queue
+	copy = out;
+	copy.Batch.Records[2].Sequence = 1;
+	expected = 0;
+	CHECK_EQUAL(EventBatchParse(copy.Bytes, written, &expected, &missed), -1);
+	expected = 10;
+	CHECK_EQUAL(EventBatchParse(out.Bytes, written, &expected, &missed), -1);
+}
+
+//
+// A monitor keeping a request pending, against events arriving at random
+// and buffers of random size: every record it is told about either
+// arrives intact or is counted as missed
+//
+static void TestMonitor(void)
+{
+	static LUMIAUSBC_EVENT_RECORD posted[20000];
+	EVENT_QUEUE queue;
+	BATCH_BUFFER out;
+	unsigned int seed = 7, i, j, burst, written, expected = 0, missed, totalMissed = 0, received = 0, lost = 0;
+	unsigned int postedCount = 0, corrupt = 0, sequence;
+	int count;
+
+	EventQueueInitialize(&queue);
+
+	while (postedCount < sizeof(posted) / sizeof(posted[0])) {
+		seed = seed * 1103515245 + 12345;
+		burst = (seed >> 16) % 100;
+		for (i = 0; i < burst && postedCount < sizeof(posted) / sizeof(posted[0]); i++) {
+			seed = seed * 1103515245 + 12345;
+			posted[postedCount].Type = 1 + (seed >> 16) % 5;
+			posted[postedCount].Time = (unsigned long long)postedCount * 10000 + (seed >> 8);
+			posted[postedCount].Data[0] = seed;
+			posted[postedCount].Data[1] = ~seed;
+			EventQueuePost(&queue, posted[postedCount].Type, posted[postedCount].Time,
+				posted[postedCount].Data[0], posted[postedCount].Data[1]);
+			postedCount++;
+		}
+
+		if (!EventQueuePending(&queue))
+			continue;
+
+		seed = seed * 1103515245 + 12345;
+		written = Transfer(&queue, &out, LUMIAUSBC_EVENT_BATCH_SIZE(1 + (seed >> 16) % BUFFER_RECORDS));
+		count = EventBatchParse(out.Bytes, written, &expected, &missed);
+		CHECK(count > 0);
+		if (count <= 0)
+			break;
+
+		totalMissed += missed;
+		lost += out.Batch.Lost;
+		received += (unsigned int)count;
+
+		for (j = 0; j < (unsigned int)count; j++) {
+			sequence = out.Batch.Records[j].Sequence;
+			if (out.Batch.Records[j].Type != posted[sequence - 1].Type ||
+				out.Batch.Records[j].Time != posted[sequence - 1].Time ||
+				out.Batch.Records[j].Data[0] != posted[sequence - 1].Data[0] ||
+				out.Batch.Records[j].Data[1] != posted[sequence - 1].Data[1])
+				corrupt++;
+		}
+	}
+
+	while (EventQueuePending(&queue)) {
+		written = Transfer(&queue, &out, sizeof(out));
+		count = EventBatchParse(out.Bytes, written, &expected, &missed);
+		totalMissed += missed;
+		lost += out.Batch.Lost;
+		received += count > 0 ? (unsigned int)count : 0;
+	}
+
+	CHECK_EQUAL(corrupt, 0);
+	CHECK_EQUAL(received + totalMissed, postedCount);
+	// The header and the numbering agree about what was dropped
+	CHECK_EQUAL(totalMissed, lost);
+	CHECK_EQUAL(totalMissed, queue.TotalLost);
+	CHECK(totalMissed > 0);
+}
+
+int main(void)
+{
+	TestLayout();
+	TestRoundTrip();
+	TestSmallBuffers();
+	TestOverflowAndWrap();
+	TestMalformed();
+	TestMonitor();
+
+	return TestExit("EventQueueTest");
+}
@@ -0,0 +1,116 @@
+/*++
+
+Module Name:
+
+    fakeuc120.c
+
+Abstract:
+
+    Register file standing in for the UC120 in the host tests.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "FakeUc120.h"
+
+const UC120_SCRIPT_OPS FakeUc120ScriptOps = { FakeUc120Read, FakeUc120Write, FakeUc120Delay };
+
+void
+FakeUc120Reset(
+	FAKE_UC120 *chip
+)
+{
+	memset(chip, 0, sizeof(*chip));
+}
+
+//
+// The register a burst touches at offset i, FIFO registers do not advance
+//
+static int FakeUc120Address(int reg, unsigned int i)
+{
+	const UC120_REGISTER_INFO *info = Uc120LookupRegister(reg);
+
+	return info && (info->Flags & UC120_REG_FIFO) ? reg : reg + (int)i;
+}
+
+static int FakeUc120Begin(FAKE_UC120 *chip, int reg, unsigned int length, int write)
+{
+	if (chip->Access)
+		chip->Access(chip, reg, length, write);
+
+	if (write)
+		chip->Writes++;
+	else
+		chip->Reads++;
+
+	if (chip->FailTransfers) {
+		chip->FailTransfers--;
+		return 0;
+	}
+
+	if (reg < 0 || reg + (int)length > UC120_SCRIPT_REG_COUNT)
+		return 0;
+
+	chip->Bytes += length;
+	return 1;
+}
+
+int FakeUc120Read(void *context, int reg, unsigned char *value, unsigned int length)
+{
+	FAKE_UC120 *chip = (FAKE_UC120 *)context;
+	unsigned int i;
+	int address;
+
+	if (!FakeUc120Begin(chip, reg, length, 0))
+		return 0;
+
+	for (i = 0; i < length; i++) {
+		address = FakeUc120Address(reg, i);
+		value[i] = chip->Registers[address];
+
+		if (address == UC120_REG_STATUS && chip->Settling) {
+			chip->Settling--;
+			value[i] = 0;
+		}
+	}
+
+	return 1;
+}
+
+int FakeUc120Write(void *context, int reg, unsigned char *value, unsigned int length)
+{
+	FAKE_UC120 *chip = (FAKE_UC120 *)context;
+	const UC120_REGISTER_INFO *info;
+	unsigned int i;
+	int address;
+
+	if (!FakeUc120Begin(chip, reg, length, 1))
+		return 0;
+
+	for (i = 0; i < length; i++) {
+		address = FakeUc120Address(reg, i);
+		info = Uc120LookupRegister(address);
+
+		if (!info || info->Access == Uc120AccessRead)
+			continue;
+
+		if (info->Access == Uc120AccessWriteClear)
+			chip->Registers[address] &= (unsigned char)~value[i];
+		else
+			chip->Registers[address] = value[i];
+
+		if (address == UC120_REG_CONFIG_LAST)
+			chip->Settling = chip->SettleReads;
+	}
+
+	return 1;
+}
+
+void FakeUc120Delay(void *context, unsigned int ms)
+{
+	((FAKE_UC120 *)context)->DelayMs += ms;
+}
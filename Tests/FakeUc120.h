@@ -0,0 +1,61 @@
+/*++
+
+Module Name:
+
+    fakeuc120.h
+
+Abstract:
+
+    A UC120 register file for the host tests. Writes follow each
+    register's access type from the map in uc120.h, and the status
+    register reads zero for a while after the configuration block is
+    written, like the chip taking its configuration.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Uc120.h"
+#include "Uc120Script.h"
+
+typedef struct _FAKE_UC120 FAKE_UC120;
+
+struct _FAKE_UC120
+{
+	unsigned char Registers[UC120_SCRIPT_REG_COUNT];
+
+	// STATUS reads zero this many times once the last configuration register is written
+	unsigned int SettleReads;
+	unsigned int Settling;
+
+	// The next this many transfers fail without touching a register
+	unsigned int FailTransfers;
+
+	// Called before every transfer, lets a test change registers behind the driver's back
+	void (*Access)(FAKE_UC120 *chip, int reg, unsigned int length, int write);
+	void *Context;
+
+	unsigned int Reads;
+	unsigned int Writes;
+	unsigned int Bytes;
+	unsigned int DelayMs;
+};
+
+//
+// Powers the chip on: every register zero, nothing counted, no hooks
+//
+void
+FakeUc120Reset(
+	FAKE_UC120 *chip
+);
+
+// UC120_SCRIPT_OPS callbacks, context is the FAKE_UC120
+int FakeUc120Read(void *context, int reg, unsigned char *value, unsigned int length);
+int FakeUc120Write(void *context, int reg, unsigned char *value, unsigned int length);
+void FakeUc120Delay(void *context, unsigned int ms);
+
+extern const UC120_SCRIPT_OPS FakeUc120ScriptOps;
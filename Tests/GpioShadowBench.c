@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    gpioshadowbench.c
+
+Abstract:
+
+    Reports the fraction of GPIO IOCTLs the output shadow in SetGPIO
+    removes from bit-banged register traffic. Transfers run through
+    bitbang.c against the mock GPIO backend, and the shadow is dropped
+    at intervals the way a power transition drops it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include "MockGpio.h"
+
+#define TRANSFERS 100000
+// Transfers between two power transitions
+#define RESYNC_INTERVAL 64
+
+typedef struct _TRAFFIC
+{
+	const char *Name;
+	// Percent of transfers that are writes
+	unsigned int WritePercent;
+	// Registers addressed, and the data bits that vary
+	unsigned int Registers;
+	unsigned char DataMask;
+	unsigned int MaxLength;
+} TRAFFIC;
+
+static const TRAFFIC Traffic[] = {
+	// Any register, any data
+	{ "random", 50, 32, 0xFF, 4 },
+	// Status polling and small configuration writes, as the driver mostly does
+	{ "polling", 10, 4, 0x0F, 2 },
+	// FIFO bursts of PD messages
+	{ "fifo", 50, 1, 0xFF, 30 },
+};
+
+static void Run(const TRAFFIC *traffic)
+{
+	MOCK_GPIO mock;
+	BIT_BANG bitBang;
+	unsigned char data[32];
+	unsigned long i, total;
+	unsigned int j, reg, length, write;
+
+	MockGpioInitialize(&mock, 1);
+	mock.UseShadow = 1;
+	BitBangInitialize(&bitBang, &MockGpioOps, &mock, 1);
+
+	for (i = 0; i < TRANSFERS; i++) {
+		if (i % RESYNC_INTERVAL == 0)
+			MockGpioResync(&mock);
+
+		reg = MockGpioRandom(&mock) % traffic->Registers;
+		write = MockGpioRandom(&mock) % 100 < traffic->WritePercent;
+		length = 1 + MockGpioRandom(&mock) % traffic->MaxLength;
+		for (j = 0; j < length; j++)
+			data[j] = (unsigned char)(MockGpioRandom(&mock) & traffic->DataMask);
+
+		BitBangTransfer(&bitBang, (unsigned char)((reg << 3) | write), data, length, write);
+	}
+
+	total = MockGpioIssued(&mock) + MockGpioSuppressed(&mock) + mock.Reads;
+
+	printf("%-8s %6lu transfers, %8lu GPIO IOCTLs, %8lu writes suppressed: %4.1f%% removed, MOSI %4.1f%%\n",
+		traffic->Name, bitBang.Transactions, total, MockGpioSuppressed(&mock),
+		100.0 * MockGpioSuppressed(&mock) / total,
+		100.0 * mock.Suppressed[BitBangPinMosi] / (mock.Issued[BitBangPinMosi] + mock.Suppressed[BitBangPinMosi]));
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	printf("GpioShadowBench\n");
+	for (i = 0; i < sizeof(Traffic) / sizeof(Traffic[0]); i++)
+		Run(&Traffic[i]);
+
+	return 0;
+}
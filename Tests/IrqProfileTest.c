@@ -0,0 +1,270 @@
+/*++
+
+Module Name:
+
+    irqprofiletest.c
+
+Abstract:
+
+    Tests for the interrupt profiler in irqprofile.c. The recorder is fed
+    the way the ISRs and the UC120 work item feed it, and the analysis is
+    run on records as LumiaUSBCPublishInterruptProfile leaves them in
+    InterruptProfileDump: a flat array of IRQ_PROFILE_RECORD, written out
+    and read back as raw bytes.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stddef.h>
+#include <string.h>
+#include "Test.h"
+#include "Public.h"
+#include "Uc120.h"
+#include "IrqProfile.h"
+
+#define PLUG     LUMIAUSBC_INTERRUPT_PLUG_DETECT
+#define UC120    LUMIAUSBC_INTERRUPT_UC120
+#define MYSTERY1 LUMIAUSBC_INTERRUPT_MYSTERY1
+#define MYSTERY2 LUMIAUSBC_INTERRUPT_MYSTERY2
+#define STATUS   IRQ_PROFILE_STATUS
+
+// A record as IrqProfileInterrupt and IrqProfileStatus make them
+#define AT(time, source, status) { (time), (source), (status), 0 }
+
+static void TestRecordLayout(void)
+{
+	// The registry dump is this layout, read back on other machines
+	CHECK_EQUAL(sizeof(IRQ_PROFILE_RECORD), 8);
+	CHECK_EQUAL(offsetof(IRQ_PROFILE_RECORD, TimeUs), 0);
+	CHECK_EQUAL(offsetof(IRQ_PROFILE_RECORD, Source), 4);
+	CHECK_EQUAL(offsetof(IRQ_PROFILE_RECORD, Status), 5);
+	CHECK_EQUAL(offsetof(IRQ_PROFILE_RECORD, Reserved), 6);
+}
+
+static void TestRecorder(void)
+{
+	static IRQ_PROFILE profile;
+	IRQ_PROFILE_RECORD records[IRQ_PROFILE_DEPTH];
+	unsigned int i, count, storms = 0, stormAt = 0, burst;
+
+	// Bursts are per line, and a gap of exactly IRQ_PROFILE_BURST_GAP_US still joins
+	IrqProfileInitialize(&profile);
+	CHECK_EQUAL(IrqProfileInterrupt(&profile, MYSTERY1, 0), 1);
+	CHECK_EQUAL(IrqProfileInterrupt(&profile, MYSTERY2, 10), 1);
+	CHECK_EQUAL(IrqProfileInterrupt(&profile, MYSTERY1, IRQ_PROFILE_BURST_GAP_US), 2);
+	CHECK_EQUAL(IrqProfileInterrupt(&profile, MYSTERY1, 2 * IRQ_PROFILE_BURST_GAP_US + 1), 1);
+	CHECK_EQUAL(profile.Interrupts[MYSTERY1], 3);
+	CHECK_EQUAL(profile.Interrupts[MYSTERY2], 1);
+
+	// Nothing is recorded for a source out of range or an interrupt that set no status bit
+	CHECK_EQUAL(IrqProfileInterrupt(&profile, IRQ_PROFILE_SOURCES, 3000), 0);
+	IrqProfileStatus(&profile, 0, 3000);
+	IrqProfileStatus(&profile, UC120_INT_PD_RX, 3100);
+	CHECK_EQUAL(profile.Recorded, 5);
+
+	count = IrqProfileDump(&profile, records, IRQ_PROFILE_DEPTH);
+	CHECK_EQUAL(count, 5);
+	CHECK_EQUAL(records[0].Source, MYSTERY1);
+	CHECK_EQUAL(records[1].Source, MYSTERY2);
+	CHECK_EQUAL(records[1].TimeUs, 10);
+	CHECK_EQUAL(records[4].Source, STATUS);
+	CHECK_EQUAL(records[4].Status, UC120_INT_PD_RX);
+	CHECK_EQUAL(records[4].TimeUs, 3100);
+
+	// Past the depth only the newest records are held, and a short buffer gets the newest that fit
+	IrqProfileInitialize(&profile);
+	for (i = 0; i < IRQ_PROFILE_DEPTH + 188; i++)
+		IrqProfileInterrupt(&profile, i % IRQ_PROFILE_SOURCES, i * 2000);
+	count = IrqProfileDump(&profile, records, IRQ_PROFILE_DEPTH);
+	CHECK_EQUAL(count, IRQ_PROFILE_DEPTH);
+	CHECK_EQUAL(records[0].TimeUs, 188 * 2000);
+	CHECK_EQUAL(records[IRQ_PROFILE_DEPTH - 1].TimeUs, (IRQ_PROFILE_DEPTH + 187) * 2000);
+	for (i = 1; i < count; i++)
+		CHECK_EQUAL(records[i].TimeUs - records[i - 1].TimeUs, 2000);
+	count = IrqProfileDump(&profile, records, 10);
+	CHECK_EQUAL(count, 10);
+	CHECK_EQUAL(records[0].TimeUs, (IRQ_PROFILE_DEPTH + 178) * 2000);
+
+	// LumiaUSBCProfileIsr masks a line when the burst reaches IRQ_PROFILE_STORM_BURST, which has to happen once
+	IrqProfileInitialize(&profile);
+	for (i = 0; i < 3 * IRQ_PROFILE_STORM_BURST; i++) {
+		burst = IrqProfileInterrupt(&profile, MYSTERY2, 0xFFFFF000 + i * 10);
+		if (burst == IRQ_PROFILE_STORM_BURST) {
+			storms++;
+			stormAt = i;
+		}
+	}
+	CHECK_EQUAL(storms, 1);
+	CHECK_EQUAL(stormAt, IRQ_PROFILE_STORM_BURST - 1);
+}
+
+typedef struct _ANALYZE_CASE
+{
+	IRQ_PROFILE_RECORD Records[8];
+	unsigned int Count;
+	unsigned int Source;
+
+	unsigned int Interrupts;
+	unsigned int RateMilliHz;
+	unsigned int Bursts;
+	unsigned int MaxBurst;
+	unsigned int Unrelated;
+	// Status bit expected to correlate, and with how many interrupts
+	int Bit;
+	unsigned int Correlated;
+} ANALYZE_CASE;
+
+static const ANALYZE_CASE AnalyzeCases[] = {
+	// One interrupt has no rate
+	{ { AT(0, MYSTERY1, 0) }, 1, MYSTERY1, 1, 0, 1, 1, 1, -1, 0 },
+	// Three 500 us apart are one burst at 2 kHz
+	{ { AT(0, MYSTERY1, 0), AT(500, MYSTERY1, 0), AT(1000, MYSTERY1, 0) }, 3, MYSTERY1, 3, 2000000, 1, 3, 3, -1, 0 },
+	// Just past the gap they are separate bursts
+	{ { AT(0, MYSTERY1, 0), AT(1001, MYSTERY1, 0), AT(2002, MYSTERY1, 0), AT(2500, MYSTERY1, 0) }, 4, MYSTERY1, 4, 1200000, 3, 2, 4, -1, 0 },
+	// Other lines do not break a burst or count towards it
+	{ { AT(0, MYSTERY2, 0), AT(300, PLUG, 0), AT(600, MYSTERY2, 0), AT(700, 7, 0) }, 4, MYSTERY2, 2, 1666666, 1, 2, 2, -1, 0 },
+	// Status bits after the interrupt, up to the window
+	{ { AT(0, MYSTERY1, 0), AT(3000, STATUS, UC120_INT_CC_CHANGE) }, 2, MYSTERY1, 1, 0, 1, 1, 0, 0, 1 },
+	{ { AT(0, MYSTERY1, 0), AT(5000, STATUS, UC120_INT_PD_RX) }, 2, MYSTERY1, 1, 0, 1, 1, 0, 1, 1 },
+	{ { AT(0, MYSTERY1, 0), AT(5001, STATUS, UC120_INT_PD_RX) }, 2, MYSTERY1, 1, 0, 1, 1, 1, -1, 0 },
+	// And before it, when the work item read the status first
+	{ { AT(0, STATUS, UC120_INT_PD_HARD_RESET), AT(4000, MYSTERY2, 0) }, 2, MYSTERY2, 1, 0, 1, 1, 0, 5, 1 },
+	// A status record only counts once per interrupt even when it is near several
+	{ { AT(0, MYSTERY1, 0), AT(900, MYSTERY1, 0), AT(1000, STATUS, UC120_INT_CC_CHANGE), AT(1100, STATUS, UC120_INT_CC_CHANGE) }, 4,
+		MYSTERY1, 2, 1111111, 1, 2, 0, 0, 2 },
+	// Across the microsecond clock wrapping
+	{ { AT(0xFFFFFE0C, PLUG, 0), AT(0xFFFFFFFF, STATUS, UC120_INT_CC_CHANGE), AT(0x1F4, PLUG, 0) }, 3, PLUG, 2, 1000000, 1, 2, 0, 0, 2 },
+};
+
+static void TestAnalyzeCases(void)
+{
+	const ANALYZE_CASE *c;
+	IRQ_PROFILE_RESULT result;
+	unsigned int i, bit, percent, other;
+
+	for (i = 0; i < sizeof(AnalyzeCases) / sizeof(AnalyzeCases[0]); i++) {
+		c = &AnalyzeCases[i];
+		IrqProfileAnalyze(c->Records, c->Count, IRQ_PROFILE_BURST_GAP_US, IRQ_PROFILE_WINDOW_US, &result);
+
+		CHECK_EQUAL(result.Sources[c->Source].Interrupts, c->Interrupts);
+		CHECK_EQUAL(result.Sources[c->Source].RateMilliHz, c->RateMilliHz);
+		CHECK_EQUAL(result.Sources[c->Source].Bursts, c->Bursts);
+		CHECK_EQUAL(result.Sources[c->Source].MaxBurst, c->MaxBurst);
+		CHECK_EQUAL(result.Sources[c->Source].Unrelated, c->Unrelated);
+
+		for (other = bit = 0; bit < 8; bit++) {
+			if ((int)bit == c->Bit)
+				CHECK_EQUAL(result.Sources[c->Source].Correlated[bit], c->Correlated);
+			else
+				other += result.Sources[c->Source].Correlated[bit];
+		}
+		CHECK_EQUAL(other, 0);
+		CHECK_EQUAL(IrqProfileBestBit(&result.Sources[c->Source], &percent), c->Bit);
+		CHECK_EQUAL(percent, c->Bit < 0 ? 0 : c->Correlated * 100 / c->Interrupts);
+	}
+}
+
+//
+// A session as the driver would record it: plugs and unplugs every second,
+// each with Mystery1 firing just ahead of the plug detect line and a CC
+// change, PD traffic in between, and Mystery2 ticking along regardless
+//
+static void RecordSession(PIRQ_PROFILE profile)
+{
+	unsigned int step, t;
+
+	IrqProfileInitialize(profile);
+
+	for (step = 0; step < 200; step++) {
+		t = 7000000 + step * 100000;
+
+		if (step % 10 == 0) {
+			IrqProfileInterrupt(profile, MYSTERY1, t);
+			IrqProfileInterrupt(profile, PLUG, t + 20);
+			IrqProfileInterrupt(profile, UC120, t + 100);
+			IrqProfileStatus(profile, UC120_INT_CC_CHANGE, t + 400);
+		}
+		else if (step % 2) {
+			IrqProfileInterrupt(profile, UC120, t + 10000);
+			IrqProfileStatus(profile, UC120_INT_PD_RX, t + 10300);
+		}
+
+		IrqProfileInterrupt(profile, MYSTERY2, t + 50000);
+	}
+}
+
+static void TestRecordedDump(void)
+{
+	static IRQ_PROFILE profile;
+	IRQ_PROFILE_RECORD records[IRQ_PROFILE_DEPTH], loaded[IRQ_PROFILE_DEPTH];
+	IRQ_PROFILE_RESULT result, reloaded;
+	unsigned int count, percent;
+	FILE *dump;
+
+	RecordSession(&profile);
+	count = IrqProfileDump(&profile, records, IRQ_PROFILE_DEPTH);
+	CHECK_EQUAL(count, 20 * 4 + 100 * 2 + 200);
+
+	// The bytes of the InterruptProfileDump value, out to a file and back
+	dump = tmpfile();
+	CHECK(dump != NULL);
+	if (!dump)
+		return;
+	CHECK_EQUAL(fwrite(records, sizeof(IRQ_PROFILE_RECORD), count, dump), count);
+	rewind(dump);
+	CHECK_EQUAL(fread(loaded, sizeof(IRQ_PROFILE_RECORD), IRQ_PROFILE_DEPTH, dump), count);
+	fclose(dump);
+	CHECK(!memcmp(records, loaded, count * sizeof(IRQ_PROFILE_RECORD)));
+
+	IrqProfileAnalyze(records, count, IRQ_PROFILE_BURST_GAP_US, IRQ_PROFILE_WINDOW_US, &result);
+	IrqProfileAnalyze(loaded, count, IRQ_PROFILE_BURST_GAP_US, IRQ_PROFILE_WINDOW_US, &reloaded);
+	CHECK(!memcmp(&result, &reloaded, sizeof(result)));
+	CHECK_EQUAL(result.StatusRecords, 120);
+
+	// Mystery1 always comes with a CC change: a line worth taking instead of polling
+	CHECK_EQUAL(result.Sources[MYSTERY1].Interrupts, 20);
+	CHECK_EQUAL(result.Sources[MYSTERY1].RateMilliHz, 1000);
+	CHECK_EQUAL(result.Sources[MYSTERY1].MaxBurst, 1);
+	CHECK_EQUAL(IrqProfileBestBit(&result.Sources[MYSTERY1], &percent), 0);
+	CHECK_EQUAL(percent, 100);
+
+	// Mystery2 is a 10 Hz tick with nothing to do with the UC120
+	CHECK_EQUAL(result.Sources[MYSTERY2].Interrupts, 200);
+	CHECK_EQUAL(result.Sources[MYSTERY2].RateMilliHz, 10000);
+	CHECK_EQUAL(result.Sources[MYSTERY2].Bursts, 200);
+	CHECK_EQUAL(result.Sources[MYSTERY2].Unrelated, 200);
+	CHECK_EQUAL(IrqProfileBestBit(&result.Sources[MYSTERY2], &percent), -1);
+	CHECK_EQUAL(percent, 0);
+
+	// The UC120 line itself carries both, mostly PD traffic
+	CHECK_EQUAL(result.Sources[UC120].Interrupts, 120);
+	CHECK_EQUAL(result.Sources[UC120].Correlated[0], 20);
+	CHECK_EQUAL(result.Sources[UC120].Correlated[1], 100);
+	CHECK_EQUAL(IrqProfileBestBit(&result.Sources[UC120], &percent), 1);
+	CHECK_EQUAL(percent, 83);
+
+	// The dump is there to be looked at again with other windows: the CC change comes 400 us after Mystery1
+	IrqProfileAnalyze(loaded, count, IRQ_PROFILE_BURST_GAP_US, 399, &reloaded);
+	CHECK_EQUAL(reloaded.Sources[MYSTERY1].Unrelated, 20);
+	CHECK_EQUAL(IrqProfileBestBit(&reloaded.Sources[MYSTERY1], &percent), -1);
+	IrqProfileAnalyze(loaded, count, IRQ_PROFILE_BURST_GAP_US, 400, &reloaded);
+	CHECK_EQUAL(reloaded.Sources[MYSTERY1].Correlated[0], 20);
+
+	// And with a gap wide enough to join the tick into one burst
+	IrqProfileAnalyze(loaded, count, 100000, IRQ_PROFILE_WINDOW_US, &reloaded);
+	CHECK_EQUAL(reloaded.Sources[MYSTERY2].Bursts, 1);
+	CHECK_EQUAL(reloaded.Sources[MYSTERY2].MaxBurst, 200);
+}
+
+int main(void)
+{
+	TestRecordLayout();
+	TestRecorder();
+	TestAnalyzeCases();
+	TestRecordedDump();
+
+	return TestExit("IrqProfileTest");
+}
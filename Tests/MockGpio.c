@@ -0,0 +1,130 @@
+/*++
+
+Module Name:
+
+    mockgpio.c
+
+Abstract:
+
+    Mock GPIO backend for the bit-bang engine.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "MockGpio.h"
+
+static int MockGpioSetPin(void *context, BIT_BANG_PIN pin, int level);
+static int MockGpioGetPin(void *context, BIT_BANG_PIN pin, int *level);
+static void MockGpioStall(void *context, unsigned int us);
+static unsigned long long MockGpioNow(void *context);
+
+const BIT_BANG_OPS MockGpioOps = { MockGpioSetPin, MockGpioGetPin, MockGpioStall, MockGpioNow };
+
+void
+MockGpioInitialize(
+	MOCK_GPIO *mock,
+	unsigned int seed
+)
+{
+	unsigned int i;
+
+	memset(mock, 0, sizeof(*mock));
+	for (i = 0; i < MOCK_GPIO_PINS; i++)
+		mock->Level[i] = 1;
+
+	mock->Seed = seed;
+}
+
+void
+MockGpioResync(
+	MOCK_GPIO *mock
+)
+{
+	memset(mock->ShadowValid, 0, sizeof(mock->ShadowValid));
+}
+
+unsigned int
+MockGpioRandom(
+	MOCK_GPIO *mock
+)
+{
+	mock->Seed = mock->Seed * 1103515245 + 12345;
+	return (mock->Seed >> 16) & 0x7FFF;
+}
+
+//
+// One IOCTL round trip to the GPIO controller, nonzero if it succeeded
+//
+static int MockGpioIoctl(MOCK_GPIO *mock)
+{
+	mock->NowNs += mock->IoctlNs;
+	if (mock->JitterNs)
+		mock->NowNs += MockGpioRandom(mock) % (mock->JitterNs + 1);
+
+	if (mock->FailAfter && --mock->FailAfter == 0)
+		return 0;
+
+	return 1;
+}
+
+static int MockGpioSetPin(void *context, BIT_BANG_PIN pin, int level)
+{
+	MOCK_GPIO *mock = (MOCK_GPIO *)context;
+
+	// The same early return as SetGPIO
+	if (mock->UseShadow && mock->ShadowValid[pin] && mock->Level[pin] == level) {
+		mock->Suppressed[pin]++;
+		return 1;
+	}
+
+	mock->Issued[pin]++;
+	if (!MockGpioIoctl(mock)) {
+		mock->ShadowValid[pin] = 0;
+		return 0;
+	}
+
+	// Sample MOSI on the rising clock edge while the chip is selected
+	if (pin == BitBangPinClk && level && !mock->Level[BitBangPinClk] && !mock->Level[BitBangPinCs] &&
+		mock->CapturedBytes < MOCK_GPIO_CAPTURE) {
+		mock->Captured[mock->CapturedBytes] = (unsigned char)((mock->Captured[mock->CapturedBytes] << 1) | mock->Level[BitBangPinMosi]);
+		if (++mock->CapturedBits == 8) {
+			mock->CapturedBits = 0;
+			mock->CapturedBytes++;
+		}
+	}
+
+	mock->Level[pin] = level;
+	mock->ShadowValid[pin] = 1;
+	return 1;
+}
+
+static int MockGpioGetPin(void *context, BIT_BANG_PIN pin, int *level)
+{
+	MOCK_GPIO *mock = (MOCK_GPIO *)context;
+
+	mock->Reads++;
+	if (!MockGpioIoctl(mock))
+		return 0;
+
+	*level = pin == BitBangPinMiso ? (int)(MockGpioRandom(mock) & 1) : mock->Level[pin];
+	return 1;
+}
+
+static void MockGpioStall(void *context, unsigned int us)
+{
+	MOCK_GPIO *mock = (MOCK_GPIO *)context;
+
+	mock->Stalls++;
+	mock->NowNs += us * 1000ULL + mock->StallSlackNs;
+}
+
+static unsigned long long MockGpioNow(void *context)
+{
+	MOCK_GPIO *mock = (MOCK_GPIO *)context;
+
+	return mock->NowNs / 1000;
+}
@@ -0,0 +1,93 @@
+/*++
+
+Module Name:
+
+    mockgpio.h
+
+Abstract:
+
+    Mock GPIO backend for the bit-bang engine. Pin writes go through the
+    same output shadow SetGPIO keeps in the driver, cost a configurable
+    time on a virtual clock, and what the engine clocks out on MOSI is
+    captured byte by byte. MISO returns pseudo-random bits.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "BitBang.h"
+
+#define MOCK_GPIO_PINS 4
+#define MOCK_GPIO_CAPTURE 256
+
+typedef struct _MOCK_GPIO
+{
+	int Level[MOCK_GPIO_PINS];
+
+	// The driver's GPIO_SHADOW, one per connection, when UseShadow is set
+	int UseShadow;
+	int ShadowValid[MOCK_GPIO_PINS];
+	unsigned long Issued[MOCK_GPIO_PINS];
+	unsigned long Suppressed[MOCK_GPIO_PINS];
+	unsigned long Reads;
+
+	// Virtual time. Every IOCTL costs IoctlNs plus up to JitterNs more, and
+	// a stall overshoots by StallSlackNs.
+	unsigned long long NowNs;
+	unsigned int IoctlNs;
+	unsigned int JitterNs;
+	unsigned int StallSlackNs;
+	unsigned long Stalls;
+
+	// Calls that fail once this many more succeeded, or never if zero
+	unsigned long FailAfter;
+
+	// Bytes clocked in on rising edges while CS was low, command bytes included
+	unsigned char Captured[MOCK_GPIO_CAPTURE];
+	unsigned int CapturedBytes;
+	unsigned int CapturedBits;
+
+	unsigned int Seed;
+} MOCK_GPIO;
+
+// SetPin, GetPin, Stall and Now with a MOCK_GPIO as the context
+extern const BIT_BANG_OPS MockGpioOps;
+
+//
+// All pins high, shadow off, IOCTLs free of cost
+//
+void
+MockGpioInitialize(
+	MOCK_GPIO *mock,
+	unsigned int seed
+);
+
+//
+// Forgets the shadow, as LumiaUSBCGpioResync does after a power transition
+//
+void
+MockGpioResync(
+	MOCK_GPIO *mock
+);
+
+//
+// Next value of the mock's pseudo-random sequence
+//
+unsigned int
+MockGpioRandom(
+	MOCK_GPIO *mock
+);
+
+static __inline unsigned long MockGpioIssued(const MOCK_GPIO *mock)
+{
+	return mock->Issued[0] + mock->Issued[1] + mock->Issued[2] + mock->Issued[3];
+}
+
+static __inline unsigned long MockGpioSuppressed(const MOCK_GPIO *mock)
+{
+	return mock->Suppressed[0] + mock->Suppressed[1] + mock->Suppressed[2] + mock->Suppressed[3];
+}
@@ -0,0 +1,284 @@
+/*++
+
+Module Name:
+
+    muxtest.c
+
+Abstract:
+
+    Tests for the mux transition planning in mux.c. A script of attach,
+    detach and mode events drives mock pins the way LumiaUSBCApplyMux
+    does, and every write is checked for order and timing. Every
+    transition between two states is also planned exhaustively.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "Uc120.h"
+#include "Mux.h"
+
+#define MOCK_LOG 64
+
+typedef struct _PIN_WRITE
+{
+	unsigned long long TimeUs;
+	unsigned char Mask;
+	unsigned char Value;
+} PIN_WRITE;
+
+typedef struct _MOCK_PINS
+{
+	unsigned char Pins;
+	unsigned long long NowUs;
+	// Every GPIO write takes this long
+	unsigned int WriteUs;
+
+	PIN_WRITE Log[MOCK_LOG];
+	unsigned int Writes;
+	// Writes that left the lanes enabled with neither the old nor the new configuration
+	unsigned int Illegal;
+} MOCK_PINS;
+
+//
+// What LumiaUSBCApplyMux drives for a connector state
+//
+static unsigned char MuxTarget(int attached, UC120_ORIENTATION orientation, int display)
+{
+	unsigned char target = 0;
+
+	if (orientation == Uc120OrientationCc2)
+		target |= MUX_PIN_POL;
+	if (display)
+		target |= MUX_PIN_AMSEL;
+	if (attached)
+		target |= MUX_PIN_EN;
+
+	return target;
+}
+
+//
+// Plans from what the driver believes the pins are and writes the steps out
+//
+static unsigned int Drive(MOCK_PINS *mock, unsigned char believed, unsigned char target, int atomic)
+{
+	MUX_STEP steps[MUX_MAX_STEPS];
+	unsigned char from = mock->Pins;
+	unsigned int count, i;
+
+	count = MuxPlanTransition(believed, target, atomic, steps);
+	CHECK(count <= MUX_MAX_STEPS);
+
+	for (i = 0; i < count; i++) {
+		mock->NowUs += mock->WriteUs;
+		mock->Pins = (unsigned char)((mock->Pins & ~steps[i].Mask) | steps[i].Value);
+
+		if (mock->Writes < MOCK_LOG) {
+			mock->Log[mock->Writes].TimeUs = mock->NowUs;
+			mock->Log[mock->Writes].Mask = steps[i].Mask;
+			mock->Log[mock->Writes].Value = steps[i].Value;
+		}
+		mock->Writes++;
+
+		if (!MuxStateIsLegal(mock->Pins, from, target))
+			mock->Illegal++;
+	}
+
+	return count;
+}
+
+typedef struct _ATTACH_EVENT
+{
+	unsigned long long TimeUs;
+	unsigned char CcStatus;
+	int Display;
+	// Separate pin writes it takes, and with the shared connection
+	unsigned int Writes;
+	unsigned int AtomicWrites;
+} ATTACH_EVENT;
+
+static const ATTACH_EVENT AttachScript[] = {
+	// Plugged in the right way round, only the enable moves
+	{ 10000,   0x01, 0, 1, 1 },
+	{ 500000,  0x00, 0, 1, 1 },
+	// Flipped: polarity first, then enable
+	{ 600000,  0x08, 0, 2, 1 },
+	// DisplayPort entered with the lanes in use: off, select, on
+	{ 700000,  0x08, 1, 3, 1 },
+	// Rp changes on the source side do not touch the mux
+	{ 750000,  0x0C, 1, 0, 0 },
+	{ 900000,  0x00, 0, 3, 1 },
+	// An accessory has no orientation and keeps the unflipped polarity
+	{ 1000000, 0x05, 0, 1, 1 },
+	// Unplugged and plugged back flipped before anything else happened
+	{ 1100000, 0x00, 0, 1, 1 },
+	{ 1100050, 0x04, 0, 2, 1 },
+	{ 1200000, 0x01, 0, 3, 1 },
+};
+
+static void RunScript(int atomic, unsigned int writeUs)
+{
+	const ATTACH_EVENT *event;
+	MOCK_PINS mock = { 0 };
+	unsigned char target, believed = 0;
+	unsigned int i, j, first, count;
+	unsigned long long start;
+
+	mock.WriteUs = writeUs;
+
+	for (i = 0; i < sizeof(AttachScript) / sizeof(AttachScript[0]); i++) {
+		event = &AttachScript[i];
+		target = MuxTarget(Uc120IsAttached(event->CcStatus), Uc120DecodeOrientation(event->CcStatus), event->Display);
+
+		mock.NowUs = start = event->TimeUs;
+		first = mock.Writes;
+		count = Drive(&mock, believed, target, atomic);
+		believed = target;
+
+		CHECK_EQUAL(count, atomic ? event->AtomicWrites : event->Writes);
+		CHECK_EQUAL(mock.Pins, target);
+		CHECK_EQUAL(mock.NowUs - start, (unsigned long long)count * writeUs);
+
+		// Lanes come on last and only once the polarity matches the plug
+		for (j = first; j < mock.Writes; j++) {
+			if ((mock.Log[j].Mask & MUX_PIN_EN) && (mock.Log[j].Value & MUX_PIN_EN)) {
+				CHECK_EQUAL(j, mock.Writes - 1);
+				CHECK_EQUAL(mock.Log[j].TimeUs - start, (unsigned long long)count * writeUs);
+			}
+		}
+	}
+
+	CHECK_EQUAL(mock.Illegal, 0);
+}
+
+static void TestAttachScript(void)
+{
+	RunScript(0, 0);
+	RunScript(0, 40);
+	RunScript(1, 40);
+}
+
+static void TestUnknownStart(void)
+{
+	unsigned char actual, target, believed;
+	MOCK_PINS mock;
+
+	// After a power transition the driver assumes the pins enabled the wrong way
+	// round. Whatever they really were, the plan must not pass lanes through
+	// a third configuration and must end at the target.
+	for (actual = 0; actual <= MUX_PINS_ALL; actual++) {
+		for (target = 0; target <= MUX_PINS_ALL; target++) {
+			believed = (unsigned char)((target ^ MUX_PINS_CONFIG) | MUX_PIN_EN);
+
+			memset(&mock, 0, sizeof(mock));
+			mock.Pins = actual;
+			Drive(&mock, believed, target, 0);
+			CHECK_EQUAL(mock.Pins, target);
+			CHECK_EQUAL(mock.Illegal, 0);
+
+			memset(&mock, 0, sizeof(mock));
+			mock.Pins = actual;
+			Drive(&mock, believed, target, 1);
+			CHECK_EQUAL(mock.Pins, target);
+			CHECK_EQUAL(mock.Writes, 1);
+		}
+	}
+}
+
+static void TestAllTransitions(void)
+{
+	MUX_STEP steps[MUX_MAX_STEPS];
+	unsigned char from, to, state, changed;
+	unsigned int count, expected, i;
+	int atomic;
+
+	// Every state to every other, pin by pin and all at once: every state on
+	// the way is legal, every write changes a pin and nothing is written twice
+	for (atomic = 0; atomic <= 1; atomic++) {
+		for (from = 0; from <= MUX_PINS_ALL; from++) {
+			for (to = 0; to <= MUX_PINS_ALL; to++) {
+				count = MuxPlanTransition(from, to, atomic, steps);
+				CHECK(count <= MUX_MAX_STEPS);
+
+				state = from;
+				changed = 0;
+				for (i = 0; i < count; i++) {
+					CHECK(steps[i].Mask != 0);
+					CHECK_EQUAL(steps[i].Value & ~steps[i].Mask, 0);
+					CHECK((state ^ steps[i].Value) & steps[i].Mask);
+					if (!atomic) {
+						// One pin per write, and only the enable may be written twice
+						CHECK_EQUAL(steps[i].Mask & (steps[i].Mask - 1), 0);
+						CHECK(!(changed & steps[i].Mask & MUX_PINS_CONFIG));
+						changed |= steps[i].Mask;
+					}
+					else {
+						CHECK_EQUAL(steps[i].Mask, MUX_PINS_ALL);
+					}
+
+					state = (unsigned char)((state & ~steps[i].Mask) | steps[i].Value);
+					CHECK(MuxStateIsLegal(state, from, to));
+				}
+				CHECK_EQUAL(state, to);
+
+				// The fewest writes that can do it
+				if (from == to)
+					expected = 0;
+				else if (atomic)
+					expected = 1;
+				else
+					expected = ((from ^ to) & MUX_PIN_POL ? 1 : 0) + ((from ^ to) & MUX_PIN_AMSEL ? 1 : 0) +
+						((from ^ to) & MUX_PIN_EN ? 1 : 0) + ((from & to & MUX_PIN_EN) && ((from ^ to) & MUX_PINS_CONFIG) ? 2 : 0);
+				CHECK_EQUAL(count, expected);
+			}
+		}
+	}
+
+	// Bits outside the mux are ignored
+	CHECK_EQUAL(MuxPlanTransition(0x08 | MUX_PIN_EN, MUX_PIN_EN, 0, steps), 0);
+	CHECK_EQUAL(MuxPlanTransition(0, 0xF0 | MUX_PIN_POL, 0, steps), 1);
+	CHECK_EQUAL(steps[0].Value, MUX_PIN_POL);
+}
+
+static void TestReconfigurationLatency(void)
+{
+	MOCK_PINS mock;
+	unsigned char from, to;
+	unsigned long long worst[2] = { 0, 0 }, total[2] = { 0, 0 };
+	int atomic;
+
+	// With one write costing an IOCTL, the worst case drops from four to one
+	for (atomic = 0; atomic <= 1; atomic++) {
+		for (from = 0; from <= MUX_PINS_ALL; from++) {
+			for (to = 0; to <= MUX_PINS_ALL; to++) {
+				memset(&mock, 0, sizeof(mock));
+				mock.Pins = from;
+				mock.WriteUs = 120;
+				Drive(&mock, from, to, atomic);
+
+				total[atomic] += mock.NowUs;
+				if (mock.NowUs > worst[atomic])
+					worst[atomic] = mock.NowUs;
+			}
+		}
+	}
+
+	CHECK_EQUAL(worst[0], 4 * 120);
+	CHECK_EQUAL(worst[1], 120);
+	CHECK_EQUAL(total[1], 56 * 120);
+	CHECK(total[0] > 2 * total[1]);
+}
+
+int main(void)
+{
+	TestAllTransitions();
+	TestReconfigurationLatency();
+	TestAttachScript();
+	TestUnknownStart();
+
+	return TestExit("MuxTest");
+}
@@ -0,0 +1,342 @@
+/*++
+
+Module Name:
+
+    pdaltmodetest.c
+
+Abstract:
+
+    Tests for DisplayPort alternate mode entry in pdaltmode.c. A scripted
+    dock answers each VDM the local DFP sends, after a delay, with an
+    ACK, NAK or BUSY or not at all, and a virtual clock runs the
+    response timers in between.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "PdPartner.h"
+#include "PdAltMode.h"
+
+// The dock does not answer this request
+#define SILENT 0xFF
+
+typedef struct _VDM_REPLY
+{
+	unsigned int Command;
+	unsigned int Type;
+	unsigned long DelayMs;
+	unsigned int Count;
+	unsigned long Vdos[3];
+} VDM_REPLY;
+
+typedef struct _DOCK
+{
+	PD_PROTOCOL Local;
+	PD_PARTNER Partner;
+	PD_ALT_MODE AltMode;
+	unsigned long Now;
+
+	const VDM_REPLY *Script;
+	unsigned int ScriptLength;
+	unsigned int Next;
+
+	// Requests the dock has seen so far, and the reply it still owes
+	unsigned int Requests;
+	int Pending;
+	unsigned long PendingAt;
+	unsigned long PendingObjects[4];
+	unsigned int PendingCount;
+
+	unsigned int Events;
+} DOCK;
+
+#define DP_MODE(pins) (PD_DP_MODE_UFP_D | PD_DP_MODE_RECEPTACLE | ((unsigned long)(pins) << 16))
+#define DP_ALL_PINS (PD_DP_PIN_C | PD_DP_PIN_D | PD_DP_PIN_E)
+
+static void DockInitialize(DOCK *dock, const VDM_REPLY *script, unsigned int length)
+{
+	memset(dock, 0, sizeof(*dock));
+
+	// The dock is a sink and UFP, the phone the DFP that runs discovery
+	PdPartnerInitialize(&dock->Partner);
+	dock->Partner.PowerRole = PD_POWER_ROLE_SINK;
+	dock->Partner.DataRole = PD_DATA_ROLE_UFP;
+	PdProtocolInitialize(&dock->Local, &PdPartnerPhy, &dock->Partner, 0);
+	dock->Local.PowerRole = PD_POWER_ROLE_SOURCE;
+	dock->Local.DataRole = PD_DATA_ROLE_DFP;
+
+	PdAltModeInitialize(&dock->AltMode);
+	dock->Script = script;
+	dock->ScriptLength = length;
+}
+
+static unsigned long LastRequest(const DOCK *dock, unsigned int object)
+{
+	return PdMessageObject(&dock->Partner.Received[dock->Requests - 1], object);
+}
+
+//
+// Takes the request the local side just sent and schedules the scripted reply
+//
+static void DockTakeRequest(DOCK *dock)
+{
+	const VDM_REPLY *reply;
+	unsigned long vdm;
+	unsigned int i;
+
+	if (dock->Requests == dock->Partner.ReceivedCount)
+		return;
+
+	dock->Requests = dock->Partner.ReceivedCount;
+	vdm = LastRequest(dock, 0);
+	CHECK_EQUAL(PD_VDM_COMMAND_TYPE(vdm), PD_VDM_REQ);
+
+	if (dock->Next == dock->ScriptLength)
+		return;
+
+	reply = &dock->Script[dock->Next++];
+	CHECK_EQUAL(PD_VDM_COMMAND(vdm), reply->Command);
+	if (reply->Type == SILENT)
+		return;
+
+	dock->PendingObjects[0] = PD_VDM_HEADER(PD_VDM_SVID(vdm), PD_VDM_POSITION(vdm), reply->Type, reply->Command);
+	for (i = 0; i < reply->Count; i++)
+		dock->PendingObjects[i + 1] = reply->Vdos[i];
+	dock->PendingCount = 1 + reply->Count;
+
+	dock->Pending = 1;
+	dock->PendingAt = dock->Now + reply->DelayMs;
+}
+
+static void DockDeliver(DOCK *dock, unsigned int count, const unsigned long *objects)
+{
+	PPD_MESSAGE message;
+
+	CHECK(PdPartnerSend(&dock->Partner, &dock->Local, PD_DATA_VENDOR_DEFINED, count, objects) > 0);
+
+	while ((message = PdProtocolRxPeek(&dock->Local)) != NULL) {
+		dock->Events |= PdAltModeHandleMessage(&dock->AltMode, &dock->Local, message, dock->Now);
+		PdProtocolRxConsume(&dock->Local);
+	}
+}
+
+//
+// Runs discovery from attach until the manager settles or nothing is left to happen
+//
+static void DockRun(DOCK *dock)
+{
+	unsigned long next;
+
+	dock->Events |= PdAltModeStart(&dock->AltMode, &dock->Local, dock->Now);
+
+	for (;;) {
+		DockTakeRequest(dock);
+
+		if (dock->AltMode.State == PdAltModeStateActive || dock->AltMode.State == PdAltModeStateDone)
+			break;
+
+		// A reply due before the response timer expires gets there first
+		if (dock->Pending && (!dock->AltMode.Deadline || (long)(dock->PendingAt - dock->AltMode.Deadline) < 0)) {
+			dock->Now = dock->PendingAt;
+			dock->Pending = 0;
+			DockDeliver(dock, dock->PendingCount, dock->PendingObjects);
+			continue;
+		}
+
+		// A reply that misses the window is lost with the request
+		dock->Pending = 0;
+		if (!dock->AltMode.Deadline)
+			break;
+
+		dock->Now = dock->AltMode.Deadline;
+		dock->Events |= PdAltModePoll(&dock->AltMode, &dock->Local, dock->Now, &next);
+	}
+}
+
+static const VDM_REPLY DockScript[] = {
+	{ PD_VDM_DISCOVER_IDENTITY, PD_VDM_ACK, 4, 3, { 0x6C000000UL, 0, 0 } },
+	{ PD_VDM_DISCOVER_SVIDS,    PD_VDM_ACK, 4, 2, { 0x8087FF01UL, 0 } },
+	{ PD_VDM_DISCOVER_MODES,    PD_VDM_ACK, 4, 2, { 0, DP_MODE(DP_ALL_PINS) } },
+	{ PD_VDM_ENTER_MODE,        PD_VDM_ACK, 40, 0, { 0 } },
+	{ PD_VDM_DP_STATUS_UPDATE,  PD_VDM_ACK, 4, 1, { PD_DP_STATUS_DFP_D_CONNECTED | PD_DP_STATUS_MULTI_FUNCTION | PD_DP_STATUS_HPD } },
+	{ PD_VDM_DP_CONFIGURE,      PD_VDM_ACK, 4, 0, { 0 } },
+};
+
+static void TestDockEntry(void)
+{
+	VDM_REPLY script[sizeof(DockScript) / sizeof(DockScript[0])];
+	DOCK dock;
+
+	// A multi-function dock gets pin assignment D, two lanes stay USB
+	DockInitialize(&dock, DockScript, sizeof(DockScript) / sizeof(DockScript[0]));
+	dock.Now = 1000;
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_ENTERED);
+	CHECK_EQUAL(dock.AltMode.State, PdAltModeStateActive);
+	CHECK_EQUAL(dock.AltMode.Lanes, PdAltModeLanesDisplayUsb);
+	CHECK_EQUAL(dock.AltMode.PinAssignment, PD_DP_PIN_D);
+	CHECK_EQUAL(dock.AltMode.SvidCount, 2);
+	CHECK_EQUAL(dock.AltMode.ModePosition, 2);
+	CHECK(dock.AltMode.Hpd);
+	CHECK_EQUAL(dock.AltMode.BringUpMs, 60);
+	CHECK_EQUAL(dock.AltMode.Entries, 1);
+	CHECK_EQUAL(dock.AltMode.Failures, 0);
+
+	// Six requests, each acknowledged at the first try
+	CHECK_EQUAL(dock.Requests, 6);
+	CHECK_EQUAL(dock.Partner.Frames, 6);
+	CHECK_EQUAL(PD_VDM_SVID(PdMessageObject(&dock.Partner.Received[0], 0)), PD_SID);
+	CHECK_EQUAL(PD_VDM_SVID(PdMessageObject(&dock.Partner.Received[2], 0)), PD_SVID_DP);
+	CHECK_EQUAL(PD_VDM_POSITION(PdMessageObject(&dock.Partner.Received[3], 0)), 2);
+	CHECK_EQUAL(LastRequest(&dock, 1), PD_DP_CONFIGURE(PD_DP_PIN_D));
+
+	// A display-only adapter gets all four lanes
+	memcpy(script, DockScript, sizeof(script));
+	script[4].Vdos[0] = PD_DP_STATUS_DFP_D_CONNECTED;
+	DockInitialize(&dock, script, sizeof(script) / sizeof(script[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.AltMode.Lanes, PdAltModeLanesDisplay);
+	CHECK_EQUAL(dock.AltMode.PinAssignment, PD_DP_PIN_C);
+	CHECK_EQUAL(LastRequest(&dock, 1), PD_DP_CONFIGURE(PD_DP_PIN_C));
+	CHECK(!dock.AltMode.Hpd);
+
+	// A plug reports its pins in the DFP_D field, E is taken when C is missing
+	script[2].Vdos[1] = PD_DP_MODE_UFP_D | ((unsigned long)PD_DP_PIN_E << 8);
+	DockInitialize(&dock, script, sizeof(script) / sizeof(script[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.AltMode.PinAssignment, PD_DP_PIN_E);
+	CHECK_EQUAL(dock.AltMode.Lanes, PdAltModeLanesDisplay);
+}
+
+static void TestStaysUsb(void)
+{
+	VDM_REPLY script[sizeof(DockScript) / sizeof(DockScript[0])];
+	DOCK dock;
+
+	// No DisplayPort SVID: USB without counting a failure
+	memcpy(script, DockScript, sizeof(script));
+	script[1].Vdos[0] = 0x80870000UL;
+	DockInitialize(&dock, script, sizeof(script) / sizeof(script[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_USB);
+	CHECK_EQUAL(dock.AltMode.State, PdAltModeStateDone);
+	CHECK_EQUAL(dock.AltMode.Lanes, PdAltModeLanesUsb);
+	CHECK_EQUAL(dock.AltMode.Failures, 0);
+	CHECK_EQUAL(dock.Requests, 2);
+
+	// DisplayPort SVID but no mode that can take our video
+	memcpy(script, DockScript, sizeof(script));
+	script[2].Vdos[1] = PD_DP_MODE_RECEPTACLE | ((unsigned long)DP_ALL_PINS << 16);
+	DockInitialize(&dock, script, sizeof(script) / sizeof(script[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_USB);
+	CHECK_EQUAL(dock.Requests, 3);
+
+	// Refused entry
+	memcpy(script, DockScript, sizeof(script));
+	script[3].Type = PD_VDM_NAK;
+	DockInitialize(&dock, script, sizeof(script) / sizeof(script[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_USB);
+	CHECK_EQUAL(dock.AltMode.Failures, 1);
+	CHECK_EQUAL(dock.AltMode.Entries, 0);
+
+	// A UFP never starts discovery
+	DockInitialize(&dock, DockScript, sizeof(DockScript) / sizeof(DockScript[0]));
+	dock.Local.DataRole = PD_DATA_ROLE_UFP;
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, 0);
+	CHECK_EQUAL(dock.Partner.Frames, 0);
+	CHECK_EQUAL(dock.AltMode.State, PdAltModeStateIdle);
+}
+
+static void TestBusyAndTimeouts(void)
+{
+	static const VDM_REPLY busyScript[] = {
+		{ PD_VDM_DISCOVER_IDENTITY, PD_VDM_ACK,  4, 0, { 0 } },
+		{ PD_VDM_DISCOVER_SVIDS,    PD_VDM_ACK,  4, 1, { 0xFF010000UL } },
+		{ PD_VDM_DISCOVER_MODES,    PD_VDM_ACK,  4, 1, { DP_MODE(PD_DP_PIN_C) } },
+		{ PD_VDM_ENTER_MODE,        PD_VDM_BUSY, 4, 0, { 0 } },
+		{ PD_VDM_ENTER_MODE,        SILENT,      0, 0, { 0 } },
+		{ PD_VDM_ENTER_MODE,        PD_VDM_ACK,  4, 0, { 0 } },
+		{ PD_VDM_DP_STATUS_UPDATE,  PD_VDM_ACK,  4, 1, { PD_DP_STATUS_HPD } },
+		// Slower than tVDMSenderResponse, the reply is lost
+		{ PD_VDM_DP_CONFIGURE,      PD_VDM_ACK,  45, 0, { 0 } },
+		{ PD_VDM_DP_CONFIGURE,      PD_VDM_ACK,  4, 0, { 0 } },
+	};
+	static const VDM_REPLY deadScript[] = {
+		{ PD_VDM_DISCOVER_IDENTITY, SILENT, 0, 0, { 0 } },
+		{ PD_VDM_DISCOVER_IDENTITY, SILENT, 0, 0, { 0 } },
+		{ PD_VDM_DISCOVER_IDENTITY, SILENT, 0, 0, { 0 } },
+		{ PD_VDM_DISCOVER_IDENTITY, SILENT, 0, 0, { 0 } },
+	};
+	DOCK dock;
+
+	// BUSY waits tVDMBusy, a silent retry waits tVDMWaitModeEntry and a late
+	// Configure reply costs tVDMSenderResponse, all counted in the bring-up
+	DockInitialize(&dock, busyScript, sizeof(busyScript) / sizeof(busyScript[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_ENTERED);
+	CHECK_EQUAL(dock.AltMode.PinAssignment, PD_DP_PIN_C);
+	CHECK_EQUAL(dock.Requests, 9);
+	CHECK_EQUAL(dock.AltMode.BringUpMs,
+		3 * 4 + 4 + PD_T_VDM_BUSY_MS + PD_T_VDM_WAIT_MODE_ENTRY_MS + 4 + 4 + PD_T_VDM_SENDER_RESPONSE_MS + 4);
+	CHECK_EQUAL(dock.AltMode.Failures, 0);
+
+	// A partner that never answers is tried four times, then left on USB
+	DockInitialize(&dock, deadScript, sizeof(deadScript) / sizeof(deadScript[0]));
+	DockRun(&dock);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_USB);
+	CHECK_EQUAL(dock.Requests, 4);
+	CHECK_EQUAL(dock.Now, 4 * PD_T_VDM_SENDER_RESPONSE_MS);
+	CHECK_EQUAL(dock.AltMode.Failures, 1);
+}
+
+static void TestAttention(void)
+{
+	unsigned long attention[2];
+	DOCK dock;
+
+	DockInitialize(&dock, DockScript, sizeof(DockScript) / sizeof(DockScript[0]));
+	DockRun(&dock);
+	CHECK(dock.AltMode.Hpd);
+
+	// HPD follows the dock's Attention messages once the mode is active
+	attention[0] = PD_VDM_HEADER(PD_SVID_DP, dock.AltMode.ModePosition, PD_VDM_REQ, PD_VDM_ATTENTION);
+	attention[1] = PD_DP_STATUS_DFP_D_CONNECTED;
+	dock.Events = 0;
+	DockDeliver(&dock, 2, attention);
+	CHECK_EQUAL(dock.Events, PD_ALT_MODE_EVENT_HPD);
+	CHECK(!dock.AltMode.Hpd);
+
+	attention[1] |= PD_DP_STATUS_HPD;
+	DockDeliver(&dock, 2, attention);
+	CHECK(dock.AltMode.Hpd);
+
+	// A stray ACK after entry changes nothing
+	attention[0] = PD_VDM_HEADER(PD_SVID_DP, 1, PD_VDM_ACK, PD_VDM_ENTER_MODE);
+	dock.Events = 0;
+	DockDeliver(&dock, 1, attention);
+	CHECK_EQUAL(dock.Events, 0);
+	CHECK_EQUAL(dock.AltMode.State, PdAltModeStateActive);
+
+	// Detach drops back to USB
+	PdAltModeStop(&dock.AltMode);
+	CHECK_EQUAL(dock.AltMode.Lanes, PdAltModeLanesUsb);
+	CHECK_EQUAL(dock.AltMode.Entries, 1);
+}
+
+int main(void)
+{
+	TestDockEntry();
+	TestStaysUsb();
+	TestBusyAndTimeouts();
+	TestAttention();
+
+	return TestExit("PdAltModeTest");
+}
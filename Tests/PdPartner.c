@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    pdpartner.c
+
+Abstract:
+
+    Simulated PD link partner for the host tests.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "PdPartner.h"
+
+static int PdPartnerTransmit(void *context, const unsigned char *frame, unsigned int length);
+static PD_TX_RESULT PdPartnerWaitTransmit(void *context, unsigned int timeoutUs);
+static int PdPartnerHardReset(void *context);
+
+const PD_PHY_OPS PdPartnerPhy = { PdPartnerTransmit, PdPartnerWaitTransmit, PdPartnerHardReset };
+
+void
+PdPartnerInitialize(
+	PD_PARTNER *partner
+)
+{
+	memset(partner, 0, sizeof(*partner));
+	partner->PowerRole = PD_POWER_ROLE_SOURCE;
+	partner->DataRole = PD_DATA_ROLE_DFP;
+	partner->SpecRevision = PD_SPEC_REV_2_0;
+	partner->RxMessageId = -1;
+	partner->Present = 1;
+}
+
+static int PdPartnerTransmit(void *context, const unsigned char *frame, unsigned int length)
+{
+	PD_PARTNER *partner = (PD_PARTNER *)context;
+	PD_MESSAGE message;
+	unsigned short header;
+	unsigned int type, count, id;
+
+	if (partner->FailTransmits) {
+		partner->FailTransmits--;
+		return 0;
+	}
+
+	memset(&message, 0, sizeof(message));
+	memcpy(&message, frame, length < sizeof(message) ? length : sizeof(message));
+	header = PdMessageHeader(&message);
+	type = PD_HEADER_TYPE(header);
+	count = PD_HEADER_COUNT(header);
+	id = PD_HEADER_ID(header);
+
+	// The local side acknowledging something the partner sent
+	if (type == PD_CTRL_GOODCRC && count == 0) {
+		partner->GoodCrcs++;
+		partner->LastGoodCrcId = id;
+		return 1;
+	}
+
+	partner->Frames++;
+	partner->Acknowledged = 0;
+
+	if (!partner->Present)
+		return 1;
+
+	if (partner->DropFrames) {
+		partner->DropFrames--;
+		return 1;
+	}
+
+	// Received, the GoodCRC goes out whether or not it is a retransmission
+	if (partner->DropGoodCrc)
+		partner->DropGoodCrc--;
+	else
+		partner->Acknowledged = 1;
+
+	if (type == PD_CTRL_SOFT_RESET && count == 0) {
+		partner->TxMessageId = 0;
+		partner->RxMessageId = -1;
+	}
+	else if ((int)id == partner->RxMessageId) {
+		partner->Duplicates++;
+		return 1;
+	}
+
+	partner->RxMessageId = (int)id;
+	if (partner->ReceivedCount < PD_PARTNER_LOG)
+		partner->Received[partner->ReceivedCount++] = message;
+
+	return 1;
+}
+
+static PD_TX_RESULT PdPartnerWaitTransmit(void *context, unsigned int timeoutUs)
+{
+	PD_PARTNER *partner = (PD_PARTNER *)context;
+
+	(void)timeoutUs;
+
+	return partner->Acknowledged ? PdTxSuccess : PdTxFailed;
+}
+
+static int PdPartnerHardReset(void *context)
+{
+	PD_PARTNER *partner = (PD_PARTNER *)context;
+
+	partner->HardResets++;
+	partner->TxMessageId = 0;
+	partner->RxMessageId = -1;
+	return 1;
+}
+
+static int PdPartnerDeliver(PPD_PROTOCOL local, const PD_MESSAGE *message)
+{
+	PPD_MESSAGE slot = PdProtocolRxSlot(local);
+
+	if (!slot)
+		return -1;
+
+	*slot = *message;
+	return PdProtocolRxCommit(local);
+}
+
+int
+PdPartnerSend(
+	PD_PARTNER *partner,
+	PPD_PROTOCOL local,
+	unsigned int type,
+	unsigned int count,
+	const unsigned long *objects
+)
+{
+	PD_MESSAGE message;
+	unsigned short header;
+	unsigned int i;
+
+	if (count == 0 && type == PD_CTRL_SOFT_RESET) {
+		partner->TxMessageId = 0;
+		partner->RxMessageId = -1;
+	}
+
+	header = PD_HEADER(type, partner->DataRole, partner->SpecRevision, partner->PowerRole, partner->TxMessageId, count);
+
+	memset(&message, 0, sizeof(message));
+	message.Length = (unsigned char)(2 + 4 * count);
+	message.Header[0] = (unsigned char)header;
+	message.Header[1] = (unsigned char)(header >> 8);
+	for (i = 0; i < count; i++)
+		PdMessageSetObject(&message, i, objects[i]);
+
+	partner->TxMessageId = (partner->TxMessageId + 1) & 7;
+	partner->LastSent = message;
+
+	return PdPartnerDeliver(local, &message);
+}
+
+int
+PdPartnerResend(
+	PD_PARTNER *partner,
+	PPD_PROTOCOL local
+)
+{
+	return PdPartnerDeliver(local, &partner->LastSent);
+}
+
+int
+PdPartnerReceivedType(
+	const PD_PARTNER *partner,
+	unsigned int index
+)
+{
+	if (index >= partner->ReceivedCount)
+		return -1;
+
+	return PD_HEADER_TYPE(PdMessageHeader(&partner->Received[index]));
+}
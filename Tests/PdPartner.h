@@ -0,0 +1,101 @@
+/*++
+
+Module Name:
+
+    pdpartner.h
+
+Abstract:
+
+    The far end of a PD link for the host tests. The partner is the PHY
+    under the local protocol layer: frames the local side transmits
+    arrive here and are answered with GoodCRC, unless the test loses
+    them on the wire, and the partner sends its own messages into the
+    local receive ring the way the driver bursts them out of the FIFO.
+
+    The partner keeps message IDs like a real port does, so it drops a
+    retransmission it already acknowledged and follows Soft_Reset.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Pd.h"
+
+#define PD_PARTNER_LOG 32
+
+typedef struct _PD_PARTNER
+{
+	unsigned char PowerRole;
+	unsigned char DataRole;
+	unsigned char SpecRevision;
+	unsigned char TxMessageId;
+	int RxMessageId;
+
+	// Cleared for a partner that does not speak PD, nothing is acknowledged then
+	int Present;
+	// Frames lost on their way to the partner, and GoodCRCs lost on their way back
+	unsigned int DropFrames;
+	unsigned int DropGoodCrc;
+	// Transmit calls that fail before anything reaches the wire
+	unsigned int FailTransmits;
+
+	int Acknowledged;
+	PD_MESSAGE LastSent;
+
+	// New messages the partner took, oldest first, retransmissions left out
+	PD_MESSAGE Received[PD_PARTNER_LOG];
+	unsigned int ReceivedCount;
+
+	// Every frame the local side put on the wire, retries included, GoodCRC not
+	unsigned int Frames;
+	unsigned int Duplicates;
+	unsigned int GoodCrcs;
+	unsigned int LastGoodCrcId;
+	unsigned int HardResets;
+} PD_PARTNER;
+
+// Transmit, WaitTransmit and HardReset with a PD_PARTNER as the context
+extern const PD_PHY_OPS PdPartnerPhy;
+
+//
+// A PD 2.0 source that acknowledges everything, message IDs reset
+//
+void
+PdPartnerInitialize(
+	PD_PARTNER *partner
+);
+
+//
+// Sends a message to the local side, data objects from objects. Returns
+// what PdProtocolRxCommit returned, or -1 if the receive ring was full.
+//
+int
+PdPartnerSend(
+	PD_PARTNER *partner,
+	PPD_PROTOCOL local,
+	unsigned int type,
+	unsigned int count,
+	const unsigned long *objects
+);
+
+//
+// Sends the partner's last message again with the same ID, as after a lost GoodCRC
+//
+int
+PdPartnerResend(
+	PD_PARTNER *partner,
+	PPD_PROTOCOL local
+);
+
+//
+// Type of the nth message the partner received, or -1 if there is none
+//
+int
+PdPartnerReceivedType(
+	const PD_PARTNER *partner,
+	unsigned int index
+);
@@ -0,0 +1,425 @@
+/*++
+
+Module Name:
+
+    pdpolicytest.c
+
+Abstract:
+
+    Tests for the sink and source policy engines in pdpolicy.c: sink
+    capability selection against typical chargers, then whole
+    negotiations, Soft_Reset and Hard Reset over the simulated partner.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "Test.h"
+#include "PdPartner.h"
+#include "PdPolicy.h"
+
+#define PDO_BATTERY(minMv, maxMv, mw) \
+	((unsigned long)(PD_PDO_TYPE_BATTERY) << 30 | (unsigned long)(((maxMv) / 50) & 0x3FF) << 20 | \
+	(unsigned long)(((minMv) / 50) & 0x3FF) << 10 | (((mw) / 250) & 0x3FF))
+
+#define PDO_AUGMENTED(minMv, maxMv, ma) \
+	((unsigned long)(PD_PDO_TYPE_AUGMENTED) << 30 | (unsigned long)(((maxMv) / 100) & 0xFF) << 17 | \
+	(unsigned long)(((minMv) / 100) & 0xFF) << 8 | (((ma) / 50) & 0x7F))
+
+// What the driver configures by default, and with the input stage opened up to 12V
+static const PD_SINK_LIMITS Limits5V = { 5000, 4750, 3000 };
+static const PD_SINK_LIMITS Limits12V = { 12000, 4750, 3000 };
+static const PD_SINK_LIMITS Limits9V2A = { 9000, 4750, 2000 };
+
+typedef struct _SELECT_CASE
+{
+	const char *Name;
+	const PD_SINK_LIMITS *Limits;
+	unsigned int Count;
+	unsigned long Pdos[PD_MAX_DATA_OBJECTS + 1];
+	// Position zero when nothing is usable
+	unsigned int Position;
+	unsigned int VoltageMv;
+	unsigned int CurrentMa;
+	int Mismatch;
+} SELECT_CASE;
+
+static const SELECT_CASE SelectCases[] = {
+	{ "5V 3A brick", &Limits5V, 1, { PD_PDO_FIXED(5000, 3000) }, 1, 5000, 3000, 0 },
+	{ "5V 2A brick, short of what we want", &Limits5V, 1, { PD_PDO_FIXED(5000, 2000) }, 1, 5000, 2000, 1 },
+	{ "5V 5A cable, capped", &Limits5V, 1, { PD_PDO_FIXED(5000, 5000) }, 1, 5000, 3000, 0 },
+	{ "18W phone charger at 5V", &Limits5V, 3,
+		{ PD_PDO_FIXED(5000, 3000) | PD_PDO_FIXED_DUAL_ROLE, PD_PDO_FIXED(9000, 2000), PD_PDO_FIXED(12000, 1500) },
+		1, 5000, 3000, 0 },
+	{ "18W phone charger up to 12V, tie goes to the lower voltage", &Limits12V, 3,
+		{ PD_PDO_FIXED(5000, 3000), PD_PDO_FIXED(9000, 2000), PD_PDO_FIXED(12000, 1500) },
+		2, 9000, 2000, 1 },
+	{ "45W laptop charger up to 12V", &Limits12V, 4,
+		{ PD_PDO_FIXED(5000, 3000), PD_PDO_FIXED(9000, 3000), PD_PDO_FIXED(15000, 3000), PD_PDO_FIXED(20000, 2250) },
+		2, 9000, 3000, 0 },
+	{ "45W laptop charger, 2A input stage", &Limits9V2A, 4,
+		{ PD_PDO_FIXED(5000, 3000), PD_PDO_FIXED(9000, 3000), PD_PDO_FIXED(15000, 3000), PD_PDO_FIXED(20000, 2250) },
+		2, 9000, 2000, 0 },
+	{ "Variable supply within 5V", &Limits5V, 2,
+		{ PD_PDO_FIXED(5000, 2000), PD_PDO_VARIABLE(4750, 5000, 3000) },
+		2, 4750, 3000, 0 },
+	{ "Variable supply above the input stage", &Limits5V, 2,
+		{ PD_PDO_FIXED(5000, 1500), PD_PDO_VARIABLE(5000, 12000, 3000) },
+		1, 5000, 1500, 1 },
+	{ "Variable supply counted at its minimum", &Limits12V, 2,
+		{ PD_PDO_FIXED(9000, 1500), PD_PDO_VARIABLE(5000, 12000, 3000) },
+		2, 5000, 3000, 0 },
+	{ "Battery supply, current from power", &Limits5V, 2,
+		{ PD_PDO_FIXED(5000, 1500), PDO_BATTERY(4750, 5000, 10000) },
+		2, 4750, 2105, 1 },
+	{ "Battery supply below the minimum voltage", &Limits5V, 2,
+		{ PD_PDO_FIXED(5000, 900), PDO_BATTERY(3300, 5000, 15000) },
+		1, 5000, 900, 1 },
+	{ "PPS only", &Limits12V, 1, { PDO_AUGMENTED(3300, 11000, 3000) }, 0, 0, 0, 0 },
+	{ "PPS ignored beside a fixed supply", &Limits12V, 2,
+		{ PD_PDO_FIXED(5000, 3000), PDO_AUGMENTED(3300, 11000, 5000) },
+		1, 5000, 3000, 0 },
+	{ "Nothing at 5V", &Limits5V, 2, { PD_PDO_FIXED(9000, 3000), PD_PDO_FIXED(12000, 3000) }, 0, 0, 0, 0 },
+	{ "Zero voltage", &Limits5V, 1, { PD_PDO_FIXED(0, 3000) }, 0, 0, 0, 0 },
+	{ "No capabilities", &Limits5V, 0, { 0 }, 0, 0, 0, 0 },
+	{ "Eighth object ignored", &Limits12V, 8,
+		{ PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(5000, 500),
+		  PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(5000, 500), PD_PDO_FIXED(9000, 3000) },
+		1, 5000, 500, 1 },
+};
+
+static void TestSinkSelect(void)
+{
+	const SELECT_CASE *test;
+	PD_SINK_SELECTION selection;
+	unsigned int i, failures;
+	unsigned long expected;
+	int selected;
+
+	for (i = 0; i < sizeof(SelectCases) / sizeof(SelectCases[0]); i++) {
+		test = &SelectCases[i];
+		failures = TestFailures;
+
+		selected = PdSinkSelect(test->Pdos, test->Count, test->Limits, &selection);
+		CHECK_EQUAL(selected, test->Position != 0);
+
+		if (selected && test->Position) {
+			CHECK_EQUAL(selection.Position, test->Position);
+			CHECK_EQUAL(selection.VoltageMv, test->VoltageMv);
+			CHECK_EQUAL(selection.CurrentMa, test->CurrentMa);
+			CHECK_EQUAL(selection.PowerMw, test->VoltageMv * test->CurrentMa / 1000);
+
+			CHECK_EQUAL(PD_RDO_POSITION(selection.Rdo), test->Position);
+			CHECK_EQUAL((selection.Rdo & PD_RDO_CAPABILITY_MISMATCH) != 0, test->Mismatch);
+			CHECK(selection.Rdo & PD_RDO_USB_COMM_CAPABLE);
+			CHECK(selection.Rdo & PD_RDO_NO_USB_SUSPEND);
+
+			// Battery requests are in 250 mW units, the others in 10 mA
+			expected = PD_PDO_TYPE(test->Pdos[test->Position - 1]) == PD_PDO_TYPE_BATTERY ?
+				selection.PowerMw / 250 : test->CurrentMa / 10;
+			CHECK_EQUAL(PD_RDO_OPERATING(selection.Rdo), expected);
+			CHECK_EQUAL(PD_RDO_MAXIMUM(selection.Rdo), expected);
+		}
+
+		if (TestFailures != failures)
+			fprintf(stderr, "  in \"%s\"\n", test->Name);
+	}
+}
+
+//
+// Hands every queued message to the sink, as the driver's PD service does
+//
+static unsigned int PumpSink(PD_SINK *sink, PD_PROTOCOL *local, unsigned long now)
+{
+	PPD_MESSAGE message;
+	unsigned int events = 0;
+
+	while ((message = PdProtocolRxPeek(local)) != NULL) {
+		events |= PdSinkHandleMessage(sink, local, message, now);
+		PdProtocolRxConsume(local);
+	}
+
+	return events;
+}
+
+static unsigned int PumpSource(PD_SOURCE *source, PD_PROTOCOL *local, unsigned long now)
+{
+	PPD_MESSAGE message;
+	unsigned int events = 0;
+
+	while ((message = PdProtocolRxPeek(local)) != NULL) {
+		events |= PdSourceHandleMessage(source, local, message, now);
+		PdProtocolRxConsume(local);
+	}
+
+	return events;
+}
+
+static int LastReceivedType(const PD_PARTNER *partner)
+{
+	return partner->ReceivedCount ? PdPartnerReceivedType(partner, partner->ReceivedCount - 1) : -1;
+}
+
+static const unsigned long ChargerCaps[3] = {
+	PD_PDO_FIXED(5000, 3000) | PD_PDO_FIXED_DUAL_ROLE, PD_PDO_FIXED(9000, 2000), PD_PDO_FIXED(12000, 1500)
+};
+
+//
+// Attaches a sink to the 18W charger and runs it to an explicit contract at 5V 3A
+//
+static void Negotiate(PD_SINK *sink, PD_PROTOCOL *local, PD_PARTNER *partner, unsigned long now)
+{
+	CHECK_EQUAL(PdPartnerSend(partner, local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps), 1);
+	CHECK_EQUAL(PumpSink(sink, local, now), PD_SINK_EVENT_CAPABILITIES);
+	CHECK_EQUAL(sink->State, PdSinkStateWaitAccept);
+	CHECK_EQUAL(LastReceivedType(partner), PD_DATA_REQUEST);
+	CHECK_EQUAL(PD_RDO_POSITION(PdMessageObject(&partner->Received[partner->ReceivedCount - 1], 0)), 1);
+
+	PdPartnerSend(partner, local, PD_CTRL_ACCEPT, 0, NULL);
+	CHECK_EQUAL(PumpSink(sink, local, now + 5), 0);
+	CHECK_EQUAL(sink->State, PdSinkStateWaitPsRdy);
+
+	PdPartnerSend(partner, local, PD_CTRL_PS_RDY, 0, NULL);
+	CHECK_EQUAL(PumpSink(sink, local, now + 50), PD_SINK_EVENT_CONTRACT);
+	CHECK_EQUAL(sink->State, PdSinkStateReady);
+	CHECK(sink->ContractValid);
+	CHECK_EQUAL(sink->Contract.CurrentMa, 3000);
+}
+
+static void SinkSetUp(PD_SINK *sink, PD_PROTOCOL *local, PD_PARTNER *partner, const PD_SINK_LIMITS *limits)
+{
+	PdPartnerInitialize(partner);
+	PdProtocolInitialize(local, &PdPartnerPhy, partner, 0);
+	PdSinkInitialize(sink, limits);
+	PdSinkStart(sink, 0);
+}
+
+static void TestSinkNegotiation(void)
+{
+	PD_SINK sink;
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	unsigned long next;
+
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 100, &next), 0);
+	CHECK_EQUAL(next, PD_T_TYPEC_SINK_WAIT_CAP_MS - 100);
+	Negotiate(&sink, &local, &partner, 100);
+	CHECK_EQUAL(sink.Negotiations, 1);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 10000, &next), 0);
+	CHECK_EQUAL(next, 0);
+
+	// Wait holds the request back for tSinkRequest, then it goes out again
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps);
+	PumpSink(&sink, &local, 20000);
+	PdPartnerSend(&partner, &local, PD_CTRL_WAIT, 0, NULL);
+	PumpSink(&sink, &local, 20005);
+	CHECK_EQUAL(sink.State, PdSinkStateWaitRetry);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 20005 + PD_T_SINK_REQUEST_MS, &next), 0);
+	CHECK_EQUAL(sink.State, PdSinkStateWaitAccept);
+	CHECK_EQUAL(LastReceivedType(&partner), PD_DATA_REQUEST);
+
+	// A Reject leaves the contract we had in place
+	PdPartnerSend(&partner, &local, PD_CTRL_REJECT, 0, NULL);
+	CHECK_EQUAL(PumpSink(&sink, &local, 20200), 0);
+	CHECK_EQUAL(sink.State, PdSinkStateReady);
+	CHECK(sink.ContractValid);
+	CHECK_EQUAL(sink.Rejects, 1);
+
+	// Without one it is a failure
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps);
+	PumpSink(&sink, &local, 0);
+	PdPartnerSend(&partner, &local, PD_CTRL_REJECT, 0, NULL);
+	CHECK_EQUAL(PumpSink(&sink, &local, 10), PD_SINK_EVENT_FAILED);
+	CHECK_EQUAL(sink.State, PdSinkStateWaitCapabilities);
+
+	// Nothing usable on offer
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 1, (const unsigned long[]){ PD_PDO_FIXED(9000, 3000) });
+	CHECK_EQUAL(PumpSink(&sink, &local, 0), PD_SINK_EVENT_CAPABILITIES | PD_SINK_EVENT_FAILED);
+	CHECK_EQUAL(partner.ReceivedCount, 0);
+
+	// No capabilities in tTypeCSinkWaitCap, the partner does not speak PD
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, PD_T_TYPEC_SINK_WAIT_CAP_MS, &next), PD_SINK_EVENT_NO_PD);
+	CHECK_EQUAL(next, 0);
+}
+
+static void TestSinkCapabilities(void)
+{
+	PD_SINK sink;
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	const PD_MESSAGE *caps;
+
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	PdPartnerSend(&partner, &local, PD_CTRL_GET_SINK_CAP, 0, NULL);
+	PumpSink(&sink, &local, 0);
+	CHECK_EQUAL(partner.ReceivedCount, 1);
+	caps = &partner.Received[0];
+	CHECK_EQUAL(PD_HEADER_COUNT(PdMessageHeader(caps)), 1);
+	CHECK_EQUAL(PdMessageObject(caps, 0), PD_PDO_FIXED(5000, 3000));
+
+	SinkSetUp(&sink, &local, &partner, &Limits12V);
+	PdPartnerSend(&partner, &local, PD_CTRL_GET_SINK_CAP, 0, NULL);
+	PumpSink(&sink, &local, 0);
+	caps = &partner.Received[0];
+	CHECK_EQUAL(PD_HEADER_COUNT(PdMessageHeader(caps)), 2);
+	CHECK_EQUAL(PdMessageObject(caps, 1), PD_PDO_VARIABLE(5000, 12000, 3000));
+}
+
+static void TestSinkSoftReset(void)
+{
+	PD_SINK sink;
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	unsigned long next;
+
+	// Soft_Reset is answered with Accept, as the first message after the reset
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	Negotiate(&sink, &local, &partner, 0);
+	PdPartnerSend(&partner, &local, PD_CTRL_SOFT_RESET, 0, NULL);
+	CHECK_EQUAL(PumpSink(&sink, &local, 1000), 0);
+	CHECK_EQUAL(LastReceivedType(&partner), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(PD_HEADER_ID(PdMessageHeader(&partner.Received[partner.ReceivedCount - 1])), 0);
+	CHECK_EQUAL(sink.State, PdSinkStateWaitCapabilities);
+	CHECK_EQUAL(partner.HardResets, 0);
+
+	// Then the source sends fresh capabilities and the contract is made again
+	Negotiate(&sink, &local, &partner, 1010);
+	CHECK_EQUAL(sink.Negotiations, 2);
+	CHECK_EQUAL(partner.Duplicates, 0);
+
+	// If the Accept does not get through, Soft_Reset has failed and Hard Reset follows
+	partner.DropFrames = 1 + PD_N_RETRY_COUNT_REV20;
+	PdPartnerSend(&partner, &local, PD_CTRL_SOFT_RESET, 0, NULL);
+	CHECK_EQUAL(PumpSink(&sink, &local, 2000), PD_SINK_EVENT_FAILED | PD_SINK_EVENT_HARD_RESET);
+	CHECK_EQUAL(partner.HardResets, 1);
+	CHECK_EQUAL(local.HardResets, 1);
+	CHECK(!sink.ContractValid);
+	CHECK_EQUAL(sink.State, PdSinkStateWaitCapabilities);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 2000, &next), 0);
+	CHECK_EQUAL(next, PD_T_NO_RESPONSE_MS);
+}
+
+static void TestSinkHardReset(void)
+{
+	PD_SINK sink;
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	unsigned long next;
+
+	// No Accept within tSenderResponse
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps);
+	PumpSink(&sink, &local, 100);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 100 + PD_T_SENDER_RESPONSE_MS - 1, &next), 0);
+	CHECK_EQUAL(next, 1);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 100 + PD_T_SENDER_RESPONSE_MS, &next),
+		PD_SINK_EVENT_FAILED | PD_SINK_EVENT_HARD_RESET);
+	CHECK_EQUAL(partner.HardResets, 1);
+	CHECK_EQUAL(sink.Failures, 1);
+
+	// The source comes back from vSafe5V with capabilities, message IDs start over on both ends
+	Negotiate(&sink, &local, &partner, 1000);
+	CHECK_EQUAL(partner.Duplicates, 0);
+	CHECK_EQUAL(local.RxDuplicates, 0);
+
+	// No PS_RDY within tPSTransition
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps);
+	PumpSink(&sink, &local, 5000);
+	PdPartnerSend(&partner, &local, PD_CTRL_ACCEPT, 0, NULL);
+	PumpSink(&sink, &local, 5010);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 5010 + PD_T_PS_TRANSITION_MS, &next),
+		PD_SINK_EVENT_FAILED | PD_SINK_EVENT_HARD_RESET);
+	CHECK(!sink.ContractValid);
+	CHECK_EQUAL(partner.HardResets, 2);
+
+	// And when nothing follows the Hard Reset, the partner is given up on as non-PD
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 5010 + PD_T_PS_TRANSITION_MS + PD_T_NO_RESPONSE_MS - 1, &next), 0);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, 5010 + PD_T_PS_TRANSITION_MS + PD_T_NO_RESPONSE_MS, &next),
+		PD_SINK_EVENT_NO_PD);
+
+	// The driver's PHY cannot signal it, the local state is reset all the same
+	SinkSetUp(&sink, &local, &partner, &Limits5V);
+	local.Phy = &(const PD_PHY_OPS){ PdPartnerPhy.Transmit, PdPartnerPhy.WaitTransmit, 0 };
+	PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 3, ChargerCaps);
+	PumpSink(&sink, &local, 0);
+	CHECK_EQUAL(PdSinkPoll(&sink, &local, PD_T_SENDER_RESPONSE_MS, &next),
+		PD_SINK_EVENT_FAILED | PD_SINK_EVENT_HARD_RESET);
+	CHECK_EQUAL(partner.HardResets, 0);
+	CHECK_EQUAL(local.TxMessageId, 0);
+}
+
+static const unsigned long PhonePdos[1] = { PD_PDO_FIXED(5000, 500) | PD_PDO_FIXED_DUAL_ROLE };
+
+static void SourceSetUp(PD_SOURCE *source, PD_PROTOCOL *local, PD_PARTNER *partner)
+{
+	PdPartnerInitialize(partner);
+	partner->PowerRole = PD_POWER_ROLE_SINK;
+	partner->DataRole = PD_DATA_ROLE_UFP;
+	PdProtocolInitialize(local, &PdPartnerPhy, partner, 0);
+	local->PowerRole = PD_POWER_ROLE_SOURCE;
+	local->DataRole = PD_DATA_ROLE_DFP;
+	PdSourceInitialize(source, PhonePdos, 1);
+}
+
+static void TestSource(void)
+{
+	PD_SOURCE source;
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	unsigned long next, now;
+	unsigned int events = 0;
+
+	SourceSetUp(&source, &local, &partner);
+	CHECK_EQUAL(PdSourceStart(&source, &local, 0), 0);
+	CHECK_EQUAL(LastReceivedType(&partner), PD_DATA_SOURCE_CAPABILITIES);
+	CHECK_EQUAL(source.State, PdSourceStateWaitRequest);
+
+	PdPartnerSend(&partner, &local, PD_DATA_REQUEST, 1, (const unsigned long[]){ PD_RDO(1, 50, 50) });
+	CHECK_EQUAL(PumpSource(&source, &local, 10), PD_SOURCE_EVENT_CONTRACT);
+	CHECK_EQUAL(PdPartnerReceivedType(&partner, 1), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(PdPartnerReceivedType(&partner, 2), PD_CTRL_PS_RDY);
+	CHECK(source.ContractValid);
+
+	// More than the PDO offers
+	PdPartnerSend(&partner, &local, PD_DATA_REQUEST, 1, (const unsigned long[]){ PD_RDO(1, 100, 100) });
+	CHECK_EQUAL(PumpSource(&source, &local, 20), 0);
+	CHECK_EQUAL(LastReceivedType(&partner), PD_CTRL_REJECT);
+	CHECK_EQUAL(source.Rejects, 1);
+	CHECK(source.ContractValid);
+
+	// Soft_Reset is accepted, then the capabilities go out again
+	PdPartnerSend(&partner, &local, PD_CTRL_SOFT_RESET, 0, NULL);
+	PumpSource(&source, &local, 30);
+	CHECK_EQUAL(PdPartnerReceivedType(&partner, 4), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(PD_HEADER_ID(PdMessageHeader(&partner.Received[4])), 0);
+	CHECK_EQUAL(PdPartnerReceivedType(&partner, 5), PD_DATA_SOURCE_CAPABILITIES);
+	CHECK_EQUAL(source.State, PdSourceStateWaitRequest);
+
+	// A sink that never answers GoodCRC gets nCapsCount tries, tTypeCSendSourceCap apart
+	SourceSetUp(&source, &local, &partner);
+	partner.Present = 0;
+	events = PdSourceStart(&source, &local, 0);
+	for (now = 0; !events && now < 60 * PD_T_TYPEC_SEND_SOURCE_CAP_MS; now += PD_T_TYPEC_SEND_SOURCE_CAP_MS)
+		events = PdSourcePoll(&source, &local, now, &next);
+	CHECK_EQUAL(events, PD_SOURCE_EVENT_NO_PD);
+	CHECK_EQUAL(source.CapsCount, PD_N_CAPS_COUNT);
+	CHECK_EQUAL(partner.Frames, PD_N_CAPS_COUNT * (1 + PD_N_RETRY_COUNT_REV20));
+}
+
+int main(void)
+{
+	TestSinkSelect();
+	TestSinkNegotiation();
+	TestSinkCapabilities();
+	TestSinkSoftReset();
+	TestSinkHardReset();
+	TestSource();
+
+	return TestExit("PdPolicyTest");
+}
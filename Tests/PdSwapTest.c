@@ -0,0 +1,294 @@
+/*++
+
+Module Name:
+
+    pdswaptest.c
+
+Abstract:
+
+    Power role swap simulation for PdPrSwap in pdpolicy.c. The partner
+    answers PR_Swap and switches its side of VBUS after scripted delays
+    on a virtual clock. Each case checks the swap latency the driver
+    reports, the failure handling and that the two sides never drive
+    VBUS together.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "PdPartner.h"
+#include "PdPolicy.h"
+
+typedef struct _SWAP_SIM
+{
+	PD_PROTOCOL Local;
+	PD_PARTNER Partner;
+	PD_PR_SWAP Swap;
+	unsigned long Now;
+
+	int LocalVbus;
+	int PartnerVbus;
+	// Both sides driving VBUS at once
+	unsigned int Overlaps;
+	unsigned int Events;
+} SWAP_SIM;
+
+static void SimSetVbus(void *context, int on)
+{
+	SWAP_SIM *sim = (SWAP_SIM *)context;
+
+	if (on && sim->PartnerVbus)
+		sim->Overlaps++;
+	sim->LocalVbus = on;
+}
+
+static void PartnerSetVbus(SWAP_SIM *sim, int on)
+{
+	if (on && sim->LocalVbus)
+		sim->Overlaps++;
+	sim->PartnerVbus = on;
+}
+
+static void SimInitialize(SWAP_SIM *sim, int localSource, int acceptToSource)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->Now = 1000;
+
+	PdPartnerInitialize(&sim->Partner);
+	PdProtocolInitialize(&sim->Local, &PdPartnerPhy, &sim->Partner, 0);
+	PdPrSwapInitialize(&sim->Swap, SimSetVbus, sim, acceptToSource);
+
+	if (localSource) {
+		sim->Local.PowerRole = PD_POWER_ROLE_SOURCE;
+		sim->Partner.PowerRole = PD_POWER_ROLE_SINK;
+		sim->LocalVbus = 1;
+	}
+	else {
+		sim->PartnerVbus = 1;
+	}
+}
+
+static int LastReceivedType(const PD_PARTNER *partner)
+{
+	return partner->ReceivedCount ? PdPartnerReceivedType(partner, partner->ReceivedCount - 1) : -1;
+}
+
+//
+// Sends a control message from the partner at the given time, unless the
+// swap timer runs out first. Returns nonzero if the message went out.
+//
+static int PartnerSendAt(SWAP_SIM *sim, unsigned int type, unsigned long at)
+{
+	PPD_MESSAGE message;
+	unsigned long next;
+
+	if (sim->Swap.Deadline && (long)(at - sim->Swap.Deadline) >= 0) {
+		sim->Now = sim->Swap.Deadline;
+		sim->Events |= PdPrSwapPoll(&sim->Swap, sim->Now, &next);
+		return 0;
+	}
+
+	sim->Now = at;
+	CHECK_EQUAL(PdPartnerSend(&sim->Partner, &sim->Local, type, 0, NULL), 1);
+
+	while ((message = PdProtocolRxPeek(&sim->Local)) != NULL) {
+		sim->Events |= PdPrSwapHandleMessage(&sim->Swap, &sim->Local, message, sim->Now);
+		PdProtocolRxConsume(&sim->Local);
+	}
+
+	return 1;
+}
+
+// The partner does not send this at all
+#define NEVER 0xFFFFFFFFUL
+
+typedef struct _SWAP_CASE
+{
+	int ToSource;
+	unsigned int Answer;
+	unsigned long AnswerMs;
+	// From Accept to the partner's PS_RDY, its VBUS switched just before
+	unsigned long PowerMs;
+
+	unsigned int Events;
+	unsigned long LatencyMs;
+} SWAP_CASE;
+
+static const SWAP_CASE SwapCases[] = {
+	// Becoming the source waits for the old source to discharge
+	{ 1, PD_CTRL_ACCEPT, 2, 150, PD_PR_SWAP_EVENT_DONE, 152 },
+	{ 1, PD_CTRL_ACCEPT, 20, 600, PD_PR_SWAP_EVENT_DONE, 620 },
+	{ 1, PD_CTRL_ACCEPT, 2, PD_T_PS_SOURCE_OFF_MS - 1, PD_PR_SWAP_EVENT_DONE, PD_T_PS_SOURCE_OFF_MS + 1 },
+	{ 1, PD_CTRL_ACCEPT, 2, PD_T_PS_SOURCE_OFF_MS, PD_PR_SWAP_EVENT_FAILED | PD_PR_SWAP_EVENT_RECOVER, 0 },
+	{ 1, PD_CTRL_ACCEPT, 2, NEVER, PD_PR_SWAP_EVENT_FAILED | PD_PR_SWAP_EVENT_RECOVER, 0 },
+	{ 1, PD_CTRL_REJECT, 3, 0, PD_PR_SWAP_EVENT_FAILED, 0 },
+	{ 1, PD_CTRL_WAIT, 3, 0, PD_PR_SWAP_EVENT_FAILED, 0 },
+	{ 1, PD_CTRL_ACCEPT, PD_T_SENDER_RESPONSE_MS, 0, PD_PR_SWAP_EVENT_FAILED, 0 },
+	{ 1, PD_CTRL_ACCEPT, NEVER, 0, PD_PR_SWAP_EVENT_FAILED, 0 },
+	// Becoming the sink waits for the new source to come up
+	{ 0, PD_CTRL_ACCEPT, 2, 100, PD_PR_SWAP_EVENT_DONE, 102 },
+	{ 0, PD_CTRL_ACCEPT, 2, PD_T_PS_SOURCE_ON_MS - 1, PD_PR_SWAP_EVENT_DONE, PD_T_PS_SOURCE_ON_MS + 1 },
+	{ 0, PD_CTRL_ACCEPT, 2, PD_T_PS_SOURCE_ON_MS, PD_PR_SWAP_EVENT_FAILED | PD_PR_SWAP_EVENT_RECOVER, 0 },
+	{ 0, PD_CTRL_REJECT, 3, 0, PD_PR_SWAP_EVENT_FAILED, 0 },
+};
+
+static void RunCase(const SWAP_CASE *c)
+{
+	SWAP_SIM sim;
+	unsigned long start, accepted;
+	unsigned int localBefore;
+
+	SimInitialize(&sim, !c->ToSource, 0);
+	localBefore = sim.Local.PowerRole;
+	start = sim.Now;
+
+	CHECK_EQUAL(PdPrSwapRequest(&sim.Swap, &sim.Local, start), 0);
+	CHECK_EQUAL(LastReceivedType(&sim.Partner), PD_CTRL_PR_SWAP);
+	CHECK(PdPrSwapBusy(&sim.Swap));
+
+	if (c->AnswerMs != NEVER && PartnerSendAt(&sim, c->Answer, start + c->AnswerMs) && c->Answer == PD_CTRL_ACCEPT) {
+		accepted = sim.Now;
+
+		if (c->ToSource) {
+			// Nothing moves until the old source says it is off
+			CHECK(sim.LocalVbus == 0);
+			if (c->PowerMs != NEVER && (long)(accepted + c->PowerMs - sim.Swap.Deadline) < 0)
+				PartnerSetVbus(&sim, 0);
+		}
+		else {
+			// We stop driving VBUS before our PS_RDY goes out
+			CHECK(sim.LocalVbus == 0);
+			CHECK_EQUAL(LastReceivedType(&sim.Partner), PD_CTRL_PS_RDY);
+			CHECK_EQUAL(sim.Local.PowerRole, PD_POWER_ROLE_SINK);
+			if (c->PowerMs != NEVER && (long)(accepted + c->PowerMs - sim.Swap.Deadline) < 0)
+				PartnerSetVbus(&sim, 1);
+		}
+
+		PartnerSendAt(&sim, PD_CTRL_PS_RDY, c->PowerMs == NEVER ? sim.Swap.Deadline : accepted + c->PowerMs);
+	}
+	else if (c->AnswerMs == NEVER || !(sim.Events & PD_PR_SWAP_EVENT_FAILED)) {
+		PartnerSendAt(&sim, c->Answer, sim.Swap.Deadline);
+	}
+
+	CHECK_EQUAL(sim.Events, c->Events);
+	CHECK(!PdPrSwapBusy(&sim.Swap));
+	CHECK_EQUAL(sim.Overlaps, 0);
+
+	if (c->Events & PD_PR_SWAP_EVENT_DONE) {
+		CHECK_EQUAL(sim.Swap.LatencyMs, c->LatencyMs);
+		CHECK_EQUAL(sim.Swap.Swaps, 1);
+		CHECK_EQUAL(sim.Local.PowerRole, c->ToSource ? PD_POWER_ROLE_SOURCE : PD_POWER_ROLE_SINK);
+		CHECK_EQUAL(sim.LocalVbus, c->ToSource);
+		CHECK_EQUAL(sim.PartnerVbus, !c->ToSource);
+		if (c->ToSource)
+			CHECK_EQUAL(LastReceivedType(&sim.Partner), PD_CTRL_PS_RDY);
+	}
+	else {
+		CHECK_EQUAL(sim.Swap.Swaps, 0);
+		CHECK_EQUAL(sim.Swap.Failures, 1);
+
+		// Refused or unanswered, nothing changed. Past Accept only error recovery helps.
+		if (!(c->Events & PD_PR_SWAP_EVENT_RECOVER)) {
+			CHECK_EQUAL(sim.Local.PowerRole, localBefore);
+			CHECK_EQUAL(sim.LocalVbus, !c->ToSource);
+		}
+		else {
+			CHECK(!sim.LocalVbus);
+		}
+	}
+}
+
+static void TestSwapCases(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(SwapCases) / sizeof(SwapCases[0]); i++)
+		RunCase(&SwapCases[i]);
+}
+
+static void TestPartnerRequest(void)
+{
+	SWAP_SIM sim;
+
+	// A sink only becomes the source when PrSwapToSource allows it
+	SimInitialize(&sim, 0, 0);
+	PartnerSendAt(&sim, PD_CTRL_PR_SWAP, sim.Now);
+	CHECK_EQUAL(sim.Events, 0);
+	CHECK_EQUAL(LastReceivedType(&sim.Partner), PD_CTRL_REJECT);
+	CHECK(!PdPrSwapBusy(&sim.Swap));
+
+	SimInitialize(&sim, 0, 1);
+	PartnerSendAt(&sim, PD_CTRL_PR_SWAP, sim.Now);
+	CHECK_EQUAL(LastReceivedType(&sim.Partner), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(sim.Swap.State, PdPrSwapStateWaitSourceOff);
+	PartnerSetVbus(&sim, 0);
+	PartnerSendAt(&sim, PD_CTRL_PS_RDY, sim.Now + 200);
+	CHECK_EQUAL(sim.Events, PD_PR_SWAP_EVENT_DONE);
+	CHECK_EQUAL(sim.Swap.LatencyMs, 200);
+	CHECK(sim.LocalVbus);
+	CHECK_EQUAL(sim.Local.PowerRole, PD_POWER_ROLE_SOURCE);
+
+	// A source always hands the role over
+	SimInitialize(&sim, 1, 0);
+	PartnerSendAt(&sim, PD_CTRL_PR_SWAP, sim.Now);
+	CHECK_EQUAL(PdPartnerReceivedType(&sim.Partner, 0), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(PdPartnerReceivedType(&sim.Partner, 1), PD_CTRL_PS_RDY);
+	CHECK(!sim.LocalVbus);
+	PartnerSetVbus(&sim, 1);
+	PartnerSendAt(&sim, PD_CTRL_PS_RDY, sim.Now + 50);
+	CHECK_EQUAL(sim.Events, PD_PR_SWAP_EVENT_DONE);
+	CHECK_EQUAL(sim.Swap.LatencyMs, 50);
+	CHECK_EQUAL(sim.Overlaps, 0);
+
+	// A second PR_Swap while one is running is ignored
+	SimInitialize(&sim, 0, 1);
+	PartnerSendAt(&sim, PD_CTRL_PR_SWAP, sim.Now);
+	PartnerSendAt(&sim, PD_CTRL_PR_SWAP, sim.Now + 5);
+	CHECK_EQUAL(sim.Partner.ReceivedCount, 1);
+	CHECK_EQUAL(PdPrSwapRequest(&sim.Swap, &sim.Local, sim.Now), 0);
+	CHECK_EQUAL(sim.Partner.ReceivedCount, 1);
+}
+
+static void TestSwapBackAndForth(void)
+{
+	SWAP_SIM sim;
+	unsigned int i;
+	unsigned long worst = 0;
+
+	// Repeated swaps keep the message IDs and the counters straight
+	SimInitialize(&sim, 0, 0);
+	for (i = 0; i < 10; i++) {
+		int toSource = sim.Local.PowerRole == PD_POWER_ROLE_SINK;
+
+		sim.Events = 0;
+		PdPrSwapRequest(&sim.Swap, &sim.Local, sim.Now);
+		PartnerSendAt(&sim, PD_CTRL_ACCEPT, sim.Now + 1 + i);
+		PartnerSetVbus(&sim, !toSource);
+		PartnerSendAt(&sim, PD_CTRL_PS_RDY, sim.Now + 20 * (i + 1));
+
+		CHECK_EQUAL(sim.Events, PD_PR_SWAP_EVENT_DONE);
+		CHECK_EQUAL(sim.Swap.LatencyMs, 1 + i + 20 * (i + 1));
+		if (sim.Swap.LatencyMs > worst)
+			worst = sim.Swap.LatencyMs;
+	}
+
+	CHECK_EQUAL(sim.Swap.Swaps, 10);
+	CHECK_EQUAL(sim.Swap.Failures, 0);
+	CHECK_EQUAL(worst, 210);
+	CHECK_EQUAL(sim.Local.PowerRole, PD_POWER_ROLE_SINK);
+	CHECK_EQUAL(sim.Overlaps, 0);
+	CHECK_EQUAL(sim.Partner.Duplicates, 0);
+}
+
+int main(void)
+{
+	TestSwapCases();
+	TestPartnerRequest();
+	TestSwapBackAndForth();
+
+	return TestExit("PdSwapTest");
+}
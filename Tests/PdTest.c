@@ -0,0 +1,320 @@
+/*++
+
+Module Name:
+
+    pdtest.c
+
+Abstract:
+
+    Tests for the PD protocol layer in pd.c, linked to a simulated
+    partner: GoodCRC, retries, duplicate detection, Soft_Reset and
+    Hard Reset.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "Test.h"
+#include "PdPartner.h"
+
+static void SetUp(PD_PROTOCOL *local, PD_PARTNER *partner, int autoGoodCrc)
+{
+	PdPartnerInitialize(partner);
+	PdProtocolInitialize(local, &PdPartnerPhy, partner, autoGoodCrc);
+}
+
+static unsigned int ReceivedId(const PD_PARTNER *partner, unsigned int index)
+{
+	return PD_HEADER_ID(PdMessageHeader(&partner->Received[index]));
+}
+
+static void TestTransmit(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	PPD_MESSAGE tx;
+	unsigned short header;
+	unsigned int i;
+
+	SetUp(&local, &partner, 0);
+
+	// Data objects go out little endian behind the header, as the FIFO frames them
+	tx = PdProtocolTxBuffer(&local);
+	PdMessageSetObject(tx, 0, 0x2301904BUL);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_DATA_REQUEST, 1), PdTxSuccess);
+	CHECK_EQUAL(partner.ReceivedCount, 1);
+	CHECK_EQUAL(partner.Received[0].Length, 6);
+	header = PdMessageHeader(&partner.Received[0]);
+	CHECK_EQUAL(PD_HEADER_TYPE(header), PD_DATA_REQUEST);
+	CHECK_EQUAL(PD_HEADER_COUNT(header), 1);
+	CHECK_EQUAL(PD_HEADER_POWER_ROLE(header), PD_POWER_ROLE_SINK);
+	CHECK_EQUAL(PD_HEADER_DATA_ROLE(header), PD_DATA_ROLE_UFP);
+	CHECK_EQUAL(PD_HEADER_SPEC_REV(header), PD_SPEC_REV_2_0);
+	CHECK_EQUAL(partner.Received[0].Data[0], 0x4B);
+	CHECK_EQUAL(PdMessageObject(&partner.Received[0], 0), 0x2301904BUL);
+
+	// Each acknowledged message takes the next ID, modulo 8
+	for (i = 1; i < 10; i++)
+		CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(partner.ReceivedCount, 10);
+	for (i = 0; i < 10; i++)
+		CHECK_EQUAL(ReceivedId(&partner, i), i & 7);
+	CHECK_EQUAL(local.TxMessages, 10);
+	CHECK_EQUAL(local.TxRetries, 0);
+	CHECK_EQUAL(partner.Frames, 10);
+}
+
+static void TestRetries(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+
+	// PD 2.0 tries nRetryCount = 3 more times, all with the same ID
+	SetUp(&local, &partner, 0);
+	partner.DropFrames = 3;
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxSuccess);
+	CHECK_EQUAL(partner.Frames, 4);
+	CHECK_EQUAL(partner.ReceivedCount, 1);
+	CHECK_EQUAL(ReceivedId(&partner, 0), 0);
+	CHECK_EQUAL(local.TxRetries, 3);
+	CHECK_EQUAL(local.TxMessageId, 1);
+
+	// One more loss and the message fails, its ID is not used up
+	partner.DropFrames = 4;
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxFailed);
+	CHECK_EQUAL(partner.Frames, 8);
+	CHECK_EQUAL(local.TxFailures, 1);
+	CHECK_EQUAL(local.TxMessageId, 1);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxSuccess);
+	CHECK_EQUAL(ReceivedId(&partner, 1), 1);
+
+	// PD 3.0 only retries twice
+	SetUp(&local, &partner, 0);
+	local.SpecRevision = PD_SPEC_REV_3_0;
+	partner.DropFrames = 3;
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxFailed);
+	CHECK_EQUAL(partner.Frames, 3);
+
+	// A PHY that cannot send at all counts as a retry too
+	SetUp(&local, &partner, 0);
+	partner.FailTransmits = 2;
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxSuccess);
+	CHECK_EQUAL(partner.Frames, 1);
+	CHECK_EQUAL(local.TxRetries, 2);
+
+	// No partner on the line, every attempt times out
+	SetUp(&local, &partner, 0);
+	partner.Present = 0;
+	PdMessageSetObject(PdProtocolTxBuffer(&local), 0, 0x0001905AUL);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_DATA_SOURCE_CAPABILITIES, 1), PdTxFailed);
+	CHECK_EQUAL(partner.Frames, 1 + PD_N_RETRY_COUNT_REV20);
+}
+
+static void TestLostGoodCrc(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+
+	// The partner got it but its GoodCRC was lost: the retry must be dropped there
+	SetUp(&local, &partner, 0);
+	partner.DropGoodCrc = 1;
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_PS_RDY, 0), PdTxSuccess);
+	CHECK_EQUAL(partner.Frames, 2);
+	CHECK_EQUAL(partner.Duplicates, 1);
+	CHECK_EQUAL(partner.ReceivedCount, 1);
+
+	// And the other way round
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_ACCEPT, 0, NULL), 1);
+	CHECK_EQUAL(partner.GoodCrcs, 1);
+	CHECK_EQUAL(PdPartnerResend(&partner, &local), 0);
+	CHECK_EQUAL(local.RxDuplicates, 1);
+	CHECK_EQUAL(local.RxMessages, 1);
+
+	// The retransmission is acknowledged again, or the partner would keep retrying
+	CHECK_EQUAL(partner.GoodCrcs, 2);
+	CHECK_EQUAL(partner.LastGoodCrcId, 0);
+}
+
+static void TestReceive(void)
+{
+	static const unsigned long caps[2] = { 0x0801912CUL, 0x0002D0C8UL };
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	PPD_MESSAGE message;
+	unsigned int i;
+
+	SetUp(&local, &partner, 0);
+
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 2, caps), 1);
+	CHECK_EQUAL(partner.GoodCrcs, 1);
+	CHECK_EQUAL(partner.LastGoodCrcId, 0);
+
+	message = PdProtocolRxPeek(&local);
+	CHECK(message != NULL);
+	if (message) {
+		CHECK_EQUAL(PD_HEADER_TYPE(PdMessageHeader(message)), PD_DATA_SOURCE_CAPABILITIES);
+		CHECK_EQUAL(PdMessageObject(message, 0), caps[0]);
+		CHECK_EQUAL(PdMessageObject(message, 1), caps[1]);
+	}
+	PdProtocolRxConsume(&local);
+	CHECK(PdProtocolRxPeek(&local) == NULL);
+
+	// GoodCRC carries the ID of the message it acknowledges
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_PS_RDY, 0, NULL), 1);
+	CHECK_EQUAL(partner.LastGoodCrcId, 1);
+
+	// A PHY that acknowledges by itself gets no GoodCRC frames from the layer
+	SetUp(&local, &partner, 1);
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_ACCEPT, 0, NULL), 1);
+	CHECK_EQUAL(partner.GoodCrcs, 0);
+
+	// Eight messages fill the ring, the ninth has nowhere to go until one is consumed
+	SetUp(&local, &partner, 1);
+	for (i = 0; i < PD_RING_SIZE; i++)
+		CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL), 1);
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL), -1);
+	PdProtocolRxConsume(&local);
+	CHECK_EQUAL(PdPartnerResend(&partner, &local), 1);
+}
+
+static void TestMalformed(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+	PPD_MESSAGE slot;
+	unsigned short header;
+
+	SetUp(&local, &partner, 0);
+
+	// Byte count disagrees with the header's object count
+	slot = PdProtocolRxSlot(&local);
+	header = PD_HEADER(PD_DATA_REQUEST, 0, PD_SPEC_REV_2_0, 1, 0, 1);
+	slot->Length = 2;
+	slot->Header[0] = (unsigned char)header;
+	slot->Header[1] = (unsigned char)(header >> 8);
+	CHECK_EQUAL(PdProtocolRxCommit(&local), 0);
+
+	// Shorter than a header, longer than a frame
+	slot->Length = 1;
+	CHECK_EQUAL(PdProtocolRxCommit(&local), 0);
+	slot->Length = PD_MESSAGE_FRAME_SIZE;
+	CHECK_EQUAL(PdProtocolRxCommit(&local), 0);
+
+	// Extended messages are not supported
+	header = PD_HEADER(PD_CTRL_ACCEPT, 0, PD_SPEC_REV_2_0, 1, 0, 0) | 0x8000;
+	slot->Length = 2;
+	slot->Header[0] = (unsigned char)header;
+	slot->Header[1] = (unsigned char)(header >> 8);
+	CHECK_EQUAL(PdProtocolRxCommit(&local), 0);
+
+	CHECK_EQUAL(local.RxDropped, 4);
+	CHECK_EQUAL(partner.GoodCrcs, 0);
+
+	// GoodCRC is for the transmit path, it is not queued or acknowledged
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_GOODCRC, 0, NULL), 0);
+	CHECK_EQUAL(local.RxDropped, 4);
+	CHECK_EQUAL(partner.GoodCrcs, 0);
+	CHECK(PdProtocolRxPeek(&local) == NULL);
+}
+
+static void TestSoftReset(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+
+	SetUp(&local, &partner, 0);
+
+	// Partner sends ID 0, then resets: its Soft_Reset is ID 0 again and must not look like a duplicate
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_PS_RDY, 0, NULL), 1);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(local.TxMessageId, 2);
+
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_SOFT_RESET, 0, NULL), 1);
+	CHECK_EQUAL(local.RxDuplicates, 0);
+	CHECK_EQUAL(local.TxMessageId, 0);
+
+	// The Accept is the first message after the reset, ID 0 on both ends
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_ACCEPT, 0), PdTxSuccess);
+	CHECK_EQUAL(PdPartnerReceivedType(&partner, 2), PD_CTRL_ACCEPT);
+	CHECK_EQUAL(ReceivedId(&partner, 2), 0);
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_PS_RDY, 0, NULL), 1);
+
+	// Sending one resets the local IDs first, so it goes out as ID 0 and the partner follows
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_SOFT_RESET, 0), PdTxSuccess);
+	CHECK_EQUAL(ReceivedId(&partner, 4), 0);
+	CHECK_EQUAL(local.RxMessageId, -1);
+	CHECK_EQUAL(partner.Duplicates, 0);
+
+	// The partner's Accept is ID 0 too, and gets through
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_CTRL_ACCEPT, 0, NULL), 1);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(ReceivedId(&partner, 5), 1);
+}
+
+static void TestHardReset(void)
+{
+	static const PD_PHY_OPS noHardReset = { 0, 0, 0 };
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+
+	SetUp(&local, &partner, 0);
+	PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0);
+	PdPartnerSend(&partner, &local, PD_CTRL_PS_RDY, 0, NULL);
+	PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL);
+
+	// Signalled on the wire, message IDs and queued messages are gone on both ends
+	CHECK_EQUAL(PdProtocolHardReset(&local), 1);
+	CHECK_EQUAL(partner.HardResets, 1);
+	CHECK_EQUAL(local.HardResets, 1);
+	CHECK_EQUAL(local.TxMessageId, 0);
+	CHECK_EQUAL(local.RxMessageId, -1);
+	CHECK(PdProtocolRxPeek(&local) == NULL);
+
+	CHECK_EQUAL(PdPartnerSend(&partner, &local, PD_DATA_SOURCE_CAPABILITIES, 1, (const unsigned long[]){ 0x0001912CUL }), 1);
+	CHECK_EQUAL(PdProtocolTransmit(&local, PD_CTRL_GET_SOURCE_CAP, 0), PdTxSuccess);
+	CHECK_EQUAL(partner.Duplicates, 0);
+
+	// The UC120 PHY has no way to signal it yet, the layer resets all the same
+	local.Phy = &noHardReset;
+	local.TxMessageId = 5;
+	CHECK_EQUAL(PdProtocolHardReset(&local), 0);
+	CHECK_EQUAL(local.HardResets, 2);
+	CHECK_EQUAL(local.TxMessageId, 0);
+}
+
+static void TestSpecRevision(void)
+{
+	PD_PROTOCOL local;
+	PD_PARTNER partner;
+
+	// Follow a PD 2.0 partner down, but never up, and ignore a reserved revision
+	SetUp(&local, &partner, 0);
+	local.SpecRevision = PD_SPEC_REV_3_0;
+	partner.SpecRevision = 0;
+	PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL);
+	CHECK_EQUAL(local.SpecRevision, PD_SPEC_REV_3_0);
+	partner.SpecRevision = PD_SPEC_REV_2_0;
+	PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL);
+	CHECK_EQUAL(local.SpecRevision, PD_SPEC_REV_2_0);
+	partner.SpecRevision = PD_SPEC_REV_3_0;
+	PdPartnerSend(&partner, &local, PD_CTRL_PING, 0, NULL);
+	CHECK_EQUAL(local.SpecRevision, PD_SPEC_REV_2_0);
+}
+
+int main(void)
+{
+	TestTransmit();
+	TestRetries();
+	TestLostGoodCrc();
+	TestReceive();
+	TestMalformed();
+	TestSoftReset();
+	TestHardReset();
+	TestSpecRevision();
+
+	return TestExit("PdTest");
+}
@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    pepclocktest.c
+
+Abstract:
+
+    Tests for the clock reference counting and release hysteresis in
+    pepclock.c, with a mock power-control callback and a virtual clock.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "Test.h"
+#include "PepClock.h"
+
+// Ticks are 100ns like the driver's interrupt time
+#define MS 10000ULL
+
+typedef struct _MOCK_POWER
+{
+	int On;
+	unsigned int Calls;
+	// Calls that did not change the state, the bookkeeping should never make one
+	unsigned int Redundant;
+} MOCK_POWER;
+
+static void MockSetClock(void *context, int on)
+{
+	MOCK_POWER *power = (MOCK_POWER *)context;
+
+	power->Calls++;
+	if (power->On == on)
+		power->Redundant++;
+	power->On = on;
+}
+
+static void TestHysteresis(void)
+{
+	MOCK_POWER power = { 0, 0, 0 };
+	PEP_CLOCK clock;
+
+	PepClockInitialize(&clock, MockSetClock, &power, 5 * MS);
+
+	PepClockAcquire(&clock, PepClockReasonSpi, 0);
+	CHECK(power.On);
+
+	// The last release only arms the deadline
+	CHECK(PepClockRelease(&clock, PepClockReasonSpi, 1 * MS));
+	CHECK(power.On);
+	CHECK_EQUAL(PepClockExpire(&clock, 2 * MS), 4 * MS);
+	CHECK(power.On);
+
+	// Another burst inside the window cancels it, a stale expiry is harmless
+	PepClockAcquire(&clock, PepClockReasonSpi, 3 * MS);
+	CHECK_EQUAL(PepClockExpire(&clock, 6 * MS), 0);
+	CHECK(power.On);
+	CHECK(PepClockRelease(&clock, PepClockReasonSpi, 4 * MS));
+
+	CHECK_EQUAL(PepClockExpire(&clock, 9 * MS), 0);
+	CHECK(!power.On);
+	CHECK_EQUAL(power.Calls, 2);
+	CHECK_EQUAL(clock.Switches, 1);
+	CHECK_EQUAL(clock.OnTime, 9 * MS);
+
+	// Already off, expiring again does nothing
+	CHECK_EQUAL(PepClockExpire(&clock, 20 * MS), 0);
+	CHECK_EQUAL(power.Calls, 2);
+	CHECK_EQUAL(power.Redundant, 0);
+}
+
+static void TestNoHysteresis(void)
+{
+	MOCK_POWER power = { 0, 0, 0 };
+	PEP_CLOCK clock;
+
+	PepClockInitialize(&clock, MockSetClock, &power, 0);
+
+	PepClockAcquire(&clock, PepClockReasonInit, 0);
+	CHECK(!PepClockRelease(&clock, PepClockReasonInit, 1 * MS));
+	CHECK(!power.On);
+	CHECK_EQUAL(power.Calls, 2);
+}
+
+static void TestNestedReasons(void)
+{
+	MOCK_POWER power = { 0, 0, 0 };
+	PEP_CLOCK clock;
+
+	PepClockInitialize(&clock, MockSetClock, &power, 2 * MS);
+
+	// An interrupt burst nested inside an init sequence, with SPI inside both
+	PepClockAcquire(&clock, PepClockReasonInit, 0);
+	PepClockAcquire(&clock, PepClockReasonInterrupt, 10 * MS);
+	PepClockAcquire(&clock, PepClockReasonSpi, 11 * MS);
+	CHECK(!PepClockRelease(&clock, PepClockReasonSpi, 12 * MS));
+	CHECK(!PepClockRelease(&clock, PepClockReasonInterrupt, 15 * MS));
+	CHECK(PepClockRelease(&clock, PepClockReasonInit, 20 * MS));
+
+	CHECK_EQUAL(power.Calls, 1);
+	CHECK_EQUAL(clock.ReasonOnTime[PepClockReasonInit], 20 * MS);
+	CHECK_EQUAL(clock.ReasonOnTime[PepClockReasonInterrupt], 5 * MS);
+	CHECK_EQUAL(clock.ReasonOnTime[PepClockReasonSpi], 1 * MS);
+
+	CHECK_EQUAL(PepClockExpire(&clock, 22 * MS), 0);
+	CHECK(!power.On);
+	CHECK_EQUAL(clock.OnTime, 22 * MS);
+}
+
+static void TestFlush(void)
+{
+	MOCK_POWER power = { 0, 0, 0 };
+	PEP_CLOCK clock;
+
+	PepClockInitialize(&clock, MockSetClock, &power, 5 * MS);
+
+	// Leaving D0 does not wait out the hysteresis
+	PepClockAcquire(&clock, PepClockReasonSpi, 0);
+	PepClockRelease(&clock, PepClockReasonSpi, 1 * MS);
+	PepClockFlush(&clock, 2 * MS);
+	CHECK(!power.On);
+	CHECK_EQUAL(PepClockExpire(&clock, 6 * MS), 0);
+
+	// But never takes the clock from under a holder
+	PepClockAcquire(&clock, PepClockReasonInterrupt, 10 * MS);
+	PepClockFlush(&clock, 11 * MS);
+	CHECK(power.On);
+	PepClockRelease(&clock, PepClockReasonInterrupt, 12 * MS);
+	PepClockFlush(&clock, 12 * MS);
+	CHECK(!power.On);
+	CHECK_EQUAL(power.Redundant, 0);
+}
+
+//
+// A register burst every millisecond for 100 ms, the hysteresis decides
+// how often the clock switches
+//
+static unsigned int RunBursts(unsigned long long hysteresis)
+{
+	MOCK_POWER power = { 0, 0, 0 };
+	PEP_CLOCK clock;
+	unsigned long long now = 0;
+	int burst;
+
+	PepClockInitialize(&clock, MockSetClock, &power, hysteresis);
+
+	for (burst = 0; burst < 100; burst++, now += MS) {
+		PepClockExpire(&clock, now);
+		PepClockAcquire(&clock, PepClockReasonSpi, now);
+		PepClockRelease(&clock, PepClockReasonSpi, now + MS / 10);
+	}
+
+	PepClockExpire(&clock, now + hysteresis);
+	CHECK(!power.On);
+	CHECK_EQUAL(power.Redundant, 0);
+
+	return power.Calls;
+}
+
+static void TestBurstSwitches(void)
+{
+	CHECK_EQUAL(RunBursts(0), 200);
+	CHECK_EQUAL(RunBursts(MS / 2), 200);
+	CHECK_EQUAL(RunBursts(2 * MS), 2);
+}
+
+int main(void)
+{
+	TestHysteresis();
+	TestNoHysteresis();
+	TestNestedReasons();
+	TestFlush();
+	TestBurstSwitches();
+
+	return TestExit("PepClockTest");
+}
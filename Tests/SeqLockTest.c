@@ -0,0 +1,280 @@
+/*++
+
+Module Name:
+
+    seqlocktest.c
+
+Abstract:
+
+    Tests for the sequence counter protocol in seqlock.h, on the
+    statistics block from public.h. Writer threads update the block the
+    way the driver does, serialized among themselves, while reader threads
+    copy it with SeqLockCopy as a monitoring client would. Every copy has
+    to come out consistent.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "Test.h"
+#include "Public.h"
+#include "SeqLock.h"
+
+#define UPDATES 200000
+#define MAX_READERS 8
+#define COPY_ATTEMPTS 1000
+
+//
+// Every field of an update derives from one number, so a copy mixing two
+// updates shows
+//
+static void Fill(volatile LUMIAUSBC_STATISTICS *stats, unsigned int n)
+{
+	unsigned int i;
+
+	stats->SnapshotTime = (unsigned long long)n * 10000;
+	for (i = 0; i < LUMIAUSBC_SNAPSHOT_REGISTERS; i++)
+		stats->Snapshot[i] = (unsigned char)(n + i);
+	stats->Attached = (int)(n & 1);
+	stats->TypeCCurrentMa = (int)(n % 3000);
+	stats->SpiTransactions = n;
+	stats->SpiBytes = 3 * n;
+	for (i = 0; i < LUMIAUSBC_INTERRUPT_SOURCES; i++)
+		stats->Interrupts[i] = n + i;
+	stats->ClockOnMs = (int)(n ^ 0x5A5A);
+	stats->BitstreamChunks = ~n;
+}
+
+//
+// The number a copy was filled from, or -1 if it is torn
+//
+static long long Check(const LUMIAUSBC_STATISTICS *stats)
+{
+	unsigned int n = stats->SpiTransactions, i;
+
+	if (stats->SnapshotTime != (unsigned long long)n * 10000 || stats->Attached != (int)(n & 1) ||
+		stats->TypeCCurrentMa != (int)(n % 3000) || stats->SpiBytes != 3 * n ||
+		stats->ClockOnMs != (int)(n ^ 0x5A5A) || stats->BitstreamChunks != ~n)
+		return -1;
+
+	for (i = 0; i < LUMIAUSBC_SNAPSHOT_REGISTERS; i++)
+		if (stats->Snapshot[i] != (unsigned char)(n + i))
+			return -1;
+	for (i = 0; i < LUMIAUSBC_INTERRUPT_SOURCES; i++)
+		if (stats->Interrupts[i] != n + i)
+			return -1;
+
+	return n;
+}
+
+static void TestLayout(void)
+{
+	// Copied a word at a time, and mapped into 32 and 64 bit clients alike
+	CHECK_EQUAL(sizeof(LUMIAUSBC_STATISTICS) % 8, 0);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_STATISTICS, Sequence), 0);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_STATISTICS, SnapshotTime) % 8, 0);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_STATISTICS, Snapshot), 24);
+	CHECK_EQUAL(offsetof(LUMIAUSBC_STATISTICS, Attached), 32);
+}
+
+static void TestProtocol(void)
+{
+	static LUMIAUSBC_STATISTICS stats, copy;
+	unsigned int start;
+
+	memset(&stats, 0, sizeof(stats));
+	Fill(&stats, 5);
+
+	// Quiet: the first try succeeds
+	start = SeqLockReadBegin(&stats.Sequence);
+	CHECK(!SeqLockReadRetry(&stats.Sequence, start));
+	CHECK_EQUAL(SeqLockCopy(&stats.Sequence, &stats, &copy, sizeof(copy), COPY_ATTEMPTS), 1);
+	CHECK_EQUAL(Check(&copy), 5);
+
+	// Odd while an update is under way
+	SeqLockWriteBegin(&stats.Sequence);
+	CHECK_EQUAL(stats.Sequence & 1, 1);
+	start = SeqLockReadBegin(&stats.Sequence);
+	CHECK(SeqLockReadRetry(&stats.Sequence, start));
+
+	// A writer that never finishes makes the copy give up rather than spin
+	CHECK_EQUAL(SeqLockCopy(&stats.Sequence, &stats, &copy, sizeof(copy), 50), 0);
+
+	// An update finishing between begin and retry invalidates what was read
+	Fill(&stats, 6);
+	SeqLockWriteEnd(&stats.Sequence);
+	start = SeqLockReadBegin(&stats.Sequence);
+	SeqLockWriteBegin(&stats.Sequence);
+	Fill(&stats, 7);
+	SeqLockWriteEnd(&stats.Sequence);
+	CHECK(SeqLockReadRetry(&stats.Sequence, start));
+	CHECK_EQUAL(stats.Sequence, 4);
+	CHECK_EQUAL(SeqLockCopy(&stats.Sequence, &stats, &copy, sizeof(copy), COPY_ATTEMPTS), 1);
+	CHECK_EQUAL(Check(&copy), 7);
+}
+
+typedef struct _SHARED
+{
+	LUMIAUSBC_STATISTICS Stats;
+
+	// StatsLock, writers only
+	pthread_mutex_t WriteLock;
+	unsigned int Next;
+	int Done;
+} SHARED;
+
+typedef struct _READER
+{
+	SHARED *Shared;
+	// Take the copy with the protocol, or as a plain copy to show what it prevents
+	int Plain;
+
+	unsigned long Copies;
+	unsigned long Attempts;
+	unsigned long GaveUp;
+	unsigned long Torn;
+	unsigned long Backwards;
+} READER;
+
+static SHARED Shared;
+
+//
+// LUMIAUSBC_STATS_BEGIN, the update, LUMIAUSBC_STATS_END
+//
+static void *Writer(void *context)
+{
+	SHARED *shared = (SHARED *)context;
+	unsigned int n;
+
+	for (;;) {
+		pthread_mutex_lock(&shared->WriteLock);
+		n = ++shared->Next;
+		if (n <= UPDATES) {
+			SeqLockWriteBegin(&shared->Stats.Sequence);
+			Fill(&shared->Stats, n);
+			SeqLockWriteEnd(&shared->Stats.Sequence);
+		}
+		pthread_mutex_unlock(&shared->WriteLock);
+
+		if (n >= UPDATES)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *Reader(void *context)
+{
+	READER *reader = (READER *)context;
+	LUMIAUSBC_STATISTICS copy;
+	long long n, last = 0;
+	unsigned int attempt;
+
+	while (!__atomic_load_n(&reader->Shared->Done, __ATOMIC_ACQUIRE)) {
+		if (reader->Plain) {
+			memcpy(&copy, (const void *)&reader->Shared->Stats, sizeof(copy));
+			attempt = 1;
+		}
+		else {
+			attempt = SeqLockCopy(&reader->Shared->Stats.Sequence, &reader->Shared->Stats, &copy, sizeof(copy), COPY_ATTEMPTS);
+			if (!attempt) {
+				reader->GaveUp++;
+				continue;
+			}
+		}
+
+		reader->Copies++;
+		reader->Attempts += attempt;
+
+		n = Check(&copy);
+		if (n < 0) {
+			reader->Torn++;
+			continue;
+		}
+
+		// A later copy never shows an older update
+		if (n < last)
+			reader->Backwards++;
+		last = n;
+	}
+
+	return NULL;
+}
+
+static void RunConcurrent(unsigned int writers, unsigned int readers, int plain, READER *results)
+{
+	pthread_t writerThreads[2], readerThreads[MAX_READERS];
+	unsigned int i;
+
+	memset(&Shared, 0, sizeof(Shared));
+	pthread_mutex_init(&Shared.WriteLock, NULL);
+	Fill(&Shared.Stats, 0);
+
+	for (i = 0; i < readers; i++) {
+		memset(&results[i], 0, sizeof(results[i]));
+		results[i].Shared = &Shared;
+		results[i].Plain = plain;
+		pthread_create(&readerThreads[i], NULL, Reader, &results[i]);
+	}
+	for (i = 0; i < writers; i++)
+		pthread_create(&writerThreads[i], NULL, Writer, &Shared);
+
+	for (i = 0; i < writers; i++)
+		pthread_join(writerThreads[i], NULL);
+	__atomic_store_n(&Shared.Done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < readers; i++)
+		pthread_join(readerThreads[i], NULL);
+
+	pthread_mutex_destroy(&Shared.WriteLock);
+}
+
+static void TestConcurrent(void)
+{
+	static const unsigned int writerCounts[] = { 1, 2 };
+	static const unsigned int readerCounts[] = { 1, 4, MAX_READERS };
+	READER results[MAX_READERS];
+	unsigned long copies, torn, backwards, plainTorn = 0;
+	unsigned int i, j, k;
+
+	for (i = 0; i < sizeof(writerCounts) / sizeof(writerCounts[0]); i++) {
+		for (j = 0; j < sizeof(readerCounts) / sizeof(readerCounts[0]); j++) {
+			RunConcurrent(writerCounts[i], readerCounts[j], 0, results);
+
+			for (copies = torn = backwards = 0, k = 0; k < readerCounts[j]; k++) {
+				copies += results[k].Copies;
+				torn += results[k].Torn;
+				backwards += results[k].Backwards;
+			}
+
+			CHECK_EQUAL(torn, 0);
+			CHECK_EQUAL(backwards, 0);
+			CHECK(copies > 0);
+
+			// Every update completed, and the writers left the counter even
+			CHECK_EQUAL(Shared.Stats.Sequence, 2 * UPDATES);
+			CHECK_EQUAL(Check(&Shared.Stats), UPDATES);
+		}
+	}
+
+	// The same readers without the protocol do see torn copies, given a second core to race on
+	RunConcurrent(1, 4, 1, results);
+	for (k = 0; k < 4; k++)
+		plainTorn += results[k].Torn;
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		CHECK(plainTorn > 0);
+}
+
+int main(void)
+{
+	TestLayout();
+	TestProtocol();
+	TestConcurrent();
+
+	return TestExit("SeqLockTest");
+}
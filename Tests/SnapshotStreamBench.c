@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    snapshotstreambench.c
+
+Abstract:
+
+    Reports how small the snapshot capture in snapshotstream.c keeps the
+    interrupt register dumps, how many of them the driver's capture size
+    holds against raw dumps, and what encoding and decoding cost. The
+    traffic is shaped after the recorded UC120_ and PLUGDET_ traces; the
+    recorded traces themselves go through uc120decode -b.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "Uc120.h"
+#include "SnapshotStream.h"
+
+#define DUMPS 100000
+#define PASSES 20
+
+typedef struct _TRAFFIC
+{
+	const char *Name;
+	// Time between interrupts in 100 ns units, the driver's interrupt time
+	unsigned int Interval;
+	// Chance in 256 of each snapshot register changing from one dump to the next
+	unsigned char ChangeChance[UC120_SNAPSHOT_COUNT];
+} TRAFFIC;
+
+static const TRAFFIC Traffic[] = {
+	// Plug events now and then: the interrupt status and sometimes the CC status move
+	{ "idle", 1000000, { 0, 0, 128, 4, 16, 0, 2, 0 } },
+	// PD message exchange, an interrupt a millisecond and the status on every one
+	{ "pd", 10000, { 0, 0, 200, 8, 2, 0, 64, 0 } },
+	// Every register on every dump, the worst there is
+	{ "random", 10000, { 255, 255, 255, 255, 255, 255, 255, 255 } },
+};
+
+static unsigned char Dumps[DUMPS][UC120_SNAPSHOT_COUNT];
+
+static unsigned long long NowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void Generate(const TRAFFIC *traffic)
+{
+	// As the chip reads after bring-up
+	static const unsigned char initial[UC120_SNAPSHOT_COUNT] = { 0x00, 0x00, 0x00, 0x88, 0x05, 0x00, 0x00, 0x00 };
+	unsigned int seed = 2024, i, j;
+
+	memcpy(Dumps[0], initial, sizeof(initial));
+	for (i = 1; i < DUMPS; i++) {
+		for (j = 0; j < UC120_SNAPSHOT_COUNT; j++) {
+			seed = seed * 1103515245 + 12345;
+			Dumps[i][j] = (seed >> 16) % 256 < traffic->ChangeChance[j] ? (unsigned char)(seed >> 8) : Dumps[i - 1][j];
+		}
+	}
+}
+
+static void Run(const TRAFFIC *traffic)
+{
+	static SNAPSHOT_STREAM stream;
+	static unsigned char capture[SNAPSHOT_STREAM_CAPTURE_SIZE];
+	unsigned long long start, encodeNs, decodeNs;
+	unsigned int pass, i, length;
+	int decoded = 0;
+
+	Generate(traffic);
+
+	start = NowNs();
+	for (pass = 0; pass < PASSES; pass++) {
+		SnapshotStreamInitialize(&stream, UC120_SNAPSHOT_COUNT);
+		for (i = 0; i < DUMPS; i++)
+			SnapshotStreamAppend(&stream, (unsigned long long)(i + 1) * traffic->Interval, Dumps[i]);
+	}
+	encodeNs = NowNs() - start;
+
+	length = SnapshotStreamCopy(&stream, capture, sizeof(capture));
+
+	start = NowNs();
+	for (pass = 0; pass < PASSES; pass++)
+		decoded = SnapshotStreamDecode(capture, length, NULL, NULL);
+	decodeNs = NowNs() - start;
+
+	printf("%-8s %3lu%% of raw, %5.2f bytes per dump, %5d dumps held against %4u raw, encode %5.1f ns, decode %5.1f ns per dump\n",
+		traffic->Name, SnapshotStreamRatio(&stream), (double)stream.EncodedBytes / DUMPS,
+		decoded, SNAPSHOT_STREAM_CAPTURE_SIZE / (UC120_SNAPSHOT_COUNT + 8),
+		(double)encodeNs / ((double)PASSES * DUMPS), decoded > 0 ? (double)decodeNs / ((double)PASSES * decoded) : 0.0);
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	printf("SnapshotStreamBench, %u dumps\n", DUMPS);
+	for (i = 0; i < sizeof(Traffic) / sizeof(Traffic[0]); i++)
+		Run(&Traffic[i]);
+
+	return 0;
+}
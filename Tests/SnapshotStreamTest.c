@@ -0,0 +1,316 @@
+/*++
+
+Module Name:
+
+    snapshotstreamtest.c
+
+Abstract:
+
+    Tests for the delta-encoded snapshot capture in snapshotstream.c: the
+    record bytes against the format in snapshotstream.h, captures decoded
+    back to exactly what was appended while the ring wraps and blocks
+    are dropped, copies into short buffers, and malformed captures.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "Public.h"
+#include "SnapshotStream.h"
+
+#define HISTORY 20000
+
+// What was appended, to check the decoded capture against
+typedef struct _HISTORY_ENTRY
+{
+	unsigned long long Time;
+	unsigned char Values[SNAPSHOT_STREAM_REGISTERS_MAX];
+} HISTORY_ENTRY;
+
+static HISTORY_ENTRY History[HISTORY];
+
+typedef struct _COLLECT
+{
+	unsigned int Registers;
+	// Index in History of the first snapshot the capture should hold
+	unsigned int Next;
+	unsigned int Mismatches;
+	unsigned int Keyframes;
+} COLLECT;
+
+static void Collect(void *context, unsigned long long time, const unsigned char *values, unsigned int registers, int keyframe)
+{
+	COLLECT *collect = (COLLECT *)context;
+
+	if (collect->Next >= HISTORY || registers != collect->Registers || time != History[collect->Next].Time ||
+		memcmp(values, History[collect->Next].Values, registers))
+		collect->Mismatches++;
+
+	collect->Next++;
+	if (keyframe)
+		collect->Keyframes++;
+}
+
+static void TestFormat(void)
+{
+	static SNAPSHOT_STREAM stream;
+	static const unsigned char values[3][8] = {
+		{ 0x00, 0x00, 0x00, 0x88, 0x05, 0x00, 0x00, 0x00 },
+		{ 0x00, 0x00, 0x01, 0x88, 0x05, 0x00, 0x00, 0x00 },
+		{ 0x00, 0x00, 0x01, 0x88, 0x05, 0x00, 0x00, 0x00 },
+	};
+	static const unsigned char expected[] = {
+		// Block 0, 18 record bytes, 8 registers, version 1
+		0x00, 0x00, 0x00, 0x00, 18, 0, 8, SNAPSHOT_STREAM_VERSION,
+		// Keyframe at 100
+		SNAPSHOT_STREAM_KEY, 100, 0x00, 0x00, 0x00, 0x88, 0x05, 0x00, 0x00, 0x00,
+		// 200 later register 2 changed
+		SNAPSHOT_STREAM_DELTA, 0xC8, 0x01, 0x04, 0x01,
+		// Nothing changed at the same time
+		SNAPSHOT_STREAM_DELTA, 0x00, 0x00,
+	};
+	unsigned char capture[64];
+	COLLECT collect;
+
+	// The statistics block names the capture size for clients, they are the same
+	CHECK_EQUAL(SNAPSHOT_STREAM_CAPTURE_SIZE, LUMIAUSBC_SNAPSHOT_CAPTURE_SIZE);
+
+	SnapshotStreamInitialize(&stream, 8);
+	CHECK_EQUAL(SnapshotStreamAppend(&stream, 100, values[0]), 10);
+	CHECK_EQUAL(SnapshotStreamAppend(&stream, 300, values[1]), 5);
+	CHECK_EQUAL(SnapshotStreamAppend(&stream, 300, values[2]), 3);
+
+	CHECK_EQUAL(SnapshotStreamCopy(&stream, capture, sizeof(capture)), sizeof(expected));
+	CHECK(!memcmp(capture, expected, sizeof(expected)));
+
+	CHECK_EQUAL(stream.Snapshots, 3);
+	CHECK_EQUAL(stream.Keyframes, 1);
+	CHECK_EQUAL(stream.RawBytes, 3 * 16);
+	CHECK_EQUAL(stream.EncodedBytes, 18);
+	CHECK_EQUAL(SnapshotStreamRatio(&stream), 18 * 100 / 48);
+
+	History[0].Time = 100;
+	History[1].Time = 300;
+	History[2].Time = 300;
+	memcpy(History[0].Values, values[0], 8);
+	memcpy(History[1].Values, values[1], 8);
+	memcpy(History[2].Values, values[2], 8);
+	memset(&collect, 0, sizeof(collect));
+	collect.Registers = 8;
+	CHECK_EQUAL(SnapshotStreamDecode(capture, sizeof(expected), Collect, &collect), 3);
+	CHECK_EQUAL(collect.Mismatches, 0);
+	CHECK_EQUAL(collect.Keyframes, 1);
+
+	// A time going backwards restarts from a keyframe; a long gap takes more time bytes
+	CHECK_EQUAL(SnapshotStreamAppend(&stream, 50, values[0]), 10);
+	CHECK_EQUAL(SnapshotStreamAppend(&stream, 50 + (1ULL << 35), values[0]), 1 + 6 + 1);
+	CHECK_EQUAL(stream.Keyframes, 2);
+
+	// Nothing appended, nothing to copy
+	SnapshotStreamInitialize(&stream, 8);
+	CHECK_EQUAL(SnapshotStreamCopy(&stream, capture, sizeof(capture)), 0);
+	CHECK_EQUAL(SnapshotStreamDecode(capture, 0, NULL, NULL), 0);
+	CHECK_EQUAL(SnapshotStreamRatio(&stream), 0);
+}
+
+typedef struct _ROUND_TRIP_CASE
+{
+	unsigned int Registers;
+	unsigned int Snapshots;
+	// Chance in 256 of each register changing between snapshots
+	unsigned int ChangeChance;
+	// Chance in 256 of time going backwards, as after a clock reset
+	unsigned int BackwardsChance;
+} ROUND_TRIP_CASE;
+
+static const ROUND_TRIP_CASE RoundTripCases[] = {
+	// The driver's snapshot, mostly quiet, a handful of snapshots and enough to wrap the ring many times
+	{ 8, 5, 16, 0 },
+	{ 8, 300, 16, 0 },
+	{ 8, HISTORY, 16, 0 },
+	// Every register changing every time, the ring still only holds whole records
+	{ 8, HISTORY, 256, 0 },
+	// Nothing changing at all
+	{ 8, HISTORY, 0, 0 },
+	{ 8, HISTORY, 16, 4 },
+	// Change masks of one, two and four bytes
+	{ 1, HISTORY, 64, 0 },
+	{ 9, HISTORY, 32, 0 },
+	{ 32, HISTORY, 8, 0 },
+	{ 32, 2000, 256, 0 },
+};
+
+static void TestRoundTrip(void)
+{
+	static SNAPSHOT_STREAM stream;
+	static unsigned char capture[SNAPSHOT_STREAM_CAPTURE_SIZE];
+	const ROUND_TRIP_CASE *c;
+	unsigned long long time;
+	unsigned int seed = 7, i, j, length, blocks, offset, sequence = 0;
+	unsigned char values[SNAPSHOT_STREAM_REGISTERS_MAX];
+	COLLECT collect;
+	int decoded;
+
+	for (i = 0; i < sizeof(RoundTripCases) / sizeof(RoundTripCases[0]); i++) {
+		c = &RoundTripCases[i];
+		SnapshotStreamInitialize(&stream, c->Registers);
+		memset(values, 0, sizeof(values));
+		time = 0;
+
+		for (j = 0; j < c->Snapshots; j++) {
+			for (length = 0; length < c->Registers; length++) {
+				seed = seed * 1103515245 + 12345;
+				if ((seed >> 16) % 256 < c->ChangeChance)
+					values[length] = (unsigned char)(seed >> 8);
+			}
+
+			// Interrupts from microseconds to minutes apart, in 100 ns units
+			seed = seed * 1103515245 + 12345;
+			if ((seed >> 16) % 256 < c->BackwardsChance)
+				time /= 2;
+			else
+				time += 1ULL << ((seed >> 16) % 30);
+
+			History[j].Time = time;
+			memcpy(History[j].Values, values, c->Registers);
+			SnapshotStreamAppend(&stream, time, values);
+		}
+
+		CHECK_EQUAL(stream.Snapshots, c->Snapshots);
+		CHECK_EQUAL(stream.RawBytes, (unsigned long long)c->Snapshots * (c->Registers + 8));
+
+		// The whole ring fits the capture size the driver hands out
+		length = SnapshotStreamCopy(&stream, capture, sizeof(capture));
+		CHECK(length <= SNAPSHOT_STREAM_CAPTURE_SIZE);
+
+		// Every block header in order, sequence numbers rising by one
+		for (blocks = 0, offset = 0; offset + SNAPSHOT_STREAM_BLOCK_HEADER <= length; blocks++) {
+			if (blocks)
+				CHECK_EQUAL(capture[offset] | capture[offset + 1] << 8, sequence + 1);
+			sequence = capture[offset] | capture[offset + 1] << 8;
+			CHECK_EQUAL(capture[offset + SNAPSHOT_STREAM_BLOCK_HEADER], SNAPSHOT_STREAM_KEY);
+			offset += SNAPSHOT_STREAM_BLOCK_HEADER + (capture[offset + 4] | capture[offset + 5] << 8);
+		}
+		CHECK_EQUAL(offset, length);
+		CHECK_EQUAL(blocks, stream.Filled);
+
+		// The newest snapshots, exactly as appended, and all of them until the ring wrapped
+		decoded = SnapshotStreamDecode(capture, length, NULL, NULL);
+		CHECK(decoded > 0);
+		if (stream.Filled < SNAPSHOT_STREAM_BLOCKS)
+			CHECK_EQUAL(decoded, c->Snapshots);
+
+		memset(&collect, 0, sizeof(collect));
+		collect.Registers = c->Registers;
+		collect.Next = c->Snapshots - (unsigned int)decoded;
+		CHECK_EQUAL(SnapshotStreamDecode(capture, length, Collect, &collect), decoded);
+		CHECK_EQUAL(collect.Mismatches, 0);
+		CHECK_EQUAL(collect.Next, c->Snapshots);
+		CHECK(collect.Keyframes >= blocks);
+		if (stream.Filled < SNAPSHOT_STREAM_BLOCKS)
+			CHECK_EQUAL(collect.Keyframes, stream.Keyframes);
+	}
+
+	// More registers than a change mask holds are cut to the most it does
+	SnapshotStreamInitialize(&stream, SNAPSHOT_STREAM_REGISTERS_MAX + 8);
+	CHECK_EQUAL(stream.Registers, SNAPSHOT_STREAM_REGISTERS_MAX);
+}
+
+static void TestShortCopy(void)
+{
+	static SNAPSHOT_STREAM stream;
+	static unsigned char capture[SNAPSHOT_STREAM_CAPTURE_SIZE];
+	unsigned char values[8];
+	unsigned int i, length, newest, size;
+	int previous = 0, decoded;
+	COLLECT collect;
+
+	SnapshotStreamInitialize(&stream, 8);
+	for (i = 0; i < 5000; i++) {
+		memset(values, 0, sizeof(values));
+		values[2] = (unsigned char)(i & 3);
+		values[4] = (unsigned char)(i / 7);
+		History[i].Time = 1000 + i * 10000ULL;
+		memcpy(History[i].Values, values, 8);
+		SnapshotStreamAppend(&stream, History[i].Time, values);
+	}
+	CHECK_EQUAL(stream.Filled, SNAPSHOT_STREAM_BLOCKS);
+
+	// Less than the newest block, nothing
+	newest = SNAPSHOT_STREAM_BLOCK_HEADER + stream.Used[stream.Block];
+	CHECK_EQUAL(SnapshotStreamCopy(&stream, capture, newest - 1), 0);
+	CHECK_EQUAL(SnapshotStreamCopy(&stream, capture, 0), 0);
+
+	// Growing buffers hold more of the newest snapshots, always ending with the last one appended
+	for (size = newest; size <= sizeof(capture); size += 97) {
+		length = SnapshotStreamCopy(&stream, capture, size);
+		CHECK(length <= size);
+		CHECK(length > 0);
+
+		decoded = SnapshotStreamDecode(capture, length, NULL, NULL);
+		CHECK(decoded >= previous);
+		previous = decoded;
+
+		memset(&collect, 0, sizeof(collect));
+		collect.Registers = 8;
+		collect.Next = 5000 - (unsigned int)decoded;
+		SnapshotStreamDecode(capture, length, Collect, &collect);
+		CHECK_EQUAL(collect.Mismatches, 0);
+	}
+}
+
+typedef struct _MALFORMED_CASE
+{
+	unsigned char Capture[24];
+	unsigned int Length;
+	int Expected;
+} MALFORMED_CASE;
+
+static const MALFORMED_CASE MalformedCases[] = {
+	// Well formed: a keyframe and a delta of two registers
+	{ { 0, 0, 0, 0, 8, 0, 2, 1, 0x01, 0x05, 0xAA, 0xBB, 0x02, 0x03, 0x02, 0xCC }, 16, 2 },
+	// An empty block is allowed
+	{ { 0, 0, 0, 0, 0, 0, 2, 1 }, 8, 0 },
+	// Header cut short
+	{ { 0, 0, 0, 0, 7, 0, 2 }, 7, -1 },
+	// Version, register count, record bytes past the end
+	{ { 0, 0, 0, 0, 4, 0, 2, 2, 0x01, 0x05, 0xAA, 0xBB }, 12, -1 },
+	{ { 0, 0, 0, 0, 4, 0, 33, 1, 0x01, 0x05, 0xAA, 0xBB }, 12, -1 },
+	{ { 0, 0, 0, 0, 5, 0, 2, 1, 0x01, 0x05, 0xAA, 0xBB }, 12, -1 },
+	// A delta with no keyframe before it in the block
+	{ { 0, 0, 0, 0, 4, 0, 2, 1, 0x02, 0x05, 0x01, 0xAA }, 12, -1 },
+	// Unknown record type
+	{ { 0, 0, 0, 0, 4, 0, 2, 1, 0x03, 0x05, 0xAA, 0xBB }, 12, -1 },
+	// A time that never ends, and one running into the end of the block
+	{ { 0, 0, 0, 0, 4, 0, 2, 1, 0x01, 0x85, 0x80, 0x80 }, 12, -1 },
+	{ { 0, 0, 0, 0, 12, 0, 2, 1, 0x01, 0x85, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 }, 20, -1 },
+	// Keyframe missing a register
+	{ { 0, 0, 0, 0, 3, 0, 2, 1, 0x01, 0x05, 0xAA }, 11, -1 },
+	// Delta missing its mask, or a value its mask promises
+	{ { 0, 0, 0, 0, 6, 0, 2, 1, 0x01, 0x05, 0xAA, 0xBB, 0x02, 0x03 }, 14, -1 },
+	{ { 0, 0, 0, 0, 8, 0, 2, 1, 0x01, 0x05, 0xAA, 0xBB, 0x02, 0x03, 0x03, 0xCC }, 16, -1 },
+	// A good block followed by a bad one
+	{ { 0, 0, 0, 0, 0, 0, 2, 1, 1, 0, 0, 0, 0, 0, 2, 9 }, 16, -1 },
+};
+
+static void TestMalformed(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(MalformedCases) / sizeof(MalformedCases[0]); i++)
+		CHECK_EQUAL(SnapshotStreamDecode(MalformedCases[i].Capture, MalformedCases[i].Length, NULL, NULL), MalformedCases[i].Expected);
+}
+
+int main(void)
+{
+	TestFormat();
+	TestRoundTrip();
+	TestShortCopy();
+	TestMalformed();
+
+	return TestExit("SnapshotStreamTest");
+}
@@ -0,0 +1,576 @@
+/*++
+
+Module Name:
+
+    spibustest.c
+
+Abstract:
+
+    Tests for the SPI bus owner's queue in spibus.c. Scripted cases pin
+    down the order transfers run in, which reads are merged and the
+    accounting. The stress test runs one owner thread, as
+    LumiaUSBCBusThread does, against many producer threads submitting
+    at once, and checks every request came back exactly once with the
+    right data.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "Test.h"
+#include "SpiBus.h"
+
+#define SIM_REGISTERS 256
+// Reads return a value derived from the register and mode, so a read merged wrongly shows
+#define SIM_CONSTANT_LAST 63
+#define SIM_FIFO 64
+// Producer p owns register SIM_OWNED + p
+#define SIM_OWNED 128
+
+#define SIM_VALUE(reg, mode) ((unsigned char)(((reg) * 7 + 3) ^ ((mode) ? 0xFF : 0)))
+
+typedef struct _TRANSFER
+{
+	int Mode;
+	int Register;
+	unsigned int Length;
+	int Write;
+} TRANSFER;
+
+#define MAX_TRANSFERS 8
+
+typedef struct _SIM_BUS
+{
+	unsigned char Registers[SIM_REGISTERS];
+
+	unsigned long long NowUs;
+	unsigned int TransferUs;
+	// The next this many transfers fail
+	unsigned int FailTransfers;
+
+	TRANSFER Log[MAX_TRANSFERS];
+	unsigned long Transfers;
+	unsigned long FifoBytes;
+	unsigned long Oversized;
+	unsigned long Completions;
+} SIM_BUS;
+
+static int SimTransfer(void *context, int mode, int reg, unsigned char *data, unsigned int length, int write)
+{
+	SIM_BUS *sim = (SIM_BUS *)context;
+	unsigned int i;
+
+	if (sim->Transfers < MAX_TRANSFERS) {
+		sim->Log[sim->Transfers].Mode = mode;
+		sim->Log[sim->Transfers].Register = reg;
+		sim->Log[sim->Transfers].Length = length;
+		sim->Log[sim->Transfers].Write = write;
+	}
+	sim->Transfers++;
+	sim->NowUs += sim->TransferUs;
+
+	if (length > SPI_BUS_MERGE_MAX && !write)
+		sim->Oversized++;
+
+	if (sim->FailTransfers) {
+		sim->FailTransfers--;
+		return 0;
+	}
+
+	for (i = 0; i < length; i++) {
+		if (reg == SIM_FIFO) {
+			if (!write)
+				data[i] = (unsigned char)sim->FifoBytes++;
+		}
+		else if (write)
+			sim->Registers[reg + i] = data[i];
+		else if (reg + (int)i <= SIM_CONSTANT_LAST)
+			data[i] = SIM_VALUE(reg + (int)i, mode);
+		else
+			data[i] = sim->Registers[reg + i];
+	}
+
+	return 1;
+}
+
+static void SimComplete(void *context, SPI_BUS_REQUEST *request)
+{
+	(void)request;
+	((SIM_BUS *)context)->Completions++;
+}
+
+static unsigned long long SimNow(void *context)
+{
+	return ((SIM_BUS *)context)->NowUs;
+}
+
+static const SPI_BUS_OPS SimOps = { SimTransfer, SimComplete, SimNow };
+
+typedef struct _QUEUED
+{
+	int Register;
+	unsigned int Length;
+	int Write;
+	int Mode;
+	unsigned int Flags;
+} QUEUED;
+
+typedef struct _MERGE_CASE
+{
+	QUEUED Queued[4];
+	unsigned int Count;
+	TRANSFER Expected[4];
+	unsigned int Transfers;
+} MERGE_CASE;
+
+static const MERGE_CASE MergeCases[] = {
+	// Overlapping and touching reads go out as one
+	{ { { 4, 1, 0, 0, 0 }, { 5, 1, 0, 0, 0 }, { 6, 2, 0, 0, 0 } }, 3, { { 0, 4, 4, 0 } }, 1 },
+	{ { { 4, 3, 0, 0, 0 }, { 5, 1, 0, 0, 0 } }, 2, { { 0, 4, 3, 0 } }, 1 },
+	// A gap keeps them apart
+	{ { { 4, 1, 0, 0, 0 }, { 9, 1, 0, 0, 0 } }, 2, { { 0, 4, 1, 0 }, { 0, 9, 1, 0 } }, 2 },
+	// Reads further back are pulled forward past ones that do not fit
+	{ { { 4, 1, 0, 0, 0 }, { 10, 1, 0, 0, 0 }, { 5, 1, 0, 0, 0 } }, 3, { { 0, 4, 2, 0 }, { 0, 10, 1, 0 } }, 2 },
+	// A read that only touches once the span has grown is picked up on the next pass
+	{ { { 4, 1, 0, 0, 0 }, { 6, 1, 0, 0, 0 }, { 5, 1, 0, 0, 0 } }, 3, { { 0, 4, 3, 0 } }, 1 },
+	// A queued write is a barrier
+	{ { { 4, 1, 0, 0, 0 }, { 40, 1, 1, 0, 0 }, { 5, 1, 0, 0, 0 } }, 3, { { 0, 4, 1, 0 }, { 0, 40, 1, 1 }, { 0, 5, 1, 0 } }, 3 },
+	// Writes are never merged, the reads behind one are
+	{ { { 4, 1, 1, 0, 0 }, { 4, 1, 0, 0, 0 }, { 5, 1, 0, 0, 0 } }, 3, { { 0, 4, 1, 1 }, { 0, 4, 2, 0 } }, 2 },
+	// Registers with read side effects, other modes and over-long spans stay apart
+	{ { { SIM_FIFO - 1, 1, 0, 0, 0 }, { SIM_FIFO, 1, 0, 0, SPI_BUS_REQUEST_NO_MERGE } }, 2,
+		{ { 0, SIM_FIFO - 1, 1, 0 }, { 0, SIM_FIFO, 1, 0 } }, 2 },
+	{ { { SIM_FIFO, 1, 0, 0, SPI_BUS_REQUEST_NO_MERGE }, { SIM_FIFO, 1, 0, 0, SPI_BUS_REQUEST_NO_MERGE } }, 2,
+		{ { 0, SIM_FIFO, 1, 0 }, { 0, SIM_FIFO, 1, 0 } }, 2 },
+	{ { { 4, 1, 0, 0, 0 }, { 5, 1, 0, 1, 0 } }, 2, { { 0, 4, 1, 0 }, { 1, 5, 1, 0 } }, 2 },
+	{ { { 0, 10, 0, 0, 0 }, { 10, 8, 0, 0, 0 } }, 2, { { 0, 0, 10, 0 }, { 0, 10, 8, 0 } }, 2 },
+	{ { { 0, 10, 0, 0, 0 }, { 10, 6, 0, 0, 0 } }, 2, { { 0, 0, 16, 0 } }, 1 },
+};
+
+static void TestMerging(void)
+{
+	const MERGE_CASE *c;
+	SIM_BUS sim;
+	SPI_BUS bus;
+	SPI_BUS_REQUEST requests[4];
+	unsigned char data[4][16];
+	unsigned int i, j, completed;
+
+	for (i = 0; i < sizeof(MergeCases) / sizeof(MergeCases[0]); i++) {
+		c = &MergeCases[i];
+
+		memset(&sim, 0, sizeof(sim));
+		memset(requests, 0, sizeof(requests));
+		memset(data, 0, sizeof(data));
+		SpiBusInitialize(&bus);
+
+		for (j = 0; j < c->Count; j++) {
+			requests[j].Priority = SpiBusPriorityControl;
+			requests[j].Register = c->Queued[j].Register;
+			requests[j].Length = c->Queued[j].Length;
+			requests[j].Write = c->Queued[j].Write;
+			requests[j].Mode = c->Queued[j].Mode;
+			requests[j].Flags = c->Queued[j].Flags;
+			requests[j].Data = data[j];
+			data[j][0] = 0xEE;
+			SpiBusSubmit(&bus, &requests[j], 1, 0);
+		}
+
+		for (completed = 0; SpiBusRun(&bus, &SimOps, &sim); completed++);
+
+		CHECK_EQUAL(completed, c->Transfers);
+		CHECK_EQUAL(sim.Transfers, c->Transfers);
+		CHECK_EQUAL(bus.Transactions, c->Transfers);
+		CHECK_EQUAL(bus.MergedReads, c->Count - c->Transfers);
+		CHECK_EQUAL(sim.Completions, c->Count);
+		CHECK_EQUAL(bus.Depth, 0);
+
+		for (j = 0; j < c->Transfers; j++) {
+			CHECK_EQUAL(sim.Log[j].Mode, c->Expected[j].Mode);
+			CHECK_EQUAL(sim.Log[j].Register, c->Expected[j].Register);
+			CHECK_EQUAL(sim.Log[j].Length, c->Expected[j].Length);
+			CHECK_EQUAL(sim.Log[j].Write, c->Expected[j].Write);
+		}
+
+		// Every read got its own bytes out of the merged span
+		for (j = 0; j < c->Count; j++) {
+			CHECK(requests[j].Succeeded);
+			if (!requests[j].Write && requests[j].Register <= SIM_CONSTANT_LAST)
+				CHECK_EQUAL(data[j][requests[j].Length - 1],
+					SIM_VALUE(requests[j].Register + (int)requests[j].Length - 1, requests[j].Mode));
+		}
+	}
+}
+
+static void TestPriorityAndAccounting(void)
+{
+	SIM_BUS sim;
+	SPI_BUS bus;
+	SPI_BUS_REQUEST requests[6];
+	unsigned char data[6];
+	unsigned int i;
+
+	memset(&sim, 0, sizeof(sim));
+	memset(requests, 0, sizeof(requests));
+	memset(data, 0, sizeof(data));
+	SpiBusInitialize(&bus);
+	sim.TransferUs = 10;
+
+	// Queued lowest class first, far apart so nothing merges
+	for (i = 0; i < 6; i++) {
+		requests[i].Priority = (SPI_BUS_PRIORITY)(SpiBusPriorityDiagnostic - i / 2);
+		requests[i].Register = (int)i * 8;
+		requests[i].Data = &data[i];
+		requests[i].Length = 1;
+		requests[i].Write = 1;
+	}
+
+	// Only a submit that finds its class empty asks for the owner to be woken
+	CHECK_EQUAL(SpiBusSubmit(&bus, &requests[0], 1, 0), 1);
+	CHECK_EQUAL(SpiBusSubmit(&bus, &requests[1], 1, 0), 0);
+	CHECK_EQUAL(SpiBusSubmit(&bus, &requests[2], 2, 0), 1);
+	CHECK_EQUAL(SpiBusSubmit(&bus, &requests[4], 2, 0), 1);
+	CHECK_EQUAL(SpiBusSubmit(&bus, NULL, 0, 0), 0);
+
+	for (i = 0; i < 6; i++)
+		CHECK_EQUAL(SpiBusRun(&bus, &SimOps, &sim), 1);
+	CHECK_EQUAL(SpiBusRun(&bus, &SimOps, &sim), 0);
+
+	// Interrupt, control, diagnostic, each class in the order it was queued
+	CHECK_EQUAL(sim.Log[0].Register, 32);
+	CHECK_EQUAL(sim.Log[1].Register, 40);
+	CHECK_EQUAL(sim.Log[2].Register, 16);
+	CHECK_EQUAL(sim.Log[3].Register, 24);
+	CHECK_EQUAL(sim.Log[4].Register, 0);
+	CHECK_EQUAL(sim.Log[5].Register, 8);
+
+	CHECK_EQUAL(bus.Requests, 6);
+	CHECK_EQUAL(bus.MaxDepth, 6);
+	CHECK_EQUAL(bus.Depth, 0);
+	CHECK_EQUAL(bus.Completed[SpiBusPriorityInterrupt], 2);
+	CHECK_EQUAL(bus.Completed[SpiBusPriorityDiagnostic], 2);
+
+	// Everything was queued at zero and each transfer takes 10 us
+	CHECK_EQUAL(bus.WaitUs[SpiBusPriorityInterrupt], 0 + 10);
+	CHECK_EQUAL(bus.WaitUs[SpiBusPriorityControl], 20 + 30);
+	CHECK_EQUAL(bus.WaitUs[SpiBusPriorityDiagnostic], 40 + 50);
+	CHECK_EQUAL(bus.MaxWaitUs[SpiBusPriorityDiagnostic], 50);
+	CHECK_EQUAL(SpiBusAverageWaitUs(&bus, SpiBusPriorityControl), 25);
+
+	// A failed transfer fails every request it covered, and nothing else
+	memset(&sim, 0, sizeof(sim));
+	SpiBusInitialize(&bus);
+	for (i = 0; i < 3; i++) {
+		requests[i].Priority = SpiBusPriorityInterrupt;
+		requests[i].Register = 4 + (int)i;
+		requests[i].Write = 0;
+	}
+	requests[3].Priority = SpiBusPriorityInterrupt;
+	requests[3].Register = 20;
+	requests[3].Write = 0;
+	SpiBusSubmit(&bus, requests, 4, 0);
+
+	sim.FailTransfers = 1;
+	CHECK_EQUAL(SpiBusRun(&bus, &SimOps, &sim), 3);
+	CHECK_EQUAL(SpiBusRun(&bus, &SimOps, &sim), 1);
+	CHECK(!requests[0].Succeeded && !requests[1].Succeeded && !requests[2].Succeeded);
+	CHECK(requests[3].Succeeded);
+	CHECK_EQUAL(bus.Failures, 1);
+	CHECK_EQUAL(bus.MergedReads, 2);
+}
+
+#define STRESS_BATCHES 2000
+#define MAX_PRODUCERS 64
+
+typedef struct _STRESS
+{
+	SPI_BUS Bus;
+	SIM_BUS Sim;
+
+	// The driver's BusWake event
+	pthread_mutex_t Lock;
+	pthread_cond_t Wake;
+	int Woken;
+	int Stop;
+
+	pthread_t OwnerThread;
+	// Work found after a wait that timed out rather than being woken
+	unsigned long MissedWakes;
+	unsigned long WrongThread;
+} STRESS;
+
+typedef struct _PRODUCER
+{
+	STRESS *Stress;
+	unsigned int Index;
+
+	pthread_mutex_t Lock;
+	pthread_cond_t Done;
+	int Remaining;
+
+	unsigned long Submitted;
+	unsigned long FifoBytes;
+	unsigned long Errors;
+} PRODUCER;
+
+static int StressTransfer(void *context, int mode, int reg, unsigned char *data, unsigned int length, int write)
+{
+	STRESS *stress = (STRESS *)context;
+
+	if (!pthread_equal(pthread_self(), stress->OwnerThread))
+		stress->WrongThread++;
+
+	return SimTransfer(&stress->Sim, mode, reg, data, length, write);
+}
+
+static void StressComplete(void *context, SPI_BUS_REQUEST *request)
+{
+	PRODUCER *producer = (PRODUCER *)request->Owner;
+
+	((STRESS *)context)->Sim.Completions++;
+
+	pthread_mutex_lock(&producer->Lock);
+	if (--producer->Remaining == 0)
+		pthread_cond_signal(&producer->Done);
+	pthread_mutex_unlock(&producer->Lock);
+}
+
+static unsigned long long StressNow(void *context)
+{
+	struct timespec now;
+
+	(void)context;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static const SPI_BUS_OPS StressOps = { StressTransfer, StressComplete, StressNow };
+
+//
+// LumiaUSBCBusThread, with a timed wait so a lost wake-up shows as a count rather than a hang
+//
+static void *StressOwner(void *context)
+{
+	STRESS *stress = (STRESS *)context;
+	struct timespec deadline;
+	int woken, ran;
+
+	for (;;) {
+		pthread_mutex_lock(&stress->Lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 50 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!stress->Woken && !stress->Stop)
+			if (pthread_cond_timedwait(&stress->Wake, &stress->Lock, &deadline))
+				break;
+		woken = stress->Woken || stress->Stop;
+		stress->Woken = 0;
+		pthread_mutex_unlock(&stress->Lock);
+
+		for (ran = 0; SpiBusRun(&stress->Bus, &StressOps, stress); ran++);
+		if (ran && !woken)
+			stress->MissedWakes++;
+
+		if (stress->Stop && !ran)
+			break;
+	}
+
+	return NULL;
+}
+
+//
+// LumiaUSBCBusSubmit
+//
+static void StressSubmit(PRODUCER *producer, SPI_BUS_REQUEST *requests, unsigned int count)
+{
+	STRESS *stress = producer->Stress;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		requests[i].Owner = producer;
+	producer->Remaining = (int)count;
+	producer->Submitted += count;
+
+	if (SpiBusSubmit(&stress->Bus, requests, count, StressNow(NULL))) {
+		pthread_mutex_lock(&stress->Lock);
+		stress->Woken = 1;
+		pthread_cond_signal(&stress->Wake);
+		pthread_mutex_unlock(&stress->Lock);
+	}
+
+	pthread_mutex_lock(&producer->Lock);
+	while (producer->Remaining)
+		pthread_cond_wait(&producer->Done, &producer->Lock);
+	pthread_mutex_unlock(&producer->Lock);
+}
+
+//
+// Batches of up to four requests in one class: constant reads the owner
+// may merge, FIFO reads it must not, and a write to the producer's own
+// register read straight back
+//
+static void *StressProducer(void *context)
+{
+	PRODUCER *producer = (PRODUCER *)context;
+	SPI_BUS_REQUEST requests[4];
+	unsigned char data[4][4], expected[4];
+	unsigned int seed = producer->Index * 2654435761U + 1, batch, count, i, j;
+	int owned = SIM_OWNED + (int)producer->Index;
+
+	for (batch = 0; batch < STRESS_BATCHES; batch++) {
+		seed = seed * 1103515245 + 12345;
+		count = 1 + (seed >> 16) % 4;
+
+		memset(requests, 0, sizeof(requests));
+		for (i = 0; i < count; i++) {
+			seed = seed * 1103515245 + 12345;
+			requests[i].Priority = (SPI_BUS_PRIORITY)(batch % SpiBusPriorityCount);
+			requests[i].Data = data[i];
+
+			switch ((seed >> 16) % 4) {
+			case 0:
+				requests[i].Flags = SPI_BUS_REQUEST_NO_MERGE;
+				requests[i].Register = SIM_FIFO;
+				requests[i].Length = 1 + (seed >> 20) % 2;
+				producer->FifoBytes += requests[i].Length;
+				break;
+			case 1:
+				if (i + 1 < count) {
+					data[i][0] = (unsigned char)(seed >> 8);
+					requests[i].Register = owned;
+					requests[i].Length = 1;
+					requests[i].Write = 1;
+					requests[++i].Priority = requests[0].Priority;
+					requests[i].Data = data[i];
+					requests[i].Register = owned;
+					requests[i].Length = 1;
+					expected[i] = data[i - 1][0];
+					break;
+				}
+				// No room to read it back
+				// Fall through
+			default:
+				requests[i].Register = (int)((seed >> 20) % (SIM_CONSTANT_LAST - 3));
+				requests[i].Length = 1 + (seed >> 26) % 3;
+				requests[i].Mode = (int)((seed >> 29) & 1);
+				break;
+			}
+		}
+
+		StressSubmit(producer, requests, count);
+
+		for (i = 0; i < count; i++) {
+			if (!requests[i].Succeeded) {
+				producer->Errors++;
+				continue;
+			}
+			if (requests[i].Write || requests[i].Register == SIM_FIFO)
+				continue;
+
+			if (requests[i].Register == owned) {
+				if (data[i][0] != expected[i])
+					producer->Errors++;
+				continue;
+			}
+
+			for (j = 0; j < requests[i].Length; j++)
+				if (data[i][j] != SIM_VALUE(requests[i].Register + (int)j, requests[i].Mode))
+					producer->Errors++;
+		}
+	}
+
+	return NULL;
+}
+
+static STRESS Stress;
+static PRODUCER Producers[MAX_PRODUCERS];
+
+static void RunStress(unsigned int count)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	unsigned long submitted = 0, fifoBytes = 0, errors = 0, completed = 0;
+	unsigned int i;
+
+	memset(&Stress, 0, sizeof(Stress));
+	SpiBusInitialize(&Stress.Bus);
+	pthread_mutex_init(&Stress.Lock, NULL);
+	pthread_cond_init(&Stress.Wake, NULL);
+	pthread_create(&Stress.OwnerThread, NULL, StressOwner, &Stress);
+
+	for (i = 0; i < count; i++) {
+		memset(&Producers[i], 0, sizeof(Producers[i]));
+		Producers[i].Stress = &Stress;
+		Producers[i].Index = i;
+		pthread_mutex_init(&Producers[i].Lock, NULL);
+		pthread_cond_init(&Producers[i].Done, NULL);
+		pthread_create(&threads[i], NULL, StressProducer, &Producers[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+		submitted += Producers[i].Submitted;
+		fifoBytes += Producers[i].FifoBytes;
+		errors += Producers[i].Errors;
+		pthread_cond_destroy(&Producers[i].Done);
+		pthread_mutex_destroy(&Producers[i].Lock);
+	}
+
+	pthread_mutex_lock(&Stress.Lock);
+	Stress.Stop = 1;
+	pthread_cond_signal(&Stress.Wake);
+	pthread_mutex_unlock(&Stress.Lock);
+	pthread_join(Stress.OwnerThread, NULL);
+
+	for (i = 0; i < SpiBusPriorityCount; i++)
+		completed += Stress.Bus.Completed[i];
+
+	// Every request ran once, on the owner, with the data its producer expected
+	CHECK_EQUAL(errors, 0);
+	CHECK_EQUAL(Stress.WrongThread, 0);
+	CHECK_EQUAL(Stress.MissedWakes, 0);
+	CHECK_EQUAL(Stress.Bus.Requests, submitted);
+	CHECK_EQUAL(completed, submitted);
+	CHECK_EQUAL(Stress.Sim.Completions, submitted);
+	CHECK_EQUAL(Stress.Bus.Depth, 0);
+	CHECK_EQUAL(Stress.Bus.Failures, 0);
+
+	// Each transfer covered one request plus the reads merged into it, FIFO reads never merged
+	CHECK_EQUAL(Stress.Sim.Transfers, Stress.Bus.Transactions);
+	CHECK_EQUAL(Stress.Bus.Transactions + Stress.Bus.MergedReads, submitted);
+	CHECK_EQUAL(Stress.Sim.FifoBytes, fifoBytes);
+	CHECK_EQUAL(Stress.Sim.Oversized, 0);
+
+	// Nobody has more than one batch in flight
+	CHECK(Stress.Bus.MaxDepth <= 4 * count);
+	if (count > 1)
+		CHECK(Stress.Bus.MaxDepth > 1);
+
+	pthread_cond_destroy(&Stress.Wake);
+	pthread_mutex_destroy(&Stress.Lock);
+}
+
+static void TestStress(void)
+{
+	static const unsigned int producers[] = { 1, 4, 16, MAX_PRODUCERS };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(producers) / sizeof(producers[0]); i++)
+		RunStress(producers[i]);
+}
+
+int main(void)
+{
+	TestMerging();
+	TestPriorityAndAccounting();
+	TestStress();
+
+	return TestExit("SpiBusTest");
+}
@@ -0,0 +1,51 @@
+/*++
+
+Module Name:
+
+    test.h
+
+Abstract:
+
+    Checks shared by the host tests. A failed check prints where it is
+    and the test carries on, so one run shows every failure. TestExit
+    prints the totals and gives the exit status make goes by.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include <stdio.h>
+
+static unsigned int TestChecks;
+static unsigned int TestFailures;
+
+#define CHECK(condition) \
+	do { \
+		TestChecks++; \
+		if (!(condition)) { \
+			TestFailures++; \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+		} \
+	} while (0)
+
+// Prints both sides when they differ, for integers of any type
+#define CHECK_EQUAL(actual, expected) \
+	do { \
+		long long actualValue = (long long)(actual), expectedValue = (long long)(expected); \
+		TestChecks++; \
+		if (actualValue != expectedValue) { \
+			TestFailures++; \
+			fprintf(stderr, "%s:%d: check failed: %s is %lld, expected %s = %lld\n", \
+				__FILE__, __LINE__, #actual, actualValue, #expected, expectedValue); \
+		} \
+	} while (0)
+
+static int TestExit(const char *name)
+{
+	printf("%-20s %5u checks, %u failed\n", name, TestChecks, TestFailures);
+	return TestFailures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/*++
+
+Module Name:
+
+    tracebench.c
+
+Abstract:
+
+    Measures what the UC120 interrupt work item spends on logging, with
+    the trace backend stubbed out. "Before" is the DbgPrint path the
+    work item used to take, copied from the work item as it was: both
+    register dumps formatted with swprintf and again by DbgPrint on
+    every interrupt. "After" is the driver's interrupttrace.c built
+    against the WPP stand-in in Wpp/, so it runs the shipped call sites
+    and the enabled check from trace.h: once with TRACE_LEVEL_VERBOSE
+    off, which is the in-flight recorder's default, once with a session
+    recording it, and once with a session that wants other flags. The
+    stand-in reads argument types off the format string where WPP knows
+    them at build time, so the recording figure is on the high side.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <ntddk.h>
+#include "Uc120.h"
+#include "InterruptTrace.h"
+#include "Trace.h"
+#include "InterruptTrace.tmh"
+
+#define INTERRUPTS 1000000
+
+volatile WPP_STUB_CONTROL WppStubControl = { ~0U, TRACE_LEVEL_INFORMATION };
+
+#define TRACE_RING 4096
+
+static const char *TraceRing[TRACE_RING];
+static unsigned int TraceArgs[TRACE_RING];
+static unsigned int TraceHead, TraceArgHead;
+
+//
+// What the WPP recorder does with an enabled message: the message and the
+// raw arguments go into the buffer, nothing is formatted
+//
+void WppStubRecord(const char *format, ...)
+{
+	va_list args;
+	const char *p;
+
+	TraceRing[TraceHead++ % TRACE_RING] = format;
+
+	va_start(args, format);
+	for (p = format; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (p[1] == '%') {
+			p++;
+		}
+		else if (p[1] == '!') {
+			// %!STATUS! and the like take an NTSTATUS
+			for (p += 2; *p && *p != '!'; p++);
+			TraceArgs[TraceArgHead++ % TRACE_RING] = (unsigned int)va_arg(args, NTSTATUS);
+			if (!*p)
+				break;
+		}
+		else {
+			for (p++; *p && strchr("0123456789-+ #.l", *p); p++);
+			TraceArgs[TraceArgHead++ % TRACE_RING] = va_arg(args, unsigned int);
+			if (!*p)
+				break;
+		}
+	}
+	va_end(args);
+}
+
+static char DebugBuffer[512];
+
+//
+// DbgPrint formats whether or not a debugger is attached
+//
+static void DbgPrint(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(DebugBuffer, sizeof(DebugBuffer), format, args);
+	va_end(args);
+}
+
+static unsigned long long NowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//
+// The logging in Uc120InterruptWorkItem before the move to WPP
+//
+static void DumpBefore(const unsigned char *registers, const NTSTATUS *statuses)
+{
+	wchar_t buf[260];
+
+	DbgPrint("Got an interrupt from the UC120!\n");
+
+	swprintf(buf, 260, L"UC120_%02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x", registers[0], registers[1], registers[2], registers[3],
+		registers[4], registers[5], registers[6], registers[7]);
+	DbgPrint("%ls\n", buf);
+
+	swprintf(buf, 260, L"S_UC120_%08x-%08x-%08x-%08x-%08x-%08x-%08x-%08x", statuses[0], statuses[1], statuses[2], statuses[3],
+		statuses[4], statuses[5], statuses[6], statuses[7]);
+	DbgPrint("%ls\n", buf);
+}
+
+//
+// And as it is now, the same calls Uc120InterruptWorkItem makes
+//
+static void DumpAfter(const unsigned char *registers, const NTSTATUS *statuses)
+{
+	LumiaUSBCTraceUc120Interrupt();
+	LumiaUSBCTraceUc120Dump(registers, statuses);
+}
+
+static void Run(const char *name, void (*dump)(const unsigned char *, const NTSTATUS *))
+{
+	unsigned char registers[UC120_SNAPSHOT_COUNT];
+	NTSTATUS statuses[UC120_SNAPSHOT_COUNT];
+	unsigned int i, j, recorded = TraceHead;
+	unsigned long long start, elapsed;
+
+	for (j = 0; j < UC120_SNAPSHOT_COUNT; j++)
+		statuses[j] = j == UC120_SNAPSHOT_CC_STATUS ? STATUS_IO_TIMEOUT : STATUS_SUCCESS;
+
+	start = NowNs();
+	for (i = 0; i < INTERRUPTS; i++) {
+		for (j = 0; j < UC120_SNAPSHOT_COUNT; j++)
+			registers[j] = (unsigned char)(i + j);
+		dump(registers, statuses);
+	}
+	elapsed = NowNs() - start;
+
+	printf("%-28s %8.1f ns per interrupt, %u messages recorded\n", name, (double)elapsed / INTERRUPTS, TraceHead - recorded);
+}
+
+int main(void)
+{
+	printf("TraceBench, %u interrupts\n", INTERRUPTS);
+
+	Run("DbgPrint and swprintf", DumpBefore);
+	WppStubControl.Level = TRACE_LEVEL_INFORMATION;
+	Run("TraceEvents, verbose off", DumpAfter);
+
+	WppStubControl.Level = TRACE_LEVEL_VERBOSE;
+	Run("TraceEvents, recording", DumpAfter);
+
+	// A session that only wants SPI leaves the interrupt flag off
+	WppStubControl.Flags = 1U << WPP_BIT_TRACE_SPI;
+	Run("TraceEvents, other flag", DumpAfter);
+
+	return 0;
+}
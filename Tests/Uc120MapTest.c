@@ -0,0 +1,215 @@
+/*++
+
+Module Name:
+
+    uc120maptest.c
+
+Abstract:
+
+    Tests for the register map in uc120.h and what is generated from it:
+    the register and field constants, the field accessors, the snapshot
+    plan, the cache and FIFO masks, and the tables host tools print
+    from. The checks walk the map itself rather than repeating it, so a
+    register added to the map is covered without touching this file.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "Public.h"
+#include "Uc120.h"
+
+#define MAP_SIZE(table) (sizeof(table) / sizeof((table)[0]))
+
+//
+// The same lists the driver is generated from, expanded here a second way
+//
+typedef struct _ACCESSOR
+{
+	unsigned int (*Get)(unsigned char value);
+	unsigned char Mask;
+	const char *Name;
+} ACCESSOR;
+
+#define ACCESSOR_ENTRY(reg, name, mask) { Uc120Get_##name, (mask), #name },
+static const ACCESSOR Accessors[] = { UC120_FIELDS(ACCESSOR_ENTRY) };
+#undef ACCESSOR_ENTRY
+
+#define REGISTER_ONE(name, address, width, access, flags) + 1
+enum { REGISTER_COUNT = 0 UC120_REGISTERS(REGISTER_ONE) };
+#undef REGISTER_ONE
+
+#define SNAPSHOT_NAME(name) #name,
+static const char *SnapshotNames[] = { UC120_SNAPSHOT(SNAPSHOT_NAME) };
+#undef SNAPSHOT_NAME
+
+static void TestRegisters(void)
+{
+	const UC120_REGISTER_INFO *info, *previous = NULL;
+	unsigned int i;
+	int reg;
+
+	CHECK_EQUAL(Uc120RegisterMapCount, REGISTER_COUNT);
+
+	// In address order, apart, and inside the 32 bits the register masks cover
+	for (i = 0; i < Uc120RegisterMapCount; i++) {
+		info = &Uc120RegisterMap[i];
+		CHECK(info->Width >= 1);
+		CHECK(info->Address + info->Width <= 32);
+		CHECK(info->Access <= Uc120AccessWriteClear);
+		CHECK(!(info->Flags & ~(UC120_REG_VOLATILE | UC120_REG_FIFO | UC120_REG_UNVERIFIED)));
+		if (previous)
+			CHECK(info->Address >= previous->Address + previous->Width);
+		previous = info;
+
+		// A FIFO is one address, and a register the chip clears is one the chip changes
+		if (info->Flags & UC120_REG_FIFO)
+			CHECK_EQUAL(info->Width, 1);
+		if (info->Access == Uc120AccessWriteClear)
+			CHECK(info->Flags & UC120_REG_VOLATILE);
+	}
+
+	// Every address finds the register covering it, and only that
+	for (reg = -1; reg < 40; reg++) {
+		for (info = NULL, i = 0; i < Uc120RegisterMapCount; i++) {
+			if (reg >= Uc120RegisterMap[i].Address && reg < Uc120RegisterMap[i].Address + Uc120RegisterMap[i].Width)
+				info = &Uc120RegisterMap[i];
+		}
+		CHECK(Uc120LookupRegister(reg) == info);
+	}
+	CHECK(Uc120LookupRegister(255) == NULL);
+
+	// The numbers Device.c used to spell out before the map, and the names tools print
+	CHECK_EQUAL(UC120_REG_INTERRUPT_STATUS, 2);
+	CHECK_EQUAL(UC120_REG_CONTROL, 4);
+	CHECK_EQUAL(UC120_REG_STATUS, 5);
+	CHECK_EQUAL(UC120_REG_CC_STATUS, 7);
+	CHECK_EQUAL(UC120_REG_MODE, 13);
+	CHECK_EQUAL(UC120_REG_CONFIG_FIRST, 18);
+	CHECK_EQUAL(UC120_REG_CONFIG_LAST, 27);
+	CHECK_EQUAL(UC120_CONFIG_COUNT, 10);
+	CHECK_EQUAL(UC120_STATUS_INTERRUPT_MASK, 0x80);
+	CHECK_EQUAL(UC120_CONTROL_INTERRUPT_ENABLE, 0x01);
+	CHECK(!strcmp(Uc120LookupRegister(UC120_REG_CONFIG_LAST)->Name, "CONFIG"));
+	CHECK(!strcmp(Uc120LookupRegister(UC120_REG_INTERRUPT_STATUS)->Name, "INTERRUPT_STATUS"));
+}
+
+static void TestFields(void)
+{
+	const UC120_REGISTER_INFO *info;
+	unsigned int i, j, value, shift;
+
+	CHECK_EQUAL(MAP_SIZE(Accessors), Uc120FieldMapCount);
+
+	for (i = 0; i < Uc120FieldMapCount && i < MAP_SIZE(Accessors); i++) {
+		// Fields sit in a one byte register that is in the map, and do not overlap
+		info = Uc120LookupRegister(Uc120FieldMap[i].Address);
+		CHECK(info != NULL);
+		if (info) {
+			CHECK_EQUAL(info->Address, Uc120FieldMap[i].Address);
+			CHECK_EQUAL(info->Width, 1);
+		}
+		CHECK(Uc120FieldMap[i].Mask != 0);
+		for (j = 0; j < i; j++) {
+			if (Uc120FieldMap[j].Address == Uc120FieldMap[i].Address)
+				CHECK(!(Uc120FieldMap[j].Mask & Uc120FieldMap[i].Mask));
+		}
+
+		// The tools' table and the accessors describe the same field
+		CHECK_EQUAL(Accessors[i].Mask, Uc120FieldMap[i].Mask);
+		CHECK(!strcmp(Accessors[i].Name, Uc120FieldMap[i].Name));
+
+		// Each accessor is the shifted field, for every register value
+		for (shift = 0; !(Uc120FieldMap[i].Mask & (1U << shift)); shift++);
+		for (value = 0; value < 256; value++) {
+			if (Accessors[i].Get((unsigned char)value) != (value & Uc120FieldMap[i].Mask) >> shift)
+				break;
+		}
+		CHECK_EQUAL(value, 256);
+	}
+
+	CHECK_EQUAL(Uc120Get_CC1(0x0E), 2);
+	CHECK_EQUAL(Uc120Get_CC2(0x0E), 3);
+	CHECK_EQUAL(Uc120Get_STATUS_INTERRUPT_MASK(0x88), 1);
+	CHECK_EQUAL(Uc120Get_INT_PD_HARD_RESET(0xDF), 0);
+}
+
+static void TestSnapshot(void)
+{
+	const UC120_REGISTER_INFO *info;
+	unsigned int i, j;
+
+	// The statistics block and the snapshot stream carry exactly this many
+	CHECK_EQUAL(UC120_SNAPSHOT_COUNT, LUMIAUSBC_SNAPSHOT_REGISTERS);
+	CHECK_EQUAL(MAP_SIZE(SnapshotNames), UC120_SNAPSHOT_COUNT);
+
+	for (i = 0; i < UC120_SNAPSHOT_COUNT; i++) {
+		info = Uc120LookupRegister(Uc120SnapshotRegisters[i]);
+		CHECK(info != NULL);
+		if (!info)
+			continue;
+
+		// Single readable registers, reading them takes nothing away
+		CHECK(!strcmp(info->Name, SnapshotNames[i]));
+		CHECK_EQUAL(info->Address, Uc120SnapshotRegisters[i]);
+		CHECK_EQUAL(info->Width, 1);
+		CHECK(info->Access != Uc120AccessWrite);
+		CHECK(!(info->Flags & UC120_REG_FIFO));
+
+		for (j = 0; j < i; j++)
+			CHECK(Uc120SnapshotRegisters[j] != Uc120SnapshotRegisters[i]);
+	}
+
+	// Indexes used by name in the interrupt work items
+	CHECK_EQUAL(Uc120SnapshotRegisters[UC120_SNAPSHOT_INTERRUPT_STATUS], UC120_REG_INTERRUPT_STATUS);
+	CHECK_EQUAL(Uc120SnapshotRegisters[UC120_SNAPSHOT_STATUS], UC120_REG_STATUS);
+	CHECK_EQUAL(Uc120SnapshotRegisters[UC120_SNAPSHOT_CC_STATUS], UC120_REG_CC_STATUS);
+}
+
+static void TestMasks(void)
+{
+	const UC120_REGISTER_INFO *info;
+	unsigned long cacheable = 0, fifo = 0, span;
+	unsigned int i;
+
+	for (i = 0; i < Uc120RegisterMapCount; i++) {
+		info = &Uc120RegisterMap[i];
+		span = Uc120RegisterSpan(info->Address, info->Width);
+		CHECK_EQUAL(span, UC120_REGISTER_SPAN(info->Address, info->Width));
+
+		if (info->Access == Uc120AccessReadWrite && !(info->Flags & (UC120_REG_VOLATILE | UC120_REG_FIFO)))
+			cacheable |= span;
+		if (info->Flags & UC120_REG_FIFO)
+			fifo |= span;
+	}
+
+	CHECK_EQUAL(UC120_CACHEABLE_REGISTERS, cacheable);
+	CHECK_EQUAL(UC120_FIFO_REGISTERS, fifo);
+	CHECK(!(UC120_CACHEABLE_REGISTERS & UC120_FIFO_REGISTERS));
+
+	// Only what the driver alone writes
+	CHECK_EQUAL(UC120_CACHEABLE_REGISTERS, (1UL << UC120_REG_CONTROL) | (1UL << UC120_REG_MODE) | (0x3FFUL << UC120_REG_CONFIG));
+	CHECK_EQUAL(UC120_FIFO_REGISTERS, (1UL << UC120_REG_PD_TX) | (1UL << UC120_REG_PD_RX));
+
+	CHECK_EQUAL(Uc120RegisterSpan(0, 32), 0xFFFFFFFFUL);
+	CHECK_EQUAL(Uc120RegisterSpan(31, 1), 0x80000000UL);
+	CHECK_EQUAL(Uc120RegisterSpan(30, 4), 0xC0000000UL);
+	CHECK_EQUAL(Uc120RegisterSpan(18, 10), 0x0FFC0000UL);
+	CHECK_EQUAL(Uc120RegisterSpan(5, 0), 0);
+	CHECK_EQUAL(Uc120RegisterSpan(-1, 1), 0);
+	CHECK_EQUAL(Uc120RegisterSpan(32, 1), 0);
+}
+
+int main(void)
+{
+	TestRegisters();
+	TestFields();
+	TestSnapshot();
+	TestMasks();
+
+	return TestExit("Uc120MapTest");
+}
@@ -0,0 +1,436 @@
+/*++
+
+Module Name:
+
+    uc120scripttest.c
+
+Abstract:
+
+    Tests for the register script engine in uc120script.c: which
+    accesses it merges into one burst and which it keeps apart, the
+    waits, failures, the traffic the driver's own scripts cause
+    compared with writing one register at a time, and the reads the
+    register cache saves them.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "FakeUc120.h"
+
+typedef struct _ACCESS
+{
+	int Write;
+	int Register;
+	unsigned int Length;
+} ACCESS;
+
+#define MAX_ACCESSES 8
+
+typedef struct _ACCESS_LOG
+{
+	ACCESS Accesses[MAX_ACCESSES];
+	unsigned int Count;
+} ACCESS_LOG;
+
+static void LogAccess(FAKE_UC120 *chip, int reg, unsigned int length, int write)
+{
+	ACCESS_LOG *log = (ACCESS_LOG *)chip->Context;
+
+	if (log->Count < MAX_ACCESSES) {
+		log->Accesses[log->Count].Write = write;
+		log->Accesses[log->Count].Register = reg;
+		log->Accesses[log->Count].Length = length;
+	}
+	log->Count++;
+}
+
+static void ResetLogged(FAKE_UC120 *chip, ACCESS_LOG *log)
+{
+	FakeUc120Reset(chip);
+	memset(log, 0, sizeof(*log));
+	chip->Access = LogAccess;
+	chip->Context = log;
+}
+
+static const unsigned char Block[] = { 0xA1, 0xA2, 0xA3 };
+
+static const UC120_SCRIPT_OP WriteNeighbours[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_WRITE(UC120_REG_STATUS, 0x22), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP WriteNeighboursReversed[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_STATUS, 0x22), UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP WriteApart[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_WRITE(UC120_REG_MODE, 0x02), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP WriteTwice[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x33), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP WriteFenced[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_FENCE(), UC120_SCRIPT_WRITE(UC120_REG_STATUS, 0x22),
+	UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP WriteDelayed[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_STATUS, 0x22), UC120_SCRIPT_DELAY(5), UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11),
+	UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP ModifyTwice[] = {
+	UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0x10, 0x01), UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0x20, 0x02),
+	UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP ModifyWritten[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0x01, 0x40), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP ModifyWhole[] = {
+	UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0xF0, 0x0F), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP ModifyNeighbours[] = {
+	UC120_SCRIPT_MODIFY(UC120_REG_STATUS, 0x0F, 0), UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0, 0x01), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP ModifyFenced[] = {
+	UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0, 0x01), UC120_SCRIPT_FENCE(), UC120_SCRIPT_MODIFY(UC120_REG_CONTROL, 0, 0x02),
+	UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP BlockAndWrite[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONFIG_FIRST + 3, 0xA4), UC120_SCRIPT_WRITE_BLOCK(UC120_REG_CONFIG_FIRST, Block, 3),
+	UC120_SCRIPT_WRITE(UC120_REG_CONFIG_FIRST + 5, 0xA6), UC120_SCRIPT_END()
+};
+
+typedef struct _MERGE_CASE
+{
+	const UC120_SCRIPT_OP *Script;
+	// Accesses the script spells out, a modify counts its read
+	unsigned int Accesses;
+	ACCESS Expected[4];
+	unsigned int Count;
+	// CONTROL and STATUS afterwards, they start out as 0x30 and 0x0F
+	unsigned char Control;
+	unsigned char Status;
+	unsigned int DelayMs;
+} MERGE_CASE;
+
+static const MERGE_CASE MergeCases[] = {
+	// Neighbours go out together, whichever the script names first
+	{ WriteNeighbours, 2, { { 1, 4, 2 } }, 1, 0x11, 0x22, 0 },
+	{ WriteNeighboursReversed, 2, { { 1, 4, 2 } }, 1, 0x11, 0x22, 0 },
+	{ WriteApart, 2, { { 1, 4, 1 }, { 1, 13, 1 } }, 2, 0x11, 0x0F, 0 },
+	// The last write to a register is the one that reaches it
+	{ WriteTwice, 2, { { 1, 4, 1 } }, 1, 0x33, 0x0F, 0 },
+	// Ordering points keep their sides apart and in order
+	{ WriteFenced, 2, { { 1, 4, 1 }, { 1, 5, 1 } }, 2, 0x11, 0x22, 0 },
+	{ WriteDelayed, 2, { { 1, 5, 1 }, { 1, 4, 1 } }, 2, 0x11, 0x22, 5 },
+	// One read per register however often it is modified
+	{ ModifyTwice, 4, { { 0, 4, 1 }, { 1, 4, 1 } }, 2, 0x03, 0x0F, 0 },
+	// No read when the old value does not matter
+	{ ModifyWritten, 3, { { 1, 4, 1 } }, 1, 0x50, 0x0F, 0 },
+	{ ModifyWhole, 2, { { 1, 4, 1 } }, 1, 0x0F, 0x0F, 0 },
+	// Reads are merged like writes
+	{ ModifyNeighbours, 4, { { 0, 4, 2 }, { 1, 4, 2 } }, 2, 0x31, 0x00, 0 },
+	// A fence between two modifies makes the second read again
+	{ ModifyFenced, 4, { { 0, 4, 1 }, { 1, 4, 1 }, { 0, 4, 1 }, { 1, 4, 1 } }, 4, 0x33, 0x0F, 0 },
+	// Blocks and single writes join into one run
+	{ BlockAndWrite, 5, { { 1, 18, 4 }, { 1, 23, 1 } }, 2, 0x30, 0x0F, 0 },
+};
+
+static void TestMergeRules(void)
+{
+	const MERGE_CASE *c;
+	FAKE_UC120 chip;
+	ACCESS_LOG log;
+	UC120_SCRIPT_RESULT result;
+	unsigned int i, j, bytes;
+
+	for (i = 0; i < sizeof(MergeCases) / sizeof(MergeCases[0]); i++) {
+		c = &MergeCases[i];
+
+		ResetLogged(&chip, &log);
+		chip.Registers[UC120_REG_CONTROL] = 0x30;
+		chip.Registers[UC120_REG_STATUS] = 0x0F;
+
+		CHECK(Uc120ScriptRun(c->Script, &FakeUc120ScriptOps, &chip, &result));
+		CHECK_EQUAL(result.FailedOp, -1);
+		CHECK_EQUAL(result.Accesses, c->Accesses);
+		CHECK_EQUAL(result.Transactions, c->Count);
+		CHECK_EQUAL(log.Count, c->Count);
+
+		for (bytes = 0, j = 0; j < c->Count && j < MAX_ACCESSES; j++) {
+			CHECK_EQUAL(log.Accesses[j].Write, c->Expected[j].Write);
+			CHECK_EQUAL(log.Accesses[j].Register, c->Expected[j].Register);
+			CHECK_EQUAL(log.Accesses[j].Length, c->Expected[j].Length);
+			bytes += c->Expected[j].Length;
+		}
+		CHECK_EQUAL(result.Bytes, bytes);
+
+		CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], c->Control);
+		CHECK_EQUAL(chip.Registers[UC120_REG_STATUS], c->Status);
+		CHECK_EQUAL(chip.DelayMs, c->DelayMs);
+	}
+
+	// Block contents land where they belong, the gap stays untouched
+	ResetLogged(&chip, &log);
+	CHECK(Uc120ScriptRun(BlockAndWrite, &FakeUc120ScriptOps, &chip, &result));
+	CHECK(memcmp(&chip.Registers[UC120_REG_CONFIG_FIRST], Block, sizeof(Block)) == 0);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONFIG_FIRST + 3], 0xA4);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONFIG_FIRST + 4], 0);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONFIG_FIRST + 5], 0xA6);
+}
+
+typedef struct _WAIT_CASE
+{
+	UC120_SCRIPT_OP Wait;
+	// STATUS holds 0x88 but reads zero this many times, and this many reads fail first
+	unsigned int Settling;
+	unsigned int FailTransfers;
+	int Satisfied;
+	unsigned int Polls;
+	unsigned char WaitValue;
+} WAIT_CASE;
+
+static const WAIT_CASE WaitCases[] = {
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 0, 0, 1, 1, 0x88 },
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 2, 0, 1, 3, 0x88 },
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 4, 0, 1, 5, 0x88 },
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 5, 0, 0, 5, 0x00 },
+	{ UC120_SCRIPT_WAIT(UC120_REG_STATUS, 0x80, 0x80, 3, 4), 1, 0, 1, 2, 0x88 },
+	{ UC120_SCRIPT_WAIT(UC120_REG_STATUS, 0x0F, 0x00, 3, 4), 0, 0, 0, 4, 0x88 },
+	// A failed read is a poll that saw nothing
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 0, 2, 1, 3, 0x88 },
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 10, 5), 0, 5, 0, 5, 0x00 },
+	// Without a sleep between polls
+	{ UC120_SCRIPT_WAIT_NOT(UC120_REG_STATUS, 0xFF, 0, 0, 5), 3, 0, 1, 4, 0x88 },
+};
+
+static void TestWaits(void)
+{
+	const WAIT_CASE *c;
+	UC120_SCRIPT_OP script[3];
+	FAKE_UC120 chip;
+	UC120_SCRIPT_RESULT result;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(WaitCases) / sizeof(WaitCases[0]); i++) {
+		c = &WaitCases[i];
+
+		// A write behind the wait shows whether the script went on
+		memset(script, 0, sizeof(script));
+		script[0] = c->Wait;
+		script[1].Type = Uc120ScriptWrite;
+		script[1].Register = UC120_REG_CONTROL;
+		script[1].Mask = 0xFF;
+		script[1].Value = UC120_CONTROL_INIT;
+		script[2].Type = Uc120ScriptEnd;
+
+		FakeUc120Reset(&chip);
+		chip.Registers[UC120_REG_STATUS] = 0x88;
+		chip.Settling = c->Settling;
+		chip.FailTransfers = c->FailTransfers;
+
+		// Every poll is a transaction, with a sleep before all but the first
+		CHECK_EQUAL(Uc120ScriptRun(script, &FakeUc120ScriptOps, &chip, &result), c->Satisfied);
+		CHECK_EQUAL(result.Polls, c->Polls);
+		CHECK_EQUAL(result.WaitValue, c->WaitValue);
+		CHECK_EQUAL(result.FailedOp, c->Satisfied ? -1 : 0);
+		CHECK_EQUAL(chip.DelayMs, (c->Polls - 1) * c->Wait.Time);
+		CHECK_EQUAL(result.Transactions, c->Polls + (c->Satisfied ? 1 : 0));
+
+		// Nothing after a wait that timed out runs
+		CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], c->Satisfied ? UC120_CONTROL_INIT : 0);
+	}
+}
+
+static const UC120_SCRIPT_OP BadRegister[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_FENCE(),
+	UC120_SCRIPT_WRITE(UC120_REG_MODE, 0x02), UC120_SCRIPT_WRITE(UC120_SCRIPT_REG_COUNT, 0), UC120_SCRIPT_END()
+};
+static const UC120_SCRIPT_OP BadBlock[] = {
+	UC120_SCRIPT_WRITE(UC120_REG_CONTROL, 0x11), UC120_SCRIPT_DELAY(1),
+	UC120_SCRIPT_WRITE_BLOCK(UC120_SCRIPT_REG_COUNT - 2, Block, 3), UC120_SCRIPT_END()
+};
+
+static void TestBadScripts(void)
+{
+	FAKE_UC120 chip;
+	ACCESS_LOG log;
+	UC120_SCRIPT_RESULT result;
+
+	// A segment naming a register outside the map fails before touching the chip, blamed on its first operation
+	ResetLogged(&chip, &log);
+	CHECK(!Uc120ScriptRun(BadRegister, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.FailedOp, 2);
+	CHECK_EQUAL(log.Count, 1);
+	CHECK_EQUAL(chip.Registers[UC120_REG_MODE], 0);
+
+	ResetLogged(&chip, &log);
+	CHECK(!Uc120ScriptRun(BadBlock, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.FailedOp, 2);
+	CHECK_EQUAL(log.Count, 1);
+	CHECK_EQUAL(chip.DelayMs, 1);
+
+	// A failed read stops a modify from writing a value made up from nothing
+	ResetLogged(&chip, &log);
+	chip.Registers[UC120_REG_CONTROL] = 0x30;
+	chip.FailTransfers = 1;
+	CHECK(!Uc120ScriptRun(ModifyFenced, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.FailedOp, 0);
+	CHECK_EQUAL(log.Count, 1);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], 0x30);
+
+	// A failed write stops the script at its segment
+	ResetLogged(&chip, &log);
+	chip.FailTransfers = 1;
+	CHECK(!Uc120ScriptRun(WriteApart, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.FailedOp, 0);
+	CHECK_EQUAL(log.Count, 1);
+	CHECK_EQUAL(chip.Registers[UC120_REG_MODE], 0);
+}
+
+//
+// What LumiaUSBCSelfManagedIoInit used to do: every register on its own,
+// the configuration in the order the original listed it
+//
+static void BringUpByHand(FAKE_UC120 *chip)
+{
+	static const int order[] = { 18, 19, 20, 21, 26, 22, 23, 24, 25, 27 };
+	unsigned char value;
+	unsigned int i;
+
+	value = UC120_CONTROL_INIT;
+	FakeUc120Write(chip, UC120_REG_CONTROL, &value, 1);
+	value = UC120_STATUS_INIT;
+	FakeUc120Write(chip, UC120_REG_STATUS, &value, 1);
+	value = UC120_MODE_INIT;
+	FakeUc120Write(chip, UC120_REG_MODE, &value, 1);
+
+	for (i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+		FakeUc120Write(chip, order[i], (unsigned char *)UC120_CONFIG_VALUE(order[i]), 1);
+}
+
+static void TestDriverScripts(void)
+{
+	FAKE_UC120 chip, reference;
+	ACCESS_LOG log;
+	UC120_SCRIPT_RESULT result;
+
+	// Bring-up: the same register file as thirteen single writes, in three bursts
+	FakeUc120Reset(&reference);
+	BringUpByHand(&reference);
+	CHECK_EQUAL(reference.Writes, 13);
+
+	ResetLogged(&chip, &log);
+	chip.SettleReads = 2;
+	CHECK(Uc120ScriptRun(Uc120InitScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK(memcmp(chip.Registers, reference.Registers, sizeof(chip.Registers)) == 0);
+	CHECK_EQUAL(result.Accesses, 13);
+	CHECK_EQUAL(result.Polls, 3);
+	CHECK_EQUAL(result.Transactions - result.Polls, 3);
+	CHECK_EQUAL(result.Bytes - result.Polls, 13);
+	CHECK_EQUAL(log.Accesses[0].Register, UC120_REG_CONTROL);
+	CHECK_EQUAL(log.Accesses[0].Length, 2);
+	CHECK_EQUAL(log.Accesses[1].Register, UC120_REG_MODE);
+	CHECK_EQUAL(log.Accesses[2].Register, UC120_REG_CONFIG_FIRST);
+	CHECK_EQUAL(log.Accesses[2].Length, UC120_CONFIG_COUNT);
+	// The settle delay, then a sleep between each of the polls
+	CHECK_EQUAL(chip.DelayMs, 100 + 2 * 10);
+
+	// Interrupt enable: one read of CONTROL and STATUS, one write clearing and unmasking
+	ResetLogged(&chip, &log);
+	chip.Registers[UC120_REG_INTERRUPT_STATUS] = 0x3F;
+	chip.Registers[UC120_REG_INTERRUPT_STATUS2] = 0x01;
+	chip.Registers[UC120_REG_CONTROL] = UC120_CONTROL_INIT;
+	chip.Registers[UC120_REG_STATUS] = UC120_STATUS_INIT;
+	CHECK(Uc120ScriptRun(Uc120InterruptEnableScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.Accesses, 6);
+	CHECK_EQUAL(result.Transactions, 2);
+	CHECK_EQUAL(log.Accesses[0].Write, 0);
+	CHECK_EQUAL(log.Accesses[0].Register, UC120_REG_CONTROL);
+	CHECK_EQUAL(log.Accesses[0].Length, 2);
+	CHECK_EQUAL(log.Accesses[1].Write, 1);
+	CHECK_EQUAL(log.Accesses[1].Register, UC120_REG_INTERRUPT_STATUS);
+	CHECK_EQUAL(log.Accesses[1].Length, 4);
+	CHECK_EQUAL(chip.Registers[UC120_REG_INTERRUPT_STATUS], 0);
+	CHECK_EQUAL(chip.Registers[UC120_REG_INTERRUPT_STATUS2], 0);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], UC120_CONTROL_INIT | UC120_CONTROL_INTERRUPT_ENABLE);
+	CHECK_EQUAL(chip.Registers[UC120_REG_STATUS], UC120_STATUS_INIT & ~UC120_STATUS_INTERRUPT_MASK);
+
+	// Interrupt disable touches only the enable bit
+	ResetLogged(&chip, &log);
+	chip.Registers[UC120_REG_CONTROL] = UC120_CONTROL_INIT | UC120_CONTROL_INTERRUPT_ENABLE;
+	CHECK(Uc120ScriptRun(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.Transactions, 2);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], UC120_CONTROL_INIT);
+}
+
+static void TestCache(void)
+{
+	FAKE_UC120 chip;
+	ACCESS_LOG log;
+	UC120_SCRIPT_RESULT result;
+	UC120_SCRIPT_CACHE cache;
+
+	memset(&cache, 0, sizeof(cache));
+
+	// Bring-up writes every register only the driver changes, and nothing else is kept
+	ResetLogged(&chip, &log);
+	CHECK(Uc120ScriptRunCached(Uc120InitScript, &FakeUc120ScriptOps, &chip, &cache, &result));
+	CHECK_EQUAL(result.CachedReads, 0);
+	CHECK_EQUAL(cache.Valid, UC120_CACHEABLE_REGISTERS);
+	CHECK_EQUAL(cache.Values[UC120_REG_CONTROL], UC120_CONTROL_INIT);
+	CHECK_EQUAL(cache.Values[UC120_REG_MODE], UC120_MODE_INIT);
+	CHECK(memcmp(&cache.Values[UC120_REG_CONFIG_FIRST], &chip.Registers[UC120_REG_CONFIG_FIRST], UC120_CONFIG_COUNT) == 0);
+
+	// Interrupt enable then only reads STATUS, the chip may change that one
+	memset(&log, 0, sizeof(log));
+	CHECK(Uc120ScriptRunCached(Uc120InterruptEnableScript, &FakeUc120ScriptOps, &chip, &cache, &result));
+	CHECK_EQUAL(result.CachedReads, 1);
+	CHECK_EQUAL(result.Transactions, 2);
+	CHECK_EQUAL(log.Accesses[0].Write, 0);
+	CHECK_EQUAL(log.Accesses[0].Register, UC120_REG_STATUS);
+	CHECK_EQUAL(log.Accesses[0].Length, 1);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], UC120_CONTROL_INIT | UC120_CONTROL_INTERRUPT_ENABLE);
+	CHECK_EQUAL(cache.Values[UC120_REG_CONTROL], UC120_CONTROL_INIT | UC120_CONTROL_INTERRUPT_ENABLE);
+
+	// And interrupt disable reads nothing at all, against two transfers without the cache
+	memset(&log, 0, sizeof(log));
+	CHECK(Uc120ScriptRunCached(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, &cache, &result));
+	CHECK_EQUAL(result.CachedReads, 1);
+	CHECK_EQUAL(result.Transactions, 1);
+	CHECK_EQUAL(log.Accesses[0].Write, 1);
+	CHECK_EQUAL(chip.Registers[UC120_REG_CONTROL], UC120_CONTROL_INIT);
+
+	// A failed write leaves the register anywhere, the next modify reads it again
+	chip.FailTransfers = 1;
+	CHECK(!Uc120ScriptRunCached(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, &cache, &result));
+	CHECK(!(cache.Valid & (1UL << UC120_REG_CONTROL)));
+	CHECK(cache.Valid & (1UL << UC120_REG_MODE));
+
+	memset(&log, 0, sizeof(log));
+	CHECK(Uc120ScriptRunCached(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, &cache, &result));
+	CHECK_EQUAL(result.CachedReads, 0);
+	CHECK_EQUAL(result.Transactions, 2);
+	CHECK_EQUAL(log.Accesses[0].Register, UC120_REG_CONTROL);
+	CHECK(cache.Valid & (1UL << UC120_REG_CONTROL));
+	CHECK_EQUAL(cache.Values[UC120_REG_CONTROL], chip.Registers[UC120_REG_CONTROL]);
+
+	// After a power loss nothing is known, and without a cache nothing is kept
+	Uc120ScriptCacheInvalidate(&cache);
+	CHECK_EQUAL(cache.Valid, 0);
+	CHECK(Uc120ScriptRunCached(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, NULL, &result));
+	CHECK_EQUAL(result.CachedReads, 0);
+	CHECK_EQUAL(result.Transactions, 2);
+}
+
+int main(void)
+{
+	TestMergeRules();
+	TestWaits();
+	TestBadScripts();
+	TestDriverScripts();
+	TestCache();
+
+	return TestExit("Uc120ScriptTest");
+}
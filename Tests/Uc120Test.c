@@ -0,0 +1,543 @@
+/*++
+
+Module Name:
+
+    uc120test.c
+
+Abstract:
+
+    Tests for the UC120 chip logic in uc120.c, run against the fake
+    register file, including interrupt servicing with events raised
+    between reading the status and acknowledging it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Test.h"
+#include "FakeUc120.h"
+
+//
+// Reads back what LumiaUSBCProbeInitState reads, the same way
+//
+static UC120_INIT_PROBE_RESULT ProbeInitState(FAKE_UC120 *chip)
+{
+	unsigned char control[2], mode, config[UC120_CONFIG_COUNT];
+
+	if (!FakeUc120Read(chip, UC120_REG_CONTROL, control, sizeof(control)) ||
+		!FakeUc120Read(chip, UC120_REG_MODE, &mode, 1) ||
+		!FakeUc120Read(chip, UC120_REG_CONFIG_FIRST, config, sizeof(config)))
+		return Uc120InitProbeMismatch;
+
+	return Uc120CheckInitState(control, mode, config);
+}
+
+static void BringUp(FAKE_UC120 *chip)
+{
+	UC120_SCRIPT_RESULT result;
+
+	CHECK(Uc120ScriptRun(Uc120InitScript, &FakeUc120ScriptOps, chip, &result));
+	CHECK(Uc120ScriptRun(Uc120InterruptEnableScript, &FakeUc120ScriptOps, chip, &result));
+}
+
+static void TestInitProbe(void)
+{
+	FAKE_UC120 chip;
+	UC120_SCRIPT_RESULT result;
+
+	// Fresh from power-on nothing is set, status included
+	FakeUc120Reset(&chip);
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeNotReady);
+
+	// Still taking the configuration: status reads zero, whatever else is there
+	chip.SettleReads = 3;
+	CHECK(Uc120ScriptRun(Uc120InitScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(result.Polls, 4);
+	chip.Settling = 1;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeNotReady);
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMatch);
+
+	// The interrupt enable and mask bits do not count, they change after bring-up
+	CHECK(Uc120ScriptRun(Uc120InterruptEnableScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK(chip.Registers[UC120_REG_CONTROL] & UC120_CONTROL_INTERRUPT_ENABLE);
+	CHECK(!(chip.Registers[UC120_REG_STATUS] & UC120_STATUS_INTERRUPT_MASK));
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMatch);
+	CHECK(Uc120ScriptRun(Uc120InterruptDisableScript, &FakeUc120ScriptOps, &chip, &result));
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMatch);
+
+	// A failed read must not be taken for a configured chip
+	chip.FailTransfers = 1;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+}
+
+static void TestInitProbeMismatch(void)
+{
+	FAKE_UC120 chip;
+	int reg;
+
+	// Any one configuration register off means the whole bring-up runs again
+	for (reg = UC120_REG_CONFIG_FIRST; reg <= UC120_REG_CONFIG_LAST; reg++) {
+		FakeUc120Reset(&chip);
+		BringUp(&chip);
+		chip.Registers[reg] ^= 0x01;
+		CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+	}
+
+	FakeUc120Reset(&chip);
+	BringUp(&chip);
+	chip.Registers[UC120_REG_MODE] = 0;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+
+	FakeUc120Reset(&chip);
+	BringUp(&chip);
+	chip.Registers[UC120_REG_CONTROL] ^= 0x02;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+
+	FakeUc120Reset(&chip);
+	BringUp(&chip);
+	chip.Registers[UC120_REG_STATUS] ^= 0x01;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+
+	// Status survived a brown-out that took the configuration block with it
+	FakeUc120Reset(&chip);
+	BringUp(&chip);
+	for (reg = UC120_REG_CONFIG_FIRST; reg <= UC120_REG_CONFIG_LAST; reg++)
+		chip.Registers[reg] = 0;
+	CHECK_EQUAL(ProbeInitState(&chip), Uc120InitProbeMismatch);
+}
+
+typedef struct _CC_CASE
+{
+	unsigned char CcStatus;
+	int Attached;
+	UC120_RP_LEVEL Level;
+	unsigned int CurrentMa;
+	UC120_ORIENTATION Orientation;
+} CC_CASE;
+
+// Each CC pin field holds the Rp level seen on it, CC1 in bits 0-1 and CC2 in bits 2-3
+static const CC_CASE CcCases[] = {
+	{ 0x00, 0, Uc120RpOpen,    0,    Uc120OrientationNone },
+	{ 0x01, 1, Uc120RpDefault, 500,  Uc120OrientationCc1 },
+	{ 0x02, 1, Uc120Rp1500mA,  1500, Uc120OrientationCc1 },
+	{ 0x03, 1, Uc120Rp3000mA,  3000, Uc120OrientationCc1 },
+	{ 0x04, 1, Uc120RpDefault, 500,  Uc120OrientationCc2 },
+	{ 0x08, 1, Uc120Rp1500mA,  1500, Uc120OrientationCc2 },
+	{ 0x0C, 1, Uc120Rp3000mA,  3000, Uc120OrientationCc2 },
+	// A pin floating for a moment while the plug goes in never lowers the level
+	{ 0x06, 1, Uc120Rp1500mA,  1500, Uc120OrientationCc1 },
+	{ 0x0D, 1, Uc120Rp3000mA,  3000, Uc120OrientationCc2 },
+	{ 0x0B, 1, Uc120Rp3000mA,  3000, Uc120OrientationCc1 },
+	// Both pins terminated alike, an accessory without orientation
+	{ 0x05, 1, Uc120RpDefault, 500,  Uc120OrientationNone },
+	{ 0x0A, 1, Uc120Rp1500mA,  1500, Uc120OrientationNone },
+	{ 0x0F, 1, Uc120Rp3000mA,  3000, Uc120OrientationNone },
+	// Bits outside the CC fields do not matter
+	{ 0xF0, 0, Uc120RpOpen,    0,    Uc120OrientationNone },
+	{ 0x32, 1, Uc120Rp1500mA,  1500, Uc120OrientationCc1 },
+};
+
+static void TestRpDecode(void)
+{
+	const UC120_RP_DECODE *rp;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(CcCases) / sizeof(CcCases[0]); i++) {
+		rp = Uc120DecodeRp(CcCases[i].CcStatus);
+		CHECK_EQUAL(Uc120IsAttached(CcCases[i].CcStatus) != 0, CcCases[i].Attached);
+		CHECK_EQUAL(rp->Level, CcCases[i].Level);
+		CHECK_EQUAL(rp->CurrentMa, CcCases[i].CurrentMa);
+		CHECK_EQUAL(Uc120DecodeOrientation(CcCases[i].CcStatus), CcCases[i].Orientation);
+	}
+
+	// The table is indexed by level, the driver looks currents up by RpLevel
+	for (i = 0; i < Uc120RpLevelCount; i++)
+		CHECK_EQUAL(Uc120RpDecodeTable[i].Level, i);
+}
+
+//
+// The chip behind the SPI controller, as ReadRegisterStrategy sees it
+//
+typedef struct _SIM_SPI
+{
+	FAKE_UC120 Chip;
+
+	// Split reads: how many read transfers after the command still return the previous answer
+	unsigned int ReadLatency;
+	// Full duplex: how many bytes the answer trails the command by
+	unsigned int DuplexLatency;
+	// One read short of the latency is right except every this many times, zero for never
+	unsigned int MarginalEvery;
+	unsigned int MarginalReads;
+
+	unsigned char Last[UC120_CONFIG_COUNT];
+	// SPI controller requests, and the read transfers among them
+	unsigned int Transfers;
+	unsigned int ReadTransfers;
+} SIM_SPI;
+
+static int SimRead(void *context, UC120_READ_STRATEGY strategy, int reg, unsigned char *value, unsigned int length)
+{
+	SIM_SPI *sim = (SIM_SPI *)context;
+	unsigned char answer[UC120_CONFIG_COUNT];
+	unsigned int i, reads;
+	int right;
+
+	CHECK(length <= sizeof(answer));
+	if (!FakeUc120Read(&sim->Chip, reg, answer, length))
+		return 0;
+
+	if (strategy == Uc120ReadFullDuplex) {
+		sim->Transfers++;
+		for (i = 0; i < length; i++)
+			value[i] = i >= sim->DuplexLatency ? answer[i - sim->DuplexLatency] : sim->Last[i];
+	}
+	else {
+		// Assert CS, the command, the reads, release CS
+		reads = UC120_READ_DUMMIES(strategy) + 1;
+		sim->Transfers += 3 + reads;
+		sim->ReadTransfers += reads;
+
+		right = reads > sim->ReadLatency;
+		if (reads == sim->ReadLatency && sim->MarginalEvery)
+			right = ++sim->MarginalReads % sim->MarginalEvery != 0;
+
+		memcpy(value, right ? answer : sim->Last, length);
+	}
+
+	memcpy(sim->Last, answer, length);
+	return 1;
+}
+
+typedef struct _READ_CASE
+{
+	unsigned int ReadLatency;
+	unsigned int DuplexLatency;
+	unsigned int MarginalEvery;
+	unsigned int Mask;
+	UC120_READ_STRATEGY Strategy;
+} READ_CASE;
+
+#define READ_ALL ((1U << Uc120ReadStrategyCount) - 1)
+#define READ_SPLIT_FROM(strategy) (READ_ALL & ~((1U << (strategy)) - 1) & ~(1U << Uc120ReadFullDuplex))
+
+static const READ_CASE ReadCases[] = {
+	{ 0, 0, 0, READ_ALL, Uc120ReadFullDuplex },
+	{ 1, 0, 0, READ_SPLIT_FROM(Uc120ReadDummy1) | (1U << Uc120ReadFullDuplex), Uc120ReadFullDuplex },
+	{ 0, 1, 0, READ_SPLIT_FROM(Uc120ReadDummy0), Uc120ReadDummy0 },
+	{ 1, 1, 0, READ_SPLIT_FROM(Uc120ReadDummy1), Uc120ReadDummy1 },
+	{ 2, 1, 0, READ_SPLIT_FROM(Uc120ReadDummy2), Uc120ReadDummy2 },
+	{ 3, 2, 0, READ_SPLIT_FROM(Uc120ReadDummy3), Uc120ReadDummy3 },
+	// Nothing works: keep what the driver always did
+	{ 4, 1, 0, 0, UC120_READ_STRATEGY_DEFAULT },
+	// Right most of the time is not good enough
+	{ 2, 1, 20, READ_SPLIT_FROM(Uc120ReadDummy2), Uc120ReadDummy2 },
+};
+
+static void TestReadStrategyProbe(void)
+{
+	SIM_SPI sim;
+	unsigned char config[UC120_CONFIG_COUNT];
+	unsigned int i, mask, reads;
+	UC120_READ_STRATEGY strategy;
+
+	for (i = 0; i < sizeof(ReadCases) / sizeof(ReadCases[0]); i++) {
+		memset(&sim, 0, sizeof(sim));
+		FakeUc120Reset(&sim.Chip);
+		BringUp(&sim.Chip);
+		sim.ReadLatency = ReadCases[i].ReadLatency;
+		sim.DuplexLatency = ReadCases[i].DuplexLatency;
+		sim.MarginalEvery = ReadCases[i].MarginalEvery;
+
+		mask = Uc120ProbeReadStrategies(SimRead, &sim, 3);
+		strategy = Uc120CheapestReadStrategy(mask, UC120_READ_STRATEGY_DEFAULT);
+		CHECK_EQUAL(mask, ReadCases[i].Mask);
+		CHECK_EQUAL(strategy, ReadCases[i].Strategy);
+
+		// The pick reads the configuration back right; against the default's three read
+		// transfers, Dummy0 and Dummy1 save two thirds and a third
+		if (!mask)
+			continue;
+		reads = sim.ReadTransfers;
+		CHECK(SimRead(&sim, strategy, UC120_REG_CONFIG_FIRST, config, sizeof(config)));
+		CHECK(memcmp(config, Uc120ConfigValues, sizeof(config)) == 0);
+		CHECK_EQUAL(sim.ReadTransfers - reads, strategy == Uc120ReadFullDuplex ? 0 : UC120_READ_DUMMIES(strategy) + 1);
+	}
+
+	// The marginal strategy gets through a single round, which is why the driver probes three
+	memset(&sim, 0, sizeof(sim));
+	FakeUc120Reset(&sim.Chip);
+	BringUp(&sim.Chip);
+	sim.ReadLatency = 2;
+	sim.DuplexLatency = 1;
+	sim.MarginalEvery = 20;
+	CHECK_EQUAL(Uc120CheapestReadStrategy(Uc120ProbeReadStrategies(SimRead, &sim, 1), UC120_READ_STRATEGY_DEFAULT), Uc120ReadDummy1);
+
+	// A failing bus fails every strategy
+	sim.Chip.FailTransfers = 1000;
+	CHECK_EQUAL(Uc120ProbeReadStrategies(SimRead, &sim, 3), 0);
+}
+
+//
+// The interrupt status register with events raised behind the driver's
+// back. Transfers are counted from the first acknowledge of a service, so
+// transfer 0 is the window between reading the status and acknowledging
+// it, transfer 1 the one between acknowledging and reading it again.
+//
+#define WINDOW_TRANSFERS 20
+
+typedef struct _WINDOW_SIM
+{
+	FAKE_UC120 Chip;
+
+	unsigned char Inject[WINDOW_TRANSFERS];
+	unsigned int Transfer;
+	// Transfer made to fail, -1 for none
+	int FailAt;
+	// Raise a random bit before a transfer one time in this many, zero for the script only
+	unsigned int RandomEvery;
+	unsigned int Seed;
+	// The old work item: write 0xFF whatever was read
+	int BlindAck;
+
+	// Raised since they were last handled
+	unsigned char Owed;
+	unsigned long Raised;
+	unsigned long Coalesced;
+	unsigned long Handled;
+	// Latched events an acknowledge cleared without them having been read
+	unsigned long Lost;
+} WINDOW_SIM;
+
+static unsigned int BitCount(unsigned int bits)
+{
+	unsigned int count;
+
+	for (count = 0; bits; bits &= bits - 1)
+		count++;
+	return count;
+}
+
+static void WindowRaise(WINDOW_SIM *sim, unsigned char bits)
+{
+	unsigned char *status = &sim->Chip.Registers[UC120_REG_INTERRUPT_STATUS];
+
+	sim->Raised += BitCount(bits);
+	// A bit still latched takes the new event with it, that is the chip, not the driver
+	sim->Coalesced += BitCount(*status & bits);
+	*status |= bits;
+	sim->Owed |= bits;
+}
+
+static void WindowAccess(FAKE_UC120 *chip, int reg, unsigned int length, int write)
+{
+	WINDOW_SIM *sim = (WINDOW_SIM *)chip->Context;
+
+	(void)reg;
+	(void)length;
+	(void)write;
+
+	if (sim->Transfer < WINDOW_TRANSFERS)
+		WindowRaise(sim, sim->Inject[sim->Transfer]);
+	if ((int)sim->Transfer == sim->FailAt)
+		chip->FailTransfers = 1;
+	sim->Transfer++;
+
+	if (sim->RandomEvery) {
+		sim->Seed = sim->Seed * 1103515245 + 12345;
+		if ((sim->Seed >> 16) % sim->RandomEvery == 0)
+			WindowRaise(sim, (unsigned char)(1U << ((sim->Seed >> 24) % 6)));
+	}
+}
+
+static int WindowReadStatus(void *context, unsigned char *status)
+{
+	return FakeUc120Read(&((WINDOW_SIM *)context)->Chip, UC120_REG_INTERRUPT_STATUS, status, 1);
+}
+
+static int WindowAcknowledge(void *context, unsigned char bits)
+{
+	WINDOW_SIM *sim = (WINDOW_SIM *)context;
+	unsigned char value = sim->BlindAck ? 0xFF : bits;
+
+	if (!FakeUc120Write(&sim->Chip, UC120_REG_INTERRUPT_STATUS, &value, 1))
+		return 0;
+
+	// Anything owed is latched, so clearing a bit that was not read throws its event away
+	sim->Lost += BitCount(sim->Owed & value & ~bits);
+	sim->Owed &= (unsigned char)~(value & ~bits);
+	return 1;
+}
+
+static void WindowHandle(void *context, unsigned char bits)
+{
+	WINDOW_SIM *sim = (WINDOW_SIM *)context;
+
+	sim->Owed &= (unsigned char)~bits;
+	sim->Handled += BitCount(bits);
+}
+
+static const UC120_INTERRUPT_OPS WindowOps = { WindowReadStatus, WindowAcknowledge, WindowHandle };
+
+static void WindowReset(WINDOW_SIM *sim, int blindAck)
+{
+	memset(sim, 0, sizeof(*sim));
+	FakeUc120Reset(&sim->Chip);
+	sim->Chip.Access = WindowAccess;
+	sim->Chip.Context = sim;
+	sim->FailAt = -1;
+	sim->BlindAck = blindAck;
+}
+
+//
+// Uc120InterruptWorkItem, for as long as the level-triggered line stays asserted
+//
+static void WindowInterrupts(WINDOW_SIM *sim, UC120_INTERRUPT_STATS *stats)
+{
+	unsigned char status;
+	unsigned int interrupts;
+
+	for (interrupts = 0; sim->Chip.Registers[UC120_REG_INTERRUPT_STATUS] && interrupts < 1000; interrupts++) {
+		sim->Transfer = WINDOW_TRANSFERS;
+		if (WindowReadStatus(sim, &status) && status) {
+			sim->Transfer = 0;
+			Uc120ServiceInterrupts(&WindowOps, sim, status, stats);
+		}
+	}
+}
+
+typedef struct _WINDOW_CASE
+{
+	unsigned char Status;
+	// Raised before transfers 0 to 3 of the service
+	unsigned char Inject[4];
+	int FailAt;
+
+	unsigned char Handled;
+	unsigned long Events;
+	unsigned long LateEvents;
+	unsigned long Rounds;
+	unsigned long AckFailures;
+	// Events the old blind acknowledge loses in the same window
+	unsigned long BlindLost;
+} WINDOW_CASE;
+
+static const WINDOW_CASE WindowCases[] = {
+	{ 0x01, { 0 }, -1, 0x01, 1, 0, 1, 0, 0 },
+	// Raised between the read and the acknowledge: left set and read on the next round
+	{ 0x01, { 0x02 }, -1, 0x03, 2, 1, 2, 0, 1 },
+	{ 0x05, { 0x0A }, -1, 0x0F, 4, 2, 2, 0, 2 },
+	// Raised after the acknowledge: the re-read catches it either way
+	{ 0x01, { 0, 0x02 }, -1, 0x03, 2, 1, 2, 0, 0 },
+	// A bit that is still latched takes the new event with it
+	{ 0x01, { 0x01 }, -1, 0x01, 1, 0, 1, 0, 0 },
+	// Once acknowledged it latches again
+	{ 0x01, { 0, 0x01 }, -1, 0x01, 2, 1, 2, 0, 0 },
+	// An event in each window, three rounds
+	{ 0x01, { 0x02, 0, 0x04, 0 }, -1, 0x07, 3, 2, 3, 0, 1 },
+	// A failed acknowledge leaves the bit set, so it is handled twice rather than not at all
+	{ 0x01, { 0 }, 0, 0x01, 2, 1, 2, 1, 0 },
+	// A failed re-read ends the service, the line stays asserted for what it missed
+	{ 0x01, { 0, 0x02 }, 1, 0x01, 1, 0, 1, 0, 0 },
+};
+
+static void TestInterruptWindow(void)
+{
+	const WINDOW_CASE *c;
+	WINDOW_SIM sim;
+	UC120_INTERRUPT_STATS stats;
+	unsigned int i;
+	int blind;
+
+	for (i = 0; i < sizeof(WindowCases) / sizeof(WindowCases[0]); i++) {
+		c = &WindowCases[i];
+
+		for (blind = 0; blind <= 1; blind++) {
+			WindowReset(&sim, blind);
+			memset(&stats, 0, sizeof(stats));
+			memcpy(sim.Inject, c->Inject, sizeof(c->Inject));
+			sim.FailAt = c->FailAt;
+			WindowRaise(&sim, c->Status);
+
+			if (!blind) {
+				CHECK_EQUAL(Uc120ServiceInterrupts(&WindowOps, &sim, c->Status, &stats), c->Handled);
+				CHECK_EQUAL(stats.Events, c->Events);
+				CHECK_EQUAL(stats.LateEvents, c->LateEvents);
+				CHECK_EQUAL(stats.Rounds, c->Rounds);
+				CHECK_EQUAL(stats.AckFailures, c->AckFailures);
+				CHECK_EQUAL(stats.Overruns, 0);
+			}
+			else
+				Uc120ServiceInterrupts(&WindowOps, &sim, c->Status, &stats);
+
+			// Whatever the service left is still latched, so the line fires again for it
+			memset(sim.Inject, 0, sizeof(sim.Inject));
+			WindowInterrupts(&sim, &stats);
+			CHECK_EQUAL(sim.Lost, blind ? c->BlindLost : 0);
+			CHECK_EQUAL(sim.Owed, 0);
+		}
+	}
+}
+
+static void TestInterruptStorm(void)
+{
+	WINDOW_SIM sim;
+	UC120_INTERRUPT_STATS stats;
+	unsigned int i;
+	int blind;
+
+	// A new event behind every acknowledge: the service gives up and leaves the rest to the next interrupt
+	WindowReset(&sim, 0);
+	memset(&stats, 0, sizeof(stats));
+	for (i = 1; i < WINDOW_TRANSFERS; i += 2)
+		sim.Inject[i] = 0x04;
+	WindowRaise(&sim, 0x01);
+	CHECK_EQUAL(Uc120ServiceInterrupts(&WindowOps, &sim, 0x01, &stats), 0x05);
+	CHECK_EQUAL(stats.Rounds, UC120_INTERRUPT_MAX_ROUNDS);
+	CHECK_EQUAL(stats.LateEvents, UC120_INTERRUPT_MAX_ROUNDS - 1);
+	CHECK_EQUAL(stats.Overruns, 1);
+	CHECK_EQUAL(sim.Chip.Registers[UC120_REG_INTERRUPT_STATUS], 0x04);
+	memset(sim.Inject, 0, sizeof(sim.Inject));
+	WindowInterrupts(&sim, &stats);
+	CHECK_EQUAL(sim.Owed, 0);
+
+	// Events at random around every transfer, one interrupt after another
+	for (blind = 0; blind <= 1; blind++) {
+		WindowReset(&sim, blind);
+		memset(&stats, 0, sizeof(stats));
+		sim.RandomEvery = 3;
+		sim.Seed = 12345;
+
+		for (i = 0; i < 10000; i++) {
+			WindowRaise(&sim, (unsigned char)(1U << (i % 6)));
+			WindowInterrupts(&sim, &stats);
+		}
+
+		// Every latched event is handled once or, with the blind acknowledge, lost
+		CHECK_EQUAL(sim.Handled + sim.Lost, sim.Raised - sim.Coalesced);
+		if (blind) {
+			CHECK(sim.Lost > 0);
+			continue;
+		}
+
+		CHECK_EQUAL(sim.Lost, 0);
+		CHECK_EQUAL(sim.Owed, 0);
+		CHECK_EQUAL(stats.Events, sim.Handled);
+		CHECK(stats.LateEvents > 0);
+	}
+}
+
+int main(void)
+{
+	TestInitProbe();
+	TestInitProbeMismatch();
+	TestRpDecode();
+	TestReadStrategyProbe();
+	TestInterruptWindow();
+	TestInterruptStorm();
+
+	return TestExit("Uc120Test");
+}
@@ -0,0 +1,25 @@
+/*++
+
+Module Name:
+
+    ntddk.h
+
+Abstract:
+
+    The little of the kernel headers driver files built on the host
+    need, for the trace benchmark.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+typedef long LONG;
+typedef LONG NTSTATUS;
+
+#define STATUS_SUCCESS          ((NTSTATUS)0x00000000L)
+#define STATUS_IO_TIMEOUT       ((NTSTATUS)0xC00000B5L)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
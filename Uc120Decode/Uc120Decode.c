@@ -0,0 +1,280 @@
+/*++
+
+Module Name:
+
+    uc120decode.c
+
+Abstract:
+
+    Host tool that decodes the UC120 register dumps in the driver's trace
+    output, the INIT_, UC120_ and PLUGDET_ lines, using the register map
+    in uc120.h. Reads formatted trace text on standard input and prints
+    each dump register by register. Builds with any C compiler together
+    with the driver's uc120.c and snapshotstream.c:
+
+        cl Uc120Decode.c ..\LumiaUSBCKm\Uc120.c ..\LumiaUSBCKm\SnapshotStream.c
+        cc -o uc120decode Uc120Decode.c ../LumiaUSBCKm/Uc120.c ../LumiaUSBCKm/SnapshotStream.c
+
+    uc120decode -s capture.bin decodes the output of
+    IOCTL_LUMIAUSBC_READ_SNAPSHOTS the same way.
+
+    uc120decode -b runs the dumps on standard input through the snapshot
+    encoder, one interrupt a millisecond as the trace has no times, and
+    prints the capture's size against the raw dumps and the encoding cost.
+    The capture is decoded again and checked against the trace.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../LumiaUSBCKm/Uc120.h"
+#include "../LumiaUSBCKm/SnapshotStream.h"
+
+// Interrupt time units between the dumps the benchmark encodes, 1 ms
+#define BENCHMARK_INTERVAL 10000
+
+// Encodes the trace over and over until this much processor time has passed
+#define BENCHMARK_SECONDS 1
+
+static const char *AccessNames[] = { "r", "w", "rw", "w1c" };
+
+static int HexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+//
+// Parses "xx-xx-...-xx" with one byte per snapshot register
+//
+static int ParseDump(const char *text, unsigned char *values)
+{
+	int i, high, low;
+
+	for (i = 0; i < UC120_SNAPSHOT_COUNT; i++) {
+		high = HexDigit(text[0]);
+		low = high < 0 ? -1 : HexDigit(text[1]);
+		if (low < 0)
+			return 0;
+
+		values[i] = (unsigned char)(high << 4 | low);
+		text += 2;
+
+		if (i + 1 < UC120_SNAPSHOT_COUNT && *text++ != '-')
+			return 0;
+	}
+
+	return 1;
+}
+
+static void PrintRegister(int reg, unsigned char value)
+{
+	const UC120_REGISTER_INFO *info = Uc120LookupRegister(reg);
+	unsigned int i, shift;
+
+	printf("  %2d %-18s %-3s 0x%02x", reg, info ? info->Name : "?", info ? AccessNames[info->Access] : "", value);
+	if (info && (info->Flags & UC120_REG_UNVERIFIED))
+		printf(" (unverified)");
+
+	for (i = 0; i < Uc120FieldMapCount; i++) {
+		if (Uc120FieldMap[i].Address != reg)
+			continue;
+
+		for (shift = 0; !(Uc120FieldMap[i].Mask & (1U << shift)); shift++);
+		printf(" %s=%u", Uc120FieldMap[i].Name, (value & Uc120FieldMap[i].Mask) >> shift);
+	}
+
+	printf("\n");
+}
+
+static void PrintSnapshot(const unsigned char *values)
+{
+	unsigned int i;
+
+	for (i = 0; i < UC120_SNAPSHOT_COUNT; i++)
+		PrintRegister(Uc120SnapshotRegisters[i], values[i]);
+}
+
+//
+// Finds the dump in a trace line, returns nonzero if there is one
+//
+static int FindDump(const char *line, unsigned char *values)
+{
+	static const char *prefixes[] = { "INIT_", "UC120_", "PLUGDET_" };
+	const char *dump;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		dump = strstr(line, prefixes[i]);
+		if (dump && ParseDump(dump + strlen(prefixes[i]), values))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int DecodeTrace(void)
+{
+	unsigned char values[UC120_SNAPSHOT_COUNT];
+	char line[1024];
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (FindDump(line, values)) {
+			fputs(line, stdout);
+			PrintSnapshot(values);
+		}
+	}
+
+	return 0;
+}
+
+static void PrintCaptured(void *context, unsigned long long time, const unsigned char *values, unsigned int registers, int keyframe)
+{
+	(void)context;
+
+	if (registers != UC120_SNAPSHOT_COUNT)
+		return;
+
+	printf("%llu.%07llu%s\n", time / 10000000, time % 10000000, keyframe ? " key" : "");
+	PrintSnapshot(values);
+}
+
+static int DecodeCapture(const char *path)
+{
+	static unsigned char capture[SNAPSHOT_STREAM_CAPTURE_SIZE];
+	unsigned int length;
+	FILE *file;
+	int count;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+
+	length = (unsigned int)fread(capture, 1, sizeof(capture), file);
+	fclose(file);
+
+	count = SnapshotStreamDecode(capture, length, PrintCaptured, NULL);
+	if (count < 0) {
+		fprintf(stderr, "%s: not a snapshot capture\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+typedef struct _VERIFY
+{
+	const unsigned char *Dumps;
+	unsigned int Next;
+	unsigned int Mismatches;
+} VERIFY;
+
+static void VerifyCaptured(void *context, unsigned long long time, const unsigned char *values, unsigned int registers, int keyframe)
+{
+	VERIFY *verify = (VERIFY *)context;
+
+	(void)keyframe;
+
+	if (time != (unsigned long long)(verify->Next + 1) * BENCHMARK_INTERVAL ||
+		registers != UC120_SNAPSHOT_COUNT ||
+		memcmp(values, verify->Dumps + verify->Next * UC120_SNAPSHOT_COUNT, UC120_SNAPSHOT_COUNT))
+		verify->Mismatches++;
+
+	verify->Next++;
+}
+
+static int Benchmark(void)
+{
+	static SNAPSHOT_STREAM stream;
+	static unsigned char capture[SNAPSHOT_STREAM_CAPTURE_SIZE];
+	unsigned char *dumps = NULL, *grown;
+	unsigned int count = 0, capacity = 0, passes, length, i;
+	char line[1024];
+	clock_t start, elapsed;
+	VERIFY verify;
+	int decoded;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			grown = realloc(dumps, (size_t)capacity * UC120_SNAPSHOT_COUNT);
+			if (!grown) {
+				free(dumps);
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+			dumps = grown;
+		}
+
+		if (FindDump(line, dumps + count * UC120_SNAPSHOT_COUNT))
+			count++;
+	}
+
+	if (!count) {
+		fprintf(stderr, "no register dumps on standard input\n");
+		free(dumps);
+		return 1;
+	}
+
+	start = clock();
+	passes = 0;
+	do {
+		SnapshotStreamInitialize(&stream, UC120_SNAPSHOT_COUNT);
+		for (i = 0; i < count; i++)
+			SnapshotStreamAppend(&stream, (unsigned long long)(i + 1) * BENCHMARK_INTERVAL, dumps + i * UC120_SNAPSHOT_COUNT);
+		passes++;
+		elapsed = clock() - start;
+	} while (elapsed < BENCHMARK_SECONDS * CLOCKS_PER_SEC);
+
+	length = SnapshotStreamCopy(&stream, capture, sizeof(capture));
+
+	// The capture holds the newest dumps, they line up with the end of the trace
+	verify.Dumps = dumps;
+	verify.Next = 0;
+	verify.Mismatches = 0;
+	decoded = SnapshotStreamDecode(capture, length, NULL, NULL);
+	if (decoded > 0) {
+		verify.Next = count - decoded;
+		SnapshotStreamDecode(capture, length, VerifyCaptured, &verify);
+	}
+
+	printf("dumps            %u\n", count);
+	printf("keyframes        %lu\n", stream.Keyframes);
+	printf("raw bytes        %llu\n", stream.RawBytes);
+	printf("encoded bytes    %llu (%lu%%)\n", stream.EncodedBytes, SnapshotStreamRatio(&stream));
+	printf("bytes per dump   %.2f\n", (double)stream.EncodedBytes / count);
+	printf("encode ns/dump   %.1f\n", (double)elapsed / CLOCKS_PER_SEC * 1e9 / ((double)passes * count));
+	printf("capture          %u bytes, last %d dumps, %u raw\n",
+		length, decoded, length / (UC120_SNAPSHOT_COUNT + 8));
+	printf("round trip       %s\n", decoded >= 0 && !verify.Mismatches ? "ok" : "MISMATCH");
+
+	free(dumps);
+	return decoded >= 0 && !verify.Mismatches ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && !strcmp(argv[1], "-s"))
+		return DecodeCapture(argv[2]);
+	if (argc == 2 && !strcmp(argv[1], "-b"))
+		return Benchmark();
+	if (argc != 1) {
+		fprintf(stderr, "usage: uc120decode [-b] < trace.txt\n       uc120decode -s capture.bin\n");
+		return 2;
+	}
+
+	return DecodeTrace();
+}